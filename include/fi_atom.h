@@ -37,6 +37,7 @@
 
 #include <assert.h>
 #include <pthread.h>
+#include <stdint.h>
 #include <stdlib.h>
 
 #include <fi_lock.h>
@@ -114,6 +115,50 @@ static inline int atomic_sub(atomic_t *atomic, int val)
 			val, memory_order_acq_rel) - 1;
 }
 
+/*
+ * 64-bit counterpart of atomic_t.  All operations are sequentially
+ * consistent, so a store to one atomic64_t followed by a load of another
+ * can be paired with the reverse sequence on a different thread.
+ */
+typedef struct {
+    atomic_uint_fast64_t val;
+#if ENABLE_DEBUG
+    int is_initialized;
+#endif
+} atomic64_t;
+
+static inline void atomic64_initialize(atomic64_t *atomic, uint64_t value)
+{
+	atomic_init(&atomic->val, value);
+#if ENABLE_DEBUG
+	atomic->is_initialized = 1;
+#endif
+}
+
+static inline uint64_t atomic64_add(atomic64_t *atomic, uint64_t val)
+{
+	ATOMIC_IS_INITIALIZED(atomic);
+	return atomic_fetch_add(&atomic->val, val) + val;
+}
+
+static inline uint64_t atomic64_inc(atomic64_t *atomic)
+{
+	return atomic64_add(atomic, 1);
+}
+
+static inline uint64_t atomic64_set(atomic64_t *atomic, uint64_t value)
+{
+	ATOMIC_IS_INITIALIZED(atomic);
+	atomic_store(&atomic->val, value);
+	return value;
+}
+
+static inline uint64_t atomic64_get(atomic64_t *atomic)
+{
+	ATOMIC_IS_INITIALIZED(atomic);
+	return atomic_load(&atomic->val);
+}
+
 #else
 
 typedef struct {
@@ -195,6 +240,59 @@ static inline int atomic_sub(atomic_t *atomic, int val)
 	return v;
 }
 
+typedef struct {
+	fastlock_t lock;
+	uint64_t val;
+#if ENABLE_DEBUG
+	int is_initialized;
+#endif
+} atomic64_t;
+
+static inline void atomic64_initialize(atomic64_t *atomic, uint64_t value)
+{
+	fastlock_init(&atomic->lock);
+	atomic->val = value;
+#if ENABLE_DEBUG
+	atomic->is_initialized = 1;
+#endif
+}
+
+static inline uint64_t atomic64_add(atomic64_t *atomic, uint64_t val)
+{
+	uint64_t v;
+
+	ATOMIC_IS_INITIALIZED(atomic);
+	fastlock_acquire(&atomic->lock);
+	v = (atomic->val += val);
+	fastlock_release(&atomic->lock);
+	return v;
+}
+
+static inline uint64_t atomic64_inc(atomic64_t *atomic)
+{
+	return atomic64_add(atomic, 1);
+}
+
+static inline uint64_t atomic64_set(atomic64_t *atomic, uint64_t value)
+{
+	ATOMIC_IS_INITIALIZED(atomic);
+	fastlock_acquire(&atomic->lock);
+	atomic->val = value;
+	fastlock_release(&atomic->lock);
+	return value;
+}
+
+static inline uint64_t atomic64_get(atomic64_t *atomic)
+{
+	uint64_t v;
+
+	ATOMIC_IS_INITIALIZED(atomic);
+	fastlock_acquire(&atomic->lock);
+	v = atomic->val;
+	fastlock_release(&atomic->lock);
+	return v;
+}
+
 #endif // HAVE_ATOMICS
 
 
@@ -44,6 +44,7 @@
 #include <fcntl.h>
 #include <fi.h>
 #include <fi_file.h>
+#include <fi_signal.h>
 #include <stdlib.h>
 
 
@@ -201,51 +202,37 @@ static inline size_t rbdiscard(struct ringbuf *rb, size_t len)
 /*
  * Ring buffer with blocking read support using an fd
  */
-enum {
-	RB_READ_FD,
-	RB_WRITE_FD
-};
-
 struct ringbuffd {
-	struct ringbuf	rb;
-	int		fdrcnt;
-	int		fdwcnt;
-	int		fd[2];
+	struct ringbuf		rb;
+	struct fd_signal	signal;
 };
 
 static inline int rbfdinit(struct ringbuffd *rbfd, size_t size)
 {
 	int ret;
 
-	rbfd->fdrcnt = 0;
-	rbfd->fdwcnt = 0;
 	ret = rbinit(&rbfd->rb, size);
 	if (ret)
 		return ret;
 
-	ret = socketpair(AF_UNIX, SOCK_STREAM, 0, rbfd->fd);
-	if (ret < 0)
-		goto err1;
-
-	ret = fi_fd_nonblock(rbfd->fd[RB_READ_FD]);
-	if (ret)
-		goto err2;
+	ret = fd_signal_init(&rbfd->signal);
+	if (ret) {
+		rbfree(&rbfd->rb);
+		return ret;
+	}
 
 	return 0;
-
-err2:
-	ofi_close_socket(rbfd->fd[0]);
-	ofi_close_socket(rbfd->fd[1]);
-err1:
-	rbfree(&rbfd->rb);
-	return -errno;
 }
 
 static inline void rbfdfree(struct ringbuffd *rbfd)
 {
 	rbfree(&rbfd->rb);
-	ofi_close_socket(rbfd->fd[0]);
-	ofi_close_socket(rbfd->fd[1]);
+	fd_signal_free(&rbfd->signal);
+}
+
+static inline int rbfdfd(struct ringbuffd *rbfd)
+{
+	return rbfd->signal.fd[FI_READ_FD];
 }
 
 static inline int rbfdfull(struct ringbuffd *rbfd)
@@ -270,21 +257,13 @@ static inline size_t rbfdavail(struct ringbuffd *rbfd)
 
 static inline void rbfdsignal(struct ringbuffd *rbfd)
 {
-	char c = 0;
-	if (rbfd->fdwcnt == rbfd->fdrcnt) {
-		if (ofi_write_socket(rbfd->fd[RB_WRITE_FD], &c, sizeof c) == sizeof c)
-			rbfd->fdwcnt++;
-	}
+	fd_signal_set(&rbfd->signal);
 }
 
 static inline void rbfdreset(struct ringbuffd *rbfd)
 {
-	char c;
-
-	if (rbfdempty(rbfd) && (rbfd->fdrcnt != rbfd->fdwcnt)) {
-		if (ofi_read_socket(rbfd->fd[RB_READ_FD], &c, sizeof c) == sizeof c)
-			rbfd->fdrcnt++;
-	}
+	if (rbfdempty(rbfd))
+		fd_signal_reset(&rbfd->signal);
 }
 
 static inline void rbfdwrite(struct ringbuffd *rbfd, const void *buf, size_t len)
@@ -327,7 +306,7 @@ static inline size_t rbfdsread(struct ringbuffd *rbfd, void *buf, size_t len,
 		return len;
 	}
 	
-	ret = fi_poll_fd(rbfd->fd[RB_READ_FD], timeout);
+	ret = fi_poll_fd(rbfdfd(rbfd), timeout);
 	if (ret == 1) {
 		len = MIN(len, rbfdused(rbfd));
 		rbfdread(rbfd, buf, len);
@@ -338,7 +317,7 @@ static inline size_t rbfdsread(struct ringbuffd *rbfd, void *buf, size_t len,
 
 static inline size_t rbfdwait(struct ringbuffd *rbfd, int timeout)
 {
-	return  fi_poll_fd(rbfd->fd[RB_READ_FD], timeout);
+	return  fi_poll_fd(rbfdfd(rbfd), timeout);
 }
 
 
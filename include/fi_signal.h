@@ -52,16 +52,63 @@ enum {
 	FI_WRITE_FD
 };
 
+/*
+ * A level triggered wakeup: the read fd polls readable from
+ * fd_signal_set() until the next fd_signal_reset().  Repeated sets
+ * are coalesced, so only the first one after a reset costs a system
+ * call.  Callers serialize set and reset.  With eventfd, both fds are
+ * the same descriptor.
+ */
 struct fd_signal {
 	int		rcnt;
 	int		wcnt;
 	int		fd[2];
 };
 
+#ifdef HAVE_EVENTFD
+#include <sys/eventfd.h>
+
+static inline int fd_signal_init(struct fd_signal *signal)
+{
+	signal->rcnt = signal->wcnt = 0;
+	signal->fd[FI_READ_FD] = eventfd(0, EFD_NONBLOCK);
+	if (signal->fd[FI_READ_FD] < 0)
+		return -errno;
+
+	signal->fd[FI_WRITE_FD] = signal->fd[FI_READ_FD];
+	return 0;
+}
+
+static inline void fd_signal_free(struct fd_signal *signal)
+{
+	close(signal->fd[FI_READ_FD]);
+}
+
+static inline void fd_signal_set(struct fd_signal *signal)
+{
+	if (signal->wcnt == signal->rcnt) {
+		if (!eventfd_write(signal->fd[FI_WRITE_FD], 1))
+			signal->wcnt++;
+	}
+}
+
+static inline void fd_signal_reset(struct fd_signal *signal)
+{
+	eventfd_t val;
+
+	if (signal->rcnt != signal->wcnt) {
+		if (!eventfd_read(signal->fd[FI_READ_FD], &val))
+			signal->rcnt++;
+	}
+}
+
+#else
+
 static inline int fd_signal_init(struct fd_signal *signal)
 {
 	int ret;
 
+	signal->rcnt = signal->wcnt = 0;
 	ret = socketpair(AF_UNIX, SOCK_STREAM, 0, signal->fd);
 	if (ret < 0)
 		return -errno;
@@ -102,6 +149,8 @@ static inline void fd_signal_reset(struct fd_signal *signal)
 	}
 }
 
+#endif /* HAVE_EVENTFD */
+
 static inline int fd_signal_poll(struct fd_signal *signal, int timeout)
 {
 	int ret;
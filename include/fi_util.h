@@ -119,6 +119,7 @@ struct util_domain {
 	uint64_t		mode;
 	uint32_t		addr_format;
 	enum fi_av_type		av_type;
+	enum fi_threading	threading;
 };
 
 int ofi_domain_init(struct fid_fabric *fabric_fid, const struct fi_info *info,
@@ -161,6 +162,24 @@ struct util_cq_err_entry {
 
 DECLARE_CIRQUE(struct fi_cq_tagged_entry, util_comp_cirq);
 
+#define UTIL_CACHE_LINE_SIZE	64
+
+/*
+ * Lock-free CQs are used when the domain threading model guarantees a
+ * single producer and a single consumer.  The producer owns the cirque
+ * counters and publishes wcnt once per ofi_cq_lock/ofi_cq_unlock batch;
+ * the consumer owns rcnt here and publishes it once per read.  Each side
+ * keeps to its own cache line.  The error list remains under cq_lock.
+ */
+struct util_cq_spsc {
+#ifdef HAVE_ATOMICS
+	atomic_size_t		wcnt;
+	char			pad[UTIL_CACHE_LINE_SIZE - sizeof(atomic_size_t)];
+	atomic_size_t		rcnt;
+#endif
+	size_t			size_mask;
+};
+
 typedef void (*fi_cq_progress_func)(struct util_cq *cq);
 struct util_cq {
 	struct fid_cq		cq_fid;
@@ -172,6 +191,7 @@ struct util_cq {
 	fastlock_t		cq_lock;
 
 	struct util_comp_cirq	*cirq;
+	struct util_cq_spsc	*spsc;
 	fi_addr_t		*src;
 
 	struct slist		err_list;
@@ -185,6 +205,36 @@ int ofi_cq_init(const struct fi_provider *prov, struct fid_domain *domain,
 		 fi_cq_progress_func progress, void *context);
 void ofi_cq_progress(struct util_cq *cq);
 int ofi_cq_cleanup(struct util_cq *cq);
+void ofi_cq_insert_error(struct util_cq *cq, struct util_cq_err_entry *err);
+
+/*
+ * Producers bracket access to the cirque with ofi_cq_lock/ofi_cq_unlock.
+ * For lock-free CQs, lock refreshes the consumer's read count and unlock
+ * publishes every entry committed since.
+ */
+static inline void ofi_cq_lock(struct util_cq *cq)
+{
+#ifdef HAVE_ATOMICS
+	if (cq->spsc) {
+		cq->cirq->rcnt = atomic_load_explicit(&cq->spsc->rcnt,
+						      memory_order_acquire);
+		return;
+	}
+#endif
+	fastlock_acquire(&cq->cq_lock);
+}
+
+static inline void ofi_cq_unlock(struct util_cq *cq)
+{
+#ifdef HAVE_ATOMICS
+	if (cq->spsc) {
+		atomic_store_explicit(&cq->spsc->wcnt, cq->cirq->wcnt,
+				      memory_order_release);
+		return;
+	}
+#endif
+	fastlock_release(&cq->cq_lock);
+}
 
 /*
  * Counter
@@ -199,16 +249,31 @@ struct util_cntr {
 /*
  * AV / addressing
  */
+/*
+ * Reverse (address -> index) lookup table used with FI_SOURCE.  The table
+ * is open-addressed with linear probing and grows by doubling.  Updates
+ * are serialized by the AV lock and bracketed by a sequence count, which
+ * lets lookups run without taking the lock.  Tables replaced by a resize
+ * are kept on the retired list until the AV is closed, so a reader racing
+ * with a resize never touches freed memory.
+ */
 struct util_av_hash_entry {
 	int			index;
-	int			next;
+	uint32_t		hash;
+};
+
+struct util_av_hash_table {
+	struct util_av_hash_table *retired;
+	size_t			size_mask;
+	struct util_av_hash_entry entry[];
 };
 
 struct util_av_hash {
-	struct util_av_hash_entry *table;
-	int			free_list;
-	int			slots;
-	int			total_count;
+	struct util_av_hash_table *table;
+	size_t			used;
+#ifdef HAVE_ATOMICS
+	atomic_uint		seq;
+#endif
 };
 
 struct util_av {
@@ -230,7 +295,6 @@ struct util_av {
 
 struct util_av_attr {
 	size_t			addrlen;
-	size_t			overhead;
 	uint64_t		flags;
 };
 
@@ -239,8 +303,9 @@ int ofi_av_init(struct util_domain *domain,
 	       struct util_av *av, void *context);
 int ofi_av_close(struct util_av *av);
 
-int ofi_av_insert_addr(struct util_av *av, const void *addr, int slot, int *index);
-int ofi_av_lookup_index(struct util_av *av, const void *addr, int slot);
+int ofi_av_insert_addr(struct util_av *av, const void *addr, uint32_t hash,
+		       int *index);
+int ofi_av_lookup_index(struct util_av *av, const void *addr, uint32_t hash);
 int ofi_av_bind(struct fid *av_fid, struct fid *eq_fid, uint64_t flags);
 
 int ip_av_create(struct fid_domain *domain_fid, struct fi_av_attr *attr,
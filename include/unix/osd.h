@@ -36,6 +36,7 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <errno.h>
+#include <sys/uio.h>
 
 struct util_shm
 {
@@ -65,6 +66,18 @@ static inline ssize_t ofi_write_socket(int fd, const void *buf, size_t count)
 	return write(fd, buf, count);
 }
 
+static inline ssize_t ofi_writev_socket(int fd, const struct iovec *iov,
+					size_t iov_cnt)
+{
+	return writev(fd, iov, iov_cnt);
+}
+
+static inline ssize_t ofi_readv_socket(int fd, const struct iovec *iov,
+				       size_t iov_cnt)
+{
+	return readv(fd, iov, iov_cnt);
+}
+
 static inline int ofi_close_socket(int socket)
 {
 	return close(socket);
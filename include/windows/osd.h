@@ -184,6 +184,40 @@ static inline ssize_t ofi_write_socket(int fd, const void *buf, size_t count)
 	return send(fd, (const char*)buf, count, 0);
 }
 
+static inline ssize_t ofi_writev_socket(int fd, const struct iovec *iov,
+					size_t iov_cnt)
+{
+	ssize_t ret, len = 0;
+	size_t i;
+
+	for (i = 0; i < iov_cnt; i++) {
+		ret = ofi_write_socket(fd, iov[i].iov_base, iov[i].iov_len);
+		if (ret < 0)
+			return len ? len : ret;
+		len += ret;
+		if ((size_t) ret != iov[i].iov_len)
+			break;
+	}
+	return len;
+}
+
+static inline ssize_t ofi_readv_socket(int fd, const struct iovec *iov,
+				       size_t iov_cnt)
+{
+	ssize_t ret, len = 0;
+	size_t i;
+
+	for (i = 0; i < iov_cnt; i++) {
+		ret = ofi_read_socket(fd, iov[i].iov_base, iov[i].iov_len);
+		if (ret <= 0)
+			return len ? len : ret;
+		len += ret;
+		if ((size_t) ret != iov[i].iov_len)
+			break;
+	}
+	return len;
+}
+
 static inline int ofi_close_socket(int socket)
 {
 	return closesocket(socket);
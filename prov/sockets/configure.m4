@@ -36,6 +36,34 @@ AC_DEFUN([FI_SOCKETS_CONFIGURE],[
 
 	      AC_CHECK_FUNCS([getifaddrs])
 
+	# large messages to local peers are copied directly when possible
+	AC_CHECK_FUNCS([process_vm_readv])
+
+	# connection I/O can optionally go through io_uring, which needs
+	# multishot receive and provided buffer rings in the kernel headers
+	sockets_io_uring=0
+	AC_CHECK_DECL([IORING_RECV_MULTISHOT],
+		[AC_CHECK_DECL([__NR_io_uring_setup],
+			[sockets_io_uring=1], [],
+			[[#include <sys/syscall.h>]])],
+		[],
+		[[#include <linux/io_uring.h>]])
+	AC_DEFINE_UNQUOTED([HAVE_IO_URING], [$sockets_io_uring],
+		[Define to 1 if io_uring multishot receive can be used.])
+
+	# atomic kernels are built for AVX2 as well when possible
+	AC_MSG_CHECKING([for target_clones attribute support])
+	AC_LINK_IFELSE([AC_LANG_PROGRAM(
+		[[__attribute__((target_clones("avx2", "default")))
+		  int foo(int arg) { return arg + 3; }]],
+		[[return foo(0) != 3;]])],
+		[AC_MSG_RESULT([yes])
+		 sockets_target_clones=1],
+		[AC_MSG_RESULT([no])
+		 sockets_target_clones=0])
+	AC_DEFINE_UNQUOTED([HAVE_TARGET_CLONES], [$sockets_target_clones],
+		[Define to 1 if the compiler supports the target_clones attribute.])
+
 	AS_IF([test $sockets_h_happy -eq 1 && \
 	       test $sockets_shm_happy -eq 1], [$1], [$2])
 ])
@@ -55,7 +55,6 @@
 #include <fi_list.h>
 #include <fi_file.h>
 #include <fi_osd.h>
-#include <rbtree.h>
 
 #ifndef _SOCK_H_
 #define _SOCK_H_
@@ -74,14 +73,36 @@
 #define SOCK_EP_MAX_IOV_LIMIT (8)
 #define SOCK_EP_TX_SZ (256)
 #define SOCK_EP_RX_SZ (256)
+#define SOCK_RX_HASH_MIN_SZ (64)
 #define SOCK_EP_MIN_MULTI_RECV (64)
 #define SOCK_EP_MAX_ATOMIC_SZ (4096)
 #define SOCK_EP_MAX_CTX_BITS (16)
 #define SOCK_EP_MSG_PREFIX_SZ (0)
 
+#define SOCK_CNTR_DEF_TRIGGERS (16)
+
 #define SOCK_PE_POLL_TIMEOUT (100000)
-#define SOCK_PE_MAX_ENTRIES (128)
+#define SOCK_PE_DEF_ENTRIES (128)
+#define SOCK_PE_ENTRY_ALIGN (64)
+/* PE entries are addressed by a 16-bit id on the wire */
+#define SOCK_PE_MAX_ENTRIES IDX_MAX_INDEX
 #define SOCK_PE_WAITTIME (10)
+#define SOCK_PE_DEF_THREADS (1)
+#define SOCK_WAIT_DEF_SPIN_MAX (1000)
+#define SOCK_RNDV_DEF_THRESHOLD (1 << 16)
+/* small messages packed into one write per connection, see sock_comm_agg() */
+#define SOCK_TX_AGG_DEF_MAX (256)
+#define SOCK_TX_AGG_SZ (4096)
+#define SOCK_TX_AGG_MAX_CNT (32)
+/* data read ahead per connection, see sock_comm_recv() */
+#define SOCK_CONN_RX_STAGE_SZ (8192)
+#define SOCK_RX_STAGE_BURST (32)
+
+/* size classes of unexpected message buffers: 256B, 1KB, ... 64KB */
+#define SOCK_RX_BUF_MIN_SHIFT (8)
+#define SOCK_RX_BUF_CLASS_SHIFT (2)
+#define SOCK_RX_BUF_CLASSES (5)
+#define SOCK_RX_BUF_CHUNK_SZ (1 << 18)
 
 #define SOCK_EQ_DEF_SZ (1<<8)
 #define SOCK_CQ_DEF_SZ (1<<8)
@@ -98,7 +119,10 @@
 #define SOCK_EP_MAX_CM_DATA_SZ (256)
 #define SOCK_CM_DEF_BACKLOG (128)
 #define SOCK_CM_DEF_RETRY (5)
-#define SOCK_CM_CONN_IN_PROGRESS ((struct sock_conn *)(0x1L))
+#define SOCK_CM_CONN_TIMEOUT (15000)
+#define SOCK_CM_RETRY_BACKOFF (100)
+#define SOCK_CM_RETRY_BACKOFF_MAX (10000)
+#define SOCK_CONN_REAP_INTERVAL (1000)
 
 #define SOCK_EP_RDM_PRI_CAP (FI_MSG | FI_RMA | FI_TAGGED | FI_ATOMICS |	\
 			 FI_NAMED_RX_CTX | \
@@ -149,8 +173,17 @@
 #define SOCK_MODE (0)
 #define SOCK_NO_COMPLETION (1ULL << 60)
 #define SOCK_USE_OP_FLAGS (1ULL << 61)
+/* wire only: the send carries a rendezvous request instead of its data */
+#define SOCK_RNDV_REQ (1ULL << 62)
 #define SOCK_PE_COMM_BUFF_SZ (1024)
-#define SOCK_PE_OVERFLOW_COMM_BUFF_SZ (128)
+#define SOCK_PE_MAX_TX_IOV (4 + 2 * SOCK_EP_MAX_IOV_LIMIT)
+
+/* the peer may close first, e.g. when both sides quiesce at once */
+#ifdef MSG_NOSIGNAL
+#define SOCK_SEND_NOSIGNAL MSG_NOSIGNAL
+#else
+#define SOCK_SEND_NOSIGNAL 0
+#endif
 
 enum {
 	SOCK_SIGNAL_RD_FD = 0,
@@ -160,7 +193,7 @@ enum {
 #define SOCK_MAJOR_VERSION 1
 #define SOCK_MINOR_VERSION 0
 
-#define SOCK_WIRE_PROTO_VERSION (1)
+#define SOCK_WIRE_PROTO_VERSION (5)
 
 struct sock_service_entry {
 	int service;
@@ -182,6 +215,44 @@ struct sock_epoll_set {
 };
 #endif
 
+enum {
+	SOCK_CM_HANDLER_IDLE = 0,
+	SOCK_CM_HANDLER_ADD,
+	SOCK_CM_HANDLER_ACTIVE,
+	SOCK_CM_HANDLER_DEL
+};
+
+/*
+ * A socket serviced by the fabric's CM reactor.  handle() runs on the
+ * reactor thread whenever fd is readable; flush(), if set, runs on every
+ * reactor wakeup and returns non-zero while it has messages awaiting
+ * retransmission.
+ */
+struct sock_cm_handler {
+	int fd;
+	int state;
+	void *ctx;
+	void (*handle)(struct sock_cm_handler *handler);
+	int (*flush)(struct sock_cm_handler *handler);
+	struct sock_cm_reactor *reactor;
+	struct dlist_entry entry;
+	struct dlist_entry pending_entry;
+};
+
+struct sock_cm_reactor {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int running;
+	int signaled;
+	int signal_fds[2];
+	struct sock_epoll_set epoll_set;
+	struct sock_cm_handler **fd_map;
+	size_t fd_map_sz;
+	struct dlist_entry handler_list;
+	struct dlist_entry pending_list;
+};
+
 struct sock_fabric {
 	struct fid_fabric fab_fid;
 	atomic_t ref;
@@ -190,29 +261,164 @@ struct sock_fabric {
 #endif
 	struct dlist_entry service_list;
 	struct dlist_entry fab_list_entry;
+	struct sock_cm_reactor cm_reactor;
 	fastlock_t lock;
 };
 
+enum sock_conn_state {
+	SOCK_CONN_STATE_CONNECTED,
+	SOCK_CONN_STATE_CONNECTING,
+	SOCK_CONN_STATE_FAILED,
+	SOCK_CONN_STATE_QUIESCING,
+	SOCK_CONN_STATE_CLOSING,
+	SOCK_CONN_STATE_IDLE,
+};
+
 struct sock_conn {
         int sock_fd;
         int disconnected;
 	int address_published;
+	enum sock_conn_state state;
+	int connect_retry;
+	int connect_err;
+	uint64_t connect_time;
+	uint64_t last_used;
+	int pe_ref;
+	int reconnect;
+	int close_nack;
+	int shm_failed;
+	struct sock_shm_conn *shm;
+	struct sock_uring_conn *uring;
+	/* packed messages not written yet, on the PE tx_agg_list if any */
+	char *tx_agg;
+	size_t tx_agg_len;
+	size_t tx_agg_sent;
+	int tx_agg_cnt;
+	struct dlist_entry tx_agg_entry;
+	/* data read ahead, on the PE rx_stage_list if not all consumed */
+	char *rx_stage;
+	size_t rx_stage_off;
+	size_t rx_stage_len;
+	struct dlist_entry rx_stage_entry;
+	/*
+	 * Sends asking for a transmit completion, counted in stream order:
+	 * tx_ack_list holds ours that the peer has yet to acknowledge, and
+	 * the conn is on the PE rx_ack_list while rx_ack_seq, the peer's
+	 * we received, is ahead of rx_acked_seq, the count we sent back.
+	 */
+	uint64_t tx_ack_seq;
+	struct dlist_entry tx_ack_list;
+	uint64_t rx_ack_seq;
+	uint64_t rx_acked_seq;
+	struct dlist_entry rx_ack_entry;
         struct sockaddr_in addr;
         struct sock_pe_entry *rx_pe_entry;
         struct sock_pe_entry *tx_pe_entry;
 	struct sock_ep_attr *ep_attr;
 	fi_addr_t av_index;
 	struct dlist_entry ep_entry;
+	struct dlist_entry unresolved_entry;
 };
 
+/*
+ * Connections are allocated individually and never move, so pointers
+ * held by PE entries stay valid as the map grows.  av_map and fd_map are
+ * direct-indexed by AV index and socket fd respectively, and grow on
+ * demand.  Connections that could not be tied to an AV index when they
+ * were accepted are kept on the unresolved list until a lookup by
+ * address claims them.
+ *
+ * RDM connections that stay idle are closed by the progress engine,
+ * either after conn_idle_timeout or when more than max_open_conn are
+ * open.  The peers first agree on the close (QUIESCING, then CLOSING),
+ * so that no message is in flight when the socket goes away.  A closed
+ * connection is left IDLE and reconnects on its next transmit.
+ */
 struct sock_conn_map {
-        struct sock_conn *table;
+	struct sock_conn **table;
+	struct sock_conn **av_map;
+	struct sock_conn **fd_map;
+	struct dlist_entry unresolved_list;
 	struct sock_epoll_set epoll_set;
-        int used;
-        int size;
+	int used;
+	int size;
+	size_t av_map_sz;
+	size_t fd_map_sz;
+	int num_open;
+	int num_shm;
+	int num_uring;
+	int reap_pending;
+	uint64_t reap_time;
 	fastlock_t lock;
 };
 
+/*
+ * RDM connections to peers on the same host carry their messages through
+ * a shared memory segment instead of the socket: one single-producer
+ * single-consumer byte ring per direction, holding the same stream the
+ * socket would.  The connecting side creates the segment and names it in
+ * a SOCK_OP_CONN_SHM request, the first message on the socket; the peer
+ * attaches and answers with an empty SOCK_OP_CONN_SHM, the last message
+ * it writes to the socket.  Each side reads the socket up to that point,
+ * as the peer may have sent it control messages before seeing the
+ * request.  The socket then only carries wakeups for a progress thread
+ * about to sleep, and its EOF when the peer goes away.  A peer that
+ * cannot attach drops the connection, and the connect is retried
+ * without shared memory.
+ *
+ * Rendezvous requests sent through a segment list the source buffers,
+ * which the receiver copies with process_vm_readv() where it is allowed
+ * to.  Otherwise it falls back to the usual CTS.
+ */
+#define SOCK_SHM_NAME_LEN (64)
+#define SOCK_SHM_DEF_RING_SZ (1 << 16)
+
+struct sock_shm_conn;
+
+/*
+ * With FI_SOCKETS_IO_URING, each PE may own an io_uring through which
+ * its connections do their socket I/O instead of epoll and read/write.
+ * Every connection keeps a multishot receive armed, landing in buffers
+ * from a ring the PE provides to the kernel; the stream is consumed from
+ * those buffers, which go back to the kernel once read.  Sends are copied
+ * to a staging ring per connection and submitted, at most one at a time
+ * per connection, when the PE is done with its contexts, so that one
+ * io_uring_enter() covers the sends of a whole progress pass.  Shared
+ * memory connections keep using the socket for their wakeups.
+ */
+struct sock_uring;
+struct sock_uring_conn;
+
+/*
+ * MR key table.  Provider generated keys (FI_MR_BASIC) index the slot
+ * array directly, with free slots chained through their key field.  User
+ * keys (FI_MR_SCALABLE) are hashed into the slots with linear probing.
+ * Updates hold the domain lock and bracket every change with a sequence
+ * count, which lets lookups run without the lock.  Replaced tables and
+ * closed MRs are kept until the domain is closed (closed MRs are reused
+ * by later registrations), so a racing lookup never touches freed memory.
+ */
+struct sock_mr_slot {
+	uint64_t key;
+	struct sock_mr *mr;
+};
+
+struct sock_mr_table {
+	struct sock_mr_table *retired;
+	uint64_t size;
+	struct sock_mr_slot slot[];
+};
+
+struct sock_mr_map {
+	struct sock_mr_table *table;
+	uint64_t used;
+	uint64_t free_key;
+	struct dlist_entry free_list;
+#ifdef HAVE_ATOMICS
+	atomic_uint seq;
+#endif
+};
+
 struct sock_domain {
 	struct fi_info info;
 	struct fid_domain dom_fid;
@@ -224,7 +430,7 @@ struct sock_domain {
 	struct sock_eq *mr_eq;
 
 	enum fi_progress progress_mode;
-	RbtHandle mr_heap;
+	struct sock_mr_map mr_map;
 	struct sock_pe *pe;
 	struct dlist_entry dom_list_entry;
 	struct fi_domain_attr attr;
@@ -233,7 +439,7 @@ struct sock_domain {
 struct sock_trigger {
 	uint8_t op_type;
 	size_t threshold;
-	struct dlist_entry entry;
+	uint64_t seq;
 
 	struct fid_ep	*ep;
 	uint64_t flags;
@@ -267,11 +473,24 @@ struct sock_trigger {
 	} op;
 };
 
+/*
+ * The value is only updated atomically.  The mutex and condition
+ * variable are used only while a waiter has published its threshold.
+ * Triggered operations are kept in a min-heap ordered by threshold, then
+ * by queueing order, and trigger_min mirrors the smallest threshold so
+ * updates that fire nothing do not take trigger_lock.
+ */
+/* gaps between the completions seen by blocking waits, see sock_pe_wait */
+struct sock_spin {
+	uint64_t last;
+	uint64_t gap;
+};
+
 struct sock_cntr {
 	struct fid_cntr cntr_fid;
 	struct sock_domain *domain;
-	atomic_t value;
-	atomic_t threshold;
+	atomic64_t value;
+	atomic64_t threshold;
 	atomic_t ref;
 	atomic_t err_cnt;
 	pthread_cond_t 	cond;
@@ -283,12 +502,17 @@ struct sock_cntr {
 	fastlock_t list_lock;
 
 	fastlock_t trigger_lock;
-	struct dlist_entry trigger_list;
+	struct sock_trigger **trigger_heap;
+	size_t trigger_cnt;
+	size_t trigger_sz;
+	uint64_t trigger_seq;
+	atomic64_t trigger_min;
 
 	struct fid_wait *waitset;
 	int signal;
 	int is_waiting;
 	int err_flag;
+	struct sock_spin spin;
 };
 
 struct sock_mr {
@@ -301,6 +525,8 @@ struct sock_mr {
 	size_t iov_count;
 	struct sock_cntr *cntr;
 	struct sock_cq *cq;
+	struct dlist_entry entry;
+	size_t iov_max;
 	struct iovec mr_iov[1];
 };
 
@@ -330,6 +556,17 @@ struct sock_av {
 	uint64_t *idx_arr;
 	struct util_shm shm;
 	int    shared;
+
+	/*
+	 * Address -> index lookup.  The index is private to each process;
+	 * entries appended to the table (by this or, for a shared AV,
+	 * another process) are picked up the next time it is used.
+	 */
+	fastlock_t table_lock;
+	uint64_t *addr_index;
+	uint64_t index_mask;
+	uint64_t index_used;
+	uint64_t indexed;
 };
 
 struct sock_fid_list {
@@ -348,8 +585,15 @@ struct sock_wait {
 	struct sock_fabric *fab;
 	struct dlist_entry fid_list;
 	enum fi_wait_obj type;
+
+	/* FI_WAIT_FD: pending wakeup, only armed on the fd if observed */
+	fastlock_t lock;
+	int signaled;
+	int num_waiters;
+	int fd_exported;
+
 	union {
-		int fd[2];
+		struct fd_signal signal;
 		struct sock_mutex_cond {
 			pthread_mutex_t	mutex;
 			pthread_cond_t	cond;
@@ -377,6 +621,14 @@ enum {
 
 	SOCK_OP_CONN_MSG = 12,
 
+	SOCK_OP_RNDV_CTS = 13,
+	SOCK_OP_RNDV_DATA = 14,
+	SOCK_OP_CONN_CLOSE = 15,
+	SOCK_OP_CONN_CLOSE_ACK = 16,
+	SOCK_OP_CONN_CLOSE_NACK = 17,
+	SOCK_OP_CONN_SHM = 18,
+	SOCK_OP_SEND_ACK = 19,
+
 	/* internal */
 	SOCK_OP_RECV,
 	SOCK_OP_TRECV,
@@ -481,20 +733,17 @@ struct sock_comp {
 struct sock_cm_entry {
 	int sock;
 	int do_listen;
-	int signal_fds[2];
 	uint64_t next_msg_id;
 	fastlock_t lock;
 	int shutdown_received;
-	pthread_t listener_thread;
+	struct sock_cm_handler handler;
 	struct dlist_entry msg_list;
 };
 
 struct sock_conn_listener {
 	int sock;
 	int do_listen;
-	int is_ready;
-	int signal_fds[2];
-	pthread_t listener_thread;
+	struct sock_cm_handler handler;
 	char service[NI_MAXSERV];
 };
 
@@ -510,6 +759,7 @@ struct sock_ep_attr {
 	struct sock_eq *eq;
 	struct sock_av *av;
 	struct sock_domain *domain;
+	struct sock_pe *pe;
 
 	struct sock_rx_ctx *rx_ctx;
 	struct sock_tx_ctx *tx_ctx;
@@ -538,8 +788,6 @@ struct sock_ep_attr {
 	struct dlist_entry conn_list;
 	fastlock_t lock;
 
-	struct index_map conn_idm;
-	struct index_map av_idm;
 	struct sock_conn_map cmap;
 };
 
@@ -569,8 +817,12 @@ struct sock_rx_entry {
 	uint8_t is_complete;
 	uint8_t is_tagged;
 	uint8_t is_pool_entry;
-	uint8_t reserved[2];
+	uint8_t is_hashed;
+	uint8_t rndv_state;
+	uint8_t buf_class;
 
+	uint64_t seq;
+	uint64_t match_hash;
 	uint64_t used;
 	uint64_t total_len;
 
@@ -584,8 +836,22 @@ struct sock_rx_entry {
 
 	union sock_iov iov[SOCK_EP_MAX_IOV_LIMIT];
 	struct dlist_entry entry;
+	struct dlist_entry match_entry;
 	struct slist_entry pool_entry;
 	struct sock_rx_ctx *rx_ctx;
+
+	/*
+	 * rendezvous: sender's connection, referenced while the entry is
+	 * on the rx_rndv_ref_list, its PE entry and the id it echoes with
+	 * the data
+	 */
+	struct sock_conn *conn;
+	struct dlist_entry conn_entry;
+	uint64_t rndv_id;
+	uint16_t rndv_pe_id;
+	/* source buffers of a local sender, copied from directly */
+	size_t rndv_src_cnt;
+	union sock_iov rndv_src[SOCK_EP_MAX_IOV_LIMIT];
 };
 
 struct sock_rx_ctx {
@@ -616,12 +882,32 @@ struct sock_rx_ctx {
 	struct dlist_entry pe_entry_list;
 	struct dlist_entry rx_entry_list;
 	struct dlist_entry rx_buffered_list;
+	struct dlist_entry rx_rndv_list;
+	struct dlist_entry rx_rndv_ref_list;
 	struct dlist_entry ep_list;
 	fastlock_t lock;
+	uint64_t rndv_seq;
+
+	/*
+	 * Match index: fully specified posted receives and keyed
+	 * unexpected messages are hashed by (tag, source); posted
+	 * receives with wildcards stay on rx_wildcard_list in post order.
+	 * Both tables double once they hold more entries than buckets.
+	 */
+	struct dlist_entry *rx_entry_hash;
+	struct dlist_entry *rx_buffered_hash;
+	struct dlist_entry rx_wildcard_list;
+	uint64_t hash_mask;
+	size_t num_hashed;
+	uint64_t post_seq;
+	uint64_t match_seq;
+	size_t num_buffered_unkeyed;
+	int match_recheck;
 
 	struct fi_rx_attr attr;
 	struct sock_rx_entry *rx_entry_pool;
 	struct slist pool_list;
+	struct util_buf_pool *buf_pool[SOCK_RX_BUF_CLASSES];
 };
 
 struct sock_tx_ctx {
@@ -685,6 +971,25 @@ struct sock_msg_tsend {
 	/* data */
 };
 
+/*
+ * Sends larger than the rendezvous threshold carry SOCK_RNDV_REQ and
+ * replace the data with its length.  Once a receive is matched the peer
+ * answers with SOCK_OP_RNDV_CTS (sock_msg_response + rndv_id), and the
+ * data follows in a SOCK_OP_RNDV_DATA message.
+ */
+struct sock_msg_rndv_data {
+	struct sock_msg_hdr msg_hdr;
+	uint64_t rndv_id;
+	/* data */
+};
+
+/* opens a connection through shared memory, see struct sock_conn_map */
+struct sock_conn_shm_req {
+	struct sock_msg_hdr msg_hdr;
+	uint64_t ring_sz;
+	char name[SOCK_SHM_NAME_LEN];
+};
+
 struct sock_rma_write_req {
 	struct sock_msg_hdr msg_hdr;
 	/* user data */
@@ -709,6 +1014,16 @@ struct sock_msg_response {
 	uint8_t reserved[2];
 };
 
+/*
+ * Acknowledges, in one go, all the sends asking for a transmit
+ * completion that were received on the connection so far: seq is their
+ * running count, which the sender matches against its own.
+ */
+struct sock_msg_send_ack {
+	struct sock_msg_hdr msg_hdr;
+	uint64_t seq;
+};
+
 struct sock_rma_read_req {
 	struct sock_msg_hdr msg_hdr;
 	/* src iov(s)*/
@@ -735,12 +1050,29 @@ struct sock_tx_iov {
 	union sock_iov cmp;
 };
 
+/* rendezvous state of a send (TX PE entry) or a receive (rx_entry) */
+enum {
+	SOCK_RNDV_NONE = 0,
+	SOCK_RNDV_SEND_REQ,
+	SOCK_RNDV_WAIT_CTS,
+	SOCK_RNDV_SEND_DATA,
+	SOCK_RNDV_UNMATCHED,
+	SOCK_RNDV_SEND_CTS,
+	SOCK_RNDV_WAIT_DATA,
+};
+
 struct sock_tx_pe_entry {
 	struct sock_op tx_op;
 	struct sock_comp *comp;
-	uint8_t header_sent;
 	uint8_t send_done;
+	uint8_t rndv_state;
 	uint8_t reserved[6];
+	uint64_t rndv_len;
+	uint64_t rndv_id;
+	uint64_t rndv_src_cnt;
+	/* position in the conn tx_ack_list, while waiting for the ack */
+	uint64_t ack_seq;
+	struct dlist_entry ack_entry;
 
 	struct sock_tx_ctx *tx_ctx;
 	struct sock_tx_iov tx_iov[SOCK_EP_MAX_IOV_LIMIT];
@@ -754,6 +1086,10 @@ struct sock_rx_pe_entry {
 	uint8_t header_read;
 	uint8_t pending_send;
 	uint8_t reserved[6];
+	uint64_t rndv_id;
+	uint64_t rndv_len;
+	uint64_t rndv_src_cnt;
+	uint64_t ack_seq;
 	struct sock_rx_entry *rx_entry;
 	union sock_iov rx_iov[SOCK_EP_MAX_IOV_LIMIT];
 	char *atomic_cmp;
@@ -786,8 +1122,8 @@ struct sock_pe_entry {
 	uint8_t is_complete;
 	uint8_t is_error;
 	uint8_t mr_checked;
-	uint8_t is_pool_entry;
-	uint8_t reserved[3];
+	uint16_t id;
+	uint8_t reserved[2];
 
 	uint64_t done_len;
 	uint64_t total_len;
@@ -807,27 +1143,53 @@ struct sock_pe_entry {
 struct sock_pe {
 	struct sock_domain *domain;
 	int num_free_entries;
-	struct sock_pe_entry pe_table[SOCK_PE_MAX_ENTRIES];
+	int num_entries;
+	int max_used_entries;
+	/* pe_idx hands out the entry ids; pe_map resolves them */
+	struct indexer pe_idx;
+	struct index_map pe_map;
 	fastlock_t lock;
 	fastlock_t signal_lock;
 	pthread_mutex_t list_lock;
 	int wcnt, rcnt;
+	int num_waiters;
+	/* waiters in sock_pe_wait() when the pending signal was written */
+	int signal_waiters;
 	int signal_fds[2];
 	uint64_t waittime;
 
-	struct util_buf_pool *pe_rx_pool;
+	struct util_buf_pool *pe_pool;
 	struct util_buf_pool *atomic_rx_pool;
 	struct dlist_entry free_list;
 	struct dlist_entry busy_list;
-	struct dlist_entry pool_list;
 
 	struct dlist_entry tx_list;
 	struct dlist_entry rx_list;
+	/* shared memory connections polled by this PE, under shm_lock */
+	fastlock_t shm_lock;
+	struct dlist_entry shm_list;
+	struct sock_uring *uring;
+	/* connections with packed messages to write, under lock */
+	struct dlist_entry tx_agg_list;
+	/* connections with data read ahead, under lock */
+	struct dlist_entry rx_stage_list;
+	/* connections owing the peer a SOCK_OP_SEND_ACK, under lock */
+	struct dlist_entry rx_ack_list;
 
 	pthread_t progress_thread;
 	volatile int do_progress;
 	struct sock_pe_entry *pe_atomic;
 	struct sock_epoll_set epoll_set;
+
+	/*
+	 * In FI_PROGRESS_AUTO mode the domain PE can own additional
+	 * worker PEs; each endpoint is bound to one of them.  shard[0]
+	 * is the domain PE itself.
+	 */
+	int shard_id;
+	int num_shards;
+	struct sock_pe **shard;
+	atomic_t num_ep;
 };
 
 typedef int (*sock_cq_report_fn) (struct sock_cq *cq, fi_addr_t addr,
@@ -856,6 +1218,10 @@ struct sock_cq {
 
 	struct fid_wait *waitset;
 	int signal;
+	struct sock_spin spin;
+	/* under lock, see sock_cq_arm() */
+	int num_waiters;
+	int fd_exported;
 
 	struct dlist_entry ep_list;
 	struct dlist_entry rx_list;
@@ -1108,6 +1474,7 @@ struct sock_conn *sock_ep_lookup_conn(struct sock_ep_attr *attr, fi_addr_t index
 int sock_ep_get_conn(struct sock_ep_attr *ep_attr, struct sock_tx_ctx *tx_ctx,
 		     fi_addr_t index, struct sock_conn **pconn);
 struct sock_conn *sock_ep_connect(struct sock_ep_attr *attr, fi_addr_t index);
+int sock_conn_progress_connect(struct sock_conn *conn);
 ssize_t sock_conn_send_src_addr(struct sock_ep_attr *ep_attr, struct sock_tx_ctx *tx_ctx,
 				struct sock_conn *conn);
 int sock_conn_listen(struct sock_ep_attr *ep_attr);
@@ -1115,22 +1482,79 @@ void sock_conn_map_destroy(struct sock_conn_map *cmap);
 void sock_set_sockopts(int sock);
 int fd_set_nonblock(int fd);
 int sock_conn_map_init(struct sock_ep *ep, int init_size);
+struct sock_conn *sock_conn_map_lookup_av(struct sock_conn_map *map,
+					  uint64_t index);
+int sock_conn_map_set_av(struct sock_conn_map *map, uint64_t index,
+			 struct sock_conn *conn);
+struct sock_conn *sock_conn_map_lookup_fd(struct sock_conn_map *map, int fd);
+void sock_conn_map_replace(struct sock_conn_map *map, struct sock_conn *conn,
+			   struct sock_conn *accepted);
+int sock_conn_reap_interval(void);
+void sock_conn_map_reap(struct sock_ep_attr *ep_attr);
+void sock_conn_process_close(struct sock_conn *conn, uint8_t op);
+void sock_conn_shm_accept(struct sock_conn *conn, struct sock_conn_shm_req *req);
+void sock_conn_shm_connected(struct sock_conn *conn);
+
+int sock_shm_is_local(struct sock_conn *conn);
+int sock_shm_create(struct sock_conn *conn, struct sock_conn_shm_req *req);
+int sock_shm_attach(struct sock_conn *conn, struct sock_conn_shm_req *req);
+void sock_shm_connected(struct sock_conn *conn);
+void sock_shm_detach(struct sock_conn *conn);
+ssize_t sock_shm_sendv(struct sock_conn *conn, const struct iovec *iov,
+		       size_t iov_cnt);
+ssize_t sock_shm_recv(struct sock_conn *conn, void *buf, size_t len, int peek);
+int sock_shm_rx_active(struct sock_conn *conn);
+int sock_shm_rx_ready(struct sock_conn *conn);
+void sock_shm_drain(struct sock_conn *conn);
+int sock_shm_prepare_wait(struct sock_pe *pe);
+int sock_shm_pull(struct sock_conn *conn, const struct iovec *local,
+		  size_t local_cnt, const union sock_iov *remote,
+		  size_t remote_cnt);
+
+int sock_uring_create(struct sock_uring **uring);
+void sock_uring_destroy(struct sock_uring *uring);
+int sock_uring_fd(struct sock_uring *uring);
+int sock_uring_prepare_wait(struct sock_uring *uring);
+void sock_uring_progress(struct sock_uring *uring);
+int sock_uring_attach(struct sock_conn *conn);
+void sock_uring_detach(struct sock_conn *conn);
+ssize_t sock_uring_sendv(struct sock_conn *conn, const struct iovec *iov,
+			 size_t iov_cnt);
+ssize_t sock_uring_recv(struct sock_conn *conn, void *buf, size_t len, int peek);
+int sock_uring_rx_ready(struct sock_conn *conn);
 
 struct sock_pe *sock_pe_init(struct sock_domain *domain);
 void sock_pe_add_tx_ctx(struct sock_pe *pe, struct sock_tx_ctx *ctx);
 void sock_pe_add_rx_ctx(struct sock_pe *pe, struct sock_rx_ctx *ctx);
 void sock_pe_signal(struct sock_pe *pe);
+void sock_pe_wait(struct sock_pe *pe, int (*ready)(void *arg), void *arg,
+		  int timeout);
+void sock_spin_update(struct sock_spin *spin);
+uint64_t sock_spin_deadline(struct sock_spin *spin);
 void sock_pe_poll_add(struct sock_pe *pe, int fd);
+void sock_pe_poll_del(struct sock_pe *pe, int fd);
 int sock_pe_progress_rx_ctx(struct sock_pe *pe, struct sock_rx_ctx *rx_ctx);
 int sock_pe_progress_tx_ctx(struct sock_pe *pe, struct sock_tx_ctx *tx_ctx);
 void sock_pe_remove_tx_ctx(struct sock_tx_ctx *tx_ctx);
 void sock_pe_remove_rx_ctx(struct sock_rx_ctx *rx_ctx);
+struct sock_pe *sock_pe_get_shard(struct sock_pe *pe, int shared);
+void sock_pe_put_shard(struct sock_pe *pe);
 void sock_pe_finalize(struct sock_pe *pe);
 
 
+int sock_rx_match_init(struct sock_rx_ctx *rx_ctx);
+void sock_rx_match_finalize(struct sock_rx_ctx *rx_ctx);
 struct sock_rx_entry *sock_rx_new_entry(struct sock_rx_ctx *rx_ctx);
 struct sock_rx_entry *sock_rx_new_buffered_entry(struct sock_rx_ctx *rx_ctx,
 						 size_t len);
+int sock_rx_buffer_full(struct sock_rx_ctx *rx_ctx, size_t len);
+void sock_rx_buffer_finalize(struct sock_rx_ctx *rx_ctx);
+void sock_rx_enqueue_entry(struct sock_rx_ctx *rx_ctx,
+			   struct sock_rx_entry *rx_entry);
+void sock_rx_enqueue_buffered_entry(struct sock_rx_ctx *rx_ctx,
+				    struct sock_rx_entry *rx_entry);
+void sock_rx_dequeue_entry(struct sock_rx_ctx *rx_ctx,
+			   struct sock_rx_entry *rx_entry);
 struct sock_rx_entry *sock_rx_get_entry(struct sock_rx_ctx *rx_ctx,
 					uint64_t addr, uint64_t tag,
 					uint8_t is_tagged);
@@ -1147,12 +1571,28 @@ ssize_t sock_rx_claim_recv(struct sock_rx_ctx *rx_ctx, void *context,
 void sock_rx_release_entry(struct sock_rx_entry *rx_entry);
 
 ssize_t sock_comm_send(struct sock_pe_entry *pe_entry, const void *buf, size_t len);
+ssize_t sock_comm_sendv(struct sock_pe_entry *pe_entry,
+			const struct iovec *iov, size_t iov_cnt, size_t offset);
 ssize_t sock_comm_recv(struct sock_pe_entry *pe_entry, void *buf, size_t len);
 ssize_t sock_comm_peek(struct sock_conn *conn, void *buf, size_t len);
 ssize_t sock_comm_discard(struct sock_pe_entry *pe_entry, size_t len);
 int sock_comm_tx_done(struct sock_pe_entry *pe_entry);
 ssize_t sock_comm_flush(struct sock_pe_entry *pe_entry);
 int sock_comm_is_disconnected(struct sock_pe_entry *pe_entry);
+int sock_comm_agg(struct sock_pe_entry *pe_entry, const struct iovec *iov,
+		  size_t iov_cnt, size_t len);
+int sock_comm_agg_flush(struct sock_conn *conn);
+void sock_comm_agg_flush_all(struct sock_pe *pe);
+void sock_comm_agg_drop(struct sock_conn *conn);
+void sock_comm_agg_move(struct sock_conn *to, struct sock_conn *from);
+int sock_comm_queue(struct sock_conn *conn, const void *buf, size_t len);
+void sock_comm_stage_drop(struct sock_conn *conn);
+void sock_comm_stage_move(struct sock_conn *to, struct sock_conn *from);
+void sock_comm_ack(struct sock_conn *conn);
+int sock_comm_ack_flush(struct sock_conn *conn);
+void sock_comm_ack_flush_all(struct sock_pe *pe);
+void sock_comm_ack_drop(struct sock_conn *conn);
+void sock_comm_ack_move(struct sock_conn *to, struct sock_conn *from);
 
 ssize_t sock_ep_recvmsg(struct fid_ep *ep, const struct fi_msg *msg,
 			uint64_t flags);
@@ -1171,6 +1611,13 @@ ssize_t sock_ep_tx_atomic(struct fid_ep *ep,
 			  const struct fi_ioc *comparev, void **compare_desc,
 			  size_t compare_count, struct fi_ioc *resultv,
 			  void **result_desc, size_t result_count, uint64_t flags);
+int sock_atomic_update(void *cmp, void *dst, const void *src, size_t cnt,
+		       enum fi_datatype datatype, enum fi_op op);
+
+typedef void (*sock_atomic_kernel_t)(void *cmp, void *dst, const void *src,
+				     size_t cnt);
+extern const sock_atomic_kernel_t
+sock_atomic_kernels[FI_ATOMIC_OP_LAST][FI_DATATYPE_LAST];
 
 
 ssize_t sock_queue_rma_op(struct fid_ep *ep, const struct fi_msg_rma *msg,
@@ -1183,6 +1630,8 @@ ssize_t sock_queue_tmsg_op(struct fid_ep *ep, const struct fi_msg_tagged *msg,
 			   uint64_t flags, uint8_t op_type);
 ssize_t sock_queue_msg_op(struct fid_ep *ep, const struct fi_msg *msg,
 			  uint64_t flags, uint8_t op_type);
+int sock_cntr_queue_trigger(struct sock_cntr *cntr,
+			    struct sock_trigger *trigger);
 void sock_cntr_check_trigger_list(struct sock_cntr *cntr);
 
 int sock_epoll_create(struct sock_epoll_set *set, int size);
@@ -1191,10 +1640,28 @@ int sock_epoll_del(struct sock_epoll_set *set, int fd);
 int sock_epoll_wait(struct sock_epoll_set *set, int timeout);
 int sock_epoll_get_fd_at_index(struct sock_epoll_set *set, int index);
 void sock_epoll_close(struct sock_epoll_set *set);
+int sock_epoll_grow(struct sock_epoll_set *set, int size);
+
+int sock_cm_reactor_init(struct sock_cm_reactor *reactor);
+void sock_cm_reactor_close(struct sock_cm_reactor *reactor);
+int sock_cm_reactor_add(struct sock_cm_reactor *reactor,
+			struct sock_cm_handler *handler);
+void sock_cm_reactor_del(struct sock_cm_handler *handler);
+void sock_cm_reactor_signal(struct sock_cm_reactor *reactor);
 
 static inline size_t sock_rx_avail_len(struct sock_rx_entry *rx_entry)
 {
 	return rx_entry->total_len - rx_entry->used;
 }
 
+static inline struct sock_pe *sock_tx_ctx_pe(struct sock_tx_ctx *tx_ctx)
+{
+	return tx_ctx->ep_attr ? tx_ctx->ep_attr->pe : tx_ctx->domain->pe;
+}
+
+static inline struct sock_pe *sock_rx_ctx_pe(struct sock_rx_ctx *rx_ctx)
+{
+	return rx_ctx->ep_attr ? rx_ctx->ep_attr->pe : rx_ctx->domain->pe;
+}
+
 #endif
@@ -35,6 +35,7 @@
 #define _SOCK_UTIL_H_
 
 #include <sys/mman.h>
+#include <sys/time.h>
 #include <rdma/providers/fi_log.h>
 #include "sock.h"
 
@@ -43,11 +44,21 @@ extern const char sock_dom_name[];
 extern const char sock_prov_name[];
 extern struct fi_provider sock_prov;
 extern int sock_pe_waittime;
+extern int sock_pe_threads;
+extern int sock_pe_entries;
 extern int sock_conn_retry;
+extern int sock_conn_max_open;
+extern int sock_conn_idle_timeout;
 extern int sock_cm_def_map_sz;
 extern int sock_av_def_sz;
 extern int sock_cq_def_sz;
 extern int sock_eq_def_sz;
+extern int sock_rndv_threshold;
+extern int sock_tx_agg_max;
+extern int sock_shm_enabled;
+extern int sock_shm_ring_sz;
+extern int sock_io_uring_enabled;
+extern int sock_wait_spin_max;
 extern char *sock_pe_affinity_str;
 #if ENABLE_DEBUG
 extern int sock_dgram_drop_rate;
@@ -55,6 +66,7 @@ extern int sock_dgram_drop_rate;
 
 #define _SOCK_LOG_DBG(subsys, ...) FI_DBG(&sock_prov, subsys, __VA_ARGS__)
 #define _SOCK_LOG_ERROR(subsys, ...) FI_WARN(&sock_prov, subsys, __VA_ARGS__)
+#define _SOCK_LOG_INFO(subsys, ...) FI_INFO(&sock_prov, subsys, __VA_ARGS__)
 
 static inline int sock_drop_packet(struct sock_ep_attr *ep_attr)
 {
@@ -68,6 +80,14 @@ static inline int sock_drop_packet(struct sock_ep_attr *ep_attr)
 	return 0;
 }
 
+static inline uint64_t sock_gettime_us(void)
+{
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	return now.tv_sec * 1000000ULL + now.tv_usec;
+}
+
 static inline void *sock_mremap(void *old_address, size_t old_size,
 				size_t new_size)
 {
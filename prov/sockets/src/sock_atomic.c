@@ -606,3 +606,20 @@ struct fi_ops_atomic sock_ep_atomic = {
 	.readwritevalid = sock_ep_atomic_valid,
 	.compwritevalid = sock_ep_atomic_valid,
 };
+
+int sock_atomic_update(void *cmp, void *dst, const void *src, size_t cnt,
+		       enum fi_datatype datatype, enum fi_op op)
+{
+	if (datatype >= FI_DATATYPE_LAST) {
+		SOCK_LOG_ERROR("Atomic datatype not supported\n");
+		return -FI_EINVAL;
+	}
+
+	if (op >= FI_ATOMIC_OP_LAST || !sock_atomic_kernels[op][datatype]) {
+		SOCK_LOG_ERROR("Atomic operation type not supported\n");
+		return -FI_EOPNOTSUPP;
+	}
+
+	sock_atomic_kernels[op][datatype](cmp, dst, src, cnt);
+	return 0;
+}
@@ -0,0 +1,299 @@
+/*
+ * Copyright (c) 2016 Intel Corporation. All rights reserved.
+ *
+ * This software is available to you under a choice of one of two
+ * licenses.  You may choose to be licensed under the terms of the GNU
+ * General Public License (GPL) Version 2, available from the file
+ * COPYING in the main directory of this source tree, or the
+ * BSD license below:
+ *
+ *     Redistribution and use in source and binary forms, with or
+ *     without modification, are permitted provided that the following
+ *     conditions are met:
+ *
+ *      - Redistributions of source code must retain the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer.
+ *
+ *      - Redistributions in binary form must reproduce the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer in the documentation and/or other materials
+ *        provided with the distribution.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <complex.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "sock.h"
+
+/*
+ * Target side kernels, one per (op, datatype).  A kernel applies its op
+ * to a whole ioc.  The previous contents of dst are returned in cmp,
+ * which also carries the compare operand of the compare ops.
+ *
+ * Arithmetic, min/max and bitwise ops on integer, float and double
+ * arrays use GCC vector types.  When the compiler supports function
+ * multiversioning, they are also built for AVX2 and picked at load time.
+ * Each vector lane computes exactly what the scalar code does, so the
+ * results are bitwise identical.
+ */
+#define SOCK_ATOMIC_VEC_SZ	32
+
+#if HAVE_TARGET_CLONES
+#define SOCK_ATOMIC_CLONES __attribute__((target_clones("avx2", "default")))
+#else
+#define SOCK_ATOMIC_CLONES
+#endif
+
+#define SOCK_ATOMIC_MIN(_d, _s)		(((_s) < (_d)) ? (_s) : (_d))
+#define SOCK_ATOMIC_MAX(_d, _s)		(((_s) > (_d)) ? (_s) : (_d))
+#define SOCK_ATOMIC_SUM(_d, _s)		((_d) + (_s))
+#define SOCK_ATOMIC_PROD(_d, _s)	((_d) * (_s))
+#define SOCK_ATOMIC_LOR(_d, _s)		((_d) || (_s))
+#define SOCK_ATOMIC_LAND(_d, _s)	((_d) && (_s))
+#define SOCK_ATOMIC_BOR(_d, _s)		((_d) | (_s))
+#define SOCK_ATOMIC_BAND(_d, _s)	((_d) & (_s))
+#define SOCK_ATOMIC_LXOR(_d, _s)	(((_d) && !(_s)) || (!(_d) && (_s)))
+#define SOCK_ATOMIC_BXOR(_d, _s)	((_d) ^ (_s))
+#define SOCK_ATOMIC_WRITE(_d, _s)	(_s)
+
+/* Lanes of _a where the mask _c is set, and of _b elsewhere */
+#define SOCK_ATOMIC_VEC_SELECT(_c, _a, _b, _mask_t)			\
+	((__typeof__(_a)) (((_mask_t) (_c) & (_mask_t) (_a)) |		\
+			   (~(_mask_t) (_c) & (_mask_t) (_b))))
+
+#define SOCK_ATOMIC_VEC_MIN(_d, _s, _mask_t)				\
+	SOCK_ATOMIC_VEC_SELECT((_s) < (_d), _s, _d, _mask_t)
+#define SOCK_ATOMIC_VEC_MAX(_d, _s, _mask_t)				\
+	SOCK_ATOMIC_VEC_SELECT((_s) > (_d), _s, _d, _mask_t)
+#define SOCK_ATOMIC_VEC_SUM(_d, _s, _mask_t)	((_d) + (_s))
+#define SOCK_ATOMIC_VEC_PROD(_d, _s, _mask_t)	((_d) * (_s))
+#define SOCK_ATOMIC_VEC_BOR(_d, _s, _mask_t)	((_d) | (_s))
+#define SOCK_ATOMIC_VEC_BAND(_d, _s, _mask_t)	((_d) & (_s))
+#define SOCK_ATOMIC_VEC_BXOR(_d, _s, _mask_t)	((_d) ^ (_s))
+
+/* Vector of _type, and the integer vector its comparisons produce */
+#define SOCK_ATOMIC_DEF_VEC_TYPE(_name, _type, _mask)			\
+typedef _type sock_vec_##_name##_t					\
+	__attribute__((vector_size(SOCK_ATOMIC_VEC_SZ)));		\
+typedef _mask sock_mask_##_name##_t					\
+	__attribute__((vector_size(SOCK_ATOMIC_VEC_SZ)));
+
+#define SOCK_ATOMIC_DEF_VEC_OP(_op, _name, _type)			\
+static void SOCK_ATOMIC_CLONES						\
+sock_atomic_##_op##_##_name(void *cmp, void *dst, const void *src,	\
+			    size_t cnt)					\
+{									\
+	_type *_cmp = cmp, *_dst = dst;					\
+	const _type *_src = src;					\
+	sock_vec_##_name##_t d, s;					\
+	size_t i, n = sizeof(d) / sizeof(_type);			\
+									\
+	for (i = 0; i + n <= cnt; i += n) {				\
+		memcpy(&d, &_dst[i], sizeof(d));			\
+		memcpy(&s, &_src[i], sizeof(s));			\
+		memcpy(&_cmp[i], &d, sizeof(d));			\
+		d = SOCK_ATOMIC_VEC_##_op(d, s, sock_mask_##_name##_t);	\
+		memcpy(&_dst[i], &d, sizeof(d));			\
+	}								\
+	for (; i < cnt; i++) {						\
+		_cmp[i] = _dst[i];					\
+		_dst[i] = SOCK_ATOMIC_##_op(_dst[i], _src[i]);		\
+	}								\
+}
+
+#define SOCK_ATOMIC_DEF_OP(_op, _name, _type)				\
+static void sock_atomic_##_op##_##_name(void *cmp, void *dst,		\
+					const void *src, size_t cnt)	\
+{									\
+	_type *_cmp = cmp, *_dst = dst;					\
+	const _type *_src = src;					\
+	size_t i;							\
+									\
+	for (i = 0; i < cnt; i++) {					\
+		_cmp[i] = _dst[i];					\
+		_dst[i] = SOCK_ATOMIC_##_op(_dst[i], _src[i]);		\
+	}								\
+}
+
+#define SOCK_ATOMIC_DEF_READ(_name, _type)				\
+static void sock_atomic_READ_##_name(void *cmp, void *dst,		\
+				     const void *src, size_t cnt)	\
+{									\
+	_type *_cmp = cmp, *_dst = dst;					\
+	size_t i;							\
+									\
+	for (i = 0; i < cnt; i++)					\
+		_cmp[i] = _dst[i];					\
+}
+
+#define SOCK_ATOMIC_DEF_CSWAP(_name, _type)				\
+static void sock_atomic_CSWAP_##_name(void *cmp, void *dst,		\
+				      const void *src, size_t cnt)	\
+{									\
+	_type *_cmp = cmp, *_dst = dst;					\
+	const _type *_src = src;					\
+	size_t i;							\
+									\
+	for (i = 0; i < cnt; i++) {					\
+		if (_cmp[i] == _dst[i])					\
+			_dst[i] = _src[i];				\
+		else							\
+			_cmp[i] = _dst[i];				\
+	}								\
+}
+
+#define SOCK_ATOMIC_DEF_CSWAP_OP(_op, _name, _type, _cond)		\
+static void sock_atomic_##_op##_##_name(void *cmp, void *dst,		\
+					const void *src, size_t cnt)	\
+{									\
+	_type *_cmp = cmp, *_dst = dst, tmp;				\
+	const _type *_src = src;					\
+	size_t i;							\
+									\
+	for (i = 0; i < cnt; i++) {					\
+		tmp = _dst[i];						\
+		if (_cmp[i] _cond _dst[i])				\
+			_dst[i] = _src[i];				\
+		_cmp[i] = tmp;						\
+	}								\
+}
+
+#define SOCK_ATOMIC_DEF_MSWAP(_name, _type)				\
+static void sock_atomic_MSWAP_##_name(void *cmp, void *dst,		\
+				      const void *src, size_t cnt)	\
+{									\
+	_type *_cmp = cmp, *_dst = dst, tmp;				\
+	const _type *_src = src;					\
+	size_t i;							\
+									\
+	for (i = 0; i < cnt; i++) {					\
+		tmp = _dst[i];						\
+		_dst[i] = (_src[i] & _cmp[i]) | (_dst[i] & ~_cmp[i]);	\
+		_cmp[i] = tmp;						\
+	}								\
+}
+
+/* Ops shared by every datatype */
+#define SOCK_ATOMIC_DEF_COMMON(_name, _type)				\
+	SOCK_ATOMIC_DEF_READ(_name, _type)				\
+	SOCK_ATOMIC_DEF_OP(WRITE, _name, _type)				\
+	SOCK_ATOMIC_DEF_OP(LOR, _name, _type)				\
+	SOCK_ATOMIC_DEF_OP(LAND, _name, _type)				\
+	SOCK_ATOMIC_DEF_CSWAP(_name, _type)				\
+	SOCK_ATOMIC_DEF_CSWAP_OP(CSWAP_NE, _name, _type, !=)
+
+/* Ops that need an ordering on the datatype */
+#define SOCK_ATOMIC_DEF_ORDERED(_name, _type)				\
+	SOCK_ATOMIC_DEF_CSWAP_OP(CSWAP_LE, _name, _type, <=)		\
+	SOCK_ATOMIC_DEF_CSWAP_OP(CSWAP_LT, _name, _type, <)		\
+	SOCK_ATOMIC_DEF_CSWAP_OP(CSWAP_GE, _name, _type, >=)		\
+	SOCK_ATOMIC_DEF_CSWAP_OP(CSWAP_GT, _name, _type, >)
+
+#define SOCK_ATOMIC_DEF_INT(_name, _type, _mask)			\
+	SOCK_ATOMIC_DEF_VEC_TYPE(_name, _type, _mask)			\
+	SOCK_ATOMIC_DEF_COMMON(_name, _type)				\
+	SOCK_ATOMIC_DEF_ORDERED(_name, _type)				\
+	SOCK_ATOMIC_DEF_VEC_OP(MIN, _name, _type)			\
+	SOCK_ATOMIC_DEF_VEC_OP(MAX, _name, _type)			\
+	SOCK_ATOMIC_DEF_VEC_OP(SUM, _name, _type)			\
+	SOCK_ATOMIC_DEF_VEC_OP(PROD, _name, _type)			\
+	SOCK_ATOMIC_DEF_VEC_OP(BOR, _name, _type)			\
+	SOCK_ATOMIC_DEF_VEC_OP(BAND, _name, _type)			\
+	SOCK_ATOMIC_DEF_VEC_OP(BXOR, _name, _type)			\
+	SOCK_ATOMIC_DEF_OP(LXOR, _name, _type)				\
+	SOCK_ATOMIC_DEF_MSWAP(_name, _type)
+
+#define SOCK_ATOMIC_DEF_FLOAT(_name, _type, _mask)			\
+	SOCK_ATOMIC_DEF_VEC_TYPE(_name, _type, _mask)			\
+	SOCK_ATOMIC_DEF_COMMON(_name, _type)				\
+	SOCK_ATOMIC_DEF_ORDERED(_name, _type)				\
+	SOCK_ATOMIC_DEF_VEC_OP(MIN, _name, _type)			\
+	SOCK_ATOMIC_DEF_VEC_OP(MAX, _name, _type)			\
+	SOCK_ATOMIC_DEF_VEC_OP(SUM, _name, _type)			\
+	SOCK_ATOMIC_DEF_VEC_OP(PROD, _name, _type)
+
+SOCK_ATOMIC_DEF_INT(int8, int8_t, int8_t)
+SOCK_ATOMIC_DEF_INT(uint8, uint8_t, int8_t)
+SOCK_ATOMIC_DEF_INT(int16, int16_t, int16_t)
+SOCK_ATOMIC_DEF_INT(uint16, uint16_t, int16_t)
+SOCK_ATOMIC_DEF_INT(int32, int32_t, int32_t)
+SOCK_ATOMIC_DEF_INT(uint32, uint32_t, int32_t)
+SOCK_ATOMIC_DEF_INT(int64, int64_t, int64_t)
+SOCK_ATOMIC_DEF_INT(uint64, uint64_t, int64_t)
+SOCK_ATOMIC_DEF_FLOAT(float, float, int32_t)
+SOCK_ATOMIC_DEF_FLOAT(double, double, int64_t)
+
+SOCK_ATOMIC_DEF_COMMON(ldouble, long double)
+SOCK_ATOMIC_DEF_ORDERED(ldouble, long double)
+SOCK_ATOMIC_DEF_OP(MIN, ldouble, long double)
+SOCK_ATOMIC_DEF_OP(MAX, ldouble, long double)
+SOCK_ATOMIC_DEF_OP(SUM, ldouble, long double)
+SOCK_ATOMIC_DEF_OP(PROD, ldouble, long double)
+
+SOCK_ATOMIC_DEF_COMMON(fcomplex, float complex)
+SOCK_ATOMIC_DEF_OP(SUM, fcomplex, float complex)
+SOCK_ATOMIC_DEF_OP(PROD, fcomplex, float complex)
+SOCK_ATOMIC_DEF_COMMON(dcomplex, double complex)
+SOCK_ATOMIC_DEF_OP(SUM, dcomplex, double complex)
+SOCK_ATOMIC_DEF_OP(PROD, dcomplex, double complex)
+SOCK_ATOMIC_DEF_COMMON(ldcomplex, long double complex)
+SOCK_ATOMIC_DEF_OP(SUM, ldcomplex, long double complex)
+SOCK_ATOMIC_DEF_OP(PROD, ldcomplex, long double complex)
+
+#define SOCK_ATOMIC_COMMON(_dt, _name)					\
+	[FI_ATOMIC_READ][_dt] = sock_atomic_READ_##_name,		\
+	[FI_ATOMIC_WRITE][_dt] = sock_atomic_WRITE_##_name,		\
+	[FI_LOR][_dt] = sock_atomic_LOR_##_name,			\
+	[FI_LAND][_dt] = sock_atomic_LAND_##_name,			\
+	[FI_CSWAP][_dt] = sock_atomic_CSWAP_##_name,			\
+	[FI_CSWAP_NE][_dt] = sock_atomic_CSWAP_NE_##_name,		\
+	[FI_SUM][_dt] = sock_atomic_SUM_##_name,			\
+	[FI_PROD][_dt] = sock_atomic_PROD_##_name
+
+#define SOCK_ATOMIC_ORDERED(_dt, _name)					\
+	SOCK_ATOMIC_COMMON(_dt, _name),					\
+	[FI_CSWAP_LE][_dt] = sock_atomic_CSWAP_LE_##_name,		\
+	[FI_CSWAP_LT][_dt] = sock_atomic_CSWAP_LT_##_name,		\
+	[FI_CSWAP_GE][_dt] = sock_atomic_CSWAP_GE_##_name,		\
+	[FI_CSWAP_GT][_dt] = sock_atomic_CSWAP_GT_##_name,		\
+	[FI_MIN][_dt] = sock_atomic_MIN_##_name,			\
+	[FI_MAX][_dt] = sock_atomic_MAX_##_name
+
+#define SOCK_ATOMIC_INT(_dt, _name)					\
+	SOCK_ATOMIC_ORDERED(_dt, _name),				\
+	[FI_BOR][_dt] = sock_atomic_BOR_##_name,			\
+	[FI_BAND][_dt] = sock_atomic_BAND_##_name,			\
+	[FI_BXOR][_dt] = sock_atomic_BXOR_##_name,			\
+	[FI_LXOR][_dt] = sock_atomic_LXOR_##_name,			\
+	[FI_MSWAP][_dt] = sock_atomic_MSWAP_##_name
+
+const sock_atomic_kernel_t
+sock_atomic_kernels[FI_ATOMIC_OP_LAST][FI_DATATYPE_LAST] = {
+	SOCK_ATOMIC_INT(FI_INT8, int8),
+	SOCK_ATOMIC_INT(FI_UINT8, uint8),
+	SOCK_ATOMIC_INT(FI_INT16, int16),
+	SOCK_ATOMIC_INT(FI_UINT16, uint16),
+	SOCK_ATOMIC_INT(FI_INT32, int32),
+	SOCK_ATOMIC_INT(FI_UINT32, uint32),
+	SOCK_ATOMIC_INT(FI_INT64, int64),
+	SOCK_ATOMIC_INT(FI_UINT64, uint64),
+	SOCK_ATOMIC_ORDERED(FI_FLOAT, float),
+	SOCK_ATOMIC_ORDERED(FI_DOUBLE, double),
+	SOCK_ATOMIC_ORDERED(FI_LONG_DOUBLE, ldouble),
+	SOCK_ATOMIC_COMMON(FI_FLOAT_COMPLEX, fcomplex),
+	SOCK_ATOMIC_COMMON(FI_DOUBLE_COMPLEX, dcomplex),
+	SOCK_ATOMIC_COMMON(FI_LONG_DOUBLE_COMPLEX, ldcomplex),
+};
@@ -51,6 +51,7 @@
 
 #include "fi_osd.h"
 #include "fi_util.h"
+#include "fasthash.h"
 
 #define SOCK_LOG_DBG(...) _SOCK_LOG_DBG(FI_LOG_AV, __VA_ARGS__)
 #define SOCK_LOG_ERROR(...) _SOCK_LOG_ERROR(FI_LOG_AV, __VA_ARGS__)
@@ -60,6 +61,9 @@
 				count * sizeof(struct sock_av_addr))
 #define SOCK_IS_SHARED_AV(av_name) ((av_name) ? 1 : 0)
 
+#define SOCK_AV_INDEX_MIN_SZ	64
+#define SOCK_AV_INDEX_EMPTY	UINT64_MAX
+
 int sock_compare_addr(struct sockaddr_in *addr1,
 			     struct sockaddr_in *addr2)
 {
@@ -67,18 +71,163 @@ int sock_compare_addr(struct sockaddr_in *addr1,
 		(addr1->sin_port == addr2->sin_port));
 }
 
-int sock_av_get_addr_index(struct sock_av *av, struct sockaddr_in *addr)
+static uint64_t sock_av_hash_addr(struct sockaddr_in *addr)
 {
-	int i;
-	struct sock_av_addr *av_addr;
+	return fasthash64(&addr->sin_addr, sizeof(addr->sin_addr),
+			  addr->sin_port);
+}
+
+static uint64_t *sock_av_index_alloc(uint64_t size)
+{
+	uint64_t *index, i;
+
+	index = malloc(size * sizeof(*index));
+	if (!index)
+		return NULL;
+
+	for (i = 0; i < size; i++)
+		index[i] = SOCK_AV_INDEX_EMPTY;
+	return index;
+}
+
+/*
+ * Returns the index slot holding addr, or the empty slot where it belongs.
+ */
+static uint64_t sock_av_index_probe(struct sock_av *av, uint64_t *index,
+				    uint64_t mask, struct sockaddr_in *addr)
+{
+	uint64_t i;
+
+	for (i = sock_av_hash_addr(addr) & mask;
+	     index[i] != SOCK_AV_INDEX_EMPTY; i = (i + 1) & mask) {
+		if (sock_compare_addr(addr, (struct sockaddr_in *)
+				      &av->table[index[i]].addr))
+			break;
+	}
+	return i;
+}
+
+static int sock_av_index_grow(struct sock_av *av)
+{
+	uint64_t *index, mask, i;
+
+	mask = av->addr_index ? (av->index_mask << 1) | 1 :
+		SOCK_AV_INDEX_MIN_SZ - 1;
+	index = sock_av_index_alloc(mask + 1);
+	if (!index)
+		return -FI_ENOMEM;
+
+	if (av->addr_index) {
+		for (i = 0; i <= av->index_mask; i++) {
+			if (av->addr_index[i] == SOCK_AV_INDEX_EMPTY)
+				continue;
+			index[sock_av_index_probe(av, index, mask,
+				(struct sockaddr_in *)
+				&av->table[av->addr_index[i]].addr)] =
+				av->addr_index[i];
+		}
+		free(av->addr_index);
+	}
+
+	av->addr_index = index;
+	av->index_mask = mask;
+	return 0;
+}
+
+/*
+ * Must hold table_lock.  A re-inserted address maps to its newest entry.
+ */
+static int sock_av_index_insert(struct sock_av *av, uint64_t idx)
+{
+	uint64_t i;
+	int ret;
+
+	if (!av->addr_index || (av->index_used + 1) * 2 > av->index_mask + 1) {
+		ret = sock_av_index_grow(av);
+		if (ret)
+			return ret;
+	}
+
+	i = sock_av_index_probe(av, av->addr_index, av->index_mask,
+				(struct sockaddr_in *) &av->table[idx].addr);
+	if (av->addr_index[i] == SOCK_AV_INDEX_EMPTY)
+		av->index_used++;
+	av->addr_index[i] = idx;
+	return 0;
+}
+
+/*
+ * Must hold table_lock.  Later entries of the probe run are shifted back
+ * into the hole so that lookups never need tombstones.
+ */
+static void sock_av_index_remove(struct sock_av *av, uint64_t idx)
+{
+	uint64_t i, j, home, mask = av->index_mask;
+
+	if (!av->addr_index)
+		return;
+
+	i = sock_av_index_probe(av, av->addr_index, mask,
+				(struct sockaddr_in *) &av->table[idx].addr);
+	if (av->addr_index[i] != idx)
+		return;
+
+	for (j = (i + 1) & mask; av->addr_index[j] != SOCK_AV_INDEX_EMPTY;
+	     j = (j + 1) & mask) {
+		home = sock_av_hash_addr((struct sockaddr_in *)
+				&av->table[av->addr_index[j]].addr) & mask;
+		if (((j - home) & mask) >= ((j - i) & mask)) {
+			av->addr_index[i] = av->addr_index[j];
+			i = j;
+		}
+	}
+	av->addr_index[i] = SOCK_AV_INDEX_EMPTY;
+	av->index_used--;
+}
+
+/*
+ * Must hold table_lock.  Index entries added to the table since the
+ * last call, including those appended to a shared AV by other processes.
+ */
+static int sock_av_index_sync(struct sock_av *av)
+{
+	int ret;
 
-	for (i = 0; i < av->table_hdr->stored; i++) {
-		av_addr = &av->table[i];
-		if (sock_compare_addr(addr, (struct sockaddr_in *)&av_addr->addr))
-			return i;
+	for (; av->indexed < av->table_hdr->stored; av->indexed++) {
+		if (!av->table[av->indexed].valid)
+			continue;
+		ret = sock_av_index_insert(av, av->indexed);
+		if (ret)
+			return ret;
 	}
-	SOCK_LOG_DBG("failed to get index in AV\n");
-	return -1;
+	return 0;
+}
+
+static int sock_av_index_lookup(struct sock_av *av, struct sockaddr_in *addr)
+{
+	uint64_t i;
+
+	if (sock_av_index_sync(av) || !av->addr_index)
+		return -1;
+
+	i = sock_av_index_probe(av, av->addr_index, av->index_mask, addr);
+	if (av->addr_index[i] == SOCK_AV_INDEX_EMPTY ||
+	    !av->table[av->addr_index[i]].valid)
+		return -1;
+	return (int) av->addr_index[i];
+}
+
+int sock_av_get_addr_index(struct sock_av *av, struct sockaddr_in *addr)
+{
+	int index;
+
+	fastlock_acquire(&av->table_lock);
+	index = sock_av_index_lookup(av, addr);
+	fastlock_release(&av->table_lock);
+
+	if (index < 0)
+		SOCK_LOG_DBG("failed to get index in AV\n");
+	return index;
 }
 
 int sock_av_compare_addr(struct sock_av *av,
@@ -146,7 +295,7 @@ static int sock_check_table_in(struct sock_av *_av, struct sockaddr_in *addr,
 			       void *context, int index)
 {
 	void *new_addr;
-	int i, j, ret = 0;
+	int i, idx, ret = 0;
 	char sa_ip[INET_ADDRSTRLEN];
 	struct sock_av_addr *av_addr;
 	size_t new_count, table_sz, old_sz;
@@ -154,28 +303,25 @@ static int sock_check_table_in(struct sock_av *_av, struct sockaddr_in *addr,
 	if ((_av->attr.flags & FI_EVENT) && !_av->eq)
 		return -FI_ENOEQ;
 
+	fastlock_acquire(&_av->table_lock);
 	if (_av->attr.flags & FI_READ) {
 		for (i = 0; i < count; i++) {
-			for (j = 0; j < _av->table_hdr->stored; j++) {
-
-				if (!sock_av_is_valid_address(&addr[i])) {
-					if (fi_addr)
-						fi_addr[i] = FI_ADDR_NOTAVAIL;
-					sock_av_report_error(_av, context, i,
-								FI_EINVAL);
-					continue;
-				}
+			if (!sock_av_is_valid_address(&addr[i])) {
+				if (fi_addr)
+					fi_addr[i] = FI_ADDR_NOTAVAIL;
+				sock_av_report_error(_av, context, i, FI_EINVAL);
+				continue;
+			}
 
-				av_addr = &_av->table[j];
-				if (memcmp(&av_addr->addr, &addr[i],
-					   sizeof(struct sockaddr_in)) == 0) {
-					SOCK_LOG_DBG("Found addr in shared av\n");
-					if (fi_addr)
-						fi_addr[i] = (fi_addr_t)j;
-					ret++;
-				}
+			idx = sock_av_index_lookup(_av, &addr[i]);
+			if (idx >= 0) {
+				SOCK_LOG_DBG("Found addr in shared av\n");
+				if (fi_addr)
+					fi_addr[i] = (fi_addr_t)idx;
+				ret++;
 			}
 		}
+		fastlock_release(&_av->table_lock);
 		sock_av_report_success(_av, context, ret, flags);
 		return (_av->attr.flags & FI_EVENT) ? 0 : ret;
 	}
@@ -242,6 +388,9 @@ static int sock_check_table_in(struct sock_av *_av, struct sockaddr_in *addr,
 		_av->table_hdr->stored++;
 		ret++;
 	}
+	if (sock_av_index_sync(_av))
+		SOCK_LOG_ERROR("failed to index AV entries\n");
+	fastlock_release(&_av->table_lock);
 	sock_av_report_success(_av, context, ret, flags);
 	return (_av->attr.flags & FI_EVENT) ? 0 : ret;
 }
@@ -376,10 +525,14 @@ static int sock_av_remove(struct fid_av *av, fi_addr_t *fi_addr, size_t count,
 	struct sock_av_addr *av_addr;
 	_av = container_of(av, struct sock_av, av_fid);
 
+	fastlock_acquire(&_av->table_lock);
 	for (i = 0; i < count; i++) {
 		av_addr = &_av->table[fi_addr[i]];
+		if (av_addr->valid)
+			sock_av_index_remove(_av, fi_addr[i]);
 		av_addr->valid = 0;
 	}
+	fastlock_release(&_av->table_lock);
 	return 0;
 }
 
@@ -428,6 +581,8 @@ static int sock_av_close(struct fid *fid)
 			SOCK_LOG_ERROR("unmap failed: %s\n", strerror(errno));
 	}
 
+	free(av->addr_index);
+	fastlock_destroy(&av->table_lock);
 	atomic_dec(&av->domain->ref);
 	free(av);
 	return 0;
@@ -504,6 +659,7 @@ int sock_av_open(struct fid_domain *domain, struct fi_av_attr *attr,
 	_av = calloc(1, sizeof(*_av));
 	if (!_av)
 		return -FI_ENOMEM;
+	fastlock_init(&_av->table_lock);
 
 	_av->attr = *attr;
 	_av->attr.count = (attr->count) ? attr->count : sock_av_def_sz;
@@ -587,6 +743,7 @@ err2:
 			free(_av->table_hdr);
 	}
 err:
+	fastlock_destroy(&_av->table_lock);
 	free(_av);
 	return ret;
 }
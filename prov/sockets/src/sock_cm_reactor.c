@@ -0,0 +1,321 @@
+/*
+ * Copyright (c) 2014 Intel Corporation, Inc.  All rights reserved.
+ *
+ * This software is available to you under a choice of one of two
+ * licenses.  You may choose to be licensed under the terms of the GNU
+ * General Public License (GPL) Version 2, available from the file
+ * COPYING in the main directory of this source tree, or the
+ * BSD license below:
+ *
+ *     Redistribution and use in source and binary forms, with or
+ *     without modification, are permitted provided that the following
+ *     conditions are met:
+ *
+ *      - Redistributions of source code must retain the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer.
+ *
+ *      - Redistributions in binary form must reproduce the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer in the documentation and/or other materials
+ *        provided with the distribution.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#include "config.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "sock.h"
+#include "sock_util.h"
+
+#define SOCK_LOG_DBG(...) _SOCK_LOG_DBG(FI_LOG_EP_CTRL, __VA_ARGS__)
+#define SOCK_LOG_ERROR(...) _SOCK_LOG_ERROR(FI_LOG_EP_CTRL, __VA_ARGS__)
+
+#define SOCK_CM_REACTOR_DEF_SZ (64)
+
+/*
+ * One reactor thread per fabric services every CM socket: the RDM
+ * listen sockets, the MSG endpoint and passive endpoint datagram
+ * sockets.  The epoll set is only ever modified by the reactor thread
+ * itself; other threads queue their handlers on pending_list and wake
+ * it up.  Handlers run with the reactor lock held, so once
+ * sock_cm_reactor_del() returns the handler will not be called again.
+ */
+
+/* Caller must hold reactor->lock */
+static void sock_cm_reactor_wake(struct sock_cm_reactor *reactor)
+{
+	char c = 0;
+
+	if (reactor->signaled)
+		return;
+
+	if (ofi_write_socket(reactor->signal_fds[SOCK_SIGNAL_WR_FD], &c, 1) != 1)
+		SOCK_LOG_ERROR("Failed to signal\n");
+	else
+		reactor->signaled = 1;
+}
+
+static int sock_cm_reactor_grow_map(struct sock_cm_reactor *reactor, int fd)
+{
+	struct sock_cm_handler **fd_map;
+	size_t new_size;
+
+	if ((size_t) fd < reactor->fd_map_sz)
+		return 0;
+
+	new_size = reactor->fd_map_sz ? reactor->fd_map_sz : 64;
+	while (new_size <= (size_t) fd)
+		new_size *= 2;
+
+	fd_map = realloc(reactor->fd_map, new_size * sizeof(*fd_map));
+	if (!fd_map)
+		return -FI_ENOMEM;
+
+	memset(&fd_map[reactor->fd_map_sz], 0,
+	       (new_size - reactor->fd_map_sz) * sizeof(*fd_map));
+	reactor->fd_map = fd_map;
+	reactor->fd_map_sz = new_size;
+	return 0;
+}
+
+static void sock_cm_reactor_remove(struct sock_cm_reactor *reactor,
+				   struct sock_cm_handler *handler)
+{
+	if (sock_epoll_del(&reactor->epoll_set, handler->fd))
+		SOCK_LOG_ERROR("failed to remove from epoll set: %d\n",
+			       handler->fd);
+	reactor->fd_map[handler->fd] = NULL;
+	dlist_remove(&handler->entry);
+	handler->state = SOCK_CM_HANDLER_IDLE;
+}
+
+static void sock_cm_reactor_apply(struct sock_cm_reactor *reactor)
+{
+	struct sock_cm_handler *handler;
+	struct sock_epoll_set *set = &reactor->epoll_set;
+
+	if (dlist_empty(&reactor->pending_list))
+		return;
+
+	while (!dlist_empty(&reactor->pending_list)) {
+		handler = container_of(reactor->pending_list.next,
+				       struct sock_cm_handler, pending_entry);
+		dlist_remove(&handler->pending_entry);
+
+		if (handler->state == SOCK_CM_HANDLER_DEL) {
+			sock_cm_reactor_remove(reactor, handler);
+			continue;
+		}
+
+		if ((set->used == set->size &&
+		     sock_epoll_grow(set, set->size * 2)) ||
+		    sock_epoll_add(set, handler->fd)) {
+			SOCK_LOG_ERROR("failed to add to epoll set: %d\n",
+				       handler->fd);
+			handler->state = SOCK_CM_HANDLER_IDLE;
+			continue;
+		}
+
+		reactor->fd_map[handler->fd] = handler;
+		dlist_insert_tail(&handler->entry, &reactor->handler_list);
+		handler->state = SOCK_CM_HANDLER_ACTIVE;
+	}
+	pthread_cond_broadcast(&reactor->cond);
+}
+
+static int sock_cm_reactor_flush(struct sock_cm_reactor *reactor)
+{
+	struct dlist_entry *entry;
+	struct sock_cm_handler *handler;
+	int pending = 0;
+
+	for (entry = reactor->handler_list.next;
+	     entry != &reactor->handler_list; entry = entry->next) {
+		handler = container_of(entry, struct sock_cm_handler, entry);
+		if (handler->flush && handler->flush(handler))
+			pending = 1;
+	}
+	return pending;
+}
+
+static void *sock_cm_reactor_thread(void *arg)
+{
+	struct sock_cm_reactor *reactor = arg;
+	struct sock_cm_handler *handler;
+	int i, fd, ret, timeout;
+	char tmp;
+
+	SOCK_LOG_DBG("Starting CM reactor: %p\n", reactor);
+	pthread_mutex_lock(&reactor->lock);
+	while (reactor->running) {
+		sock_cm_reactor_apply(reactor);
+		timeout = sock_cm_reactor_flush(reactor) ?
+			SOCK_CM_COMM_TIMEOUT : -1;
+		pthread_mutex_unlock(&reactor->lock);
+
+		ret = sock_epoll_wait(&reactor->epoll_set, timeout);
+
+		pthread_mutex_lock(&reactor->lock);
+		if (ret < 0) {
+			if (errno != EINTR)
+				SOCK_LOG_ERROR("poll failed: %s\n", strerror(errno));
+			continue;
+		}
+
+		for (i = 0; i < ret; i++) {
+			fd = sock_epoll_get_fd_at_index(&reactor->epoll_set, i);
+			if (fd == reactor->signal_fds[SOCK_SIGNAL_RD_FD]) {
+				if (ofi_read_socket(fd, &tmp, 1) == 1)
+					reactor->signaled = 0;
+				continue;
+			}
+
+			handler = (fd >= 0 && (size_t) fd < reactor->fd_map_sz) ?
+				reactor->fd_map[fd] : NULL;
+			if (handler && handler->state == SOCK_CM_HANDLER_ACTIVE)
+				handler->handle(handler);
+		}
+	}
+	pthread_mutex_unlock(&reactor->lock);
+	SOCK_LOG_DBG("CM reactor exited\n");
+	return NULL;
+}
+
+int sock_cm_reactor_init(struct sock_cm_reactor *reactor)
+{
+	int ret;
+
+	memset(reactor, 0, sizeof(*reactor));
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, reactor->signal_fds) < 0)
+		return -errno;
+
+	fd_set_nonblock(reactor->signal_fds[SOCK_SIGNAL_RD_FD]);
+	if (sock_epoll_create(&reactor->epoll_set, SOCK_CM_REACTOR_DEF_SZ) < 0) {
+		ret = -FI_ENOMEM;
+		goto err;
+	}
+
+	if (sock_epoll_add(&reactor->epoll_set,
+			   reactor->signal_fds[SOCK_SIGNAL_RD_FD])) {
+		ret = -FI_EINVAL;
+		sock_epoll_close(&reactor->epoll_set);
+		goto err;
+	}
+
+	pthread_mutex_init(&reactor->lock, NULL);
+	pthread_cond_init(&reactor->cond, NULL);
+	dlist_init(&reactor->handler_list);
+	dlist_init(&reactor->pending_list);
+	return 0;
+err:
+	ofi_close_socket(reactor->signal_fds[0]);
+	ofi_close_socket(reactor->signal_fds[1]);
+	return ret;
+}
+
+void sock_cm_reactor_close(struct sock_cm_reactor *reactor)
+{
+	int running;
+
+	pthread_mutex_lock(&reactor->lock);
+	running = reactor->running;
+	if (running) {
+		reactor->running = 0;
+		sock_cm_reactor_wake(reactor);
+	}
+	pthread_mutex_unlock(&reactor->lock);
+
+	if (running && pthread_join(reactor->thread, NULL))
+		SOCK_LOG_ERROR("pthread join failed (%d)\n", errno);
+
+	sock_epoll_close(&reactor->epoll_set);
+	ofi_close_socket(reactor->signal_fds[0]);
+	ofi_close_socket(reactor->signal_fds[1]);
+	pthread_cond_destroy(&reactor->cond);
+	pthread_mutex_destroy(&reactor->lock);
+	free(reactor->fd_map);
+}
+
+int sock_cm_reactor_add(struct sock_cm_reactor *reactor,
+			struct sock_cm_handler *handler)
+{
+	int ret;
+
+	pthread_mutex_lock(&reactor->lock);
+	ret = sock_cm_reactor_grow_map(reactor, handler->fd);
+	if (ret)
+		goto out;
+
+	if (!reactor->running) {
+		reactor->running = 1;
+		if (pthread_create(&reactor->thread, NULL,
+				   sock_cm_reactor_thread, reactor)) {
+			SOCK_LOG_ERROR("failed to create CM reactor thread\n");
+			reactor->running = 0;
+			ret = -FI_EINVAL;
+			goto out;
+		}
+	}
+
+	handler->reactor = reactor;
+	handler->state = SOCK_CM_HANDLER_ADD;
+	dlist_insert_tail(&handler->pending_entry, &reactor->pending_list);
+	sock_cm_reactor_wake(reactor);
+out:
+	pthread_mutex_unlock(&reactor->lock);
+	return ret;
+}
+
+void sock_cm_reactor_del(struct sock_cm_handler *handler)
+{
+	struct sock_cm_reactor *reactor = handler->reactor;
+
+	if (!reactor)
+		return;
+
+	pthread_mutex_lock(&reactor->lock);
+	switch (handler->state) {
+	case SOCK_CM_HANDLER_ADD:
+		dlist_remove(&handler->pending_entry);
+		handler->state = SOCK_CM_HANDLER_IDLE;
+		break;
+	case SOCK_CM_HANDLER_ACTIVE:
+		if (pthread_equal(pthread_self(), reactor->thread)) {
+			sock_cm_reactor_remove(reactor, handler);
+			break;
+		}
+		handler->state = SOCK_CM_HANDLER_DEL;
+		dlist_insert_tail(&handler->pending_entry, &reactor->pending_list);
+		sock_cm_reactor_wake(reactor);
+		while (handler->state != SOCK_CM_HANDLER_IDLE)
+			pthread_cond_wait(&reactor->cond, &reactor->lock);
+		break;
+	default:
+		break;
+	}
+	handler->reactor = NULL;
+	pthread_mutex_unlock(&reactor->lock);
+}
+
+void sock_cm_reactor_signal(struct sock_cm_reactor *reactor)
+{
+	pthread_mutex_lock(&reactor->lock);
+	sock_cm_reactor_wake(reactor);
+	pthread_mutex_unlock(&reactor->lock);
+}
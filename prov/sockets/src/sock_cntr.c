@@ -119,83 +119,160 @@ int sock_cntr_progress(struct sock_cntr *cntr)
 	return 0;
 }
 
-void sock_cntr_check_trigger_list(struct sock_cntr *cntr)
+static int sock_trigger_before(struct sock_trigger *t1,
+			       struct sock_trigger *t2)
 {
-	struct sock_trigger *trigger;
-	struct dlist_entry *entry;
-	int ret = 0;
-
-	fastlock_acquire(&cntr->trigger_lock);
-	for (entry = cntr->trigger_list.next;
-	     entry != &cntr->trigger_list;) {
-
-		trigger = container_of(entry, struct sock_trigger, entry);
-		entry = entry->next;
+	return (t1->threshold < t2->threshold) ||
+	       (t1->threshold == t2->threshold && t1->seq < t2->seq);
+}
 
-		if (atomic_get(&cntr->value) < trigger->threshold)
-			continue;
+/* Must hold trigger_lock */
+static void sock_trigger_heap_push(struct sock_cntr *cntr,
+				   struct sock_trigger *trigger)
+{
+	struct sock_trigger **heap = cntr->trigger_heap;
+	size_t i, parent;
 
-		switch (trigger->op_type) {
-		case SOCK_OP_SEND:
-			ret = sock_ep_sendmsg(trigger->ep, &trigger->op.msg.msg,
-					trigger->flags & ~FI_TRIGGER);
+	for (i = cntr->trigger_cnt++; i > 0; i = parent) {
+		parent = (i - 1) / 2;
+		if (!sock_trigger_before(trigger, heap[parent]))
 			break;
+		heap[i] = heap[parent];
+	}
+	heap[i] = trigger;
+}
 
-		case SOCK_OP_RECV:
-			ret = sock_ep_recvmsg(trigger->ep, &trigger->op.msg.msg,
-					trigger->flags & ~FI_TRIGGER);
+/* Must hold trigger_lock */
+static void sock_trigger_heap_pop(struct sock_cntr *cntr)
+{
+	struct sock_trigger **heap = cntr->trigger_heap;
+	struct sock_trigger *last;
+	size_t i, child;
+
+	last = heap[--cntr->trigger_cnt];
+	for (i = 0; (child = 2 * i + 1) < cntr->trigger_cnt; i = child) {
+		if (child + 1 < cntr->trigger_cnt &&
+		    sock_trigger_before(heap[child + 1], heap[child]))
+			child++;
+		if (!sock_trigger_before(heap[child], last))
 			break;
+		heap[i] = heap[child];
+	}
+	heap[i] = last;
+}
 
-		case SOCK_OP_TSEND:
-			ret = sock_ep_tsendmsg(trigger->ep,
-					&trigger->op.tmsg.msg,
+/* Must hold trigger_lock */
+static void sock_trigger_update_min(struct sock_cntr *cntr)
+{
+	atomic64_set(&cntr->trigger_min, cntr->trigger_cnt ?
+		     cntr->trigger_heap[0]->threshold : UINT64_MAX);
+}
+
+static ssize_t sock_trigger_fire(struct sock_trigger *trigger)
+{
+	switch (trigger->op_type) {
+	case SOCK_OP_SEND:
+		return sock_ep_sendmsg(trigger->ep, &trigger->op.msg.msg,
+				trigger->flags & ~FI_TRIGGER);
+
+	case SOCK_OP_RECV:
+		return sock_ep_recvmsg(trigger->ep, &trigger->op.msg.msg,
+				trigger->flags & ~FI_TRIGGER);
+
+	case SOCK_OP_TSEND:
+		return sock_ep_tsendmsg(trigger->ep,
+				&trigger->op.tmsg.msg,
+				trigger->flags & ~FI_TRIGGER);
+
+	case SOCK_OP_TRECV:
+		return sock_ep_trecvmsg(trigger->ep,
+				&trigger->op.tmsg.msg,
+				trigger->flags & ~FI_TRIGGER);
+
+	case SOCK_OP_WRITE:
+		return sock_ep_rma_writemsg(trigger->ep,
+					&trigger->op.rma.msg,
 					trigger->flags & ~FI_TRIGGER);
-			break;
 
-		case SOCK_OP_TRECV:
-			ret = sock_ep_trecvmsg(trigger->ep,
-					&trigger->op.tmsg.msg,
+	case SOCK_OP_READ:
+		return sock_ep_rma_readmsg(trigger->ep,
+					&trigger->op.rma.msg,
 					trigger->flags & ~FI_TRIGGER);
-			break;
 
-		case SOCK_OP_WRITE:
-			ret = sock_ep_rma_writemsg(trigger->ep,
-						&trigger->op.rma.msg,
-						trigger->flags & ~FI_TRIGGER);
-			break;
+	case SOCK_OP_ATOMIC:
+		return sock_ep_tx_atomic(trigger->ep,
+				&trigger->op.atomic.msg,
+				trigger->op.atomic.comparev,
+				NULL,
+				trigger->op.atomic.compare_count,
+				trigger->op.atomic.resultv,
+				NULL,
+				trigger->op.atomic.result_count,
+				trigger->flags & ~FI_TRIGGER);
 
-		case SOCK_OP_READ:
-			ret = sock_ep_rma_readmsg(trigger->ep,
-						&trigger->op.rma.msg,
-						trigger->flags & ~FI_TRIGGER);
-			break;
+	default:
+		SOCK_LOG_ERROR("unsupported op\n");
+		return 0;
+	}
+}
 
-		case SOCK_OP_ATOMIC:
-			ret = sock_ep_tx_atomic(trigger->ep,
-					&trigger->op.atomic.msg,
-					trigger->op.atomic.comparev,
-					NULL,
-					trigger->op.atomic.compare_count,
-					trigger->op.atomic.resultv,
-					NULL,
-					trigger->op.atomic.result_count,
-					trigger->flags & ~FI_TRIGGER);
+/*
+ * Fires the triggers whose threshold has been reached, in threshold
+ * order.  Returns without taking trigger_lock when none has.
+ */
+void sock_cntr_check_trigger_list(struct sock_cntr *cntr)
+{
+	struct sock_trigger *trigger;
+
+	if (atomic64_get(&cntr->value) < atomic64_get(&cntr->trigger_min))
+		return;
+
+	fastlock_acquire(&cntr->trigger_lock);
+	while (cntr->trigger_cnt) {
+		trigger = cntr->trigger_heap[0];
+		if (atomic64_get(&cntr->value) < trigger->threshold)
 			break;
 
-		default:
-			SOCK_LOG_ERROR("unsupported op\n");
-			ret = 0;
+		if (sock_trigger_fire(trigger) == -FI_EAGAIN)
 			break;
-		}
 
-		if (ret != -FI_EAGAIN) {
-			dlist_remove(&trigger->entry);
+		sock_trigger_heap_pop(cntr);
+		free(trigger);
+	}
+	sock_trigger_update_min(cntr);
+	fastlock_release(&cntr->trigger_lock);
+}
+
+/*
+ * Takes ownership of trigger, which is freed if it cannot be queued.
+ */
+int sock_cntr_queue_trigger(struct sock_cntr *cntr,
+			    struct sock_trigger *trigger)
+{
+	struct sock_trigger **heap;
+	size_t size;
+
+	fastlock_acquire(&cntr->trigger_lock);
+	if (cntr->trigger_cnt == cntr->trigger_sz) {
+		size = cntr->trigger_sz ? cntr->trigger_sz * 2 :
+			SOCK_CNTR_DEF_TRIGGERS;
+		heap = realloc(cntr->trigger_heap, size * sizeof(*heap));
+		if (!heap) {
+			fastlock_release(&cntr->trigger_lock);
 			free(trigger);
-		} else {
-			break;
+			return -FI_ENOMEM;
 		}
+		cntr->trigger_heap = heap;
+		cntr->trigger_sz = size;
 	}
+
+	trigger->seq = cntr->trigger_seq++;
+	sock_trigger_heap_push(cntr, trigger);
+	sock_trigger_update_min(cntr);
 	fastlock_release(&cntr->trigger_lock);
+
+	sock_cntr_check_trigger_list(cntr);
+	return 0;
 }
 
 static uint64_t sock_cntr_read(struct fid_cntr *cntr)
@@ -203,19 +280,32 @@ static uint64_t sock_cntr_read(struct fid_cntr *cntr)
 	struct sock_cntr *_cntr;
 	_cntr = container_of(cntr, struct sock_cntr, cntr_fid);
 	sock_cntr_progress(_cntr);
-	return atomic_get(&_cntr->value);
+	return atomic64_get(&_cntr->value);
 }
 
-void sock_cntr_inc(struct sock_cntr *cntr)
+/*
+ * Called after the value has been updated.  A waiter publishes its
+ * threshold before checking the value, so either it sees the update or
+ * this sees the threshold.  The mutex is held by the waiter until it
+ * sleeps, which keeps the signal from being lost.
+ */
+static void sock_cntr_signal(struct sock_cntr *cntr, uint64_t value)
 {
-	pthread_mutex_lock(&cntr->mut);
-	atomic_inc(&cntr->value);
-	if (atomic_get(&cntr->value) >= atomic_get(&cntr->threshold))
+	if (value >= atomic64_get(&cntr->threshold)) {
+		pthread_mutex_lock(&cntr->mut);
 		pthread_cond_signal(&cntr->cond);
-	pthread_mutex_unlock(&cntr->mut);
+		pthread_mutex_unlock(&cntr->mut);
+		if (cntr->domain->progress_mode == FI_PROGRESS_MANUAL)
+			sock_pe_signal(cntr->domain->pe);
+	}
 	sock_cntr_check_trigger_list(cntr);
 }
 
+void sock_cntr_inc(struct sock_cntr *cntr)
+{
+	sock_cntr_signal(cntr, atomic64_inc(&cntr->value));
+}
+
 void sock_cntr_err_inc(struct sock_cntr *cntr)
 {
 	pthread_mutex_lock(&cntr->mut);
@@ -224,6 +314,8 @@ void sock_cntr_err_inc(struct sock_cntr *cntr)
 		cntr->err_flag = 1;
 	pthread_cond_signal(&cntr->cond);
 	pthread_mutex_unlock(&cntr->mut);
+	if (cntr->domain->progress_mode == FI_PROGRESS_MANUAL)
+		sock_pe_signal(cntr->domain->pe);
 }
 
 static int sock_cntr_add(struct fid_cntr *cntr, uint64_t value)
@@ -231,12 +323,7 @@ static int sock_cntr_add(struct fid_cntr *cntr, uint64_t value)
 	struct sock_cntr *_cntr;
 
 	_cntr = container_of(cntr, struct sock_cntr, cntr_fid);
-	pthread_mutex_lock(&_cntr->mut);
-	atomic_set(&_cntr->value, atomic_get(&_cntr->value) + value);
-	if (atomic_get(&_cntr->value) >= atomic_get(&_cntr->threshold))
-		pthread_cond_signal(&_cntr->cond);
-	pthread_mutex_unlock(&_cntr->mut);
-	sock_cntr_check_trigger_list(_cntr);
+	sock_cntr_signal(_cntr, atomic64_add(&_cntr->value, value));
 	return 0;
 }
 
@@ -245,20 +332,23 @@ static int sock_cntr_set(struct fid_cntr *cntr, uint64_t value)
 	struct sock_cntr *_cntr;
 
 	_cntr = container_of(cntr, struct sock_cntr, cntr_fid);
-	pthread_mutex_lock(&_cntr->mut);
-	atomic_set(&_cntr->value, value);
-	if (atomic_get(&_cntr->value) >= atomic_get(&_cntr->threshold))
-		pthread_cond_signal(&_cntr->cond);
-	pthread_mutex_unlock(&_cntr->mut);
-	sock_cntr_check_trigger_list(_cntr);
+	sock_cntr_signal(_cntr, atomic64_set(&_cntr->value, value));
 	return 0;
 }
 
+static int sock_cntr_ready(void *arg)
+{
+	struct sock_cntr *cntr = arg;
+
+	return atomic64_get(&cntr->value) >= atomic64_get(&cntr->threshold) ||
+	       cntr->err_flag;
+}
+
 static int sock_cntr_wait(struct fid_cntr *cntr, uint64_t threshold,
 				int timeout)
 {
 	int ret = 0;
-	uint64_t start_ms = 0, end_ms = 0;
+	uint64_t start_ms = 0, end_ms = 0, now_ms, spin_end;
 	struct sock_cntr *_cntr;
 
 	_cntr = container_of(cntr, struct sock_cntr, cntr_fid);
@@ -269,7 +359,7 @@ static int sock_cntr_wait(struct fid_cntr *cntr, uint64_t threshold,
 		goto out;
 	}
 
-	if (atomic_get(&_cntr->value) >= threshold) {
+	if (atomic64_get(&_cntr->value) >= threshold) {
 		ret = 0;
 		goto out;
 	}
@@ -280,29 +370,42 @@ static int sock_cntr_wait(struct fid_cntr *cntr, uint64_t threshold,
 	}
 
 	_cntr->is_waiting = 1;
-	atomic_set(&_cntr->threshold, threshold);
+	atomic64_set(&_cntr->threshold, threshold);
 
-	if (_cntr->domain->progress_mode == FI_PROGRESS_MANUAL) {
+	if (atomic64_get(&_cntr->value) >= threshold) {
+		ret = 0;
+	} else if (_cntr->domain->progress_mode == FI_PROGRESS_MANUAL) {
 		pthread_mutex_unlock(&_cntr->mut);
 		if (timeout >= 0) {
 			start_ms = fi_gettime_ms();
 			end_ms = start_ms + timeout;
 		}
 
-		while (atomic_get(&_cntr->value) < threshold) {
+		spin_end = sock_spin_deadline(&_cntr->spin);
+		while (!sock_cntr_ready(_cntr)) {
 			sock_cntr_progress(_cntr);
-			if (timeout >= 0 && fi_gettime_ms() >= end_ms) {
+			if (sock_cntr_ready(_cntr))
+				break;
+
+			now_ms = fi_gettime_ms();
+			if (timeout >= 0 && now_ms >= end_ms) {
 				ret = FI_ETIMEDOUT;
 				break;
 			}
+			if (timeout && sock_gettime_us() >= spin_end)
+				sock_pe_wait(_cntr->domain->pe, sock_cntr_ready,
+					     _cntr, timeout < 0 ? -1 :
+					     (int) (end_ms - now_ms));
 		}
 		pthread_mutex_lock(&_cntr->mut);
+		if (!ret)
+			sock_spin_update(&_cntr->spin);
 	} else {
 		ret = fi_wait_cond(&_cntr->cond, &_cntr->mut, timeout);
 	}
 
 	_cntr->is_waiting = 0;
-	atomic_set(&_cntr->threshold, ~0);
+	atomic64_set(&_cntr->threshold, UINT64_MAX);
 	pthread_mutex_unlock(&_cntr->mut);
 	sock_cntr_check_trigger_list(_cntr);
 	return (_cntr->err_flag) ? -FI_EAVAIL : -ret;
@@ -362,6 +465,7 @@ static int sock_cntr_control(struct fid *fid, int command, void *arg)
 static int sock_cntr_close(struct fid *fid)
 {
 	struct sock_cntr *cntr;
+	size_t i;
 
 	cntr = container_of(fid, struct sock_cntr, cntr_fid.fid);
 	if (atomic_get(&cntr->ref))
@@ -370,6 +474,10 @@ static int sock_cntr_close(struct fid *fid)
 	if (cntr->signal && cntr->attr.wait_obj == FI_WAIT_FD)
 		sock_wait_close(&cntr->waitset->fid);
 
+	for (i = 0; i < cntr->trigger_cnt; i++)
+		free(cntr->trigger_heap[i]);
+	free(cntr->trigger_heap);
+
 	pthread_mutex_destroy(&cntr->mut);
 	fastlock_destroy(&cntr->list_lock);
 	fastlock_destroy(&cntr->trigger_lock);
@@ -508,13 +616,13 @@ int sock_cntr_open(struct fid_domain *domain, struct fi_cntr_attr *attr,
 	atomic_initialize(&_cntr->ref, 0);
 	atomic_initialize(&_cntr->err_cnt, 0);
 
-	atomic_initialize(&_cntr->value, 0);
-	atomic_initialize(&_cntr->threshold, INT_MAX);
+	atomic64_initialize(&_cntr->value, 0);
+	atomic64_initialize(&_cntr->threshold, UINT64_MAX);
 
 	dlist_init(&_cntr->tx_list);
 	dlist_init(&_cntr->rx_list);
 
-	dlist_init(&_cntr->trigger_list);
+	atomic64_initialize(&_cntr->trigger_min, UINT64_MAX);
 	fastlock_init(&_cntr->trigger_lock);
 
 	_cntr->cntr_fid.fid.fclass = FI_CLASS_CNTR;
@@ -44,8 +44,8 @@
 #define SOCK_LOG_DBG(...) _SOCK_LOG_DBG(FI_LOG_EP_DATA, __VA_ARGS__)
 #define SOCK_LOG_ERROR(...) _SOCK_LOG_ERROR(FI_LOG_EP_DATA, __VA_ARGS__)
 
-static ssize_t sock_comm_send_socket(struct sock_conn *conn,
-				     const void *buf, size_t len)
+static ssize_t sock_comm_write_socket(struct sock_conn *conn,
+				      const void *buf, size_t len)
 {
 	ssize_t ret;
 
@@ -62,6 +62,276 @@ static ssize_t sock_comm_send_socket(struct sock_conn *conn,
 	return ret;
 }
 
+static ssize_t sock_comm_write_conn(struct sock_conn *conn,
+				    const void *buf, size_t len)
+{
+	struct iovec iov;
+
+	if (conn->shm || conn->uring) {
+		iov.iov_base = (void *) buf;
+		iov.iov_len = len;
+		return conn->shm ? sock_shm_sendv(conn, &iov, 1) :
+				   sock_uring_sendv(conn, &iov, 1);
+	}
+	return sock_comm_write_socket(conn, buf, len);
+}
+
+/*
+ * Small messages to the same peer are packed back to back into the
+ * connection's tx_agg buffer, and written with one system call once it
+ * is full or holds SOCK_TX_AGG_MAX_CNT messages, or at the end of the
+ * progress pass.  Each message keeps its own header, so the receiver
+ * unpacks a batch like any other part of the stream.  Anything else
+ * written to the connection flushes the buffer first.  Shared memory
+ * and io_uring connections batch on their own, and only get
+ * acknowledgements queued here, see sock_comm_ack().
+ *
+ * Returns 1 if the whole message was packed, which the caller may then
+ * consider sent.  The caller owns the connection and holds the PE lock.
+ */
+int sock_comm_agg(struct sock_pe_entry *pe_entry, const struct iovec *iov,
+		  size_t iov_cnt, size_t len)
+{
+	struct sock_conn *conn = pe_entry->conn;
+	size_t i;
+
+	if (sock_tx_agg_max <= 0 || len > (size_t) sock_tx_agg_max ||
+	    len > SOCK_TX_AGG_SZ || conn->shm || conn->uring ||
+	    !rbempty(&pe_entry->comm_buf))
+		return 0;
+
+	if (!conn->tx_agg) {
+		conn->tx_agg = malloc(SOCK_TX_AGG_SZ);
+		if (!conn->tx_agg)
+			return 0;
+	}
+
+	if (SOCK_TX_AGG_SZ - conn->tx_agg_len < len &&
+	    sock_comm_agg_flush(conn))
+		return 0;
+
+	if (!conn->tx_agg_len)
+		dlist_insert_tail(&conn->tx_agg_entry,
+				  &conn->ep_attr->pe->tx_agg_list);
+
+	for (i = 0; i < iov_cnt; i++) {
+		memcpy(conn->tx_agg + conn->tx_agg_len, iov[i].iov_base,
+		       iov[i].iov_len);
+		conn->tx_agg_len += iov[i].iov_len;
+	}
+
+	if (++conn->tx_agg_cnt >= SOCK_TX_AGG_MAX_CNT ||
+	    SOCK_TX_AGG_SZ - conn->tx_agg_len < (size_t) sock_tx_agg_max)
+		sock_comm_agg_flush(conn);
+	return 1;
+}
+
+/* Forget the packed messages, as when the connection goes away */
+void sock_comm_agg_drop(struct sock_conn *conn)
+{
+	if (conn->tx_agg_len)
+		dlist_remove(&conn->tx_agg_entry);
+	conn->tx_agg_len = conn->tx_agg_sent = 0;
+	conn->tx_agg_cnt = 0;
+}
+
+/* Hand the messages queued on a socket to the connection taking it over */
+void sock_comm_agg_move(struct sock_conn *to, struct sock_conn *from)
+{
+	char *buf;
+
+	sock_comm_agg_drop(to);
+	buf = to->tx_agg;
+	to->tx_agg = from->tx_agg;
+	from->tx_agg = buf;
+
+	if (from->tx_agg_len) {
+		dlist_remove(&from->tx_agg_entry);
+		dlist_insert_tail(&to->tx_agg_entry,
+				  &to->ep_attr->pe->tx_agg_list);
+	}
+	to->tx_agg_len = from->tx_agg_len;
+	to->tx_agg_sent = from->tx_agg_sent;
+	to->tx_agg_cnt = from->tx_agg_cnt;
+	from->tx_agg_len = from->tx_agg_sent = 0;
+	from->tx_agg_cnt = 0;
+}
+
+/*
+ * Returns 0 once all packed messages have been written.  After a write
+ * error the rest of the batch can never follow what went out, so it is
+ * dropped and the connection is left for the reaper to close.
+ */
+int sock_comm_agg_flush(struct sock_conn *conn)
+{
+	ssize_t ret;
+
+	if (conn->tx_agg_sent < conn->tx_agg_len) {
+		ret = sock_comm_write_conn(conn,
+					   conn->tx_agg + conn->tx_agg_sent,
+					   conn->tx_agg_len - conn->tx_agg_sent);
+		if (ret < 0) {
+			ret = -errno;
+			SOCK_LOG_DBG("Dropping conn to %s:%d after a failed write\n",
+				     inet_ntoa(conn->addr.sin_addr),
+				     ntohs(conn->addr.sin_port));
+			conn->disconnected = 1;
+			sock_comm_agg_drop(conn);
+			return (int) ret;
+		}
+		if (ret > 0)
+			conn->tx_agg_sent += ret;
+		if (conn->tx_agg_sent < conn->tx_agg_len)
+			return -FI_EAGAIN;
+	}
+
+	sock_comm_agg_drop(conn);
+	return 0;
+}
+
+void sock_comm_agg_flush_all(struct sock_pe *pe)
+{
+	struct dlist_entry *entry, *next;
+	struct sock_conn *conn;
+
+	for (entry = pe->tx_agg_list.next; entry != &pe->tx_agg_list;
+	     entry = next) {
+		next = entry->next;
+		conn = container_of(entry, struct sock_conn, tx_agg_entry);
+		sock_comm_agg_flush(conn);
+	}
+}
+
+/*
+ * Sends that asked for a transmit completion are not acknowledged one
+ * by one.  Both sides count them in stream order, and the receiver
+ * answers with its running count in a single SOCK_OP_SEND_ACK per
+ * connection, ahead of its next message to the peer or at the end of
+ * the progress pass, packed with whatever else the pass queued.  The
+ * sender then completes its sends up to that count.  Called with the PE
+ * lock held, once the message has been received.
+ */
+void sock_comm_ack(struct sock_conn *conn)
+{
+	if (conn->rx_ack_seq++ == conn->rx_acked_seq)
+		dlist_insert_tail(&conn->rx_ack_entry,
+				  &conn->ep_attr->pe->rx_ack_list);
+}
+
+/* Forget the acks owed and start counting afresh, as on a new socket */
+void sock_comm_ack_drop(struct sock_conn *conn)
+{
+	if (conn->rx_ack_seq != conn->rx_acked_seq)
+		dlist_remove(&conn->rx_ack_entry);
+	conn->rx_ack_seq = conn->rx_acked_seq = 0;
+	conn->tx_ack_seq = 0;
+}
+
+void sock_comm_ack_move(struct sock_conn *to, struct sock_conn *from)
+{
+	sock_comm_ack_drop(to);
+	if (from->rx_ack_seq != from->rx_acked_seq) {
+		dlist_remove(&from->rx_ack_entry);
+		dlist_insert_tail(&to->rx_ack_entry,
+				  &to->ep_attr->pe->rx_ack_list);
+	}
+	to->rx_ack_seq = from->rx_ack_seq;
+	to->rx_acked_seq = from->rx_acked_seq;
+	from->rx_ack_seq = from->rx_acked_seq = 0;
+}
+
+/*
+ * Queue a message of our own, such as an ack or a connection control
+ * message, behind the packed messages.  It is written at the end of the
+ * progress pass at the latest, and never blocks the caller.  Returns 0
+ * once queued, or -FI_EAGAIN while another message is being transmitted
+ * on the connection or no room can be made.  The caller holds the PE
+ * lock.
+ */
+int sock_comm_queue(struct sock_conn *conn, const void *buf, size_t len)
+{
+	/* it would land in the middle of that message */
+	if (conn->tx_pe_entry)
+		return -FI_EAGAIN;
+
+	if (!conn->tx_agg) {
+		conn->tx_agg = malloc(SOCK_TX_AGG_SZ);
+		if (!conn->tx_agg)
+			return -FI_ENOMEM;
+	}
+
+	if (SOCK_TX_AGG_SZ - conn->tx_agg_len < len &&
+	    sock_comm_agg_flush(conn))
+		return -FI_EAGAIN;
+
+	if (!conn->tx_agg_len)
+		dlist_insert_tail(&conn->tx_agg_entry,
+				  &conn->ep_attr->pe->tx_agg_list);
+	memcpy(conn->tx_agg + conn->tx_agg_len, buf, len);
+	conn->tx_agg_len += len;
+	conn->tx_agg_cnt++;
+	return 0;
+}
+
+/*
+ * Queue the ack owed, if any, ahead of anything else written to the
+ * connection.  Returns 0 once queued.
+ */
+int sock_comm_ack_flush(struct sock_conn *conn)
+{
+	struct sock_msg_send_ack ack;
+	int ret;
+
+	if (conn->rx_ack_seq == conn->rx_acked_seq)
+		return 0;
+
+	memset(&ack, 0, sizeof(ack));
+	ack.msg_hdr.version = SOCK_WIRE_PROTO_VERSION;
+	ack.msg_hdr.op_type = SOCK_OP_SEND_ACK;
+	ack.msg_hdr.msg_len = htonll(sizeof(ack));
+	ack.seq = htonll(conn->rx_ack_seq);
+
+	ret = sock_comm_queue(conn, &ack, sizeof(ack));
+	if (ret)
+		return ret;
+
+	SOCK_LOG_DBG("Acking %" PRIu64 " sends on conn %p\n",
+		     conn->rx_ack_seq - conn->rx_acked_seq, conn);
+	dlist_remove(&conn->rx_ack_entry);
+	conn->rx_acked_seq = conn->rx_ack_seq;
+	return 0;
+}
+
+/*
+ * Connections busy with another message keep their ack for a later
+ * pass.  Nothing can be sent to a peer that went away.
+ */
+void sock_comm_ack_flush_all(struct sock_pe *pe)
+{
+	struct dlist_entry *entry, *next;
+	struct sock_conn *conn;
+
+	for (entry = pe->rx_ack_list.next; entry != &pe->rx_ack_list;
+	     entry = next) {
+		next = entry->next;
+		conn = container_of(entry, struct sock_conn, rx_ack_entry);
+		if (conn->disconnected) {
+			dlist_remove(&conn->rx_ack_entry);
+			conn->rx_acked_seq = conn->rx_ack_seq;
+			continue;
+		}
+		sock_comm_ack_flush(conn);
+	}
+}
+
+static ssize_t sock_comm_send_socket(struct sock_conn *conn,
+				     const void *buf, size_t len)
+{
+	if (conn->tx_agg_len && sock_comm_agg_flush(conn))
+		return 0;
+	return sock_comm_write_conn(conn, buf, len);
+}
+
 ssize_t sock_comm_flush(struct sock_pe_entry *pe_entry)
 {
 	ssize_t ret1, ret2 = 0;
@@ -96,6 +366,14 @@ ssize_t sock_comm_send(struct sock_pe_entry *pe_entry,
 {
 	ssize_t ret, used;
 
+	/*
+	 * shared memory is written directly, and io_uring sends are
+	 * staged already: there is nothing to batch
+	 */
+	if ((pe_entry->conn->shm || pe_entry->conn->uring) &&
+	    rbempty(&pe_entry->comm_buf))
+		return sock_comm_send_socket(pe_entry->conn, buf, len);
+
 	if (len > pe_entry->cache_sz) {
 		used = rbused(&pe_entry->comm_buf);
 		if (used == sock_comm_flush(pe_entry)) {
@@ -118,88 +396,221 @@ ssize_t sock_comm_send(struct sock_pe_entry *pe_entry,
 	return ret;
 }
 
+/*
+ * Gather transmit: send the iov stream starting at byte 'offset' with a
+ * single writev, so that headers and user buffers go out without being
+ * staged in comm_buf.  Anything still buffered is flushed first to keep
+ * the stream ordered.
+ */
+ssize_t sock_comm_sendv(struct sock_pe_entry *pe_entry,
+			const struct iovec *iov, size_t iov_cnt, size_t offset)
+{
+	struct iovec send_iov[SOCK_PE_MAX_TX_IOV];
+	size_t i, cnt;
+	ssize_t ret;
+
+	if (!rbempty(&pe_entry->comm_buf)) {
+		sock_comm_flush(pe_entry);
+		if (!rbempty(&pe_entry->comm_buf))
+			return 0;
+	}
+
+	for (i = 0; i < iov_cnt && offset >= iov[i].iov_len; i++)
+		offset -= iov[i].iov_len;
+
+	for (cnt = 0; i < iov_cnt && cnt < SOCK_PE_MAX_TX_IOV; i++) {
+		if (!iov[i].iov_len)
+			continue;
+		send_iov[cnt].iov_base = (char *) iov[i].iov_base + offset;
+		send_iov[cnt].iov_len = iov[i].iov_len - offset;
+		offset = 0;
+		cnt++;
+	}
+
+	if (!cnt)
+		return 0;
+
+	if (pe_entry->conn->tx_agg_len && sock_comm_agg_flush(pe_entry->conn))
+		return 0;
+
+	if (pe_entry->conn->shm)
+		return sock_shm_sendv(pe_entry->conn, send_iov, cnt);
+	if (pe_entry->conn->uring)
+		return sock_uring_sendv(pe_entry->conn, send_iov, cnt);
+
+	ret = ofi_writev_socket(pe_entry->conn->sock_fd, send_iov, cnt);
+	if (ret < 0) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK) {
+			ret = 0;
+		} else {
+			SOCK_LOG_DBG("writev %s\n", strerror(errno));
+		}
+	}
+	if (ret > 0)
+		SOCK_LOG_DBG("wrote to network: %lu\n", ret);
+	return ret;
+}
+
 int sock_comm_tx_done(struct sock_pe_entry *pe_entry)
 {
 	return rbempty(&pe_entry->comm_buf);
 }
 
-static ssize_t sock_comm_recv_socket(struct sock_conn *conn,
-			      void *buf, size_t len)
+/*
+ * Whatever a socket has beyond the field being read is received into
+ * the connection's rx_stage buffer as well, so that one system call
+ * brings in a run of small messages, whose headers and fields are then
+ * parsed from memory.  Peeking at a header only looks into that buffer.
+ * Large fields are read straight into the caller's buffer, with the
+ * stage buffer as a second iovec to read ahead into.
+ */
+static void sock_comm_stage_consume(struct sock_conn *conn, size_t len)
+{
+	conn->rx_stage_off += len;
+	if (conn->rx_stage_off == conn->rx_stage_len) {
+		dlist_remove(&conn->rx_stage_entry);
+		conn->rx_stage_off = conn->rx_stage_len = 0;
+	}
+}
+
+/* Forget the data read ahead, as when the socket goes away */
+void sock_comm_stage_drop(struct sock_conn *conn)
+{
+	if (conn->rx_stage_off < conn->rx_stage_len)
+		dlist_remove(&conn->rx_stage_entry);
+	conn->rx_stage_off = conn->rx_stage_len = 0;
+}
+
+/* Hand the data read ahead on a socket to the connection taking it over */
+void sock_comm_stage_move(struct sock_conn *to, struct sock_conn *from)
 {
+	char *buf;
+
+	sock_comm_stage_drop(to);
+	buf = to->rx_stage;
+	to->rx_stage = from->rx_stage;
+	from->rx_stage = buf;
+
+	if (from->rx_stage_off < from->rx_stage_len) {
+		dlist_remove(&from->rx_stage_entry);
+		dlist_insert_tail(&to->rx_stage_entry,
+				  &to->ep_attr->pe->rx_stage_list);
+	}
+	to->rx_stage_off = from->rx_stage_off;
+	to->rx_stage_len = from->rx_stage_len;
+	from->rx_stage_off = from->rx_stage_len = 0;
+}
+
+/*
+ * Receive up to len bytes into buf, and what else is available into the
+ * free end of the stage buffer.  Returns the number of bytes placed in
+ * buf.
+ */
+static ssize_t sock_comm_stage_read(struct sock_conn *conn,
+				    void *buf, size_t len)
+{
+	struct iovec iov[2];
+	int iov_cnt = 0;
 	ssize_t ret;
-	ret = recv(conn->sock_fd, buf, len, 0);
+
+	if (!conn->rx_stage)
+		conn->rx_stage = malloc(SOCK_CONN_RX_STAGE_SZ);
+
+	if (len) {
+		iov[iov_cnt].iov_base = buf;
+		iov[iov_cnt++].iov_len = len;
+	}
+	if (conn->rx_stage && conn->rx_stage_len < SOCK_CONN_RX_STAGE_SZ) {
+		iov[iov_cnt].iov_base = conn->rx_stage + conn->rx_stage_len;
+		iov[iov_cnt++].iov_len = SOCK_CONN_RX_STAGE_SZ -
+					 conn->rx_stage_len;
+	}
+	if (!iov_cnt)
+		return 0;
+
+	ret = ofi_readv_socket(conn->sock_fd, iov, iov_cnt);
 	if (ret == 0) {
 		conn->disconnected = 1;
 		SOCK_LOG_DBG("Disconnected: %s:%d\n", inet_ntoa(conn->addr.sin_addr),
                                ntohs(conn->addr.sin_port));
-
+		/* only part of a message can be left */
+		sock_comm_stage_drop(conn);
 		return ret;
 	}
 
 	if (ret < 0) {
 		SOCK_LOG_DBG("read %s\n", strerror(errno));
-		ret = 0;
+		if (ofi_sockerr() == ECONNRESET) {
+			conn->disconnected = 1;
+			sock_comm_stage_drop(conn);
+		}
+		return 0;
 	}
 
-	if (ret > 0)
-		SOCK_LOG_DBG("read from network: %lu\n", ret);
-	return ret;
+	SOCK_LOG_DBG("read from network: %lu\n", ret);
+	if ((size_t) ret <= len)
+		return ret;
+
+	if (conn->rx_stage_off == conn->rx_stage_len)
+		dlist_insert_tail(&conn->rx_stage_entry,
+				  &conn->ep_attr->pe->rx_stage_list);
+	conn->rx_stage_len += ret - len;
+	return len;
 }
 
-static void sock_comm_recv_buffer(struct sock_pe_entry *pe_entry)
+static ssize_t sock_comm_recv_socket(struct sock_conn *conn,
+			      void *buf, size_t len)
 {
-	int ret;
-	size_t max_read, avail;
-
-	avail = rbavail(&pe_entry->comm_buf);
-	assert(avail == pe_entry->comm_buf.size);
-	pe_entry->comm_buf.rcnt = 
-		pe_entry->comm_buf.wcnt = 
-		pe_entry->comm_buf.wpos = 0;
-
-	max_read = pe_entry->rem ? pe_entry->rem :
-		pe_entry->total_len - pe_entry->done_len;
-	ret = sock_comm_recv_socket(pe_entry->conn, (char *) pe_entry->comm_buf.buf,
-				    MIN(max_read, avail));
-	pe_entry->comm_buf.wpos += ret;
-	rbcommit(&pe_entry->comm_buf);
+	if (sock_shm_rx_active(conn))
+		return sock_shm_recv(conn, buf, len, 0);
+	if (conn->uring)
+		return sock_uring_recv(conn, buf, len, 0);
+	return sock_comm_stage_read(conn, buf, len);
 }
 
 ssize_t sock_comm_recv(struct sock_pe_entry *pe_entry, void *buf, size_t len)
 {
-	ssize_t read_len;
-	if (rbempty(&pe_entry->comm_buf)) {
-		if (len <= pe_entry->cache_sz) {
-			sock_comm_recv_buffer(pe_entry);
-		} else {
-			return sock_comm_recv_socket(pe_entry->conn, buf, len);
-		}
+	struct sock_conn *conn = pe_entry->conn;
+	size_t read_len;
+
+	read_len = MIN(len, conn->rx_stage_len - conn->rx_stage_off);
+	if (read_len) {
+		memcpy(buf, conn->rx_stage + conn->rx_stage_off, read_len);
+		sock_comm_stage_consume(conn, read_len);
+		SOCK_LOG_DBG("read from buffer: %lu\n", read_len);
+		if (read_len == len)
+			return read_len;
 	}
-
-	read_len = MIN(len, rbused(&pe_entry->comm_buf));
-	rbread(&pe_entry->comm_buf, buf, read_len);
-	SOCK_LOG_DBG("read from buffer: %lu\n", read_len);
-	return read_len;
+	return read_len + sock_comm_recv_socket(conn, (char *) buf + read_len,
+						len - read_len);
 }
 
 ssize_t sock_comm_peek(struct sock_conn *conn, void *buf, size_t len)
 {
-	ssize_t ret;
-	ret = recv(conn->sock_fd, buf, len, MSG_PEEK);
-	if (ret == 0) {
-		conn->disconnected = 1;
-		SOCK_LOG_DBG("Disconnected\n");
-		return ret;
-	}
-
-	if (ret < 0) {
-		SOCK_LOG_DBG("peek %s\n", strerror(errno));
-		ret = 0;
+	size_t staged;
+
+	if (sock_shm_rx_active(conn))
+		return sock_shm_recv(conn, buf, len, 1);
+	if (conn->uring)
+		return sock_uring_recv(conn, buf, len, 1);
+
+	staged = conn->rx_stage_len - conn->rx_stage_off;
+	if (staged < len) {
+		/* make room behind what is left of the last read */
+		if (conn->rx_stage_off) {
+			memmove(conn->rx_stage,
+				conn->rx_stage + conn->rx_stage_off, staged);
+			conn->rx_stage_off = 0;
+			conn->rx_stage_len = staged;
+		}
+		sock_comm_stage_read(conn, NULL, 0);
+		staged = conn->rx_stage_len - conn->rx_stage_off;
 	}
 
-	if (ret > 0)
-		SOCK_LOG_DBG("peek from network: %lu\n", ret);
-	return ret;
+	staged = MIN(len, staged);
+	if (staged)
+		memcpy(buf, conn->rx_stage + conn->rx_stage_off, staged);
+	return staged;
 }
 
 ssize_t sock_comm_discard(struct sock_pe_entry *pe_entry, size_t len)
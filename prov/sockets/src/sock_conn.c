@@ -34,7 +34,9 @@
 
 #include <sys/types.h>
 #include <stdlib.h>
+#include <inttypes.h>
 #include <stdio.h>
+#include <string.h>
 
 #include <errno.h>
 #include <fcntl.h>
@@ -49,6 +51,7 @@
 #include <ifaddrs.h>
 #include <poll.h>
 #include <limits.h>
+#include <sched.h>
 
 #include "sock.h"
 #include "sock_util.h"
@@ -104,11 +107,16 @@ int sock_conn_map_init(struct sock_ep *ep, int init_size)
         }
 
 	fastlock_init(&map->lock);
+	dlist_init(&map->unresolved_list);
+	map->av_map = map->fd_map = NULL;
+	map->av_map_sz = map->fd_map_sz = 0;
 	map->used = 0;
 	map->size = init_size;
 	return 0;
 }
 
+static int sock_conn_drain_agg(struct sock_conn *conn);
+
 static int sock_conn_map_increase(struct sock_conn_map *map, int new_size)
 {
 	void *_table;
@@ -125,25 +133,212 @@ static int sock_conn_map_increase(struct sock_conn_map *map, int new_size)
 	return 0;
 }
 
+static int sock_conn_map_grow_index(struct sock_conn ***array, size_t *size,
+				    uint64_t index)
+{
+	struct sock_conn **_array;
+	size_t new_size;
+
+	if (index < *size)
+		return 0;
+
+	new_size = *size ? *size : 64;
+	while (new_size <= index)
+		new_size *= 2;
+
+	_array = realloc(*array, new_size * sizeof(**array));
+	if (!_array)
+		return -FI_ENOMEM;
+
+	memset(&_array[*size], 0, (new_size - *size) * sizeof(**array));
+	*array = _array;
+	*size = new_size;
+	return 0;
+}
+
+struct sock_conn *sock_conn_map_lookup_av(struct sock_conn_map *map,
+					  uint64_t index)
+{
+	return (index < map->av_map_sz) ? map->av_map[index] : NULL;
+}
+
+int sock_conn_map_set_av(struct sock_conn_map *map, uint64_t index,
+			 struct sock_conn *conn)
+{
+	if (sock_conn_map_grow_index(&map->av_map, &map->av_map_sz, index))
+		return -FI_ENOMEM;
+	map->av_map[index] = conn;
+	return 0;
+}
+
+struct sock_conn *sock_conn_map_lookup_fd(struct sock_conn_map *map, int fd)
+{
+	return (fd >= 0 && (size_t) fd < map->fd_map_sz) ? map->fd_map[fd] : NULL;
+}
+
 void sock_conn_map_destroy(struct sock_conn_map *cmap)
 {
+	struct sock_conn *conn;
 	int i;
 
 	for (i = 0; i < cmap->used; i++) {
-		ofi_close_socket(cmap->table[i].sock_fd);
+		conn = cmap->table[i];
+		if (conn->tx_agg_len) {
+			/* completions were reported for these already */
+			fastlock_acquire(&conn->ep_attr->pe->lock);
+			if (sock_conn_drain_agg(conn))
+				sock_comm_agg_drop(conn);
+			fastlock_release(&conn->ep_attr->pe->lock);
+		}
+		free(conn->tx_agg);
+		if (conn->rx_ack_seq != conn->rx_acked_seq) {
+			fastlock_acquire(&conn->ep_attr->pe->lock);
+			sock_comm_ack_drop(conn);
+			fastlock_release(&conn->ep_attr->pe->lock);
+		}
+		if (conn->rx_stage_off < conn->rx_stage_len) {
+			fastlock_acquire(&conn->ep_attr->pe->lock);
+			sock_comm_stage_drop(conn);
+			fastlock_release(&conn->ep_attr->pe->lock);
+		}
+		free(conn->rx_stage);
+		sock_shm_detach(conn);
+		sock_uring_detach(conn);
+		if (conn->sock_fd >= 0)
+			ofi_close_socket(conn->sock_fd);
+		free(conn);
 	}
 	free(cmap->table);
+	free(cmap->av_map);
+	free(cmap->fd_map);
 	cmap->table = NULL;
+	cmap->av_map = cmap->fd_map = NULL;
+	cmap->av_map_sz = cmap->fd_map_sz = 0;
 	cmap->used = cmap->size = 0;
 	sock_epoll_close(&cmap->epoll_set);
 	fastlock_destroy(&cmap->lock);
 }
 
+static int sock_conn_use_shm(struct sock_conn *conn)
+{
+	return sock_shm_enabled && !conn->shm_failed &&
+	       conn->ep_attr->ep_type == FI_EP_RDM && sock_shm_is_local(conn);
+}
+
+/*
+ * Connections that are, or may become, shared memory ones keep their
+ * socket in the epoll sets, as it only carries wakeups.
+ */
+static int sock_conn_use_uring(struct sock_conn *conn)
+{
+	return conn->ep_attr->pe->uring && !conn->shm &&
+	       !sock_conn_use_shm(conn);
+}
+
+static int sock_conn_map_register(struct sock_conn_map *map,
+				  struct sock_conn *conn)
+{
+	if (sock_conn_map_grow_index(&map->fd_map, &map->fd_map_sz,
+				     conn->sock_fd)) {
+		SOCK_LOG_ERROR("failed to grow fd map: %d\n", conn->sock_fd);
+		return -FI_ENOMEM;
+	}
+
+	map->fd_map[conn->sock_fd] = conn;
+	sock_set_sockopts(conn->sock_fd);
+
+	if (sock_conn_use_uring(conn) && !sock_uring_attach(conn)) {
+		map->num_uring++;
+	} else {
+		if (sock_epoll_add(&map->epoll_set, conn->sock_fd))
+			SOCK_LOG_ERROR("failed to add to epoll set: %d\n",
+				       conn->sock_fd);
+		sock_pe_poll_add(conn->ep_attr->pe, conn->sock_fd);
+	}
+	conn->last_used = fi_gettime_ms();
+	if (++map->num_open > sock_conn_max_open && sock_conn_max_open)
+		map->reap_pending = 1;
+	return 0;
+}
+
+static void sock_conn_map_unregister(struct sock_conn_map *map,
+				     struct sock_conn *conn)
+{
+	if (conn->uring) {
+		map->num_uring--;
+	} else {
+		sock_epoll_del(&map->epoll_set, conn->sock_fd);
+		sock_pe_poll_del(conn->ep_attr->pe, conn->sock_fd);
+	}
+	map->fd_map[conn->sock_fd] = NULL;
+	map->num_open--;
+}
+
+static void sock_conn_map_free_conn(struct sock_conn_map *map,
+				    struct sock_conn *conn)
+{
+	int i;
+
+	for (i = 0; i < map->used; i++) {
+		if (map->table[i] == conn) {
+			map->table[i] = map->table[--map->used];
+			break;
+		}
+	}
+
+	dlist_remove(&conn->unresolved_entry);
+	fastlock_acquire(&conn->ep_attr->lock);
+	dlist_remove(&conn->ep_entry);
+	fastlock_release(&conn->ep_attr->lock);
+	sock_comm_agg_drop(conn);
+	free(conn->tx_agg);
+	sock_comm_stage_drop(conn);
+	free(conn->rx_stage);
+	sock_comm_ack_drop(conn);
+	free(conn);
+}
+
+/*
+ * Move the socket of a newly accepted connection into an IDLE one for
+ * the same peer, so that operations still referencing the IDLE
+ * connection use it.  The accepted connection is freed.  Called with the
+ * map lock held, by the PE entry reading the accepted connection.
+ */
+void sock_conn_map_replace(struct sock_conn_map *map, struct sock_conn *conn,
+			   struct sock_conn *accepted)
+{
+	SOCK_LOG_DBG("Peer %s:%d reconnected\n", inet_ntoa(conn->addr.sin_addr),
+		     ntohs(conn->addr.sin_port));
+
+	conn->sock_fd = accepted->sock_fd;
+	conn->disconnected = accepted->disconnected;
+	conn->last_used = accepted->last_used;
+	conn->rx_pe_entry = accepted->rx_pe_entry;
+	conn->pe_ref += accepted->pe_ref;
+	conn->shm = accepted->shm;
+	accepted->shm = NULL;
+	conn->uring = accepted->uring;
+	accepted->uring = NULL;
+	sock_comm_agg_move(conn, accepted);
+	sock_comm_stage_move(conn, accepted);
+	sock_comm_ack_move(conn, accepted);
+	conn->reconnect = 0;
+	conn->connect_retry = 0;
+	conn->state = accepted->state;
+	map->fd_map[conn->sock_fd] = conn;
+
+	sock_conn_map_free_conn(map, accepted);
+}
+
+/*
+ * A negative conn_fd inserts a connection that is still to be
+ * established; it is registered for polling once the connect completes.
+ */
 static struct sock_conn *sock_conn_map_insert(struct sock_ep_attr *ep_attr,
 				struct sockaddr_in *addr, int conn_fd,
 				int addr_published)
 {
-	int index;
+	struct sock_conn *conn;
 	struct sock_conn_map *map = &ep_attr->cmap;
 
 	if (map->size == map->used) {
@@ -151,27 +346,34 @@ static struct sock_conn *sock_conn_map_insert(struct sock_ep_attr *ep_attr,
 			return NULL;
 	}
 
-	index = map->used;
-	map->used++;
+	conn = calloc(1, sizeof(*conn));
+	if (!conn)
+		return NULL;
+
+	conn->addr = *addr;
+	conn->sock_fd = conn_fd;
+	conn->ep_attr = ep_attr;
+	conn->av_index = FI_ADDR_NOTAVAIL;
+	conn->address_published = addr_published;
+	dlist_init(&conn->unresolved_entry);
+	dlist_init(&conn->tx_ack_list);
+
+	if (conn_fd >= 0) {
+		conn->state = SOCK_CONN_STATE_CONNECTED;
+		if (sock_conn_map_register(map, conn)) {
+			free(conn);
+			return NULL;
+		}
+	} else {
+		conn->state = SOCK_CONN_STATE_CONNECTING;
+	}
 
-	map->table[index].addr = *addr;
-	map->table[index].sock_fd = conn_fd;
-	map->table[index].ep_attr = ep_attr;
-	sock_set_sockopts(conn_fd);
+	map->table[map->used++] = conn;
 
 	fastlock_acquire(&ep_attr->lock);
-	dlist_insert_tail(&map->table[index].ep_entry, &ep_attr->conn_list);
+	dlist_insert_tail(&conn->ep_entry, &ep_attr->conn_list);
 	fastlock_release(&ep_attr->lock);
-
-	if (idm_set(&ep_attr->conn_idm, conn_fd, &map->table[index]) < 0)
-                SOCK_LOG_ERROR("idm_set failed\n");
-
-	if (sock_epoll_add(&map->epoll_set, conn_fd))
-                SOCK_LOG_ERROR("failed to add to epoll set: %d\n", conn_fd);
-
-	map->table[index].address_published = addr_published;
-	sock_pe_poll_add(ep_attr->domain->pe, conn_fd);
-	return &map->table[index];
+	return conn;
 }
 
 int fd_set_nonblock(int fd)
@@ -215,59 +417,34 @@ void sock_set_sockopts(int sock)
 	fd_set_nonblock(sock);
 }
 
-static void *_sock_conn_listen(void *arg)
+static void sock_conn_handle_listen(struct sock_cm_handler *handler)
 {
-	int conn_fd, ret;
-	char tmp;
+	int conn_fd;
 	socklen_t addr_size;
 	struct sockaddr_in remote;
-	struct pollfd poll_fds[2];
-
-	struct sock_ep_attr *ep_attr = (struct sock_ep_attr *)arg;
-	struct sock_conn_listener *listener = &ep_attr->listener;
+	struct sock_ep_attr *ep_attr = handler->ctx;
 	struct sock_conn_map *map = &ep_attr->cmap;
 
-	poll_fds[0].fd = listener->sock;
-	poll_fds[1].fd = listener->signal_fds[1];
-	poll_fds[0].events = poll_fds[1].events = POLLIN;
-	listener->is_ready = 1;
-
-	while (listener->do_listen) {
-		if (poll(poll_fds, 2, -1) > 0) {
-			if (poll_fds[1].revents & POLLIN) {
-				ret = ofi_read_socket(listener->signal_fds[1], &tmp, 1);
-				if (ret != 1) {
-					SOCK_LOG_ERROR("Invalid signal\n");
-					goto err;
-				}
-				continue;
-			}
-		} else {
-			goto err;
-		}
-
+	for (;;) {
 		addr_size = sizeof(remote);
-		conn_fd = accept(listener->sock, (struct sockaddr *) &remote,
-					&addr_size);
+		conn_fd = accept(handler->fd, (struct sockaddr *) &remote,
+				 &addr_size);
 		SOCK_LOG_DBG("CONN: accepted conn-req: %d\n", conn_fd);
 		if (conn_fd < 0) {
-			SOCK_LOG_ERROR("failed to accept: %d\n", errno);
-			goto err;
+			if (errno != EAGAIN && errno != EWOULDBLOCK &&
+			    errno != EINTR)
+				SOCK_LOG_ERROR("failed to accept: %d\n", errno);
+			return;
 		}
 
 		SOCK_LOG_DBG("ACCEPT: %s, %d\n", inet_ntoa(remote.sin_addr),
-				ntohs(remote.sin_port));
+			     ntohs(remote.sin_port));
 
 		fastlock_acquire(&map->lock);
 		sock_conn_map_insert(ep_attr, &remote, conn_fd, 1);
 		fastlock_release(&map->lock);
-		sock_pe_signal(ep_attr->domain->pe);
+		sock_pe_signal(ep_attr->pe);
 	}
-
-err:
-	ofi_close_socket(listener->sock);
-	SOCK_LOG_DBG("Listener thread exited\n");
-	return NULL;
 }
 
 int sock_conn_listen(struct sock_ep_attr *ep_attr)
@@ -308,7 +485,7 @@ int sock_conn_listen(struct sock_ep_attr *ep_attr)
 		return -FI_EINVAL;
 	}
 
-	SOCK_LOG_DBG("Binding listener thread to port: %s\n", listener->service);
+	SOCK_LOG_DBG("Binding listener to port: %s\n", listener->service);
 	for (p = s_res; p; p = p->ai_next) {
 		listen_fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
 		if (listen_fd >= 0) {
@@ -354,18 +531,19 @@ int sock_conn_listen(struct sock_ep_attr *ep_attr)
 			htons(atoi(listener->service));
 	}
 
+	fd_set_nonblock(listen_fd);
 	listener->sock = listen_fd;
-	if (socketpair(AF_UNIX, SOCK_STREAM, 0, listener->signal_fds) < 0)
+	listener->handler.fd = listen_fd;
+	listener->handler.ctx = ep_attr;
+	listener->handler.handle = sock_conn_handle_listen;
+	listener->handler.flush = NULL;
+	if (sock_cm_reactor_add(&ep_attr->domain->fab->cm_reactor,
+				&listener->handler)) {
+		SOCK_LOG_ERROR("failed to register conn listener\n");
 		goto err;
+	}
 
 	listener->do_listen = 1;
-
-	fd_set_nonblock(listener->signal_fds[1]);
-	if (pthread_create(&listener->listener_thread, 0,
-			   _sock_conn_listen, ep_attr)) {
-		SOCK_LOG_ERROR("failed to create conn listener thread\n");
-		goto err;
-	} while (!*((volatile int*)&listener->is_ready));
 	return 0;
 err:
 	if (listen_fd >= 0)
@@ -373,16 +551,293 @@ err:
 	return -FI_EINVAL;
 }
 
+static int sock_conn_start_connect(struct sock_conn *conn)
+{
+	int conn_fd, ret;
+
+	conn_fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (conn_fd == -1) {
+		SOCK_LOG_ERROR("failed to create conn_fd, errno: %d\n", errno);
+		return -errno;
+	}
+
+	ret = fd_set_nonblock(conn_fd);
+	if (ret) {
+		SOCK_LOG_ERROR("failed to set conn_fd nonblocking, errno: %d\n", errno);
+		ofi_close_socket(conn_fd);
+		return -FI_EOTHER;
+	}
+
+	SOCK_LOG_DBG("Connecting to: %s:%d\n", inet_ntoa(conn->addr.sin_addr),
+		     ntohs(conn->addr.sin_port));
+
+	ret = connect(conn_fd, (struct sockaddr *) &conn->addr,
+		      sizeof(conn->addr));
+	if (ret < 0 && ofi_sockerr() != EINPROGRESS) {
+		ret = -ofi_sockerr();
+		ofi_close_socket(conn_fd);
+		return ret;
+	}
+
+	conn->sock_fd = conn_fd;
+	conn->connect_time = fi_gettime_ms();
+	return 0;
+}
+
+/*
+ * Schedule the next attempt with exponential backoff, or give up once
+ * sock_conn_retry attempts have failed.  While no socket is open,
+ * connect_time holds the time of the next attempt.
+ */
+static int sock_conn_connect_failed(struct sock_conn *conn, int err)
+{
+	uint64_t backoff;
+
+	if (conn->sock_fd >= 0) {
+		ofi_close_socket(conn->sock_fd);
+		conn->sock_fd = -1;
+	}
+	/* a hello queued for the old socket */
+	sock_comm_agg_drop(conn);
+
+	conn->connect_err = err;
+	if (++conn->connect_retry >= sock_conn_retry) {
+		SOCK_LOG_ERROR("failed to connect to %s:%d - %s\n",
+			       inet_ntoa(conn->addr.sin_addr),
+			       ntohs(conn->addr.sin_port), strerror(err));
+		conn->state = SOCK_CONN_STATE_FAILED;
+		return -err;
+	}
+
+	backoff = MIN((uint64_t) SOCK_CM_RETRY_BACKOFF << (conn->connect_retry - 1),
+		      SOCK_CM_RETRY_BACKOFF_MAX);
+	SOCK_LOG_DBG("Connect error, retrying in %" PRIu64 " ms - %s\n",
+		     backoff, strerror(err));
+	conn->connect_time = fi_gettime_ms() + backoff;
+	return -FI_EAGAIN;
+}
+
+/*
+ * The shared memory handshake goes out on the socket itself, while
+ * nothing else has been written to it.  A message that does not go out
+ * whole at once fails, and the caller drops the connection rather than
+ * leave part of a header on the stream.
+ */
+static int sock_conn_send_socket(struct sock_conn *conn, const void *buf,
+				 size_t len)
+{
+	ssize_t ret;
+
+	ret = send(conn->sock_fd, buf, len, SOCK_SEND_NOSIGNAL);
+	if (ret == (ssize_t) len)
+		return 0;
+	return ret < 0 ? -ofi_sockerr() : -FI_EAGAIN;
+}
+
+/*
+ * Write out the messages packed by sock_comm_agg() before the connection
+ * is freed.  Completions were reported for them already, so this is the
+ * one place that waits, for at most SOCK_CM_COMM_TIMEOUT.
+ */
+static int sock_conn_drain_agg(struct sock_conn *conn)
+{
+	uint64_t start = fi_gettime_ms();
+	int ret;
+
+	while ((ret = sock_comm_agg_flush(conn)) == -FI_EAGAIN) {
+		if (conn->uring)
+			sock_uring_progress(conn->ep_attr->pe->uring);
+		if (fi_gettime_ms() - start > SOCK_CM_COMM_TIMEOUT)
+			return -FI_ETIMEDOUT;
+		sched_yield();
+	}
+
+	if (conn->uring)
+		sock_uring_progress(conn->ep_attr->pe->uring);
+	return ret;
+}
+
+/*
+ * Connection control messages are queued behind the packed messages and
+ * written by the PE, like acks, so they never block the caller.  They
+ * are only queued while no PE entry is transmitting on the connection,
+ * so they cannot interleave with another message.
+ */
+static int sock_conn_send_ctrl(struct sock_conn *conn, const void *buf,
+			       size_t len)
+{
+	return sock_comm_queue(conn, buf, len);
+}
+
+static int sock_conn_send_op(struct sock_conn *conn, uint8_t op)
+{
+	struct sock_msg_hdr msg_hdr;
+
+	memset(&msg_hdr, 0, sizeof(msg_hdr));
+	msg_hdr.version = SOCK_WIRE_PROTO_VERSION;
+	msg_hdr.op_type = op;
+	msg_hdr.msg_len = htonll(sizeof(msg_hdr));
+	return sock_conn_send_ctrl(conn, &msg_hdr, sizeof(msg_hdr));
+}
+
+/*
+ * A connection reopened after being reaped announces our address ahead
+ * of anything else, as the peer may have freed its end of it.
+ */
+static int sock_conn_send_hello(struct sock_conn *conn)
+{
+	struct {
+		struct sock_msg_hdr msg_hdr;
+		struct sockaddr_in addr;
+	} msg;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_hdr.version = SOCK_WIRE_PROTO_VERSION;
+	msg.msg_hdr.op_type = SOCK_OP_CONN_MSG;
+	msg.msg_hdr.msg_len = htonll(sizeof(msg));
+	msg.addr = *conn->ep_attr->src_addr;
+	return sock_conn_send_ctrl(conn, &msg, sizeof(msg));
+}
+
+/*
+ * Offer a shared memory segment to a peer on the same host, see struct
+ * sock_conn_map.  Returns -FI_ENOSYS if the connection should go on
+ * without it.
+ */
+static int sock_conn_shm_connect(struct sock_conn *conn)
+{
+	struct sock_conn_shm_req req;
+	int ret;
+
+	memset(&req, 0, sizeof(req));
+	if (sock_shm_create(conn, &req))
+		return -FI_ENOSYS;
+
+	req.msg_hdr.version = SOCK_WIRE_PROTO_VERSION;
+	req.msg_hdr.op_type = SOCK_OP_CONN_SHM;
+	req.msg_hdr.msg_len = htonll(sizeof(req));
+	ret = sock_conn_send_socket(conn, &req, sizeof(req));
+	if (!ret)
+		ret = sock_conn_map_register(&conn->ep_attr->cmap, conn);
+	if (ret)
+		sock_shm_detach(conn);
+	return ret;
+}
+
+/*
+ * Wait for the peer to attach.  If it dropped the connection instead,
+ * connect again right away without shared memory.
+ */
+static int sock_conn_shm_wait(struct sock_conn *conn)
+{
+	if (!conn->disconnected || conn->rx_pe_entry)
+		return -FI_EAGAIN;
+
+	SOCK_LOG_DBG("%s:%d refused shared memory\n",
+		     inet_ntoa(conn->addr.sin_addr), ntohs(conn->addr.sin_port));
+	sock_conn_map_unregister(&conn->ep_attr->cmap, conn);
+	sock_shm_detach(conn);
+	ofi_close_socket(conn->sock_fd);
+	conn->sock_fd = -1;
+	conn->disconnected = 0;
+	conn->shm_failed = 1;
+	conn->connect_time = 0;
+	return -FI_EAGAIN;
+}
+
+/*
+ * Drive a pending connect without blocking.  Returns 0 once the
+ * connection is usable, -FI_EAGAIN while it is still in progress, or the
+ * error of the last attempt once retries are exhausted.  Called with the
+ * connection map lock held.
+ */
+int sock_conn_progress_connect(struct sock_conn *conn)
+{
+	struct pollfd poll_fd;
+	socklen_t len;
+	int ret, err = 0;
+
+	if (conn->state == SOCK_CONN_STATE_CONNECTED)
+		return 0;
+	if (conn->state == SOCK_CONN_STATE_FAILED)
+		return -conn->connect_err;
+	if (conn->state == SOCK_CONN_STATE_QUIESCING ||
+	    conn->state == SOCK_CONN_STATE_CLOSING)
+		return -FI_EAGAIN;
+	if (conn->state == SOCK_CONN_STATE_IDLE) {
+		conn->state = SOCK_CONN_STATE_CONNECTING;
+		conn->connect_retry = 0;
+		conn->connect_time = 0;
+		conn->reconnect = 1;
+	}
+	if (conn->shm)
+		return sock_conn_shm_wait(conn);
+
+	if (conn->sock_fd < 0) {
+		if (fi_gettime_ms() < conn->connect_time)
+			return -FI_EAGAIN;
+		ret = sock_conn_start_connect(conn);
+		if (ret)
+			return sock_conn_connect_failed(conn, -ret);
+	}
+
+	poll_fd.fd = conn->sock_fd;
+	poll_fd.events = POLLOUT;
+	poll_fd.revents = 0;
+	ret = poll(&poll_fd, 1, 0);
+	if (ret < 0)
+		return sock_conn_connect_failed(conn, ofi_sockerr());
+
+	if (ret == 0) {
+		if (fi_gettime_ms() - conn->connect_time > SOCK_CM_CONN_TIMEOUT)
+			return sock_conn_connect_failed(conn, ETIMEDOUT);
+		return -FI_EAGAIN;
+	}
+
+	len = sizeof(err);
+	if (getsockopt(conn->sock_fd, SOL_SOCKET, SO_ERROR, (void *) &err, &len))
+		err = ofi_sockerr();
+	if (err)
+		return sock_conn_connect_failed(conn, err);
+
+	if (sock_conn_use_shm(conn)) {
+		ret = sock_conn_shm_connect(conn);
+		if (ret != -FI_ENOSYS)
+			return ret ? sock_conn_connect_failed(conn, -ret) :
+				     -FI_EAGAIN;
+		conn->shm_failed = 1;
+	}
+
+	if (conn->reconnect) {
+		ret = sock_conn_send_hello(conn);
+		if (ret)
+			return sock_conn_connect_failed(conn, -ret);
+		conn->reconnect = 0;
+	}
+
+	ret = sock_conn_map_register(&conn->ep_attr->cmap, conn);
+	if (ret)
+		return sock_conn_connect_failed(conn, -ret);
+
+	SOCK_LOG_DBG("Connected to: %s:%d\n", inet_ntoa(conn->addr.sin_addr),
+		     ntohs(conn->addr.sin_port));
+	conn->state = SOCK_CONN_STATE_CONNECTED;
+	conn->connect_retry = 0;
+	return 0;
+}
+
+/*
+ * Start a non-blocking connect to the given peer.  The returned
+ * connection may still be connecting; operations queued on it are held
+ * by the progress engine until sock_conn_progress_connect() completes it.
+ * Called with the connection map lock held.
+ */
 struct sock_conn *sock_ep_connect(struct sock_ep_attr *ep_attr, fi_addr_t index)
 {
-	int conn_fd = -1, ret;
-	int do_retry = sock_conn_retry;
-	struct sock_conn *conn, *new_conn;
-	uint16_t idx;
+	int ret;
+	uint64_t idx;
+	struct sock_conn *conn;
 	struct sockaddr_in *addr;
-	socklen_t lon;
-	int valopt = 0;
-	struct pollfd poll_fd;
 
 	if (ep_attr->ep_type == FI_EP_MSG) {
 		idx = 0;
@@ -392,110 +847,266 @@ struct sock_conn *sock_ep_connect(struct sock_ep_attr *ep_attr, fi_addr_t index)
 		addr = (struct sockaddr_in *)&ep_attr->av->table[idx].addr;
 	}
 
-do_connect:
-	fastlock_acquire(&ep_attr->cmap.lock);
-	conn = sock_ep_lookup_conn(ep_attr, index, addr);
-	fastlock_release(&ep_attr->cmap.lock);
-
-	if (conn != SOCK_CM_CONN_IN_PROGRESS)
-		return conn;
-
-	conn_fd = socket(AF_INET, SOCK_STREAM, 0);
-	if (conn_fd == -1) {
-		SOCK_LOG_ERROR("failed to create conn_fd, errno: %d\n", errno);
-		errno = FI_EOTHER;
+	conn = sock_conn_map_insert(ep_attr, addr, -1, 0);
+	if (!conn || sock_conn_map_set_av(&ep_attr->cmap, idx, conn)) {
+		errno = FI_ENOMEM;
 		return NULL;
 	}
+	conn->av_index = (ep_attr->ep_type == FI_EP_MSG) ?
+			 FI_ADDR_NOTAVAIL : (fi_addr_t) idx;
 
-	ret = fd_set_nonblock(conn_fd);
-	if (ret) {
-		SOCK_LOG_ERROR("failed to set conn_fd nonblocking, errno: %d\n", errno);
-		errno = FI_EOTHER;
-		ofi_close_socket(conn_fd);
-                return NULL;
-	}
+	ret = sock_conn_start_connect(conn);
+	if (ret)
+		sock_conn_connect_failed(conn, -ret);
+	return conn;
+}
+
+static int sock_conn_is_idle(struct sock_conn *conn)
+{
+	return !conn->pe_ref && !conn->tx_pe_entry && !conn->rx_pe_entry &&
+		!conn->tx_agg_len && conn->rx_stage_off == conn->rx_stage_len &&
+		conn->rx_ack_seq == conn->rx_acked_seq && !conn->disconnected;
+}
+
+/*
+ * Ask the peer to close an idle connection.  If the request cannot be
+ * queued, the connection stays open until the next try.
+ */
+static int sock_conn_quiesce(struct sock_conn *conn, uint64_t now)
+{
+	int ret;
 
-	SOCK_LOG_DBG("Connecting to: %s:%d\n", inet_ntoa(addr->sin_addr),
-			ntohs(addr->sin_port));
-	SOCK_LOG_DBG("Connecting using address:%s\n",
-			inet_ntoa(ep_attr->src_addr->sin_addr));
+	SOCK_LOG_DBG("Quiescing idle conn to %s:%d\n",
+		     inet_ntoa(conn->addr.sin_addr), ntohs(conn->addr.sin_port));
 
-	ret = connect(conn_fd, (struct sockaddr *) addr, sizeof *addr);
-	if (ret < 0) {
-		if (ofi_sockerr() == EINPROGRESS) {
-			poll_fd.fd = conn_fd;
-			poll_fd.events = POLLOUT;
+	ret = sock_conn_send_op(conn, SOCK_OP_CONN_CLOSE);
+	if (ret)
+		return ret;
+	conn->state = SOCK_CONN_STATE_QUIESCING;
+	conn->last_used = now;
+	return 0;
+}
 
-			ret = poll(&poll_fd, 1, 15 * 1000);
-			if (ret < 0) {
-				SOCK_LOG_DBG("poll failed\n");
-				goto retry;
-			}
+/*
+ * Close the socket and leave the connection IDLE.  A connection that was
+ * never tied to an AV index cannot be looked up again and is freed.
+ */
+static void sock_conn_close(struct sock_conn_map *map, struct sock_conn *conn)
+{
+	SOCK_LOG_DBG("Closing conn to %s:%d\n", inet_ntoa(conn->addr.sin_addr),
+		     ntohs(conn->addr.sin_port));
+
+	sock_conn_map_unregister(map, conn);
+	sock_comm_agg_drop(conn);
+	sock_comm_stage_drop(conn);
+	sock_comm_ack_drop(conn);
+	sock_shm_detach(conn);
+	if (conn->uring)
+		sock_uring_detach(conn);	/* closes the socket once flushed */
+	else
+		ofi_close_socket(conn->sock_fd);
+	conn->sock_fd = -1;
+	conn->disconnected = 0;
+	conn->state = SOCK_CONN_STATE_IDLE;
+
+	if (conn->av_index == FI_ADDR_NOTAVAIL)
+		sock_conn_map_free_conn(map, conn);
+}
+
+static struct sock_conn *sock_conn_map_lru(struct sock_conn_map *map)
+{
+	struct sock_conn *conn, *lru = NULL;
+	int i;
+
+	for (i = 0; i < map->used; i++) {
+		conn = map->table[i];
+		if (conn->state == SOCK_CONN_STATE_CONNECTED &&
+		    sock_conn_is_idle(conn) &&
+		    (!lru || conn->last_used < lru->last_used))
+			lru = conn;
+	}
+	return lru;
+}
+
+/*
+ * How often idle connections are looked for, in milliseconds, or -1 if
+ * they are never closed.
+ */
+int sock_conn_reap_interval(void)
+{
+	if (sock_conn_idle_timeout)
+		return MIN(sock_conn_idle_timeout, SOCK_CONN_REAP_INTERVAL);
+	return sock_conn_max_open ? SOCK_CONN_REAP_INTERVAL : -1;
+}
 
-			lon = sizeof(int);
-			ret = getsockopt(conn_fd, SOL_SOCKET, SO_ERROR, (void*)(&valopt), &lon);
-			if (ret < 0) {
-				SOCK_LOG_DBG("getsockopt failed: %d, %d\n", ret, conn_fd);
-				goto retry;
+/*
+ * Close connections the peers have agreed to close or that the peer has
+ * dropped, and start closing the ones that have been idle for longer
+ * than sock_conn_idle_timeout, or for longest while more than
+ * sock_conn_max_open are open.  Called by the progress engine, which
+ * serializes it against the PE entries using the connections.
+ */
+void sock_conn_map_reap(struct sock_ep_attr *ep_attr)
+{
+	struct sock_conn_map *map = &ep_attr->cmap;
+	struct sock_conn *conn;
+	uint64_t now;
+	int i, leaving = 0;
+
+	if (ep_attr->ep_type != FI_EP_RDM)
+		return;
+
+	now = fi_gettime_ms();
+	if (!map->reap_pending && now < map->reap_time)
+		return;
+
+	fastlock_acquire(&map->lock);
+	map->reap_pending = 0;
+	map->reap_time = now + sock_conn_reap_interval();
+
+	/* walk backwards, as closing may free the current entry */
+	for (i = map->used - 1; i >= 0; i--) {
+		conn = map->table[i];
+		if (conn->close_nack) {
+			if (conn->tx_pe_entry ||
+			    sock_conn_send_op(conn, SOCK_OP_CONN_CLOSE_NACK)) {
+				map->reap_pending = 1;
+				continue;
 			}
+			conn->close_nack = 0;
+		}
 
-			if (valopt) {
-				SOCK_LOG_DBG("Error in connection() %d - %s - %d\n", valopt, strerror(valopt), conn_fd);
-				SOCK_LOG_DBG("Connecting to: %s:%d\n", inet_ntoa(addr->sin_addr),
-						ntohs(addr->sin_port));
-				SOCK_LOG_DBG("Connecting using address:%s\n",
-				inet_ntoa(ep_attr->src_addr->sin_addr));
-				goto retry;
+		switch (conn->state) {
+		case SOCK_CONN_STATE_CONNECTED:
+			if (conn->disconnected) {
+				if (!conn->pe_ref)
+					sock_conn_close(map, conn);
+			} else if (sock_conn_idle_timeout &&
+				   sock_conn_is_idle(conn) &&
+				   now - conn->last_used >=
+				   (uint64_t) sock_conn_idle_timeout &&
+				   !sock_conn_quiesce(conn, now)) {
+				leaving++;
 			}
-			goto out;
-		} else {
-			SOCK_LOG_DBG("Timeout or error() - %s: %d\n", strerror(errno), conn_fd);
-			SOCK_LOG_DBG("Connecting to: %s:%d\n", inet_ntoa(addr->sin_addr),
-					ntohs(addr->sin_port));
-			SOCK_LOG_DBG("Connecting using address:%s\n",
-					inet_ntoa(ep_attr->src_addr->sin_addr));
-			goto retry;
+			break;
+		case SOCK_CONN_STATE_QUIESCING:
+			if (conn->disconnected && !conn->pe_ref)
+				sock_conn_close(map, conn);
+			else
+				leaving++;
+			break;
+		case SOCK_CONN_STATE_CLOSING:
+			/*
+			 * Nothing more is sent either way once our close ack
+			 * is out; PE entries still referencing the
+			 * connection wait to reconnect.
+			 */
+			if (!conn->tx_pe_entry && !conn->rx_pe_entry &&
+			    (!conn->tx_agg_len || conn->disconnected))
+				sock_conn_close(map, conn);
+			else
+				leaving++;
+			break;
+		default:
+			break;
 		}
-	} else {
-		goto out;
 	}
 
-retry:
-	do_retry--;
-	sleep(10);
-	if (!do_retry)
-		goto err;
-
-	if (conn_fd != -1) {
-		ofi_close_socket(conn_fd);
-		conn_fd = -1;
+	if (sock_conn_max_open) {
+		for (i = map->num_open - leaving - sock_conn_max_open; i > 0; i--) {
+			conn = sock_conn_map_lru(map);
+			if (!conn || sock_conn_quiesce(conn, now))
+				break;
+		}
 	}
+	fastlock_release(&map->lock);
+}
 
-	SOCK_LOG_ERROR("Connect error, retrying - %s - %d\n", strerror(errno), conn_fd);
-	SOCK_LOG_DBG("Connecting to: %s:%d\n", inet_ntoa(addr->sin_addr),
-			ntohs(addr->sin_port));
-	SOCK_LOG_DBG("Connecting using address:%s\n",
-			inet_ntoa(ep_attr->src_addr->sin_addr));
-        goto do_connect;
-
-out:
-	fastlock_acquire(&ep_attr->cmap.lock);
-	new_conn = sock_conn_map_insert(ep_attr, addr, conn_fd, 0);
-	if (!new_conn) {
-		fastlock_release(&ep_attr->cmap.lock);
-		goto err;
-	}
-	new_conn->av_index = (ep_attr->ep_type == FI_EP_MSG) ? FI_ADDR_NOTAVAIL : (fi_addr_t) idx;
-	conn = idm_lookup(&ep_attr->av_idm, index);
-	if (conn == SOCK_CM_CONN_IN_PROGRESS) {
-		idm_set(&ep_attr->av_idm, index, new_conn);
-		conn = new_conn;
+/*
+ * Handle a connection control message.  The PE entry that read it still
+ * holds a reference on the connection.  A close request is refused while
+ * anything else is in flight on our side; the peer then keeps using the
+ * connection.  The refusal waits for any message being transmitted to
+ * go out first.
+ */
+void sock_conn_process_close(struct sock_conn *conn, uint8_t op)
+{
+	struct sock_conn_map *map = &conn->ep_attr->cmap;
+
+	fastlock_acquire(&map->lock);
+	switch (op) {
+	case SOCK_OP_CONN_CLOSE:
+		if ((conn->state == SOCK_CONN_STATE_CONNECTED ||
+		     conn->state == SOCK_CONN_STATE_QUIESCING) &&
+		    conn->pe_ref == 1 && !conn->tx_pe_entry &&
+		    conn->rx_ack_seq == conn->rx_acked_seq &&
+		    !sock_conn_send_op(conn, SOCK_OP_CONN_CLOSE_ACK)) {
+			conn->state = SOCK_CONN_STATE_CLOSING;
+		} else {
+			conn->close_nack = 1;
+		}
+		break;
+	case SOCK_OP_CONN_CLOSE_ACK:
+		if (conn->state == SOCK_CONN_STATE_QUIESCING)
+			conn->state = SOCK_CONN_STATE_CLOSING;
+		break;
+	case SOCK_OP_CONN_CLOSE_NACK:
+		if (conn->state == SOCK_CONN_STATE_QUIESCING) {
+			conn->state = SOCK_CONN_STATE_CONNECTED;
+			conn->last_used = fi_gettime_ms();
+		}
+		break;
 	}
-	fastlock_release(&ep_attr->cmap.lock);
-	return conn;
+	map->reap_pending = 1;
+	fastlock_release(&map->lock);
+}
 
-err:
-	ofi_close_socket(conn_fd);
-	return NULL;
+/*
+ * A peer on the same host offered a shared memory segment.  Attach and
+ * answer on the socket, or drop the connection so that the peer
+ * reconnects without it.
+ */
+void sock_conn_shm_accept(struct sock_conn *conn, struct sock_conn_shm_req *req)
+{
+	struct sock_conn_map *map = &conn->ep_attr->cmap;
+	struct sock_msg_hdr msg_hdr;
+
+	memset(&msg_hdr, 0, sizeof(msg_hdr));
+	msg_hdr.version = SOCK_WIRE_PROTO_VERSION;
+	msg_hdr.op_type = SOCK_OP_CONN_SHM;
+	msg_hdr.msg_len = htonll(sizeof(msg_hdr));
+
+	fastlock_acquire(&map->lock);
+	if (!sock_shm_enabled || conn->shm || sock_shm_attach(conn, req) ||
+	    sock_conn_send_socket(conn, &msg_hdr, sizeof(msg_hdr))) {
+		SOCK_LOG_DBG("Refusing shared memory from %s:%d\n",
+			     inet_ntoa(conn->addr.sin_addr),
+			     ntohs(conn->addr.sin_port));
+		sock_shm_detach(conn);
+		conn->disconnected = 1;
+		map->reap_pending = 1;
+	}
+	fastlock_release(&map->lock);
 }
 
+/* The peer attached to the segment we offered */
+void sock_conn_shm_connected(struct sock_conn *conn)
+{
+	struct sock_conn_map *map = &conn->ep_attr->cmap;
+
+	fastlock_acquire(&map->lock);
+	if (conn->shm && conn->state == SOCK_CONN_STATE_CONNECTING) {
+		sock_shm_connected(conn);
+		if (conn->reconnect && sock_conn_send_hello(conn)) {
+			conn->disconnected = 1;
+			map->reap_pending = 1;
+		}
+		conn->reconnect = 0;
+		conn->connect_retry = 0;
+		conn->state = SOCK_CONN_STATE_CONNECTED;
+		SOCK_LOG_DBG("Connected to: %s:%d through shared memory\n",
+			     inet_ntoa(conn->addr.sin_addr),
+			     ntohs(conn->addr.sin_port));
+	}
+	fastlock_release(&map->lock);
+}
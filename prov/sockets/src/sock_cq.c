@@ -158,6 +158,17 @@ static ssize_t sock_cq_entry_size(struct sock_cq *sock_cq)
 	return size;
 }
 
+/*
+ * The CQ fd only needs to turn readable while a thread blocks in
+ * fi_cq_sread or once the application has fetched it.  Called with
+ * the lock held after entries were committed.
+ */
+static inline void sock_cq_arm(struct sock_cq *cq)
+{
+	if (cq->num_waiters || cq->fd_exported)
+		rbfdsignal(&cq->cq_rbfd);
+}
+
 static ssize_t _sock_cq_write(struct sock_cq *cq, fi_addr_t addr,
 			      const void *buf, size_t len)
 {
@@ -186,10 +197,8 @@ static ssize_t _sock_cq_write(struct sock_cq *cq, fi_addr_t addr,
 	rbcommit(&cq->addr_rb);
 
 	rbfdwrite(&cq->cq_rbfd, buf, len);
-	if (cq->domain->progress_mode == FI_PROGRESS_MANUAL)
-		rbcommit(&cq->cq_rbfd.rb);
-	else
-		rbfdcommit(&cq->cq_rbfd);
+	rbcommit(&cq->cq_rbfd.rb);
+	sock_cq_arm(cq);
 
 	ret = len;
 
@@ -197,6 +206,8 @@ static ssize_t _sock_cq_write(struct sock_cq *cq, fi_addr_t addr,
 		sock_wait_signal(cq->waitset);
 out:
 	fastlock_release(&cq->lock);
+	if (cq->domain->progress_mode == FI_PROGRESS_MANUAL)
+		sock_pe_signal(cq->domain->pe);
 	return ret;
 }
 
@@ -282,10 +293,8 @@ static inline void sock_cq_copy_overflow_list(struct sock_cq *cq, size_t count)
 		rbcommit(&cq->addr_rb);
 
 		rbfdwrite(&cq->cq_rbfd, &overflow_entry->cq_entry[0], overflow_entry->len);
-		if (cq->domain->progress_mode == FI_PROGRESS_MANUAL)
-			rbcommit(&cq->cq_rbfd.rb);
-		else
-			rbfdcommit(&cq->cq_rbfd);
+		rbcommit(&cq->cq_rbfd.rb);
+		sock_cq_arm(cq);
 
 		dlist_remove(&overflow_entry->entry);
 		free(overflow_entry);
@@ -309,13 +318,20 @@ static inline ssize_t sock_cq_rbuf_read(struct sock_cq *cq, void *buf,
 	return count;
 }
 
+static int sock_cq_ready(void *arg)
+{
+	struct sock_cq *cq = arg;
+
+	return rbfdused(&cq->cq_rbfd) || rbused(&cq->cqerr_rb);
+}
+
 static ssize_t sock_cq_sreadfrom(struct fid_cq *cq, void *buf, size_t count,
 			fi_addr_t *src_addr, const void *cond, int timeout)
 {
 	int ret = 0;
 	size_t threshold;
 	struct sock_cq *sock_cq;
-	uint64_t start_ms = 0, end_ms = 0;
+	uint64_t start_ms = 0, end_ms = 0, now_ms, spin_end;
 	ssize_t cq_entry_len, avail;
 
 	sock_cq = container_of(cq, struct sock_cq, cq_fid);
@@ -334,32 +350,49 @@ static ssize_t sock_cq_sreadfrom(struct fid_cq *cq, void *buf, size_t count,
 			end_ms = start_ms + timeout;
 		}
 
+		spin_end = sock_spin_deadline(&sock_cq->spin);
 		do {
 			sock_cq_progress(sock_cq);
+			if (rbused(&sock_cq->cqerr_rb))
+				return -FI_EAVAIL;
 			fastlock_acquire(&sock_cq->lock);
 			avail = rbfdused(&sock_cq->cq_rbfd);
-			if (avail)
+			if (avail) {
 				ret = sock_cq_rbuf_read(sock_cq, buf,
 					MIN(threshold, avail / cq_entry_len),
 					src_addr, cq_entry_len);
-			fastlock_release(&sock_cq->lock);
-			if (ret == 0 && timeout >= 0) {
-				if (fi_gettime_ms() >= end_ms)
-					return -FI_EAGAIN;
+				sock_spin_update(&sock_cq->spin);
 			}
-		} while (ret == 0);
+			fastlock_release(&sock_cq->lock);
+			if (ret)
+				break;
+
+			now_ms = fi_gettime_ms();
+			if (timeout >= 0 && now_ms >= end_ms)
+				return -FI_EAGAIN;
+			if (timeout && sock_gettime_us() >= spin_end)
+				sock_pe_wait(sock_cq->domain->pe, sock_cq_ready,
+					     sock_cq, timeout < 0 ? -1 :
+					     (int) (end_ms - now_ms));
+		} while (1);
 	} else {
-		ret = rbfdwait(&sock_cq->cq_rbfd, timeout);
-		if (ret > 0) {
+		fastlock_acquire(&sock_cq->lock);
+		if (!rbfdused(&sock_cq->cq_rbfd)) {
+			sock_cq->num_waiters++;
+			fastlock_release(&sock_cq->lock);
+			ret = rbfdwait(&sock_cq->cq_rbfd, timeout);
 			fastlock_acquire(&sock_cq->lock);
+			sock_cq->num_waiters--;
+		}
+		if (ret >= 0) {
 			ret = 0;
 			avail = rbfdused(&sock_cq->cq_rbfd);
 			if (avail)
 				ret = sock_cq_rbuf_read(sock_cq, buf,
 					MIN(threshold, avail / cq_entry_len),
 					src_addr, cq_entry_len);
-			fastlock_release(&sock_cq->lock);
 		}
+		fastlock_release(&sock_cq->lock);
 	}
 	return (ret == 0 || ret == -FI_ETIMEDOUT) ? -FI_EAGAIN : ret;
 }
@@ -437,7 +470,9 @@ static int sock_cq_signal(struct fid_cq *cq)
 {
 	struct sock_cq *sock_cq;
 	sock_cq = container_of(cq, struct sock_cq, cq_fid);
+	fastlock_acquire(&sock_cq->lock);
 	rbfdsignal(&sock_cq->cq_rbfd);
+	fastlock_release(&sock_cq->lock);
 	return 0;
 }
 
@@ -467,7 +502,15 @@ static int sock_cq_control(struct fid *fid, int command, void *arg)
 		case FI_WAIT_NONE:
 		case FI_WAIT_FD:
 		case FI_WAIT_UNSPEC:
-			memcpy(arg, &cq->cq_rbfd.fd[RB_READ_FD], sizeof(int));
+			fastlock_acquire(&cq->lock);
+			if (!cq->fd_exported) {
+				cq->fd_exported = 1;
+				if (rbfdused(&cq->cq_rbfd))
+					rbfdsignal(&cq->cq_rbfd);
+			}
+			fastlock_release(&cq->lock);
+			memcpy(arg, &cq->cq_rbfd.signal.fd[FI_READ_FD],
+			       sizeof(int));
 			break;
 
 		case FI_WAIT_SET:
@@ -688,5 +731,7 @@ int sock_cq_report_error(struct sock_cq *cq, struct sock_pe_entry *entry,
 
 out:
 	fastlock_release(&cq->lock);
+	if (cq->domain->progress_mode == FI_PROGRESS_MANUAL)
+		sock_pe_signal(cq->domain->pe);
 	return ret;
 }
@@ -55,6 +55,8 @@ struct sock_rx_ctx *sock_rx_ctx_alloc(const struct fi_rx_attr *attr,
 	dlist_init(&rx_ctx->pe_entry_list);
 	dlist_init(&rx_ctx->rx_entry_list);
 	dlist_init(&rx_ctx->rx_buffered_list);
+	dlist_init(&rx_ctx->rx_rndv_list);
+	dlist_init(&rx_ctx->rx_rndv_ref_list);
 	dlist_init(&rx_ctx->ep_list);
 
 	fastlock_init(&rx_ctx->lock);
@@ -63,12 +65,32 @@ struct sock_rx_ctx *sock_rx_ctx_alloc(const struct fi_rx_attr *attr,
 	rx_ctx->ctx.fid.context = context;
 	rx_ctx->num_left = attr->size;
 	rx_ctx->attr = *attr;
+	if (!rx_ctx->attr.total_buffered_recv)
+		rx_ctx->attr.total_buffered_recv = SOCK_EP_MAX_BUFF_RECV;
 	rx_ctx->use_shared = use_shared;
+
+	if (sock_rx_match_init(rx_ctx)) {
+		fastlock_destroy(&rx_ctx->lock);
+		free(rx_ctx);
+		return NULL;
+	}
 	return rx_ctx;
 }
 
 void sock_rx_ctx_free(struct sock_rx_ctx *rx_ctx)
 {
+	struct sock_rx_entry *rx_entry;
+
+	/* rendezvous receives still waiting for their data */
+	while (!dlist_empty(&rx_ctx->rx_rndv_list)) {
+		rx_entry = container_of(rx_ctx->rx_rndv_list.next,
+					struct sock_rx_entry, entry);
+		dlist_remove(&rx_entry->entry);
+		sock_rx_release_entry(rx_entry);
+	}
+
+	sock_rx_buffer_finalize(rx_ctx);
+	sock_rx_match_finalize(rx_ctx);
 	fastlock_destroy(&rx_ctx->lock);
 	free(rx_ctx->rx_entry_pool);
 	free(rx_ctx);
@@ -170,7 +192,7 @@ void sock_tx_ctx_write(struct sock_tx_ctx *tx_ctx, const void *buf, size_t len)
 void sock_tx_ctx_commit(struct sock_tx_ctx *tx_ctx)
 {
 	rbcommit(&tx_ctx->rb);
-	sock_pe_signal(tx_ctx->domain->pe);
+	sock_pe_signal(sock_tx_ctx_pe(tx_ctx));
 	fastlock_release(&tx_ctx->wlock);
 }
 
@@ -37,10 +37,14 @@
 
 #include "sock.h"
 #include "sock_util.h"
+#include "fasthash.h"
 
 #define SOCK_LOG_DBG(...) _SOCK_LOG_DBG(FI_LOG_DOMAIN, __VA_ARGS__)
 #define SOCK_LOG_ERROR(...) _SOCK_LOG_ERROR(FI_LOG_DOMAIN, __VA_ARGS__)
 
+#define SOCK_MR_TABLE_MIN_SZ	64
+#define SOCK_MR_NO_KEY		UINT64_MAX
+
 const struct fi_domain_attr sock_domain_attr = {
 	.name = NULL,
 	.threading = FI_THREAD_SAFE,
@@ -153,6 +157,24 @@ int sock_verify_domain_attr(struct fi_domain_attr *attr)
 	return 0;
 }
 
+static void sock_mr_map_free(struct sock_mr_map *map)
+{
+	struct sock_mr_table *table;
+	struct sock_mr *mr;
+
+	while (map->table) {
+		table = map->table;
+		map->table = table->retired;
+		free(table);
+	}
+
+	while (!dlist_empty(&map->free_list)) {
+		mr = container_of(map->free_list.next, struct sock_mr, entry);
+		dlist_remove(&mr->entry);
+		free(mr);
+	}
+}
+
 static int sock_dom_close(struct fid *fid)
 {
 	struct sock_domain *dom;
@@ -162,43 +184,255 @@ static int sock_dom_close(struct fid *fid)
 
 	sock_pe_finalize(dom->pe);
 	fastlock_destroy(&dom->lock);
-	rbtDelete(dom->mr_heap);
+	sock_mr_map_free(&dom->mr_map);
 	sock_dom_remove_from_list(dom);
+	atomic_dec(&dom->fab->ref);
 	free(dom);
 	return 0;
 }
 
-static uint64_t sock_get_mr_key(struct sock_domain *dom)
+/*
+ * Writers hold the domain lock and bracket every change to the MR table,
+ * or to an MR reachable through it, with these calls.  The count is odd
+ * while an update is in progress.
+ */
+static void sock_mr_write_begin(struct sock_domain *dom)
+{
+#ifdef HAVE_ATOMICS
+	atomic_store_explicit(&dom->mr_map.seq,
+		atomic_load_explicit(&dom->mr_map.seq, memory_order_relaxed) + 1,
+		memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+#endif
+}
+
+static void sock_mr_write_end(struct sock_domain *dom)
+{
+#ifdef HAVE_ATOMICS
+	atomic_store_explicit(&dom->mr_map.seq,
+		atomic_load_explicit(&dom->mr_map.seq, memory_order_relaxed) + 1,
+		memory_order_release);
+#endif
+}
+
+/*
+ * Lookups run without the domain lock when atomics are available.  A
+ * lookup that overlaps an update sees the sequence count change and
+ * retries; without atomics the lookup holds the lock instead.
+ */
+#ifdef HAVE_ATOMICS
+static inline unsigned sock_mr_read_begin(struct sock_domain *dom)
+{
+	unsigned seq;
+
+	do {
+		seq = atomic_load_explicit(&dom->mr_map.seq,
+					   memory_order_acquire);
+	} while (seq & 1);
+	return seq;
+}
+
+static inline int sock_mr_read_retry(struct sock_domain *dom, unsigned seq)
+{
+	atomic_thread_fence(memory_order_acquire);
+	return seq != atomic_load_explicit(&dom->mr_map.seq,
+					   memory_order_relaxed);
+}
+#else
+static inline unsigned sock_mr_read_begin(struct sock_domain *dom)
+{
+	fastlock_acquire(&dom->lock);
+	return 0;
+}
+
+static inline int sock_mr_read_retry(struct sock_domain *dom, unsigned seq)
 {
+	fastlock_release(&dom->lock);
+	return 0;
+}
+#endif
+
+static inline uint64_t sock_mr_hash_key(uint64_t key)
+{
+	return fasthash64(&key, sizeof(key), 0);
+}
+
+/*
+ * Returns the slot holding key, or the empty slot where it belongs.
+ */
+static uint64_t sock_mr_hash_probe(struct sock_mr_table *table, uint64_t key)
+{
+	uint64_t i, mask = table->size - 1;
+
+	for (i = sock_mr_hash_key(key) & mask;
+	     table->slot[i].mr && table->slot[i].key != key;
+	     i = (i + 1) & mask)
+		;
+	return i;
+}
+
+static struct sock_mr *sock_mr_map_find(struct sock_domain *dom, uint64_t key)
+{
+	struct sock_mr_table *table = dom->mr_map.table;
+
+	if (!table)
+		return NULL;
+
+	if (dom->attr.mr_mode == FI_MR_BASIC)
+		return (key < table->size) ? table->slot[key].mr : NULL;
+
+	return table->slot[sock_mr_hash_probe(table, key)].mr;
+}
+
+/*
+ * Must hold domain lock.  The direct table only grows once every key is
+ * in use; the hash table is kept at most half full.
+ */
+static int sock_mr_map_grow(struct sock_domain *dom)
+{
+	struct sock_mr_map *map = &dom->mr_map;
+	struct sock_mr_table *old = map->table, *table;
+	uint64_t size, start, i;
+
+	size = old ? old->size * 2 : SOCK_MR_TABLE_MIN_SZ;
+	table = calloc(1, sizeof(*table) + size * sizeof(table->slot[0]));
+	if (!table)
+		return -FI_ENOMEM;
+	table->size = size;
+
+	if (dom->attr.mr_mode == FI_MR_BASIC) {
+		start = old ? old->size : 0;
+		if (old)
+			memcpy(table->slot, old->slot,
+			       old->size * sizeof(old->slot[0]));
+		for (i = start; i < size - 1; i++)
+			table->slot[i].key = i + 1;
+		table->slot[size - 1].key = map->free_key;
+		map->free_key = start;
+	} else if (old) {
+		for (i = 0; i < old->size; i++) {
+			if (old->slot[i].mr)
+				table->slot[sock_mr_hash_probe(table,
+					old->slot[i].key)] = old->slot[i];
+		}
+	}
+
+	table->retired = old;
+	map->table = table;
+	return 0;
+}
+
+/*
+ * Must hold domain lock.  Assigns the key of a provider generated MR.
+ */
+static int sock_mr_map_insert(struct sock_domain *dom, struct sock_mr *mr)
+{
+	struct sock_mr_map *map = &dom->mr_map;
 	uint64_t i;
-	for (i = 0; i < UINT64_MAX; i++) {
-		if (!sock_mr_get_entry(dom, i))
-			return i;
+	int ret;
+
+	if (dom->attr.mr_mode == FI_MR_BASIC) {
+		if (map->free_key == SOCK_MR_NO_KEY) {
+			ret = sock_mr_map_grow(dom);
+			if (ret)
+				return ret;
+		}
+		i = map->free_key;
+		map->free_key = map->table->slot[i].key;
+		mr->key = i;
+	} else {
+		if (!map->table || (map->used + 1) * 2 > map->table->size) {
+			ret = sock_mr_map_grow(dom);
+			if (ret)
+				return ret;
+		}
+		i = sock_mr_hash_probe(map->table, mr->key);
+		if (map->table->slot[i].mr)
+			return -FI_ENOKEY;
+	}
+
+	map->table->slot[i].key = mr->key;
+	map->table->slot[i].mr = mr;
+	map->used++;
+	return 0;
+}
+
+/*
+ * Must hold domain lock.  Later entries of a probe run are shifted back
+ * into the hole, so hash lookups never need tombstones.
+ */
+static int sock_mr_map_remove(struct sock_domain *dom, struct sock_mr *mr)
+{
+	struct sock_mr_map *map = &dom->mr_map;
+	struct sock_mr_table *table = map->table;
+	uint64_t i, j, home, mask;
+
+	if (!table || sock_mr_map_find(dom, mr->key) != mr)
+		return -FI_ENOKEY;
+
+	if (dom->attr.mr_mode == FI_MR_BASIC) {
+		table->slot[mr->key].mr = NULL;
+		table->slot[mr->key].key = map->free_key;
+		map->free_key = mr->key;
+		map->used--;
+		return 0;
+	}
+
+	mask = table->size - 1;
+	i = sock_mr_hash_probe(table, mr->key);
+	for (j = (i + 1) & mask; table->slot[j].mr; j = (j + 1) & mask) {
+		home = sock_mr_hash_key(table->slot[j].key) & mask;
+		if (((j - home) & mask) >= ((j - i) & mask)) {
+			table->slot[i] = table->slot[j];
+			i = j;
+		}
+	}
+	table->slot[i].mr = NULL;
+	map->used--;
+	return 0;
+}
+
+/*
+ * Must hold domain lock.  Closed MRs are reused rather than freed, since
+ * a lookup may still be reading one.
+ */
+static struct sock_mr *sock_mr_alloc(struct sock_domain *dom, size_t iov_count)
+{
+	struct dlist_entry *entry;
+	struct sock_mr *mr;
+
+	for (entry = dom->mr_map.free_list.next;
+	     entry != &dom->mr_map.free_list; entry = entry->next) {
+		mr = container_of(entry, struct sock_mr, entry);
+		if (mr->iov_max >= iov_count) {
+			dlist_remove(&mr->entry);
+			return mr;
+		}
 	}
-	SOCK_LOG_ERROR("failed to get a free key\n");
-	return UINT64_MAX;
+
+	mr = calloc(1, sizeof(*mr) + sizeof(mr->mr_iov) * (iov_count - 1));
+	if (mr)
+		mr->iov_max = iov_count;
+	return mr;
 }
 
 static int sock_mr_close(struct fid *fid)
 {
 	struct sock_domain *dom;
 	struct sock_mr *mr;
-	RbtIterator it;
-	RbtStatus res;
-	uint64_t mr_key;
 
 	mr = container_of(fid, struct sock_mr, mr_fid.fid);
 	dom = mr->domain;
-	mr_key = mr->key;
 
 	fastlock_acquire(&dom->lock);
-	it = rbtFind(dom->mr_heap, &mr_key);
-	if (!it || ((res = rbtErase(dom->mr_heap, it)) != RBT_STATUS_OK))
+	sock_mr_write_begin(dom);
+	if (sock_mr_map_remove(dom, mr))
 		SOCK_LOG_ERROR("Invalid mr\n");
-
+	sock_mr_write_end(dom);
+	dlist_insert_tail(&mr->entry, &dom->mr_map.free_list);
 	fastlock_release(&dom->lock);
+
 	atomic_dec(&dom->ref);
-	free(mr);
 	return 0;
 }
 
@@ -244,30 +478,21 @@ static struct fi_ops sock_mr_fi_ops = {
 
 struct sock_mr *sock_mr_get_entry(struct sock_domain *domain, uint64_t key)
 {
-	RbtIterator it;
-	void *value;
-	void *mr_key = &key;
-
-	it = rbtFind(domain->mr_heap, mr_key);
-	if (!it)
-		return NULL;
+	struct sock_mr *mr;
+	unsigned seq;
 
-	rbtKeyValue(domain->mr_heap, it, &mr_key, &value);
-	return (struct sock_mr *) value;
+	do {
+		seq = sock_mr_read_begin(domain);
+		mr = sock_mr_map_find(domain, key);
+	} while (sock_mr_read_retry(domain, seq));
+	return mr;
 }
 
-struct sock_mr *sock_mr_verify_key(struct sock_domain *domain, uint64_t key,
-				   void *buf, size_t len, uint64_t access)
+static int sock_mr_check_access(struct sock_domain *domain,
+				struct sock_mr *mr, void *buf, size_t len,
+				uint64_t access)
 {
 	int i;
-	struct sock_mr *mr;
-
-	fastlock_acquire(&domain->lock);
-	mr = sock_mr_get_entry(domain, key);
-	if (!mr) {
-		fastlock_release(&domain->lock);
-		return NULL;
-	}
 
 	if (domain->attr.mr_mode == FI_MR_SCALABLE)
 		buf = (char *)buf + mr->offset;
@@ -277,13 +502,29 @@ struct sock_mr *sock_mr_verify_key(struct sock_domain *domain, uint64_t key,
 		    ((uintptr_t)buf + len <= (uintptr_t) mr->mr_iov[i].iov_base +
 		     mr->mr_iov[i].iov_len)) {
 			if ((access & mr->access) == access)
-				goto out;
+				return 1;
 		}
 	}
-	SOCK_LOG_ERROR("MR check failed\n");
-	mr = NULL;
-out:
-	fastlock_release(&domain->lock);
+	return 0;
+}
+
+struct sock_mr *sock_mr_verify_key(struct sock_domain *domain, uint64_t key,
+				   void *buf, size_t len, uint64_t access)
+{
+	struct sock_mr *mr;
+	unsigned seq;
+	int valid;
+
+	do {
+		seq = sock_mr_read_begin(domain);
+		mr = sock_mr_map_find(domain, key);
+		valid = mr && sock_mr_check_access(domain, mr, buf, len, access);
+	} while (sock_mr_read_retry(domain, seq));
+
+	if (mr && !valid) {
+		SOCK_LOG_ERROR("MR check failed\n");
+		return NULL;
+	}
 	return mr;
 }
 
@@ -302,7 +543,6 @@ static int sock_regattr(struct fid *fid, const struct fi_mr_attr *attr,
 	struct sock_mr *_mr;
 	uint64_t key;
 	struct fid_domain *domain;
-	RbtStatus res;
 	int ret = 0;
 
 	if (fid->fclass != FI_CLASS_DOMAIN || !attr || attr->iov_count <= 0) {
@@ -312,18 +552,14 @@ static int sock_regattr(struct fid *fid, const struct fi_mr_attr *attr,
 	domain = container_of(fid, struct fid_domain, fid);
 	dom = container_of(domain, struct sock_domain, dom_fid);
 
-	_mr = calloc(1, sizeof(*_mr) +
-		     sizeof(_mr->mr_iov) * (attr->iov_count - 1));
-	if (!_mr)
-		return -FI_ENOMEM;
-
 	fastlock_acquire(&dom->lock);
-	if (dom->attr.mr_mode == FI_MR_SCALABLE &&
-	    sock_mr_get_entry(dom, attr->requested_key) != NULL) {
-		ret = -FI_ENOKEY;
-		goto err;
+	_mr = sock_mr_alloc(dom, attr->iov_count);
+	if (!_mr) {
+		ret = -FI_ENOMEM;
+		goto err1;
 	}
 
+	sock_mr_write_begin(dom);
 	_mr->mr_fid.fid.fclass = FI_CLASS_MR;
 	_mr->mr_fid.fid.context = attr->context;
 	_mr->mr_fid.fid.ops = &sock_mr_fi_ops;
@@ -335,23 +571,22 @@ static int sock_regattr(struct fid *fid, const struct fi_mr_attr *attr,
 		(uintptr_t) attr->mr_iov[0].iov_base + attr->offset :
 		(uintptr_t) attr->mr_iov[0].iov_base;
 
-	key = (dom->attr.mr_mode == FI_MR_BASIC) ?
-		sock_get_mr_key(dom) : attr->requested_key;
+	_mr->cntr = NULL;
+	_mr->cq = NULL;
+	_mr->iov_count = attr->iov_count;
+	memcpy(&_mr->mr_iov, attr->mr_iov, sizeof(_mr->mr_iov) * attr->iov_count);
 
-	_mr->key = key;
-	res = rbtInsert(dom->mr_heap, &_mr->key, _mr);
-	if (res != RBT_STATUS_OK) {
-		ret = -FI_ENOMEM;
-		goto err;
-	}
+	_mr->key = attr->requested_key;
+	ret = sock_mr_map_insert(dom, _mr);
+	if (ret)
+		goto err2;
+	sock_mr_write_end(dom);
 
+	key = _mr->key;
 	_mr->mr_fid.key = key;
 	_mr->mr_fid.mem_desc = (void *) (uintptr_t) key;
 	fastlock_release(&dom->lock);
 
-	_mr->iov_count = attr->iov_count;
-	memcpy(&_mr->mr_iov, attr->mr_iov, sizeof(_mr->mr_iov) * attr->iov_count);
-
 	*mr = &_mr->mr_fid;
 	atomic_inc(&dom->ref);
 
@@ -364,9 +599,11 @@ static int sock_regattr(struct fid *fid, const struct fi_mr_attr *attr,
 
 	return 0;
 
-err:
+err2:
+	sock_mr_write_end(dom);
+	dlist_insert_tail(&_mr->entry, &dom->mr_map.free_list);
+err1:
 	fastlock_release(&dom->lock);
-	free(_mr);
 	return ret;
 }
 
@@ -473,13 +710,6 @@ static struct fi_ops_mr sock_dom_mr_ops = {
 	.regattr = sock_regattr,
 };
 
-static int sock_compare_mr_keys(void *key1, void *key2)
-{
-	uint64_t k1 = *((uint64_t *) key1);
-	uint64_t k2 = *((uint64_t *) key2);
-	return (k1 < k2) ?  -1 : (k1 > k2);
-}
-
 int sock_domain(struct fid_fabric *fabric, struct fi_info *info,
 		struct fid_domain **dom, void *context)
 {
@@ -526,11 +756,13 @@ int sock_domain(struct fid_fabric *fabric, struct fi_info *info,
 		goto err;
 	}
 
-	sock_domain->mr_heap = rbtNew(&sock_compare_mr_keys);
-	if (!sock_domain->mr_heap) {
-		goto err;
-	}
+	sock_domain->mr_map.free_key = SOCK_MR_NO_KEY;
+	dlist_init(&sock_domain->mr_map.free_list);
+#ifdef HAVE_ATOMICS
+	atomic_init(&sock_domain->mr_map.seq, 0);
+#endif
 	sock_domain->fab = fab;
+	atomic_inc(&fab->ref);
 	*dom = &sock_domain->dom_fid;
 
 	if (info->domain_attr)
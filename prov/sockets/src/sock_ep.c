@@ -278,9 +278,9 @@ static int sock_ctx_enable(struct fid_ep *ep)
 	case FI_CLASS_RX_CTX:
 		rx_ctx = container_of(ep, struct sock_rx_ctx, ctx.fid);
 		rx_ctx->enabled = 1;
-		sock_pe_add_rx_ctx(rx_ctx->domain->pe, rx_ctx);
+		sock_pe_add_rx_ctx(sock_rx_ctx_pe(rx_ctx), rx_ctx);
 
-		if (!rx_ctx->ep_attr->listener.listener_thread &&
+		if (!rx_ctx->ep_attr->listener.do_listen &&
 		    sock_conn_listen(rx_ctx->ep_attr)) {
 			SOCK_LOG_ERROR("failed to create listener\n");
 		}
@@ -289,9 +289,9 @@ static int sock_ctx_enable(struct fid_ep *ep)
 	case FI_CLASS_TX_CTX:
 		tx_ctx = container_of(ep, struct sock_tx_ctx, fid.ctx.fid);
 		tx_ctx->enabled = 1;
-		sock_pe_add_tx_ctx(tx_ctx->domain->pe, tx_ctx);
+		sock_pe_add_tx_ctx(sock_tx_ctx_pe(tx_ctx), tx_ctx);
 
-		if (!tx_ctx->ep_attr->listener.listener_thread &&
+		if (!tx_ctx->ep_attr->listener.do_listen &&
 		    sock_conn_listen(tx_ctx->ep_attr)) {
 			SOCK_LOG_ERROR("failed to create listener\n");
 		}
@@ -494,7 +494,7 @@ static ssize_t sock_rx_ctx_cancel(struct sock_rx_ctx *rx_ctx, void *context)
 			if (rx_ctx->comp.recv_cntr)
 				sock_cntr_err_inc(rx_ctx->comp.recv_cntr);
 
-			dlist_remove(&rx_entry->entry);
+			sock_rx_dequeue_entry(rx_ctx, rx_entry);
 			sock_rx_release_entry(rx_entry);
 			ret = 0;
 			break;
@@ -597,7 +597,6 @@ struct fi_ops_ep sock_ctx_ep_ops = {
 static int sock_ep_close(struct fid *fid)
 {
 	struct sock_ep *sock_ep;
-	char c = 0;
 
 	switch (fid->fclass) {
 	case FI_CLASS_EP:
@@ -621,16 +620,11 @@ static int sock_ep_close(struct fid *fid)
 		return -FI_EBUSY;
 
 	if (sock_ep->attr->ep_type == FI_EP_MSG) {
-		sock_ep->attr->cm.do_listen = 0;
-		if (ofi_write_socket(sock_ep->attr->cm.signal_fds[0], &c, 1) != 1)
-			SOCK_LOG_DBG("Failed to signal\n");
-
-		if (sock_ep->attr->cm.listener_thread &&
-		    pthread_join(sock_ep->attr->cm.listener_thread, NULL)) {
-			SOCK_LOG_ERROR("pthread join failed (%d)\n", errno);
+		sock_cm_reactor_del(&sock_ep->attr->cm.handler);
+		if (sock_ep->attr->cm.do_listen) {
+			sock_ep->attr->cm.do_listen = 0;
+			ofi_close_socket(sock_ep->attr->cm.sock);
 		}
-		ofi_close_socket(sock_ep->attr->cm.signal_fds[0]);
-		ofi_close_socket(sock_ep->attr->cm.signal_fds[1]);
 	} else {
 		if (sock_ep->attr->av)
 			atomic_dec(&sock_ep->attr->av->ref);
@@ -652,16 +646,8 @@ static int sock_ep_close(struct fid *fid)
 
 	if (sock_ep->attr->listener.do_listen) {
 		sock_ep->attr->listener.do_listen = 0;
-		if (ofi_write_socket(sock_ep->attr->listener.signal_fds[0], &c, 1) != 1)
-			SOCK_LOG_DBG("Failed to signal\n");
-
-		if (sock_ep->attr->listener.listener_thread &&
-		     pthread_join(sock_ep->attr->listener.listener_thread, NULL)) {
-			SOCK_LOG_ERROR("pthread join failed (%d)\n", errno);
-		}
-
-		ofi_close_socket(sock_ep->attr->listener.signal_fds[0]);
-		ofi_close_socket(sock_ep->attr->listener.signal_fds[1]);
+		sock_cm_reactor_del(&sock_ep->attr->listener.handler);
+		ofi_close_socket(sock_ep->attr->listener.sock);
 	}
 
 	fastlock_destroy(&sock_ep->attr->cm.lock);
@@ -691,6 +677,7 @@ static int sock_ep_close(struct fid *fid)
 		free(sock_ep->attr->dest_addr);
 
 	sock_conn_map_destroy(&sock_ep->attr->cmap);
+	sock_pe_put_shard(sock_ep->attr->pe);
 	atomic_dec(&sock_ep->attr->domain->ref);
 	fastlock_destroy(&sock_ep->attr->lock);
 	free(sock_ep->attr);
@@ -937,11 +924,12 @@ int sock_ep_enable(struct fid_ep *ep)
 			tx_ctx->enabled = 1;
 			if (tx_ctx->use_shared) {
 				if (tx_ctx->stx_ctx) {
-					sock_pe_add_tx_ctx(tx_ctx->domain->pe, tx_ctx->stx_ctx);
+					sock_pe_add_tx_ctx(sock_tx_ctx_pe(tx_ctx->stx_ctx),
+							   tx_ctx->stx_ctx);
 					tx_ctx->stx_ctx->enabled = 1;
 				}
 			} else {
-				sock_pe_add_tx_ctx(tx_ctx->domain->pe, tx_ctx);
+				sock_pe_add_tx_ctx(sock_tx_ctx_pe(tx_ctx), tx_ctx);
 			}
 		}
 	}
@@ -952,17 +940,18 @@ int sock_ep_enable(struct fid_ep *ep)
 			rx_ctx->enabled = 1;
 			if (rx_ctx->use_shared) {
 				if (rx_ctx->srx_ctx) {
-					sock_pe_add_rx_ctx(rx_ctx->domain->pe, rx_ctx->srx_ctx);
+					sock_pe_add_rx_ctx(sock_rx_ctx_pe(rx_ctx->srx_ctx),
+							   rx_ctx->srx_ctx);
 					rx_ctx->srx_ctx->enabled = 1;
 				}
 			} else {
-				sock_pe_add_rx_ctx(rx_ctx->domain->pe, rx_ctx);
+				sock_pe_add_rx_ctx(sock_rx_ctx_pe(rx_ctx), rx_ctx);
 			}
 		}
 	}
 
 	if (sock_ep->attr->ep_type != FI_EP_MSG &&
-	    !sock_ep->attr->listener.listener_thread && sock_conn_listen(sock_ep->attr))
+	    !sock_ep->attr->listener.do_listen && sock_conn_listen(sock_ep->attr))
 		SOCK_LOG_ERROR("cannot start connection thread\n");
 	sock_ep->attr->is_disabled = 0;
 	return 0;
@@ -1661,17 +1650,8 @@ int sock_alloc_endpoint(struct fid_domain *domain, struct fi_info *info,
 
 	sock_ep->attr->domain = sock_dom;
 	fastlock_init(&sock_ep->attr->cm.lock);
-	if (sock_ep->attr->ep_type == FI_EP_MSG) {
+	if (sock_ep->attr->ep_type == FI_EP_MSG)
 		dlist_init(&sock_ep->attr->cm.msg_list);
-		if (socketpair(AF_UNIX, SOCK_STREAM, 0,
-			       sock_ep->attr->cm.signal_fds) < 0) {
-			ret = -FI_EINVAL;
-			goto err2;
-		}
-
-		if (fi_fd_nonblock(sock_ep->attr->cm.signal_fds[1]))
-			SOCK_LOG_ERROR("fi_fd_nonblock failed");
-	}
 
 	if (sock_conn_map_init(sock_ep, sock_cm_def_map_sz)) {
 		SOCK_LOG_ERROR("failed to init connection map: %s\n", strerror(errno));
@@ -1679,6 +1659,9 @@ int sock_alloc_endpoint(struct fid_domain *domain, struct fi_info *info,
 		goto err2;
 	}
 
+	sock_ep->attr->pe = sock_pe_get_shard(sock_dom->pe,
+					      sock_ep->attr->tx_shared ||
+					      sock_ep->attr->rx_shared);
 	atomic_inc(&sock_dom->ref);
 	return 0;
 
@@ -1696,20 +1679,31 @@ err1:
 struct sock_conn *sock_ep_lookup_conn(struct sock_ep_attr *attr, fi_addr_t index,
 					struct sockaddr_in *addr)
 {
-	int i;
-	uint16_t idx;
-	struct sock_conn *conn;
+	uint64_t idx;
+	struct sock_conn *conn, *unresolved;
+	struct dlist_entry *entry;
 
 	idx = (attr->ep_type == FI_EP_MSG) ? index : index & attr->av->mask;
-	conn = idm_lookup(&attr->av_idm, idx);
-	if (conn && conn != SOCK_CM_CONN_IN_PROGRESS) {
+	conn = sock_conn_map_lookup_av(&attr->cmap, idx);
+	if (conn) {
 		assert(sock_compare_addr(&conn->addr, addr));
 		return conn;
 	}
 
-	for (i = 0; i < attr->cmap.used; i++) {
-		if (sock_compare_addr(&attr->cmap.table[i].addr, addr))
-			return &attr->cmap.table[i];
+	/* Accepted connections whose source was not in the AV at the time */
+	for (entry = attr->cmap.unresolved_list.next;
+	     entry != &attr->cmap.unresolved_list; entry = entry->next) {
+		unresolved = container_of(entry, struct sock_conn,
+					  unresolved_entry);
+		if (!sock_compare_addr(&unresolved->addr, addr))
+			continue;
+
+		if (sock_conn_map_set_av(&attr->cmap, idx, unresolved))
+			return conn;
+		dlist_remove(&unresolved->unresolved_entry);
+		dlist_init(&unresolved->unresolved_entry);
+		unresolved->av_index = idx;
+		return unresolved;
 	}
 	return conn;
 }
@@ -1729,20 +1723,20 @@ int sock_ep_get_conn(struct sock_ep_attr *attr, struct sock_tx_ctx *tx_ctx,
 	fastlock_acquire(&attr->cmap.lock);
 	conn = sock_ep_lookup_conn(attr, av_index, addr);
 	if (!conn) {
-		conn = SOCK_CM_CONN_IN_PROGRESS;
-		idm_set(&attr->av_idm, av_index, conn);
+		conn = sock_ep_connect(attr, av_index);
+	} else if (conn->state == SOCK_CONN_STATE_FAILED) {
+		/* retry a peer whose earlier connect attempts all failed */
+		conn->state = SOCK_CONN_STATE_CONNECTING;
+		conn->connect_retry = 0;
+		conn->connect_time = 0;
+		conn->reconnect = 0;
+		conn->address_published = 0;
 	}
 	fastlock_release(&attr->cmap.lock);
 
-	if (conn == SOCK_CM_CONN_IN_PROGRESS)
-		conn = sock_ep_connect(attr, av_index);
-
 	if (!conn) {
 		SOCK_LOG_ERROR("Error in connecting: %s\n", strerror(errno));
-		if (errno == EINPROGRESS)
-			return -FI_EAGAIN;
-		else
-			return -errno;
+		return -errno;
 	}
 
 	*pconn = conn;
@@ -38,7 +38,6 @@
 #include <netdb.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
-#include <poll.h>
 #include <stdarg.h>
 #include <stddef.h>
 #include <stdio.h>
@@ -350,13 +349,13 @@ static int sock_ep_cm_setname(fid_t fid, void *addr, size_t addrlen)
 	case FI_CLASS_EP:
 	case FI_CLASS_SEP:
 		sock_ep = container_of(fid, struct sock_ep, ep.fid);
-		if (sock_ep->attr->listener.listener_thread)
+		if (sock_ep->attr->listener.do_listen)
 			return -FI_EINVAL;
 		memcpy(sock_ep->attr->src_addr, addr, addrlen);
 		return sock_conn_listen(sock_ep->attr);
 	case FI_CLASS_PEP:
 		sock_pep = container_of(fid, struct sock_pep, pep.fid);
-		if (sock_pep->cm.listener_thread)
+		if (sock_pep->cm.handler.reactor)
 			return -FI_EINVAL;
 		memcpy(&sock_pep->src_addr, addr, addrlen);
 		return sock_pep_create_listener(sock_pep);
@@ -398,10 +397,11 @@ static int sock_ep_cm_enqueue_msg(struct sock_cm_entry *cm,
 				  void *msg, size_t len,
 				  fid_t fid, struct sock_eq *eq)
 {
-	char c = 0;
-	int ret = 0;
 	struct sock_cm_msg_list_entry *list_entry;
 
+	if (!cm->handler.reactor)
+		return -FI_EIO;
+
 	list_entry = calloc(1, sizeof(*list_entry) + len);
 	if (!list_entry)
 		return -FI_ENOMEM;
@@ -416,15 +416,9 @@ static int sock_ep_cm_enqueue_msg(struct sock_cm_entry *cm,
 	dlist_insert_tail(&list_entry->entry, &cm->msg_list);
 	fastlock_release(&cm->lock);
 
-	ret = ofi_write_socket(cm->signal_fds[0], &c, 1);
-	if (ret != 1) {
-		SOCK_LOG_DBG("failed to signal\n");
-		ret = -FI_EIO;
-	} else {
-		ret = 0;
-		SOCK_LOG_DBG("Enqueued CM Msg\n");
-	}
-	return ret;
+	sock_cm_reactor_signal(cm->handler.reactor);
+	SOCK_LOG_DBG("Enqueued CM Msg\n");
+	return 0;
 }
 
 static int sock_ep_cm_send_msg(struct sock_cm_entry *cm,
@@ -470,10 +464,12 @@ static void sock_ep_cm_release_entry(struct sock_cm_msg_list_entry *msg_entry)
 	free(msg_entry);
 }
 
-static void sock_ep_cm_flush_msg(struct sock_cm_entry *cm)
+static int sock_ep_cm_flush_msg(struct sock_cm_entry *cm)
 {
 	struct dlist_entry *entry, *next_entry;
 	struct sock_cm_msg_list_entry *msg_entry;
+	int pending;
+
 	fastlock_acquire(&cm->lock);
 	for (entry = cm->msg_list.next; entry != &cm->msg_list;) {
 		msg_entry = container_of(entry,
@@ -500,7 +496,15 @@ static void sock_ep_cm_flush_msg(struct sock_cm_entry *cm)
 			SOCK_LOG_DBG("Failed to send out cm message\n");
 		entry = next_entry;
 	}
+	pending = !dlist_empty(&cm->msg_list);
 	fastlock_release(&cm->lock);
+	return pending;
+}
+
+static int sock_ep_cm_flush(struct sock_cm_handler *handler)
+{
+	return sock_ep_cm_flush_msg(container_of(handler, struct sock_cm_entry,
+						 handler));
 }
 
 static int sock_ep_cm_send_ack(struct sock_cm_entry *cm,
@@ -656,154 +660,110 @@ static int sock_is_connecting(struct sock_cm_entry *cm,
 	return 0;
 }
 
-static void *sock_msg_ep_listener_thread(void *data)
+static void sock_msg_ep_cm_handle(struct sock_cm_handler *handler)
 {
-	struct pollfd poll_fds[2];
-	struct sock_ep *ep = (struct sock_ep *)data;
+	struct sock_ep *ep = handler->ctx;
 	struct sock_conn_response *conn_response;
 	struct fi_eq_cm_entry *cm_entry;
 
 	struct sockaddr_in from_addr;
 	socklen_t addr_len;
-	int ret, user_data_sz, entry_sz, timeout;
-	char tmp = 0;
+	int ret, user_data_sz, entry_sz;
 
-	ep->attr->cm.sock = sock_ep_cm_create_socket();
-	if (!ep->attr->cm.sock) {
-		SOCK_LOG_ERROR("Cannot open socket\n");
-		return NULL;
-	}
-
-	SOCK_LOG_DBG("Starting listener thread for EP: %p\n", ep);
 	conn_response = calloc(1, sizeof(*conn_response) + SOCK_EP_MAX_CM_DATA_SZ);
-	if (!conn_response) {
-		SOCK_LOG_ERROR("cannot allocate\n");
-		return NULL;
-	}
-
 	cm_entry = calloc(1, sizeof(*cm_entry) + SOCK_EP_MAX_CM_DATA_SZ);
-	if (!cm_entry) {
-		free(conn_response);
+	if (!conn_response || !cm_entry) {
 		SOCK_LOG_ERROR("cannot allocate\n");
-		return NULL;
+		goto out;
 	}
 
-	poll_fds[0].fd = ep->attr->cm.sock;
-	poll_fds[1].fd = ep->attr->cm.signal_fds[1];
-	poll_fds[0].events = poll_fds[1].events = POLLIN;
-
-	while (*((volatile int*) &ep->attr->cm.do_listen)) {
-		timeout = dlist_empty(&ep->attr->cm.msg_list) ? -1 :
-					SOCK_CM_COMM_TIMEOUT;
-		ret = poll(poll_fds, 2, timeout);
-		if (ret > 0) {
-			if (poll_fds[1].revents & POLLIN) {
-				ret = ofi_read_socket(ep->attr->cm.signal_fds[1], &tmp, 1);
-				if (ret != 1) {
-					SOCK_LOG_DBG("Invalid signal\n");
-					break;
-				}
-				sock_ep_cm_flush_msg(&ep->attr->cm);
-				continue;
-			}
-		} else {
-			if (ret == 0) {
-				sock_ep_cm_flush_msg(&ep->attr->cm);
-				continue;
-			} else {
-				break;
-			}
-		}
-
-		addr_len = sizeof(from_addr);
-		ret = recvfrom(ep->attr->cm.sock, (char *) conn_response,
-			       sizeof(*conn_response) + SOCK_EP_MAX_CM_DATA_SZ,
-			       0, (struct sockaddr *) &from_addr, &addr_len);
-		if (ret <= 0)
-			continue;
-
-		SOCK_LOG_DBG("Total received: %d\n", ret);
-
-		if (ret < sizeof(*conn_response))
-			continue;
+	addr_len = sizeof(from_addr);
+	ret = recvfrom(ep->attr->cm.sock, (char *) conn_response,
+		       sizeof(*conn_response) + SOCK_EP_MAX_CM_DATA_SZ,
+		       0, (struct sockaddr *) &from_addr, &addr_len);
+	if (ret <= 0)
+		goto out;
 
-		if (conn_response->hdr.type != SOCK_CONN_ACK)
-			sock_ep_cm_send_ack(&ep->attr->cm, &from_addr,
-						conn_response->hdr.msg_id);
+	SOCK_LOG_DBG("Total received: %d\n", ret);
 
-		user_data_sz = ret - sizeof(*conn_response);
-		switch (conn_response->hdr.type) {
+	if (ret < sizeof(*conn_response))
+		goto out;
 
-		case SOCK_CONN_ACK:
-			SOCK_LOG_DBG("Received SOCK_CONN_ACK\n");
-			sock_ep_cm_handle_ack(ep, &conn_response->hdr);
-			break;
+	if (conn_response->hdr.type != SOCK_CONN_ACK)
+		sock_ep_cm_send_ack(&ep->attr->cm, &from_addr,
+					conn_response->hdr.msg_id);
 
-		case SOCK_CONN_ACCEPT:
-			SOCK_LOG_DBG("Received SOCK_CONN_ACCEPT\n");
+	user_data_sz = ret - sizeof(*conn_response);
+	switch (conn_response->hdr.type) {
 
-			entry_sz = sizeof(*cm_entry) + user_data_sz;
-			memset(cm_entry, 0, sizeof(*cm_entry));
-			cm_entry->fid = &ep->ep.fid;
+	case SOCK_CONN_ACK:
+		SOCK_LOG_DBG("Received SOCK_CONN_ACK\n");
+		sock_ep_cm_handle_ack(ep, &conn_response->hdr);
+		break;
 
-			memcpy(&ep->attr->cm_addr, &from_addr, sizeof(from_addr));
-			memcpy(&cm_entry->data, &conn_response->user_data,
-			       user_data_sz);
+	case SOCK_CONN_ACCEPT:
+		SOCK_LOG_DBG("Received SOCK_CONN_ACCEPT\n");
 
-			if (ep->attr->is_disabled || ep->attr->cm.shutdown_received)
-				break;
+		entry_sz = sizeof(*cm_entry) + user_data_sz;
+		memset(cm_entry, 0, sizeof(*cm_entry));
+		cm_entry->fid = &ep->ep.fid;
 
-			((struct sockaddr_in *) ep->attr->dest_addr)->sin_port =
-				conn_response->hdr.s_port;
+		memcpy(&ep->attr->cm_addr, &from_addr, sizeof(from_addr));
+		memcpy(&cm_entry->data, &conn_response->user_data,
+		       user_data_sz);
 
-			sock_ep_enable(&ep->ep);
-			if (sock_eq_report_event(ep->attr->eq, FI_CONNECTED, cm_entry,
-						 entry_sz, 0))
-				SOCK_LOG_ERROR("Error in writing to EQ\n");
+		if (ep->attr->is_disabled || ep->attr->cm.shutdown_received)
 			break;
-		case SOCK_CONN_REJECT:
-			SOCK_LOG_DBG("Received SOCK_CONN_REJECT\n");
 
-			if (ep->attr->is_disabled || ep->attr->cm.shutdown_received)
-				break;
+		((struct sockaddr_in *) ep->attr->dest_addr)->sin_port =
+			conn_response->hdr.s_port;
 
-			if (sock_eq_report_error(ep->attr->eq, &ep->ep.fid, NULL, 0,
-						FI_ECONNREFUSED,
-						-FI_ECONNREFUSED,
-						&conn_response->user_data,
-						user_data_sz))
-				SOCK_LOG_ERROR("Error in writing to EQ\n");
+		sock_ep_enable(&ep->ep);
+		if (sock_eq_report_event(ep->attr->eq, FI_CONNECTED, cm_entry,
+					 entry_sz, 0))
+			SOCK_LOG_ERROR("Error in writing to EQ\n");
+		break;
+	case SOCK_CONN_REJECT:
+		SOCK_LOG_DBG("Received SOCK_CONN_REJECT\n");
+
+		if (ep->attr->is_disabled || ep->attr->cm.shutdown_received)
 			break;
 
-		case SOCK_CONN_SHUTDOWN:
-			SOCK_LOG_DBG("Received SOCK_CONN_SHUTDOWN\n");
+		if (sock_eq_report_error(ep->attr->eq, &ep->ep.fid, NULL, 0,
+					FI_ECONNREFUSED,
+					-FI_ECONNREFUSED,
+					&conn_response->user_data,
+					user_data_sz))
+			SOCK_LOG_ERROR("Error in writing to EQ\n");
+		break;
 
-			entry_sz = sizeof(*cm_entry);
-			memset(cm_entry, 0, sizeof(*cm_entry));
-			cm_entry->fid = &ep->ep.fid;
+	case SOCK_CONN_SHUTDOWN:
+		SOCK_LOG_DBG("Received SOCK_CONN_SHUTDOWN\n");
 
-			sock_release_shutdowns(&ep->attr->cm);
-			if (ep->attr->cm.shutdown_received ||
-			     sock_is_connecting(&ep->attr->cm, &conn_response->hdr))
-				break;
+		entry_sz = sizeof(*cm_entry);
+		memset(cm_entry, 0, sizeof(*cm_entry));
+		cm_entry->fid = &ep->ep.fid;
 
-			sock_ep_disable(&ep->ep);
-			ep->attr->cm.shutdown_received = 1;
-			if (sock_eq_report_event(ep->attr->eq, FI_SHUTDOWN, cm_entry,
-						 entry_sz, 0))
-				SOCK_LOG_ERROR("Error in writing to EQ\n");
+		sock_release_shutdowns(&ep->attr->cm);
+		if (ep->attr->cm.shutdown_received ||
+		     sock_is_connecting(&ep->attr->cm, &conn_response->hdr))
 			break;
 
-		default:
-			SOCK_LOG_ERROR("Invalid event: %d\n", conn_response->hdr.type);
-			break;
-		}
+		sock_ep_disable(&ep->ep);
+		ep->attr->cm.shutdown_received = 1;
+		if (sock_eq_report_event(ep->attr->eq, FI_SHUTDOWN, cm_entry,
+					 entry_sz, 0))
+			SOCK_LOG_ERROR("Error in writing to EQ\n");
+		break;
+
+	default:
+		SOCK_LOG_ERROR("Invalid event: %d\n", conn_response->hdr.type);
+		break;
 	}
 
+out:
 	free(conn_response);
 	free(cm_entry);
-	ofi_close_socket(ep->attr->cm.sock);
-	return NULL;
 }
 
 static int sock_ep_cm_connect(struct fid_ep *ep, const void *addr,
@@ -819,7 +779,7 @@ static int sock_ep_cm_connect(struct fid_ep *ep, const void *addr,
 	if (!_eq || !addr || (paramlen > SOCK_EP_MAX_CM_DATA_SZ))
 		return -FI_EINVAL;
 
-	if (!_ep->attr->listener.listener_thread && sock_conn_listen(_ep->attr))
+	if (!_ep->attr->listener.do_listen && sock_conn_listen(_ep->attr))
 		return -FI_EINVAL;
 
 	req = calloc(1, sizeof(*req) + paramlen);
@@ -879,7 +839,7 @@ static int sock_ep_cm_accept(struct fid_ep *ep, const void *param,
 	if (_ep->attr->is_disabled || _ep->attr->cm.shutdown_received)
 		return -FI_EINVAL;
 
-	if (!_ep->attr->listener.listener_thread && sock_conn_listen(_ep->attr))
+	if (!_ep->attr->listener.do_listen && sock_conn_listen(_ep->attr))
 		return -FI_EINVAL;
 
 	response = calloc(1, sizeof(*response) + paramlen);
@@ -1015,15 +975,29 @@ int sock_msg_ep(struct fid_domain *domain, struct fi_info *info,
 	if (ret)
 		return ret;
 
-	endpoint->attr->cm.do_listen = 1;
-	if (pthread_create(&endpoint->attr->cm.listener_thread, NULL,
-			   sock_msg_ep_listener_thread, endpoint)) {
-		SOCK_LOG_ERROR("Couldn't create listener thread\n");
-		return -FI_EINVAL;
+	endpoint->attr->cm.sock = sock_ep_cm_create_socket();
+	if (!endpoint->attr->cm.sock) {
+		SOCK_LOG_ERROR("Cannot open socket\n");
+		ret = -FI_EIO;
+		goto err;
 	}
+	endpoint->attr->cm.do_listen = 1;
+	fd_set_nonblock(endpoint->attr->cm.sock);
+
+	endpoint->attr->cm.handler.fd = endpoint->attr->cm.sock;
+	endpoint->attr->cm.handler.ctx = endpoint;
+	endpoint->attr->cm.handler.handle = sock_msg_ep_cm_handle;
+	endpoint->attr->cm.handler.flush = sock_ep_cm_flush;
+	ret = sock_cm_reactor_add(&endpoint->attr->domain->fab->cm_reactor,
+				  &endpoint->attr->cm.handler);
+	if (ret)
+		goto err;
 
 	*ep = &endpoint->ep;
 	return 0;
+err:
+	fi_close(&endpoint->ep.fid);
+	return ret;
 }
 
 static int sock_pep_fi_bind(fid_t fid, struct fid *bfid, uint64_t flags)
@@ -1047,25 +1021,16 @@ static int sock_pep_fi_bind(fid_t fid, struct fid *bfid, uint64_t flags)
 
 static int sock_pep_fi_close(fid_t fid)
 {
-	int ret;
-	char c = 0;
 	struct sock_pep *pep;
 
 	pep = container_of(fid, struct sock_pep, pep.fid);
+	sock_cm_reactor_del(&pep->cm.handler);
 	pep->cm.do_listen = 0;
-	ret = ofi_write_socket(pep->cm.signal_fds[0], &c, 1);
-	if (ret != 1)
-		SOCK_LOG_DBG("Failed to signal\n");
-
-	if (pep->cm.listener_thread &&
-	    pthread_join(pep->cm.listener_thread, NULL)) {
-		SOCK_LOG_DBG("pthread join failed\n");
-	}
+	if (pep->cm.sock >= 0)
+		ofi_close_socket(pep->cm.sock);
 
-	ofi_close_socket(pep->cm.signal_fds[0]);
-	ofi_close_socket(pep->cm.signal_fds[1]);
 	fastlock_destroy(&pep->cm.lock);
-
+	atomic_dec(&pep->sock_fab->ref);
 	free(pep);
 	return 0;
 }
@@ -1100,155 +1065,105 @@ static struct fi_info *sock_ep_msg_process_info(struct sock_conn_req *req)
 			    req->info.dest_addr, req->info.src_addr);
 }
 
-static void *sock_pep_listener_thread(void *data)
+static void sock_pep_cm_handle(struct sock_cm_handler *handler)
 {
-	struct sock_pep *pep = (struct sock_pep *) data;
-	struct sock_conn_req_handle *handle = NULL;
-	struct sock_conn_req *conn_req = NULL;
+	struct sock_pep *pep = handler->ctx;
+	struct sock_conn_req_handle *handle;
+	struct sock_conn_req *conn_req;
 	struct fi_eq_cm_entry *cm_entry;
 	struct sockaddr_in from_addr;
-	struct pollfd poll_fds[2];
 
 	socklen_t addr_len;
-	int ret = 0, user_data_sz, entry_sz, timeout;
-	char tmp = 0;
+	int ret, user_data_sz, entry_sz;
 
-	SOCK_LOG_DBG("Starting listener thread for PEP: %p\n", pep);
+	handle = calloc(1, sizeof(*handle));
+	conn_req = calloc(1, sizeof(*conn_req) + SOCK_EP_MAX_CM_DATA_SZ);
 	cm_entry = calloc(1, sizeof(*cm_entry) + SOCK_EP_MAX_CM_DATA_SZ);
-	if (!cm_entry) {
+	if (!handle || !conn_req || !cm_entry) {
 		SOCK_LOG_ERROR("cannot allocate\n");
-		return NULL;
+		goto out;
 	}
 
-	poll_fds[0].fd = pep->cm.sock;
-	poll_fds[1].fd = pep->cm.signal_fds[1];
-	poll_fds[0].events = poll_fds[1].events = POLLIN;
-	while (*((volatile int *) &pep->cm.do_listen)) {
-		timeout = dlist_empty(&pep->cm.msg_list) ? -1 :
-					SOCK_CM_COMM_TIMEOUT;
-		ret = poll(poll_fds, 2, timeout);
-		if (ret > 0) {
-			if (poll_fds[1].revents & POLLIN) {
-				ret = ofi_read_socket(pep->cm.signal_fds[1], &tmp, 1);
-				if (ret != 1)
-					SOCK_LOG_DBG("Invalid signal\n");
-				sock_ep_cm_flush_msg(&pep->cm);
-				continue;
-			}
-		} else {
-			if (ret == 0) {
-				sock_ep_cm_flush_msg(&pep->cm);
-				continue;
-			} else {
-				break;
-			}
-		}
-
-		if (handle == NULL) {
-			handle = calloc(1, sizeof(*handle));
-			if (!handle)
-				break;
-		}
-
-		if (conn_req == NULL) {
-			conn_req = calloc(1, sizeof(*conn_req) +
-						SOCK_EP_MAX_CM_DATA_SZ);
-			if (!conn_req) {
-				SOCK_LOG_ERROR("cannot allocate\n");
-				break;
-			}
-		}
-
-		handle->handle.fclass = FI_CLASS_CONNREQ;
-		handle->req = conn_req;
+	handle->handle.fclass = FI_CLASS_CONNREQ;
+	handle->req = conn_req;
 
-		addr_len = sizeof(struct sockaddr_in);
-		ret = recvfrom(pep->cm.sock, (char *) conn_req,
-			       sizeof(*conn_req) + SOCK_EP_MAX_CM_DATA_SZ, 0,
-			       (struct sockaddr *) &from_addr, &addr_len);
-		SOCK_LOG_DBG("Total received: %d\n", ret);
+	addr_len = sizeof(struct sockaddr_in);
+	ret = recvfrom(pep->cm.sock, (char *) conn_req,
+		       sizeof(*conn_req) + SOCK_EP_MAX_CM_DATA_SZ, 0,
+		       (struct sockaddr *) &from_addr, &addr_len);
+	SOCK_LOG_DBG("Total received: %d\n", ret);
 
-		if (ret <= 0)
-			continue;
-		memcpy(&conn_req->from_addr, &from_addr, sizeof(struct sockaddr_in));
-		SOCK_LOG_DBG("CM msg received: %d\n", ret);
-		memset(cm_entry, 0, sizeof(*cm_entry));
+	if (ret <= 0)
+		goto out;
+	memcpy(&conn_req->from_addr, &from_addr, sizeof(struct sockaddr_in));
+	SOCK_LOG_DBG("CM msg received: %d\n", ret);
 
-		if (conn_req->hdr.type != SOCK_CONN_ACK)
-			sock_ep_cm_send_ack(&pep->cm, &from_addr,
-						conn_req->hdr.msg_id);
+	if (conn_req->hdr.type != SOCK_CONN_ACK)
+		sock_ep_cm_send_ack(&pep->cm, &from_addr,
+					conn_req->hdr.msg_id);
 
-		switch (conn_req->hdr.type) {
-		case SOCK_CONN_REQ:
-			SOCK_LOG_DBG("Received SOCK_CONN_REQ\n");
+	switch (conn_req->hdr.type) {
+	case SOCK_CONN_REQ:
+		SOCK_LOG_DBG("Received SOCK_CONN_REQ\n");
 
-			user_data_sz = ret - sizeof(*conn_req);
-			entry_sz = sizeof(*cm_entry) + user_data_sz;
+		user_data_sz = ret - sizeof(*conn_req);
+		entry_sz = sizeof(*cm_entry) + user_data_sz;
 
-			if (ret < sizeof(*conn_req)) {
-				SOCK_LOG_ERROR("Invalid connection request\n");
-				break;
-			}
+		if (ret < sizeof(*conn_req)) {
+			SOCK_LOG_ERROR("Invalid connection request\n");
+			break;
+		}
 
-			cm_entry->fid = &pep->pep.fid;
-			cm_entry->info = sock_ep_msg_process_info(conn_req);
-			if (!cm_entry->info)
-				goto out;
-			cm_entry->info->handle = &handle->handle;
+		cm_entry->fid = &pep->pep.fid;
+		cm_entry->info = sock_ep_msg_process_info(conn_req);
+		if (!cm_entry->info)
+			break;
+		cm_entry->info->handle = &handle->handle;
 
-			memcpy(&cm_entry->data, &conn_req->user_data,
-			       user_data_sz);
-			handle = NULL;
-			conn_req = NULL;
+		memcpy(&cm_entry->data, &conn_req->user_data,
+		       user_data_sz);
+		handle = NULL;
+		conn_req = NULL;
 
-			if (sock_eq_report_event(pep->eq, FI_CONNREQ, cm_entry,
-						 entry_sz, 0))
-				SOCK_LOG_ERROR("Error in writing to EQ\n");
-			break;
-		case SOCK_CONN_ACK:
-			SOCK_LOG_DBG("Received SOCK_CONN_ACK\n");
-			sock_pep_cm_handle_ack(&pep->cm, &conn_req->hdr);
-			break;
+		if (sock_eq_report_event(pep->eq, FI_CONNREQ, cm_entry,
+					 entry_sz, 0))
+			SOCK_LOG_ERROR("Error in writing to EQ\n");
+		break;
+	case SOCK_CONN_ACK:
+		SOCK_LOG_DBG("Received SOCK_CONN_ACK\n");
+		sock_pep_cm_handle_ack(&pep->cm, &conn_req->hdr);
+		break;
 
-		default:
-			SOCK_LOG_ERROR("Invalid event: %d\n", conn_req->hdr.type);
-			goto out;
-		}
+	default:
+		SOCK_LOG_ERROR("Invalid event: %d\n", conn_req->hdr.type);
+		break;
 	}
 
 out:
-	if (conn_req)
-		free(conn_req);
-	if (handle)
-		free(handle);
+	free(conn_req);
+	free(handle);
 	free(cm_entry);
-	ofi_close_socket(pep->cm.sock);
-	return NULL;
-}
-
-static int sock_pep_start_listener_thread(struct sock_pep *pep)
-{
-	if (pthread_create(&pep->cm.listener_thread, NULL,
-			   sock_pep_listener_thread, (void *)pep)) {
-		SOCK_LOG_ERROR("Couldn't create listener thread\n");
-		return -FI_EINVAL;
-	}
-	return 0;
 }
 
 static int sock_pep_listen(struct fid_pep *pep)
 {
 	struct sock_pep *_pep;
 	_pep = container_of(pep, struct sock_pep, pep);
-	if (_pep->cm.listener_thread)
+	if (_pep->cm.handler.reactor)
 		return 0;
 
 	if (!_pep->cm.do_listen && sock_pep_create_listener(_pep)) {
-		SOCK_LOG_ERROR("Failed to create pep thread\n");
+		SOCK_LOG_ERROR("Failed to create pep listener\n");
 		return -FI_EINVAL;
 	}
 
-	return sock_pep_start_listener_thread(_pep);
+	fd_set_nonblock(_pep->cm.sock);
+	_pep->cm.handler.fd = _pep->cm.sock;
+	_pep->cm.handler.ctx = _pep;
+	_pep->cm.handler.handle = sock_pep_cm_handle;
+	_pep->cm.handler.flush = sock_ep_cm_flush;
+	return sock_cm_reactor_add(&_pep->sock_fab->cm_reactor,
+				   &_pep->cm.handler);
 }
 
 static int sock_pep_reject(struct fid_pep *pep, fid_t handle,
@@ -1390,13 +1305,7 @@ int sock_msg_passive_ep(struct fid_fabric *fabric, struct fi_info *info,
 		goto err;
 	}
 
-	ret = socketpair(AF_UNIX, SOCK_STREAM, 0, _pep->cm.signal_fds);
-	if (ret) {
-		ret = -errno;
-		goto err;
-	}
-
-	fd_set_nonblock(_pep->cm.signal_fds[1]);
+	_pep->cm.sock = -1;
 	dlist_init(&_pep->cm.msg_list);
 
 	_pep->pep.fid.fclass = FI_CLASS_PEP;
@@ -1407,6 +1316,7 @@ int sock_msg_passive_ep(struct fid_fabric *fabric, struct fi_info *info,
 	fastlock_init(&_pep->cm.lock);
 
 	_pep->sock_fab = container_of(fabric, struct sock_fabric, fab_fid);
+	atomic_inc(&_pep->sock_fab->ref);
 	*pep = &_pep->pep;
 	return 0;
 err:
@@ -110,6 +110,22 @@ void sock_epoll_close(struct sock_epoll_set *set)
 	close(set->fd);
 }
 
+int sock_epoll_grow(struct sock_epoll_set *set, int size)
+{
+	struct epoll_event *events;
+
+	if (size <= set->size)
+		return 0;
+
+	events = realloc(set->events, size * sizeof(*events));
+	if (!events)
+		return -FI_ENOMEM;
+
+	set->events = events;
+	set->size = size;
+	return 0;
+}
+
 #else
 
 int sock_epoll_create(struct sock_epoll_set *set, int size)
@@ -179,4 +195,20 @@ void sock_epoll_close(struct sock_epoll_set *set)
 	free(set->pollfds);
 }
 
+int sock_epoll_grow(struct sock_epoll_set *set, int size)
+{
+	struct pollfd *pollfds;
+
+	if (size <= set->size)
+		return 0;
+
+	pollfds = realloc(set->pollfds, size * sizeof(*pollfds));
+	if (!pollfds)
+		return -FI_ENOMEM;
+
+	set->pollfds = pollfds;
+	set->size = size;
+	return 0;
+}
+
 #endif
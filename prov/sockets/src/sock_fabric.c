@@ -54,14 +54,24 @@
 #define SOCK_LOG_ERROR(...) _SOCK_LOG_ERROR(FI_LOG_FABRIC, __VA_ARGS__)
 
 int sock_pe_waittime = SOCK_PE_WAITTIME;
+int sock_pe_threads = SOCK_PE_DEF_THREADS;
+int sock_pe_entries = SOCK_PE_DEF_ENTRIES;
 const char sock_fab_name[] = "IP";
 const char sock_dom_name[] = "sockets";
 const char sock_prov_name[] = "sockets";
 int sock_conn_retry = SOCK_CM_DEF_RETRY;
+int sock_conn_max_open = 0;
+int sock_conn_idle_timeout = 0;
 int sock_cm_def_map_sz = SOCK_CMAP_DEF_SZ;
 int sock_av_def_sz = SOCK_AV_DEF_SZ;
 int sock_cq_def_sz = SOCK_CQ_DEF_SZ;
 int sock_eq_def_sz = SOCK_EQ_DEF_SZ;
+int sock_rndv_threshold = SOCK_RNDV_DEF_THRESHOLD;
+int sock_tx_agg_max = SOCK_TX_AGG_DEF_MAX;
+int sock_shm_enabled = 1;
+int sock_shm_ring_sz = SOCK_SHM_DEF_RING_SZ;
+int sock_io_uring_enabled = 0;
+int sock_wait_spin_max = SOCK_WAIT_DEF_SPIN_MAX;
 char *sock_pe_affinity_str = NULL;
 #if ENABLE_DEBUG
 int sock_dgram_drop_rate = 0;
@@ -316,6 +326,7 @@ static int sock_fabric_close(fid_t fid)
 		return -FI_EBUSY;
 
 	sock_fab_remove_from_list(fab);
+	sock_cm_reactor_close(&fab->cm_reactor);
 	fastlock_destroy(&fab->lock);
 	free(fab);
 	return 0;
@@ -333,11 +344,21 @@ static void sock_read_default_params()
 {
 	if (!read_default_params) {
 		fi_param_get_int(&sock_prov, "pe_waittime", &sock_pe_waittime);
+		fi_param_get_int(&sock_prov, "pe_threads", &sock_pe_threads);
+		fi_param_get_int(&sock_prov, "pe_entries", &sock_pe_entries);
 		fi_param_get_int(&sock_prov, "max_conn_retry", &sock_conn_retry);
+		fi_param_get_int(&sock_prov, "max_open_conn", &sock_conn_max_open);
+		fi_param_get_int(&sock_prov, "conn_idle_timeout", &sock_conn_idle_timeout);
 		fi_param_get_int(&sock_prov, "def_conn_map_sz", &sock_cm_def_map_sz);
 		fi_param_get_int(&sock_prov, "def_av_sz", &sock_av_def_sz);
 		fi_param_get_int(&sock_prov, "def_cq_sz", &sock_cq_def_sz);
 		fi_param_get_int(&sock_prov, "def_eq_sz", &sock_eq_def_sz);
+		fi_param_get_int(&sock_prov, "rndv_threshold", &sock_rndv_threshold);
+		fi_param_get_int(&sock_prov, "tx_agg_max", &sock_tx_agg_max);
+		fi_param_get_int(&sock_prov, "shm", &sock_shm_enabled);
+		fi_param_get_int(&sock_prov, "shm_ring_size", &sock_shm_ring_sz);
+		fi_param_get_int(&sock_prov, "io_uring", &sock_io_uring_enabled);
+		fi_param_get_int(&sock_prov, "wait_spin_max", &sock_wait_spin_max);
 		if (fi_param_get_str(&sock_prov, "pe_affinity", &sock_pe_affinity_str) != FI_SUCCESS)
 			sock_pe_affinity_str = NULL;
 #if ENABLE_DEBUG
@@ -358,6 +379,11 @@ static int sock_fabric(struct fi_fabric_attr *attr,
 
 	sock_read_default_params();
 
+	if (sock_cm_reactor_init(&fab->cm_reactor)) {
+		free(fab);
+		return -FI_ENOMEM;
+	}
+
 	fastlock_init(&fab->lock);
 	dlist_init(&fab->service_list);
 
@@ -709,9 +735,25 @@ SOCKETS_INI
 	fi_param_define(&sock_prov, "pe_waittime", FI_PARAM_INT,
 			"How many milliseconds to spin while waiting for progress");
 
+	fi_param_define(&sock_prov, "pe_threads", FI_PARAM_INT,
+			"Number of progress threads per domain in FI_PROGRESS_AUTO mode");
+
+	fi_param_define(&sock_prov, "pe_entries", FI_PARAM_INT,
+			"Number of in-flight operation entries kept allocated "
+			"per progress engine");
+
 	fi_param_define(&sock_prov, "max_conn_retry", FI_PARAM_INT,
 			"Number of connection retries before reporting as failure");
 
+	fi_param_define(&sock_prov, "max_open_conn", FI_PARAM_INT,
+			"Number of open connections per RDM endpoint above which "
+			"the least recently used idle ones are closed (default: "
+			"0, unlimited)");
+
+	fi_param_define(&sock_prov, "conn_idle_timeout", FI_PARAM_INT,
+			"Milliseconds after which an idle RDM connection is "
+			"closed (default: 0, never)");
+
 	fi_param_define(&sock_prov, "def_conn_map_sz", FI_PARAM_INT,
 			"Default connection map size");
 
@@ -724,6 +766,31 @@ SOCKETS_INI
 	fi_param_define(&sock_prov, "def_eq_sz", FI_PARAM_INT,
 			"Default event queue size");
 
+	fi_param_define(&sock_prov, "rndv_threshold", FI_PARAM_INT,
+			"Message size above which sends use the rendezvous protocol");
+
+	fi_param_define(&sock_prov, "tx_agg_max", FI_PARAM_INT,
+			"Largest message, header included, that is packed "
+			"with other small messages to the same peer into one "
+			"socket write, or 0 to disable (default: 256)");
+
+	fi_param_define(&sock_prov, "shm", FI_PARAM_INT,
+			"Use shared memory for RDM connections to peers on the "
+			"same host (default: 1)");
+
+	fi_param_define(&sock_prov, "shm_ring_size", FI_PARAM_INT,
+			"Size in bytes of each direction of a shared memory "
+			"connection (default: 65536)");
+
+	fi_param_define(&sock_prov, "io_uring", FI_PARAM_INT,
+			"Use io_uring for connection I/O where the kernel "
+			"supports it (default: 0)");
+
+	fi_param_define(&sock_prov, "wait_spin_max", FI_PARAM_INT,
+			"Longest time in microseconds that blocking reads and "
+			"waits keep polling under manual progress before "
+			"sleeping, or -1 to never sleep (default: 1000)");
+
 	fi_param_define(&sock_prov, "pe_affinity", FI_PARAM_STRING,
 			"If specified, bind the progress thread to the indicated range(s) of Linux virtual processor ID(s). "
 			"This option is currently not supported on OS X. Usage: id_start[-id_end[:stride]][,]");
@@ -142,8 +142,8 @@ static int sock_poll_poll(struct fid_poll *pollset, void **context, int count)
 						cntr_fid);
 			sock_cntr_progress(cntr);
 			pthread_mutex_lock(&cntr->mut);
-			if (atomic_get(&cntr->value) >=
-				atomic_get(&cntr->threshold)) {
+			if (atomic64_get(&cntr->value) >=
+				atomic64_get(&cntr->threshold)) {
 				*context++ = cntr->cntr_fid.fid.context;
 				ret_count++;
 			}
@@ -51,7 +51,6 @@
 #include <unistd.h>
 #include <pthread.h>
 #include <inttypes.h>
-#include <complex.h>
 #include <arpa/inet.h>
 #include <net/if.h>
 
@@ -61,8 +60,8 @@
 
 #define SOCK_LOG_DBG(...) _SOCK_LOG_DBG(FI_LOG_EP_DATA, __VA_ARGS__)
 #define SOCK_LOG_ERROR(...) _SOCK_LOG_ERROR(FI_LOG_EP_DATA, __VA_ARGS__)
+#define SOCK_LOG_INFO(...) _SOCK_LOG_INFO(FI_LOG_EP_DATA, __VA_ARGS__)
 
-#define PE_INDEX(_pe, _e) (_e - &_pe->pe_table[0])
 #define SOCK_GET_RX_ID(_addr, _bits) (((_bits) == 0) ? 0 : \
 		(((uint64_t)_addr) >> (64 - _bits)))
 
@@ -74,6 +73,7 @@ static inline int sock_pe_is_data_msg(int msg_id)
 	case SOCK_OP_WRITE:
 	case SOCK_OP_READ:
 	case SOCK_OP_ATOMIC:
+	case SOCK_OP_RNDV_DATA:
 		return 1;
 	default:
 		return 0;
@@ -101,6 +101,41 @@ static inline ssize_t sock_pe_send_field(struct sock_pe_entry *pe_entry,
 	return (ret == data_len) ? 0 : -1;
 }
 
+static inline void sock_pe_add_iov(struct iovec *iov, int *iov_cnt,
+				   void *buf, size_t len)
+{
+	iov[*iov_cnt].iov_base = buf;
+	iov[*iov_cnt].iov_len = len;
+	(*iov_cnt)++;
+}
+
+/* Returns 0 once the whole iov stream has been sent */
+static inline ssize_t sock_pe_send_iov(struct sock_pe_entry *pe_entry,
+				       struct iovec *iov, int iov_cnt)
+{
+	ssize_t ret;
+	size_t len = 0;
+	int i;
+
+	for (i = 0; i < iov_cnt; i++)
+		len += iov[i].iov_len;
+
+	if (pe_entry->done_len >= len)
+		return 0;
+
+	if (!pe_entry->done_len && sock_comm_agg(pe_entry, iov, iov_cnt, len)) {
+		pe_entry->done_len = len;
+		return 0;
+	}
+
+	ret = sock_comm_sendv(pe_entry, iov, iov_cnt, pe_entry->done_len);
+	if (ret <= 0)
+		return -1;
+
+	pe_entry->done_len += ret;
+	return (pe_entry->done_len == len) ? 0 : -1;
+}
+
 static inline ssize_t sock_pe_recv_field(struct sock_pe_entry *pe_entry,
 					 void *field, size_t field_len,
 					 size_t start_offset)
@@ -141,25 +176,115 @@ static inline void sock_pe_discard_field(struct sock_pe_entry *pe_entry)
 	}
 }
 
+static struct sock_pe_entry *sock_pe_alloc_entry(struct sock_pe *pe)
+{
+	struct sock_pe_entry *pe_entry;
+	int id;
+
+	if (pe->num_entries >= SOCK_PE_MAX_ENTRIES)
+		return NULL;
+
+	pe_entry = util_buf_alloc(pe->pe_pool);
+	if (!pe_entry)
+		return NULL;
+
+	memset(pe_entry, 0, sizeof(*pe_entry));
+	if (rbinit(&pe_entry->comm_buf, SOCK_PE_COMM_BUFF_SZ))
+		goto err1;
+	pe_entry->cache_sz = SOCK_PE_COMM_BUFF_SZ;
+
+	id = idx_insert(&pe->pe_idx, pe_entry);
+	if (id <= 0)
+		goto err2;
+	if (idm_set(&pe->pe_map, id, pe_entry) < 0)
+		goto err3;
+
+	pe_entry->id = id;
+	pe->num_entries++;
+	pe->num_free_entries++;
+	dlist_insert_head(&pe_entry->entry, &pe->free_list);
+	return pe_entry;
+
+err3:
+	idx_remove(&pe->pe_idx, id);
+err2:
+	rbfree(&pe_entry->comm_buf);
+err1:
+	util_buf_release(pe->pe_pool, pe_entry);
+	return NULL;
+}
+
+static void sock_pe_free_entry(struct sock_pe *pe,
+			       struct sock_pe_entry *pe_entry)
+{
+	dlist_remove(&pe_entry->entry);
+	idm_clear(&pe->pe_map, pe_entry->id);
+	idx_remove(&pe->pe_idx, pe_entry->id);
+	rbfree(&pe_entry->comm_buf);
+	util_buf_release(pe->pe_pool, pe_entry);
+	pe->num_entries--;
+}
+
+/*
+ * Resolve the id a peer echoed back in a response.  It comes off the
+ * wire, so it must name a transmit entry of ours that is still waiting
+ * for a response: sent, or waiting for a rendezvous CTS.
+ */
+static struct sock_pe_entry *sock_pe_lookup_entry(struct sock_pe *pe,
+						  uint16_t id)
+{
+	struct sock_pe_entry *pe_entry;
+
+	pe_entry = id ? idm_lookup(&pe->pe_map, id) : NULL;
+	if (!pe_entry || pe_entry->type != SOCK_PE_TX ||
+	    pe_entry->is_complete ||
+	    (!pe_entry->pe.tx.send_done &&
+	     pe_entry->pe.tx.rndv_state != SOCK_RNDV_WAIT_CTS)) {
+		SOCK_LOG_ERROR("No request waiting for response (index: %d)\n",
+			       id);
+		return NULL;
+	}
+	return pe_entry;
+}
+
+/* Skip the rest of a response that no request is waiting for */
+static void sock_pe_discard_response(struct sock_pe_entry *pe_entry)
+{
+	pe_entry->is_error = 1;
+	pe_entry->rem = pe_entry->total_len - pe_entry->done_len;
+	pe_entry->done_len = pe_entry->total_len;
+}
+
+static inline int sock_pe_entry_avail(struct sock_pe *pe)
+{
+	return !dlist_empty(&pe->free_list) ||
+		pe->num_entries < SOCK_PE_MAX_ENTRIES;
+}
+
 static void sock_pe_release_entry(struct sock_pe *pe,
 				  struct sock_pe_entry *pe_entry)
 {
 	dlist_remove(&pe_entry->ctx_entry);
 
+	pe_entry->conn->pe_ref--;
 	if (pe_entry->conn->tx_pe_entry == pe_entry)
 		pe_entry->conn->tx_pe_entry = NULL;
 	if (pe_entry->conn->rx_pe_entry == pe_entry)
 		pe_entry->conn->rx_pe_entry = NULL;
 
+	if (pe_entry->type == SOCK_PE_TX && pe_entry->pe.tx.ack_seq)
+		dlist_remove(&pe_entry->pe.tx.ack_entry);
+
 	if (pe_entry->type == SOCK_PE_RX && pe_entry->pe.rx.atomic_cmp) {
 		util_buf_release(pe->atomic_rx_pool, pe_entry->pe.rx.atomic_cmp);
 		util_buf_release(pe->atomic_rx_pool, pe_entry->pe.rx.atomic_src);
 	}
 
-	if (pe_entry->is_pool_entry) {
-		rbfree(&pe_entry->comm_buf);
-		dlist_remove(&pe_entry->entry);
-		util_buf_release(pe->pe_rx_pool, pe_entry);
+	/* shrink back once a burst has drained */
+	if (pe->num_entries > sock_pe_entries &&
+	    pe->num_free_entries >= pe->num_entries / 2) {
+		sock_pe_free_entry(pe, pe_entry);
+		SOCK_LOG_DBG("progress entry %p freed\n", pe_entry);
 		return;
 	}
 
@@ -187,31 +312,27 @@ static void sock_pe_release_entry(struct sock_pe *pe,
 	SOCK_LOG_DBG("progress entry %p released\n", pe_entry);
 }
 
+/* The table grows on demand, up to the 16-bit id space of the wire */
 static struct sock_pe_entry *sock_pe_acquire_entry(struct sock_pe *pe)
 {
 	struct dlist_entry *entry;
 	struct sock_pe_entry *pe_entry;
 
-	if (dlist_empty(&pe->free_list)) {
-		pe_entry = util_buf_alloc(pe->pe_rx_pool);
-		SOCK_LOG_DBG("Getting rx pool entry\n");
-		if (pe_entry) {
-			memset(pe_entry, 0, sizeof(*pe_entry));
-			pe_entry->is_pool_entry = 1;
-			if (rbinit(&pe_entry->comm_buf, SOCK_PE_OVERFLOW_COMM_BUFF_SZ))
-				SOCK_LOG_ERROR("failed to init comm-cache\n");
-			pe_entry->cache_sz = SOCK_PE_OVERFLOW_COMM_BUFF_SZ;
-			dlist_insert_tail(&pe_entry->entry, &pe->pool_list);
-		}
-	} else {
-		pe->num_free_entries--;
-		entry = pe->free_list.next;
-		pe_entry = container_of(entry, struct sock_pe_entry, entry);
-		dlist_remove(&pe_entry->entry);
-		dlist_insert_tail(&pe_entry->entry, &pe->busy_list);
-		SOCK_LOG_DBG("progress entry %p acquired : %lu\n", pe_entry,
-			     PE_INDEX(pe, pe_entry));
+	if (dlist_empty(&pe->free_list) && !sock_pe_alloc_entry(pe)) {
+		SOCK_LOG_DBG("No free progress entry (%d in use)\n",
+			     pe->num_entries);
+		return NULL;
 	}
+
+	pe->num_free_entries--;
+	entry = pe->free_list.next;
+	pe_entry = container_of(entry, struct sock_pe_entry, entry);
+	dlist_remove(&pe_entry->entry);
+	dlist_insert_tail(&pe_entry->entry, &pe->busy_list);
+	pe->max_used_entries = MAX(pe->max_used_entries,
+				   pe->num_entries - pe->num_free_entries);
+	SOCK_LOG_DBG("progress entry %p acquired : %d\n", pe_entry,
+		     pe_entry->id);
 	return pe_entry;
 }
 
@@ -282,9 +403,7 @@ static void sock_pe_report_mr_completion(struct sock_domain *domain,
 	struct sock_mr *mr;
 
 	for (i = 0; i < pe_entry->msg_hdr.dest_iov_len; i++) {
-		fastlock_acquire(&domain->lock);
 		mr = sock_mr_get_entry(domain, pe_entry->pe.rx.rx_iov[i].iov.key);
-		fastlock_release(&domain->lock);
 		if (!mr || (!mr->cq && !mr->cntr))
 			continue;
 
@@ -355,6 +474,15 @@ static void sock_pe_report_rx_error(struct sock_pe_entry *pe_entry, int rem)
 				     FI_ETRUNC, -FI_ETRUNC, NULL);
 }
 
+static void sock_pe_report_rx_abort(struct sock_pe_entry *pe_entry, int err)
+{
+	if (pe_entry->comp->recv_cntr)
+		sock_cntr_err_inc(pe_entry->comp->recv_cntr);
+	if (pe_entry->comp->recv_cq)
+		sock_cq_report_error(pe_entry->comp->recv_cq, pe_entry, 0,
+				     err, -err, NULL);
+}
+
 static void sock_pe_report_tx_rma_read_err(struct sock_pe_entry *pe_entry,
 						int err)
 {
@@ -375,6 +503,32 @@ static void sock_pe_report_tx_rma_write_err(struct sock_pe_entry *pe_entry,
 				     err, -err, NULL);
 }
 
+static void sock_pe_report_tx_error(struct sock_pe_entry *pe_entry, int err)
+{
+	switch (pe_entry->msg_hdr.op_type) {
+	case SOCK_OP_SEND:
+	case SOCK_OP_TSEND:
+		if (pe_entry->comp->send_cntr)
+			sock_cntr_err_inc(pe_entry->comp->send_cntr);
+		break;
+	case SOCK_OP_WRITE:
+	case SOCK_OP_ATOMIC:
+		if (pe_entry->comp->write_cntr)
+			sock_cntr_err_inc(pe_entry->comp->write_cntr);
+		break;
+	case SOCK_OP_READ:
+		if (pe_entry->comp->read_cntr)
+			sock_cntr_err_inc(pe_entry->comp->read_cntr);
+		break;
+	default:
+		return;
+	}
+
+	if (pe_entry->comp->send_cq)
+		sock_cq_report_error(pe_entry->comp->send_cq, pe_entry, 0,
+				     err, -err, NULL);
+}
+
 static void sock_pe_progress_pending_ack(struct sock_pe *pe,
 					 struct sock_pe_entry *pe_entry)
 {
@@ -423,6 +577,13 @@ static void sock_pe_progress_pending_ack(struct sock_pe *pe,
 		}
 		break;
 
+	case SOCK_OP_RNDV_CTS:
+		if (sock_pe_send_field(pe_entry, &pe_entry->pe.rx.rndv_id,
+				       sizeof(uint64_t), len))
+			return;
+		len += sizeof(uint64_t);
+		break;
+
 	default:
 		break;
 	}
@@ -493,18 +654,100 @@ static int sock_pe_handle_ack(struct sock_pe *pe,
 		return 0;
 
 	response = &pe_entry->response;
-	assert(response->pe_entry_id <= SOCK_PE_MAX_ENTRIES);
-	waiting_entry = &pe->pe_table[response->pe_entry_id];
+	waiting_entry = sock_pe_lookup_entry(pe, response->pe_entry_id);
+	if (!waiting_entry) {
+		sock_pe_discard_response(pe_entry);
+		return 0;
+	}
 	SOCK_LOG_DBG("Received ack for PE entry %p (index: %d)\n",
 		      waiting_entry, response->pe_entry_id);
 
-	assert(waiting_entry->type == SOCK_PE_TX);
 	sock_pe_report_send_completion(waiting_entry);
 	waiting_entry->is_complete = 1;
 	pe_entry->is_complete = 1;
 	return 0;
 }
 
+/* Complete our sends the peer has received, up to its running count */
+static int sock_pe_handle_send_ack(struct sock_pe *pe,
+				   struct sock_pe_entry *pe_entry)
+{
+	struct sock_pe_entry *waiting_entry;
+	struct sock_conn *conn = pe_entry->conn;
+	uint64_t seq;
+
+	if (sock_pe_recv_field(pe_entry, &pe_entry->pe.rx.ack_seq,
+			       sizeof(uint64_t), sizeof(struct sock_msg_hdr)))
+		return 0;
+
+	seq = ntohll(pe_entry->pe.rx.ack_seq);
+	SOCK_LOG_DBG("Received ack up to %" PRIu64 " on conn %p\n", seq, conn);
+
+	while (!dlist_empty(&conn->tx_ack_list)) {
+		waiting_entry = container_of(conn->tx_ack_list.next,
+					     struct sock_pe_entry,
+					     pe.tx.ack_entry);
+		if (waiting_entry->pe.tx.ack_seq > seq)
+			break;
+
+		dlist_remove(&waiting_entry->pe.tx.ack_entry);
+		waiting_entry->pe.tx.ack_seq = 0;
+		sock_pe_report_send_completion(waiting_entry);
+		waiting_entry->is_complete = 1;
+	}
+	pe_entry->is_complete = 1;
+	return 0;
+}
+
+/* The receiver matched a rendezvous send: turn it into the data transfer */
+static int sock_pe_handle_rndv_cts(struct sock_pe *pe,
+				   struct sock_pe_entry *pe_entry)
+{
+	struct sock_pe_entry *waiting_entry;
+	struct sock_msg_response *response;
+	struct sock_msg_hdr *msg_hdr;
+
+	if (sock_pe_read_response(pe_entry))
+		return 0;
+
+	if (sock_pe_recv_field(pe_entry, &pe_entry->pe.rx.rndv_id,
+			       sizeof(uint64_t),
+			       sizeof(struct sock_msg_response)))
+		return 0;
+
+	response = &pe_entry->response;
+	waiting_entry = sock_pe_lookup_entry(pe, response->pe_entry_id);
+	if (!waiting_entry) {
+		sock_pe_discard_response(pe_entry);
+		return 0;
+	}
+	SOCK_LOG_DBG("Received CTS for PE entry %p (index: %d)\n",
+		      waiting_entry, response->pe_entry_id);
+
+	if (waiting_entry->pe.tx.rndv_state != SOCK_RNDV_WAIT_CTS ||
+	    waiting_entry->conn != pe_entry->conn) {
+		SOCK_LOG_ERROR("Unexpected CTS for PE entry %p (index: %d)\n",
+			       waiting_entry, response->pe_entry_id);
+		sock_pe_discard_response(pe_entry);
+		return 0;
+	}
+
+	/* rndv_id is echoed back as received, in network order */
+	waiting_entry->pe.tx.rndv_id = pe_entry->pe.rx.rndv_id;
+	waiting_entry->total_len = sizeof(struct sock_msg_rndv_data) +
+				   waiting_entry->data_len;
+	waiting_entry->done_len = 0;
+
+	msg_hdr = &waiting_entry->msg_hdr;
+	msg_hdr->op_type = SOCK_OP_RNDV_DATA;
+	msg_hdr->flags = htonll(waiting_entry->flags);
+	msg_hdr->msg_len = htonll(waiting_entry->total_len);
+	waiting_entry->pe.tx.rndv_state = SOCK_RNDV_SEND_DATA;
+
+	pe_entry->is_complete = 1;
+	return 0;
+}
+
 static int sock_pe_handle_error(struct sock_pe *pe,
 				struct sock_pe_entry *pe_entry)
 {
@@ -515,12 +758,14 @@ static int sock_pe_handle_error(struct sock_pe *pe,
 		return 0;
 
 	response = &pe_entry->response;
-	assert(response->pe_entry_id <= SOCK_PE_MAX_ENTRIES);
-	waiting_entry = &pe->pe_table[response->pe_entry_id];
+	waiting_entry = sock_pe_lookup_entry(pe, response->pe_entry_id);
+	if (!waiting_entry) {
+		sock_pe_discard_response(pe_entry);
+		return 0;
+	}
 	SOCK_LOG_ERROR("Received error for PE entry %p (index: %d)\n",
 		      waiting_entry, response->pe_entry_id);
 
-	assert(waiting_entry->type == SOCK_PE_TX);
 
 	switch (pe_entry->msg_hdr.op_type) {
 	case SOCK_OP_READ_ERROR:
@@ -551,13 +796,14 @@ static int sock_pe_handle_read_complete(struct sock_pe *pe,
 		return 0;
 
 	response = &pe_entry->response;
-	assert(response->pe_entry_id <= SOCK_PE_MAX_ENTRIES);
-	waiting_entry = &pe->pe_table[response->pe_entry_id];
+	waiting_entry = sock_pe_lookup_entry(pe, response->pe_entry_id);
+	if (!waiting_entry) {
+		sock_pe_discard_response(pe_entry);
+		return 0;
+	}
 	SOCK_LOG_DBG("Received read complete for PE entry %p (index: %d)\n",
 		      waiting_entry, response->pe_entry_id);
 
-	waiting_entry = &pe->pe_table[response->pe_entry_id];
-	assert(waiting_entry->type == SOCK_PE_TX);
 
 	len = sizeof(struct sock_msg_response);
 	for (i = 0; i < waiting_entry->pe.tx.tx_op.dest_iov_len; i++) {
@@ -585,12 +831,14 @@ static int sock_pe_handle_write_complete(struct sock_pe *pe,
 		return 0;
 
 	response = &pe_entry->response;
-	assert(response->pe_entry_id <= SOCK_PE_MAX_ENTRIES);
-	waiting_entry = &pe->pe_table[response->pe_entry_id];
+	waiting_entry = sock_pe_lookup_entry(pe, response->pe_entry_id);
+	if (!waiting_entry) {
+		sock_pe_discard_response(pe_entry);
+		return 0;
+	}
 	SOCK_LOG_DBG("Received ack for PE entry %p (index: %d)\n",
 		      waiting_entry, response->pe_entry_id);
 
-	assert(waiting_entry->type == SOCK_PE_TX);
 	sock_pe_report_write_completion(waiting_entry);
 	waiting_entry->is_complete = 1;
 	pe_entry->is_complete = 1;
@@ -609,13 +857,14 @@ static int sock_pe_handle_atomic_complete(struct sock_pe *pe,
 		return 0;
 
 	response = &pe_entry->response;
-	assert(response->pe_entry_id <= SOCK_PE_MAX_ENTRIES);
-	waiting_entry = &pe->pe_table[response->pe_entry_id];
+	waiting_entry = sock_pe_lookup_entry(pe, response->pe_entry_id);
+	if (!waiting_entry) {
+		sock_pe_discard_response(pe_entry);
+		return 0;
+	}
 	SOCK_LOG_DBG("Received atomic complete for PE entry %p (index: %d)\n",
 		      waiting_entry, response->pe_entry_id);
 
-	waiting_entry = &pe->pe_table[response->pe_entry_id];
-	assert(waiting_entry->type == SOCK_PE_TX);
 
 	len = sizeof(struct sock_msg_response);
 	datatype_sz = fi_datatype_size(waiting_entry->pe.tx.tx_op.atomic.datatype);
@@ -763,396 +1012,11 @@ out:
 	return ret;
 }
 
-#define SOCK_ATOMIC_UPDATE_INT(_cmp, _src, _dst, _tmp) do {		\
-	switch (op) {							\
-	case FI_MIN:							\
-		*_cmp = *_dst;						\
-		if (*_src < *_dst)					\
-			*_dst = *_src;					\
-		break;							\
-									\
-	case FI_MAX:							\
-		*_cmp = *_dst;						\
-		if (*_src > *_dst)					\
-			*_dst = *_src;					\
-		break;							\
-									\
-	case FI_SUM:							\
-		*_cmp = *_dst;						\
-		*_dst = *_dst + *_src;					\
-		break;							\
-									\
-	case FI_PROD:							\
-		*_cmp = *_dst;						\
-		*_dst = *_dst * *_src;					\
-		break;							\
-									\
-	case FI_LOR:							\
-		*_cmp = *_dst;						\
-		*_dst = *_dst || *_src;					\
-		break;							\
-									\
-	case FI_LAND:							\
-		*_cmp = *_dst;						\
-		*_dst = *_dst && *_src;					\
-		break;							\
-									\
-	case FI_BOR:							\
-		*_cmp = *_dst;						\
-		*_dst = *_dst | *_src;					\
-		break;							\
-									\
-	case FI_BAND:							\
-		*_cmp = *_dst;						\
-		*_dst = *_dst & *_src;					\
-		break;							\
-									\
-	case FI_LXOR:							\
-		*_cmp = *_dst;						\
-									\
-		*_dst = ((*_dst && !*_src) || (!*_dst && *_src));	\
-		break;							\
-									\
-	case FI_BXOR:							\
-		*_cmp = *_dst;						\
-		*_dst = *_dst ^ *_src;					\
-		break;							\
-									\
-	case FI_ATOMIC_READ:						\
-		*_cmp = *_dst;						\
-		break;							\
-									\
-	case FI_ATOMIC_WRITE:						\
-		*_cmp = *_dst;						\
-		*_dst = *_src;						\
-		break;							\
-									\
-	case FI_CSWAP:							\
-		if (*_cmp == *_dst)					\
-			*_dst = *_src;					\
-		else							\
-			*_cmp = *_dst;					\
-		break;							\
-									\
-	case FI_CSWAP_NE:						\
-		_tmp = *_dst;						\
-		if (*_cmp != *_dst)					\
-			*_dst = *_src;					\
-		*_cmp = _tmp;						\
-		break;							\
-									\
-	case FI_CSWAP_LE:						\
-		_tmp = *_dst;						\
-		if (*_cmp <= *_dst)					\
-			*_dst = *_src;					\
-		*_cmp = _tmp;						\
-		break;							\
-									\
-	case FI_CSWAP_LT:						\
-		_tmp = *_dst;						\
-		if (*_cmp < *_dst)					\
-			*_dst = *_src;					\
-		*_cmp = _tmp;						\
-		break;							\
-									\
-	case FI_CSWAP_GE:						\
-		_tmp = *_dst;						\
-		if (*_cmp >= *_dst)					\
-			*_dst = *_src;					\
-		*_cmp = _tmp;						\
-		break;							\
-									\
-	case FI_CSWAP_GT:						\
-		_tmp = *_dst;						\
-		if (*_cmp > *_dst)					\
-			*_dst = *_src;					\
-		*_cmp = _tmp;						\
-		break;							\
-									\
-	case FI_MSWAP:							\
-		_tmp = *_dst;						\
-		*_dst = (*_src & *_cmp) | (*_dst & ~(*_cmp));		\
-		*_cmp = _tmp;						\
-		break;							\
-									\
-	default:							\
-		SOCK_LOG_ERROR("Atomic operation type not supported\n"); \
-		break;							\
-	}								\
-} while (0)
-
-#define SOCK_ATOMIC_UPDATE_FLOAT(_cmp, _src, _dst) do {			\
-	switch (op) {							\
-	case FI_MIN:							\
-		*_cmp = *_dst;						\
-		if (*_src < *_dst)					\
-			*_dst = *_src;					\
-		break;							\
-									\
-	case FI_MAX:							\
-		*_cmp = *_dst;						\
-		if (*_src > *_dst)					\
-			*_dst = *_src;					\
-		break;							\
-									\
-	case FI_SUM:							\
-		*_cmp = *_dst;						\
-		*_dst = *_dst + *_src;					\
-		break;							\
-									\
-	case FI_PROD:							\
-		*_cmp = *_dst;						\
-		*_dst = *_dst * *_src;					\
-		break;							\
-									\
-	case FI_LOR:							\
-		*_cmp = *_dst;						\
-		*_dst = *_dst || *_src;					\
-		break;							\
-									\
-	case FI_LAND:							\
-		*_cmp = *_dst;						\
-		*_dst = *_dst && *_src;					\
-		break;							\
-									\
-	case FI_ATOMIC_READ:						\
-		*_cmp = *_dst;						\
-		break;							\
-									\
-	case FI_ATOMIC_WRITE:						\
-		*_cmp = *_dst;						\
-		*_dst = *_src;						\
-		break;							\
-									\
-	case FI_CSWAP:							\
-		if (*_cmp == *_dst)					\
-			*_dst = *_src;					\
-		else							\
-			*_cmp = *_dst;					\
-		break;							\
-									\
-	case FI_CSWAP_NE:						\
-		_tmp = *_dst;						\
-		if (*_cmp != *_dst)					\
-			*_dst = *_src;					\
-		*_cmp = _tmp;						\
-		break;							\
-									\
-	case FI_CSWAP_LE:						\
-		_tmp = *_dst;						\
-		if (*_cmp <= *_dst)					\
-			*_dst = *_src;					\
-		*_cmp = _tmp;						\
-		break;							\
-									\
-	case FI_CSWAP_LT:						\
-		_tmp = *_dst;						\
-		if (*_cmp < *_dst)					\
-			*_dst = *_src;					\
-		*_cmp = _tmp;						\
-		break;							\
-									\
-	case FI_CSWAP_GE:						\
-		_tmp = *_dst;						\
-		if (*_cmp >= *_dst)					\
-			*_dst = *_src;					\
-		*_cmp = _tmp;						\
-		break;							\
-									\
-	case FI_CSWAP_GT:						\
-		_tmp = *_dst;						\
-		if (*_cmp > *_dst)					\
-			*_dst = *_src;					\
-		*_cmp = _tmp;						\
-		break;							\
-									\
-	default:							\
-		SOCK_LOG_ERROR("Atomic operation type not supported\n"); \
-		break;							\
-	}								\
-} while (0)
-
-#define SOCK_ATOMIC_UPDATE_COMPLEX(_cmp, _src, _dst) do {		\
-	switch (op) {							\
-	case FI_SUM:							\
-		*_cmp = *_dst;						\
-		*_dst = *_dst + *_src;					\
-		break;							\
-									\
-	case FI_PROD:							\
-		*_cmp = *_dst;						\
-		*_dst = *_dst * *_src;					\
-		break;							\
-									\
-	case FI_LOR:							\
-		*_cmp = *_dst;						\
-		*_dst = *_dst || *_src;					\
-		break;							\
-									\
-	case FI_LAND:							\
-		*_cmp = *_dst;						\
-		*_dst = *_dst && *_src;					\
-		break;							\
-									\
-	case FI_ATOMIC_READ:						\
-		*_cmp = *_dst;						\
-		break;							\
-									\
-	case FI_ATOMIC_WRITE:						\
-		*_cmp = *_dst;						\
-		*_dst = *_src;						\
-		break;							\
-									\
-	case FI_CSWAP:							\
-		if (*_cmp == *_dst)					\
-			*_dst = *_src;					\
-		else							\
-			*_cmp = *_dst;					\
-		break;							\
-									\
-	case FI_CSWAP_NE:						\
-		_tmp = *_dst;						\
-		if (*_cmp != *_dst)					\
-			*_dst = *_src;					\
-		*_cmp = _tmp;						\
-		break;							\
-									\
-	default:							\
-		SOCK_LOG_ERROR("Atomic operation type not supported\n");\
-		break;							\
-	}								\
-} while (0)
-
-
-static int sock_pe_update_atomic(void *cmp, void *dst, void *src,
-				 enum fi_datatype datatype, enum fi_op op)
-{
-	switch (datatype) {
-	case FI_INT8:
-	{
-		int8_t *_cmp, *_dst, *_src, _tmp;
-		_cmp = cmp, _src = src, _dst = dst;
-		SOCK_ATOMIC_UPDATE_INT(_cmp, _src, _dst, _tmp);
-		break;
-	}
-
-	case FI_UINT8:
-	{
-		uint8_t *_cmp, *_dst, *_src, _tmp;
-		_cmp = cmp, _src = src, _dst = dst;
-		SOCK_ATOMIC_UPDATE_INT(_cmp, _src, _dst, _tmp);
-		break;
-	}
-
-	case FI_INT16:
-	{
-		int16_t *_cmp, *_dst, *_src, _tmp;
-		_cmp = cmp, _src = src, _dst = dst;
-		SOCK_ATOMIC_UPDATE_INT(_cmp, _src, _dst, _tmp);
-		break;
-	}
-
-	case FI_UINT16:
-	{
-		uint16_t *_cmp, *_dst, *_src, _tmp;
-		_cmp = cmp, _src = src, _dst = dst;
-		SOCK_ATOMIC_UPDATE_INT(_cmp, _src, _dst, _tmp);
-		break;
-	}
-
-	case FI_INT32:
-	{
-		int32_t *_cmp, *_dst, *_src, _tmp;
-		_cmp = cmp, _src = src, _dst = dst;
-		SOCK_ATOMIC_UPDATE_INT(_cmp, _src, _dst, _tmp);
-		break;
-	}
-
-	case FI_UINT32:
-	{
-		uint32_t *_cmp, *_dst, *_src, _tmp;
-		_cmp = cmp, _src = src, _dst = dst;
-		SOCK_ATOMIC_UPDATE_INT(_cmp, _src, _dst, _tmp);
-		break;
-	}
-
-	case FI_INT64:
-	{
-		int64_t *_cmp, *_dst, *_src, _tmp;
-		_cmp = cmp, _src = src, _dst = dst;
-		SOCK_ATOMIC_UPDATE_INT(_cmp, _src, _dst, _tmp);
-		break;
-	}
-
-	case FI_UINT64:
-	{
-		uint64_t *_cmp, *_dst, *_src, _tmp;
-		_cmp = cmp, _src = src, _dst = dst;
-		SOCK_ATOMIC_UPDATE_INT(_cmp, _src, _dst, _tmp);
-		break;
-	}
-
-	case FI_FLOAT:
-	{
-		float *_cmp, *_dst, *_src, _tmp;
-		_cmp = cmp, _src = src, _dst = dst;
-		SOCK_ATOMIC_UPDATE_FLOAT(_cmp, _src, _dst);
-		break;
-	}
-
-	case FI_DOUBLE:
-	{
-		double *_cmp, *_dst, *_src, _tmp;
-		_cmp = cmp, _src = src, _dst = dst;
-		SOCK_ATOMIC_UPDATE_FLOAT(_cmp, _src, _dst);
-		break;
-	}
-
-	case FI_LONG_DOUBLE:
-	{
-		long double *_cmp, *_dst, *_src, _tmp;
-		_cmp = cmp, _src = src, _dst = dst;
-		SOCK_ATOMIC_UPDATE_FLOAT(_cmp, _src, _dst);
-		break;
-	}
-
-	case FI_DOUBLE_COMPLEX:
-	{
-		double complex *_cmp, *_dst, *_src, _tmp;
-		_cmp = cmp, _src = src, _dst = dst;
-		SOCK_ATOMIC_UPDATE_COMPLEX(_cmp, _src, _dst);
-		break;
-	}
-
-	case FI_FLOAT_COMPLEX:
-	{
-		float complex *_cmp, *_dst, *_src, _tmp;
-		_cmp = cmp, _src = src, _dst = dst;
-		SOCK_ATOMIC_UPDATE_COMPLEX(_cmp, _src, _dst);
-		break;
-	}
-
-	case FI_LONG_DOUBLE_COMPLEX:
-	{
-		long double complex *_cmp, *_dst, *_src, _tmp;
-		_cmp = cmp, _src = src, _dst = dst;
-		SOCK_ATOMIC_UPDATE_COMPLEX(_cmp, _src, _dst);
-		break;
-	}
-
-	default:
-		SOCK_LOG_ERROR("Atomic datatype not supported\n");
-		break;
-	}
-	return 0;
-}
-
-
 static int sock_pe_process_rx_atomic(struct sock_pe *pe,
 				struct sock_rx_ctx *rx_ctx,
 				struct sock_pe_entry *pe_entry)
 {
-	int i, j, ret = 0;
+	int i, ret = 0;
 	size_t datatype_sz;
 	struct sock_mr *mr;
 	uint64_t offset, len, entry_len;
@@ -1238,14 +1102,13 @@ static int sock_pe_process_rx_atomic(struct sock_pe *pe,
 
 	offset = 0;
 	for (i = 0; i < pe_entry->pe.rx.rx_op.dest_iov_len; i++) {
-		for (j = 0; j < pe_entry->pe.rx.rx_iov[i].ioc.count; j++) {
-			sock_pe_update_atomic(pe_entry->pe.rx.atomic_cmp + offset,
-					      (char *) (uintptr_t) pe_entry->pe.rx.rx_iov[i].ioc.addr + j * datatype_sz,
-					      pe_entry->pe.rx.atomic_src + offset,
-					      pe_entry->pe.rx.rx_op.atomic.datatype,
-					      pe_entry->pe.rx.rx_op.atomic.op);
-			offset += datatype_sz;
-		}
+		sock_atomic_update(pe_entry->pe.rx.atomic_cmp + offset,
+				   (void *) (uintptr_t) pe_entry->pe.rx.rx_iov[i].ioc.addr,
+				   pe_entry->pe.rx.atomic_src + offset,
+				   pe_entry->pe.rx.rx_iov[i].ioc.count,
+				   pe_entry->pe.rx.rx_op.atomic.datatype,
+				   pe_entry->pe.rx.rx_op.atomic.op);
+		offset += pe_entry->pe.rx.rx_iov[i].ioc.count * datatype_sz;
 	}
 
 	pe_entry->buf = pe_entry->pe.rx.rx_iov[0].iov.addr;
@@ -1264,6 +1127,52 @@ static int sock_pe_process_rx_atomic(struct sock_pe *pe,
 	return ret;
 }
 
+/*
+ * Bind a rendezvous message to the receive buffer described by iov,
+ * starting offset bytes in, and queue a request for its data.  The data
+ * is received directly into the buffer; nothing is reported until it
+ * arrives.  With FI_DISCARD the data is dropped silently.  Returns how
+ * much of the buffer the message will use.  Must hold rx_ctx->lock.
+ */
+static size_t sock_rx_rndv_bind(struct sock_rx_ctx *rx_ctx,
+				struct sock_rx_entry *rx_rndv,
+				const union sock_iov *iov, size_t iov_count,
+				size_t offset, uint64_t context, uint64_t flags)
+{
+	size_t i, len, rem = rx_rndv->total_len;
+	int cnt = 0;
+
+	for (i = 0; i < iov_count && rem > 0; i++) {
+		if (offset >= iov[i].iov.len) {
+			offset -= iov[i].iov.len;
+			continue;
+		}
+
+		len = MIN(iov[i].iov.len - offset, rem);
+		rx_rndv->iov[cnt].iov.addr = iov[i].iov.addr + offset;
+		rx_rndv->iov[cnt].iov.len = len;
+		cnt++;
+		rem -= len;
+		offset = 0;
+	}
+
+	rx_rndv->rx_op.dest_iov_len = cnt;
+	rx_rndv->context = context;
+	rx_rndv->flags = (rx_rndv->flags & FI_REMOTE_CQ_DATA) | flags |
+			 FI_MSG | FI_RECV;
+	if (rx_rndv->is_tagged)
+		rx_rndv->flags |= FI_TAGGED;
+
+	rx_rndv->rndv_id = rx_ctx->rndv_seq++;
+	rx_rndv->rndv_state = SOCK_RNDV_SEND_CTS;
+	sock_rx_dequeue_entry(rx_ctx, rx_rndv);
+	dlist_insert_tail(&rx_rndv->entry, &rx_ctx->rx_rndv_list);
+
+	/* the CTS is sent by the progress engine, which may be asleep */
+	sock_pe_signal(sock_rx_ctx_pe(rx_ctx));
+	return rx_rndv->total_len - rem;
+}
+
 ssize_t sock_rx_peek_recv(struct sock_rx_ctx *rx_ctx, fi_addr_t addr,
 			  uint64_t tag, uint64_t ignore, void *context,
 			  uint64_t flags, uint8_t is_tagged)
@@ -1292,8 +1201,11 @@ ssize_t sock_rx_peek_recv(struct sock_rx_ctx *rx_ctx, fi_addr_t addr,
 		if (flags & FI_CLAIM)
 			rx_buffered->is_claimed = 1;
 
-		if (flags & FI_DISCARD) {
-			dlist_remove(&rx_buffered->entry);
+		if ((flags & FI_DISCARD) && rx_buffered->rndv_state) {
+			sock_rx_rndv_bind(rx_ctx, rx_buffered, NULL, 0, 0,
+					  (uintptr_t)context, FI_DISCARD);
+		} else if (flags & FI_DISCARD) {
+			sock_rx_dequeue_entry(rx_ctx, rx_buffered);
 			sock_rx_release_entry(rx_buffered);
 		}
 		sock_pe_report_recv_completion(&pe_entry);
@@ -1315,6 +1227,7 @@ ssize_t sock_rx_claim_recv(struct sock_rx_ctx *rx_ctx, void *context,
 	struct dlist_entry *entry;
 	struct sock_pe_entry pe_entry;
 	struct sock_rx_entry *rx_buffered = NULL;
+	union sock_iov rx_iov[SOCK_EP_MAX_IOV_LIMIT];
 
 	fastlock_acquire(&rx_ctx->lock);
 	for (entry = rx_ctx->rx_buffered_list.next;
@@ -1340,6 +1253,21 @@ ssize_t sock_rx_claim_recv(struct sock_rx_ctx *rx_ctx, void *context,
 		if (is_tagged)
 			pe_entry.flags |= FI_TAGGED;
 
+		if (rx_buffered->rndv_state) {
+			if (flags & FI_DISCARD) {
+				sock_pe_report_recv_completion(&pe_entry);
+				iov_count = 0;
+			}
+			for (i = 0; i < iov_count; i++) {
+				rx_iov[i].iov.addr = (uintptr_t) msg_iov[i].iov_base;
+				rx_iov[i].iov.len = msg_iov[i].iov_len;
+			}
+			sock_rx_rndv_bind(rx_ctx, rx_buffered, rx_iov, iov_count,
+					  0, rx_buffered->context, flags);
+			fastlock_release(&rx_ctx->lock);
+			return 0;
+		}
+
 		if (!(flags & FI_DISCARD)) {
 			pe_entry.buf = (uintptr_t)msg_iov[0].iov_base;
 			offset = 0;
@@ -1361,7 +1289,7 @@ ssize_t sock_rx_claim_recv(struct sock_rx_ctx *rx_ctx, void *context,
 			sock_pe_report_recv_completion(&pe_entry);
 		}
 
-		dlist_remove(&rx_buffered->entry);
+		sock_rx_dequeue_entry(rx_ctx, rx_buffered);
 		sock_rx_release_entry(rx_buffered);
 	} else {
 		ret = -FI_ENOMSG;
@@ -1371,99 +1299,403 @@ ssize_t sock_rx_claim_recv(struct sock_rx_ctx *rx_ctx, void *context,
 	return ret;
 }
 
-static int sock_pe_progress_buffered_rx(struct sock_rx_ctx *rx_ctx)
+/* Returns 1 if the posted entry remains posted (multi-recv) */
+static int sock_pe_consume_buffered(struct sock_rx_ctx *rx_ctx,
+				    struct sock_rx_entry *rx_buffered,
+				    struct sock_rx_entry *rx_posted)
 {
-	struct dlist_entry *entry;
 	struct sock_pe_entry pe_entry;
-	struct sock_rx_entry *rx_buffered, *rx_posted;
 	size_t i, rem = 0, offset, len, used_len, dst_offset;
 
-	if (dlist_empty(&rx_ctx->rx_entry_list) ||
-	    dlist_empty(&rx_ctx->rx_buffered_list))
-		return 0;
-
-	for (entry = rx_ctx->rx_buffered_list.next;
-	     entry != &rx_ctx->rx_buffered_list;) {
-
-		rx_buffered = container_of(entry, struct sock_rx_entry, entry);
-		entry = entry->next;
-
-		if (!rx_buffered->is_complete || rx_buffered->is_claimed)
-			continue;
+	SOCK_LOG_DBG("Consuming buffered entry: %p, ctx: %p\n",
+		      rx_buffered, rx_ctx);
+	SOCK_LOG_DBG("Consuming posted entry: %p, ctx: %p\n",
+		      rx_posted, rx_ctx);
+
+	if (rx_buffered->rndv_state) {
+		rx_posted->used += sock_rx_rndv_bind(rx_ctx, rx_buffered,
+					rx_posted->iov,
+					rx_posted->rx_op.dest_iov_len,
+					rx_posted->used, rx_posted->context,
+					rx_posted->flags & ~FI_MULTI_RECV);
+		if (!(rx_posted->flags & FI_MULTI_RECV) ||
+		    sock_rx_avail_len(rx_posted) < rx_ctx->min_multi_recv) {
+			if (rx_posted->flags & FI_MULTI_RECV)
+				rx_buffered->flags |= FI_MULTI_RECV;
+			sock_rx_dequeue_entry(rx_ctx, rx_posted);
+			sock_rx_release_entry(rx_posted);
+			rx_ctx->num_left++;
+			return 0;
+		}
+		rx_posted->is_busy = 0;
+		return 1;
+	}
 
-		rx_posted = sock_rx_get_entry(rx_ctx, rx_buffered->addr,
-						rx_buffered->tag,
-						rx_buffered->is_tagged);
-		if (!rx_posted)
+	offset = 0;
+	rem = rx_buffered->iov[0].iov.len;
+	used_len = rx_posted->used;
+	pe_entry.data_len = 0;
+	pe_entry.buf = 0L;
+	for (i = 0; i < rx_posted->rx_op.dest_iov_len && rem > 0; i++) {
+		if (used_len >= rx_posted->iov[i].iov.len) {
+			used_len -= rx_posted->iov[i].iov.len;
 			continue;
-
-		SOCK_LOG_DBG("Consuming buffered entry: %p, ctx: %p\n",
-			      rx_buffered, rx_ctx);
-		SOCK_LOG_DBG("Consuming posted entry: %p, ctx: %p\n",
-			      rx_posted, rx_ctx);
-
-		offset = 0;
-		rem = rx_buffered->iov[0].iov.len;
-		rx_ctx->buffered_len -= rem;
-		used_len = rx_posted->used;
-		pe_entry.data_len = 0;
-		pe_entry.buf = 0L;
-		for (i = 0; i < rx_posted->rx_op.dest_iov_len && rem > 0; i++) {
-			if (used_len >= rx_posted->rx_op.dest_iov_len) {
-				used_len -= rx_posted->rx_op.dest_iov_len;
-				continue;
-			}
-
-			dst_offset = used_len;
-			len = MIN(rx_posted->iov[i].iov.len, rem);
-			pe_entry.buf = rx_posted->iov[i].iov.addr + dst_offset;
-			memcpy((char *) (uintptr_t) rx_posted->iov[i].iov.addr + dst_offset,
-			       (char *) (uintptr_t) rx_buffered->iov[0].iov.addr + offset, len);
-			offset += len;
-			rem -= len;
-			dst_offset = used_len = 0;
-			rx_posted->used += len;
-			pe_entry.data_len = rx_buffered->used;
 		}
 
-		pe_entry.done_len = offset;
-		pe_entry.data = rx_buffered->data;
-		pe_entry.tag = rx_buffered->tag;
-		pe_entry.context = (uint64_t)rx_posted->context;
-		pe_entry.pe.rx.rx_iov[0].iov.addr = rx_posted->iov[0].iov.addr;
-		pe_entry.type = SOCK_PE_RX;
-		pe_entry.comp = rx_buffered->comp;
-		pe_entry.flags = rx_posted->flags;
-		pe_entry.flags |= (FI_MSG | FI_RECV);
-		if (rx_buffered->is_tagged)
-			pe_entry.flags |= FI_TAGGED;
-		pe_entry.flags &= ~FI_MULTI_RECV;
+		dst_offset = used_len;
+		len = MIN(rx_posted->iov[i].iov.len - dst_offset, rem);
+		pe_entry.buf = rx_posted->iov[i].iov.addr + dst_offset;
+		memcpy((char *) (uintptr_t) rx_posted->iov[i].iov.addr + dst_offset,
+		       (char *) (uintptr_t) rx_buffered->iov[0].iov.addr + offset, len);
+		offset += len;
+		rem -= len;
+		dst_offset = used_len = 0;
+		rx_posted->used += len;
+		pe_entry.data_len = rx_buffered->used;
+	}
+
+	pe_entry.done_len = offset;
+	pe_entry.data = rx_buffered->data;
+	pe_entry.tag = rx_buffered->tag;
+	pe_entry.context = (uint64_t)rx_posted->context;
+	pe_entry.pe.rx.rx_iov[0].iov.addr = rx_posted->iov[0].iov.addr;
+	pe_entry.type = SOCK_PE_RX;
+	pe_entry.addr = rx_buffered->addr;
+	pe_entry.comp = rx_buffered->comp;
+	pe_entry.flags = rx_posted->flags;
+	pe_entry.flags |= (FI_MSG | FI_RECV);
+	if (rx_buffered->is_tagged)
+		pe_entry.flags |= FI_TAGGED;
+	pe_entry.flags &= ~FI_MULTI_RECV;
 
-		if (rx_posted->flags & FI_MULTI_RECV) {
-			if (sock_rx_avail_len(rx_posted) < rx_ctx->min_multi_recv) {
-				pe_entry.flags |= FI_MULTI_RECV;
-				dlist_remove(&rx_posted->entry);
-			}
-		} else {
-			dlist_remove(&rx_posted->entry);
+	if (rx_posted->flags & FI_MULTI_RECV) {
+		if (sock_rx_avail_len(rx_posted) < rx_ctx->min_multi_recv) {
+			pe_entry.flags |= FI_MULTI_RECV;
+			sock_rx_dequeue_entry(rx_ctx, rx_posted);
 		}
+	} else {
+		sock_rx_dequeue_entry(rx_ctx, rx_posted);
+	}
 
-		if (rem) {
-			SOCK_LOG_DBG("Not enough space in posted recv buffer\n");
-			sock_pe_report_rx_error(&pe_entry, rem);
-		} else {
-			sock_pe_report_recv_completion(&pe_entry);
-		}
+	if (rem) {
+		SOCK_LOG_DBG("Not enough space in posted recv buffer\n");
+		sock_pe_report_rx_error(&pe_entry, rem);
+	} else {
+		sock_pe_report_recv_completion(&pe_entry);
+	}
 
-		dlist_remove(&rx_buffered->entry);
-		sock_rx_release_entry(rx_buffered);
+	sock_rx_dequeue_entry(rx_ctx, rx_buffered);
+	sock_rx_release_entry(rx_buffered);
 
-		if ((!(rx_posted->flags & FI_MULTI_RECV) ||
-		     (pe_entry.flags & FI_MULTI_RECV))) {
-			sock_rx_release_entry(rx_posted);
-			rx_ctx->num_left++;
+	if ((!(rx_posted->flags & FI_MULTI_RECV) ||
+	     (pe_entry.flags & FI_MULTI_RECV))) {
+		sock_rx_release_entry(rx_posted);
+		rx_ctx->num_left++;
+		return 0;
+	}
+	rx_posted->is_busy = 0;
+	return 1;
+}
+
+/*
+ * Buffered messages are matched when they complete, so only receives
+ * posted since the last pass (seq >= match_seq) need to be checked
+ * against the unexpected queue.  A multi-recv buffer that becomes
+ * available again forces a full pass.
+ */
+static int sock_pe_progress_buffered_rx(struct sock_rx_ctx *rx_ctx)
+{
+	struct dlist_entry *entry;
+	struct sock_rx_entry *rx_buffered, *rx_posted;
+
+	if (dlist_empty(&rx_ctx->rx_entry_list) ||
+	    dlist_empty(&rx_ctx->rx_buffered_list)) {
+		rx_ctx->match_seq = rx_ctx->post_seq;
+		rx_ctx->match_recheck = 0;
+		return 0;
+	}
+
+	if (rx_ctx->match_recheck) {
+		rx_ctx->match_recheck = 0;
+		for (entry = rx_ctx->rx_buffered_list.next;
+		     entry != &rx_ctx->rx_buffered_list;) {
+			rx_buffered = container_of(entry, struct sock_rx_entry,
+						   entry);
+			entry = entry->next;
+
+			if (!rx_buffered->is_complete || rx_buffered->is_claimed)
+				continue;
+
+			rx_posted = sock_rx_get_entry(rx_ctx, rx_buffered->addr,
+						      rx_buffered->tag,
+						      rx_buffered->is_tagged);
+			if (rx_posted)
+				sock_pe_consume_buffered(rx_ctx, rx_buffered,
+							 rx_posted);
+		}
+		rx_ctx->match_seq = rx_ctx->post_seq;
+		return 0;
+	}
+
+	if (rx_ctx->match_seq == rx_ctx->post_seq)
+		return 0;
+
+	for (entry = rx_ctx->rx_entry_list.prev;
+	     entry != &rx_ctx->rx_entry_list; entry = entry->prev) {
+		rx_posted = container_of(entry, struct sock_rx_entry, entry);
+		if (rx_posted->seq < rx_ctx->match_seq)
+			break;
+	}
+
+	for (entry = entry->next; entry != &rx_ctx->rx_entry_list;) {
+		rx_posted = container_of(entry, struct sock_rx_entry, entry);
+		entry = entry->next;
+
+		while (!rx_posted->is_busy) {
+			rx_buffered = sock_rx_get_buffered_entry(rx_ctx,
+							rx_posted->addr,
+							rx_posted->tag,
+							rx_posted->ignore,
+							rx_posted->is_tagged);
+			if (!rx_buffered)
+				break;
+
+			rx_posted->is_busy = 1;
+			if (!sock_pe_consume_buffered(rx_ctx, rx_buffered,
+						      rx_posted))
+				break;
+		}
+	}
+	rx_ctx->match_seq = rx_ctx->post_seq;
+	return 0;
+}
+
+/* Deliver a buffered message that just completed to a posted receive */
+static void sock_pe_match_buffered(struct sock_rx_ctx *rx_ctx,
+				   struct sock_rx_entry *rx_buffered)
+{
+	struct sock_rx_entry *rx_posted;
+
+	/*
+	 * Receives older than match_seq have already been checked against
+	 * every other complete message, so the earliest of them that
+	 * matches takes this one.  Newer receives are left to the regular
+	 * pass, which walks the unexpected queue in arrival order.
+	 */
+	if (!rx_ctx->match_recheck) {
+		rx_posted = sock_rx_get_entry(rx_ctx, rx_buffered->addr,
+					      rx_buffered->tag,
+					      rx_buffered->is_tagged);
+		if (rx_posted && rx_posted->seq >= rx_ctx->match_seq) {
+			rx_posted->is_busy = 0;
+			rx_posted = NULL;
+		}
+		if (rx_posted)
+			sock_pe_consume_buffered(rx_ctx, rx_buffered,
+						 rx_posted);
+	}
+	sock_pe_progress_buffered_rx(rx_ctx);
+}
+
+/*
+ * Release a rendezvous receive, and its hold on the sender's connection.
+ * Must hold rx_ctx->lock.
+ */
+static void sock_pe_release_rndv(struct sock_rx_entry *rx_rndv)
+{
+	struct sock_conn *conn = rx_rndv->conn;
+
+	dlist_remove(&rx_rndv->conn_entry);
+	if (--conn->pe_ref == 0 && conn->disconnected)
+		conn->ep_attr->cmap.reap_pending = 1;
+	sock_rx_release_entry(rx_rndv);
+}
+
+/*
+ * A rendezvous request carries only the length of the data.  It is
+ * queued like an unexpected message, and the data is requested once a
+ * receive buffer has been bound to it.  The entry keeps the connection
+ * open until then.
+ */
+static int sock_pe_process_rx_rndv_req(struct sock_pe *pe,
+				       struct sock_rx_ctx *rx_ctx,
+				       struct sock_pe_entry *pe_entry,
+				       uint64_t len)
+{
+	struct sock_rx_entry *rx_rndv, *rx_posted;
+	uint64_t src_cnt = 0;
+
+	if (sock_pe_recv_field(pe_entry, &pe_entry->pe.rx.rndv_len,
+			       sizeof(uint64_t), len))
+		return 0;
+	len += sizeof(uint64_t);
+
+	if (pe_entry->conn->shm) {
+		if (sock_pe_recv_field(pe_entry, &pe_entry->pe.rx.rndv_src_cnt,
+				       sizeof(uint64_t), len))
+			return 0;
+		len += sizeof(uint64_t);
+
+		src_cnt = ntohll(pe_entry->pe.rx.rndv_src_cnt);
+		if (src_cnt > SOCK_EP_MAX_IOV_LIMIT) {
+			SOCK_LOG_ERROR("Invalid rendezvous request\n");
+			pe_entry->is_error = 1;
+			pe_entry->rem = pe_entry->total_len - pe_entry->done_len;
+			pe_entry->done_len = pe_entry->total_len;
+			return 0;
+		}
+
+		if (sock_pe_recv_field(pe_entry, pe_entry->pe.rx.rx_iov,
+				       src_cnt * sizeof(union sock_iov), len))
+			return 0;
+	}
+
+	fastlock_acquire(&rx_ctx->lock);
+	sock_pe_progress_buffered_rx(rx_ctx);
+
+	rx_rndv = sock_rx_new_buffered_entry(rx_ctx, 0);
+	if (!rx_rndv) {
+		fastlock_release(&rx_ctx->lock);
+		return -FI_ENOMEM;
+	}
+
+	rx_rndv->addr = pe_entry->addr;
+	rx_rndv->tag = pe_entry->tag;
+	rx_rndv->data = pe_entry->data;
+	rx_rndv->ignore = 0;
+	rx_rndv->comp = pe_entry->comp;
+	rx_rndv->total_len = ntohll(pe_entry->pe.rx.rndv_len);
+	rx_rndv->conn = pe_entry->conn;
+	rx_rndv->conn->pe_ref++;
+	dlist_insert_tail(&rx_rndv->conn_entry, &rx_ctx->rx_rndv_ref_list);
+	rx_rndv->rndv_pe_id = pe_entry->msg_hdr.pe_entry_id;
+	rx_rndv->rndv_state = SOCK_RNDV_UNMATCHED;
+	rx_rndv->rndv_src_cnt = src_cnt;
+	memcpy(rx_rndv->rndv_src, pe_entry->pe.rx.rx_iov,
+	       src_cnt * sizeof(union sock_iov));
+	rx_rndv->is_complete = 1;
+	rx_rndv->is_busy = 0;
+
+	if (pe_entry->msg_hdr.flags & FI_REMOTE_CQ_DATA)
+		rx_rndv->flags |= FI_REMOTE_CQ_DATA;
+	if (pe_entry->msg_hdr.op_type == SOCK_OP_TSEND)
+		rx_rndv->is_tagged = 1;
+
+	SOCK_LOG_DBG("%p: rendezvous request (len = %" PRIu64 ")\n",
+		     pe_entry, rx_rndv->total_len);
+	sock_rx_enqueue_buffered_entry(rx_ctx, rx_rndv);
+
+	rx_posted = sock_rx_get_entry(rx_ctx, pe_entry->addr, pe_entry->tag,
+				      rx_rndv->is_tagged);
+	if (rx_posted)
+		sock_pe_consume_buffered(rx_ctx, rx_rndv, rx_posted);
+	fastlock_release(&rx_ctx->lock);
+
+	pe_entry->is_complete = 1;
+	return 0;
+}
+
+/* Data of a rendezvous send, received directly into the bound buffer */
+static int sock_pe_process_rx_rndv_data(struct sock_pe *pe,
+					struct sock_rx_ctx *rx_ctx,
+					struct sock_pe_entry *pe_entry)
+{
+	ssize_t i, ret = 0;
+	struct dlist_entry *entry;
+	struct sock_rx_entry *rx_rndv;
+	uint64_t len, rem, data_len, done_data, used;
+
+	len = sizeof(struct sock_msg_hdr);
+	if (sock_pe_recv_field(pe_entry, &pe_entry->pe.rx.rndv_id,
+			       sizeof(uint64_t), len))
+		return 0;
+	len += sizeof(uint64_t);
+
+	if (!pe_entry->pe.rx.rx_entry) {
+		pe_entry->pe.rx.rndv_id = ntohll(pe_entry->pe.rx.rndv_id);
+		fastlock_acquire(&rx_ctx->lock);
+		for (entry = rx_ctx->rx_rndv_list.next;
+		     entry != &rx_ctx->rx_rndv_list; entry = entry->next) {
+			rx_rndv = container_of(entry, struct sock_rx_entry,
+					       entry);
+			if (rx_rndv->rndv_id == pe_entry->pe.rx.rndv_id &&
+			    rx_rndv->rndv_state == SOCK_RNDV_WAIT_DATA) {
+				pe_entry->pe.rx.rx_entry = rx_rndv;
+				break;
+			}
+		}
+		fastlock_release(&rx_ctx->lock);
+
+		if (!pe_entry->pe.rx.rx_entry) {
+			SOCK_LOG_ERROR("No rendezvous receive for id %" PRIu64 "\n",
+				       pe_entry->pe.rx.rndv_id);
+			pe_entry->is_error = 1;
+			pe_entry->rem = pe_entry->total_len - pe_entry->done_len;
+			pe_entry->done_len = pe_entry->total_len;
+			/* acks count every such message, to stay in step */
+			if (pe_entry->msg_hdr.flags & FI_TRANSMIT_COMPLETE)
+				sock_comm_ack(pe_entry->conn);
+			return 0;
 		}
 	}
+
+	rx_rndv = pe_entry->pe.rx.rx_entry;
+	data_len = pe_entry->msg_hdr.msg_len - len;
+	done_data = pe_entry->done_len - len;
+	rem = data_len - done_data;
+	used = rx_rndv->used;
+
+	for (i = 0; rem > 0 && i < rx_rndv->rx_op.dest_iov_len; i++) {
+		if (used >= rx_rndv->iov[i].iov.len) {
+			used -= rx_rndv->iov[i].iov.len;
+			continue;
+		}
+
+		len = MIN(rx_rndv->iov[i].iov.len - used, rem);
+		ret = sock_comm_recv(pe_entry,
+				     (char *) (uintptr_t) rx_rndv->iov[i].iov.addr + used,
+				     len);
+		if (ret <= 0)
+			return ret;
+
+		rem -= ret;
+		used = 0;
+		pe_entry->done_len += ret;
+		rx_rndv->used += ret;
+		if (ret != len)
+			return 0;
+	}
+
+	pe_entry->flags = rx_rndv->flags & ~FI_DISCARD;
+	pe_entry->context = rx_rndv->context;
+	pe_entry->data = rx_rndv->data;
+	pe_entry->tag = rx_rndv->tag;
+	pe_entry->comp = rx_rndv->comp;
+	pe_entry->data_len = data_len;
+	pe_entry->buf = rx_rndv->rx_op.dest_iov_len ?
+			rx_rndv->iov[0].iov.addr : 0;
+
+	if (rem) {
+		if (!(rx_rndv->flags & FI_DISCARD)) {
+			SOCK_LOG_ERROR("Not enough space in posted recv buffer\n");
+			sock_pe_report_rx_error(pe_entry, rem);
+		}
+		pe_entry->is_error = 1;
+		pe_entry->rem = rem;
+		pe_entry->done_len = pe_entry->total_len;
+	} else {
+		pe_entry->is_complete = 1;
+		sock_pe_report_recv_completion(pe_entry);
+	}
+
+	fastlock_acquire(&rx_ctx->lock);
+	dlist_remove(&rx_rndv->entry);
+	sock_pe_release_rndv(rx_rndv);
+	fastlock_release(&rx_ctx->lock);
+	pe_entry->pe.rx.rx_entry = NULL;
+
+	if (pe_entry->msg_hdr.flags & FI_TRANSMIT_COMPLETE)
+		sock_comm_ack(pe_entry->conn);
 	return 0;
 }
 
@@ -1492,6 +1724,9 @@ static int sock_pe_process_rx_send(struct sock_pe *pe,
 		len += SOCK_CQ_DATA_SIZE;
 	}
 
+	if (pe_entry->msg_hdr.flags & SOCK_RNDV_REQ)
+		return sock_pe_process_rx_rndv_req(pe, rx_ctx, pe_entry, len);
+
 	data_len = pe_entry->msg_hdr.msg_len - len;
 	if (pe_entry->done_len == len && !pe_entry->pe.rx.rx_entry) {
 		fastlock_acquire(&rx_ctx->lock);
@@ -1502,6 +1737,20 @@ static int sock_pe_process_rx_send(struct sock_pe *pe,
 		SOCK_LOG_DBG("Consuming posted entry: %p\n", rx_entry);
 
 		if (!rx_entry) {
+			/*
+			 * Out of buffer space: leave the message in the
+			 * socket, so that the connection stops being read
+			 * and TCP pushes back on the sender.  It is
+			 * retried until a receive is posted or space frees.
+			 */
+			if (sock_rx_buffer_full(rx_ctx, data_len)) {
+				fastlock_release(&rx_ctx->lock);
+				SOCK_LOG_DBG("%p: Buffered recv limit reached, "
+					     "deferring recv (len = %llu)\n",
+					     pe_entry, (long long unsigned int)data_len);
+				return 0;
+			}
+
 			SOCK_LOG_DBG("%p: No matching recv, buffering recv (len = %llu)\n",
 				      pe_entry, (long long unsigned int)data_len);
 
@@ -1522,6 +1771,7 @@ static int sock_pe_process_rx_send(struct sock_pe *pe,
 
 			if (pe_entry->msg_hdr.op_type == SOCK_OP_TSEND)
 				rx_entry->is_tagged = 1;
+			sock_rx_enqueue_buffered_entry(rx_ctx, rx_entry);
 		}
 		fastlock_release(&rx_ctx->lock);
 		pe_entry->context = rx_entry->context;
@@ -1576,11 +1826,13 @@ static int sock_pe_process_rx_send(struct sock_pe *pe,
 	if (rx_entry->flags & FI_MULTI_RECV) {
 		if (sock_rx_avail_len(rx_entry) < rx_ctx->min_multi_recv) {
 			pe_entry->flags |= FI_MULTI_RECV;
-			dlist_remove(&rx_entry->entry);
+			sock_rx_dequeue_entry(rx_ctx, rx_entry);
+		} else {
+			rx_ctx->match_recheck = 1;
 		}
 	} else {
 		if (!rx_entry->is_buffered)
-			dlist_remove(&rx_entry->entry);
+			sock_rx_dequeue_entry(rx_ctx, rx_entry);
 	}
 	rx_entry->is_busy = 0;
 	fastlock_release(&rx_ctx->lock);
@@ -1598,14 +1850,15 @@ static int sock_pe_process_rx_send(struct sock_pe *pe,
 	}
 
 out:
-	if (pe_entry->msg_hdr.flags & FI_TRANSMIT_COMPLETE) {
-		sock_pe_send_response(pe, rx_ctx, pe_entry, 0,
-				      SOCK_OP_SEND_COMPLETE, 0);
-	}
+	if (pe_entry->msg_hdr.flags & FI_TRANSMIT_COMPLETE)
+		sock_comm_ack(pe_entry->conn);
 
-	if (!rx_entry->is_buffered &&
-	    (!(rx_entry->flags & FI_MULTI_RECV) ||
-	     (pe_entry->flags & FI_MULTI_RECV))) {
+	if (rx_entry->is_buffered) {
+		fastlock_acquire(&rx_ctx->lock);
+		sock_pe_match_buffered(rx_ctx, rx_entry);
+		fastlock_release(&rx_ctx->lock);
+	} else if (!(rx_entry->flags & FI_MULTI_RECV) ||
+		   (pe_entry->flags & FI_MULTI_RECV)) {
 		fastlock_acquire(&rx_ctx->lock);
 		sock_rx_release_entry(rx_entry);
 		rx_ctx->num_left++;
@@ -1653,8 +1906,20 @@ static int sock_pe_process_rx_conn_msg(struct sock_pe *pe,
 	if (index != -1) {
 		fastlock_acquire(&map->lock);
 		conn = sock_ep_lookup_conn(ep_attr, index, addr);
-		if (conn == NULL || conn == SOCK_CM_CONN_IN_PROGRESS)
-			idm_set(&ep_attr->av_idm, index, pe_entry->conn);
+		if (conn == NULL) {
+			if (sock_conn_map_set_av(map, index, pe_entry->conn))
+				SOCK_LOG_ERROR("failed to grow av map\n");
+		} else if (conn != pe_entry->conn &&
+			   conn->state == SOCK_CONN_STATE_IDLE) {
+			sock_conn_map_replace(map, conn, pe_entry->conn);
+			pe_entry->conn = conn;
+		}
+		fastlock_release(&map->lock);
+	} else {
+		fastlock_acquire(&map->lock);
+		if (dlist_empty(&pe_entry->conn->unresolved_entry))
+			dlist_insert_tail(&pe_entry->conn->unresolved_entry,
+					  &map->unresolved_list);
 		fastlock_release(&map->lock);
 	}
 	pe_entry->conn->av_index = (ep_attr->ep_type == FI_EP_MSG || index == -1) ?
@@ -1667,6 +1932,53 @@ static int sock_pe_process_rx_conn_msg(struct sock_pe *pe,
 	return 0;
 }
 
+static int sock_pe_process_rx_conn_close(struct sock_pe *pe,
+					 struct sock_pe_entry *pe_entry)
+{
+	sock_conn_process_close(pe_entry->conn, pe_entry->msg_hdr.op_type);
+	pe_entry->is_complete = 1;
+	return 0;
+}
+
+/* A shared memory offer from a local peer, or its answer to ours */
+static int sock_pe_process_rx_conn_shm(struct sock_pe *pe,
+				       struct sock_pe_entry *pe_entry)
+{
+	struct sock_conn_shm_req *req;
+	size_t len = sizeof(struct sock_msg_hdr);
+
+	if (pe_entry->msg_hdr.msg_len == len) {
+		sock_conn_shm_connected(pe_entry->conn);
+		pe_entry->is_complete = 1;
+		return 0;
+	}
+
+	if (pe_entry->msg_hdr.msg_len != sizeof(*req)) {
+		SOCK_LOG_ERROR("Invalid shared memory request\n");
+		pe_entry->is_error = 1;
+		pe_entry->rem = pe_entry->total_len - pe_entry->done_len;
+		pe_entry->done_len = pe_entry->total_len;
+		return 0;
+	}
+
+	if (!pe_entry->comm_addr) {
+		pe_entry->comm_addr = calloc(1, sizeof(*req));
+		if (!pe_entry->comm_addr)
+			return -FI_ENOMEM;
+	}
+
+	req = pe_entry->comm_addr;
+	if (sock_pe_recv_field(pe_entry, (char *) req + len,
+			       sizeof(*req) - len, len))
+		return 0;
+
+	sock_conn_shm_accept(pe_entry->conn, req);
+	pe_entry->is_complete = 1;
+	free(pe_entry->comm_addr);
+	pe_entry->comm_addr = NULL;
+	return 0;
+}
+
 static int sock_pe_process_recv(struct sock_pe *pe, struct sock_rx_ctx *rx_ctx,
 				struct sock_pe_entry *pe_entry)
 {
@@ -1697,6 +2009,9 @@ static int sock_pe_process_recv(struct sock_pe *pe, struct sock_rx_ctx *rx_ctx,
 	case SOCK_OP_SEND_COMPLETE:
 		ret = sock_pe_handle_ack(pe, pe_entry);
 		break;
+	case SOCK_OP_SEND_ACK:
+		ret = sock_pe_handle_send_ack(pe, pe_entry);
+		break;
 	case SOCK_OP_WRITE_COMPLETE:
 		ret = sock_pe_handle_write_complete(pe, pe_entry);
 		break;
@@ -1714,6 +2029,20 @@ static int sock_pe_process_recv(struct sock_pe *pe, struct sock_rx_ctx *rx_ctx,
 	case SOCK_OP_CONN_MSG:
 		ret = sock_pe_process_rx_conn_msg(pe, rx_ctx, pe_entry);
 		break;
+	case SOCK_OP_RNDV_CTS:
+		ret = sock_pe_handle_rndv_cts(pe, pe_entry);
+		break;
+	case SOCK_OP_RNDV_DATA:
+		ret = sock_pe_process_rx_rndv_data(pe, rx_ctx, pe_entry);
+		break;
+	case SOCK_OP_CONN_CLOSE:
+	case SOCK_OP_CONN_CLOSE_ACK:
+	case SOCK_OP_CONN_CLOSE_NACK:
+		ret = sock_pe_process_rx_conn_close(pe, pe_entry);
+		break;
+	case SOCK_OP_CONN_SHM:
+		ret = sock_pe_process_rx_conn_shm(pe, pe_entry);
+		break;
 	default:
 		ret = -FI_ENOSYS;
 		SOCK_LOG_ERROR("Operation not supported\n");
@@ -1798,77 +2127,58 @@ static int sock_pe_progress_tx_atomic(struct sock_pe *pe,
 				      struct sock_pe_entry *pe_entry,
 				      struct sock_conn *conn)
 {
-	int datatype_sz;
-	union sock_iov iov[SOCK_EP_MAX_IOV_LIMIT];
-	ssize_t len, i, entry_len;
+	int datatype_sz, iov_cnt = 0;
+	union sock_iov ioc[SOCK_EP_MAX_IOV_LIMIT];
+	struct iovec iov[SOCK_PE_MAX_TX_IOV];
+	ssize_t i;
 
 	if (pe_entry->pe.tx.send_done)
 		return 0;
 
-	len = sizeof(struct sock_msg_hdr);
-	entry_len = sizeof(struct sock_atomic_req) - sizeof(struct sock_msg_hdr);
-	if (sock_pe_send_field(pe_entry, &pe_entry->pe.tx.tx_op, entry_len, len))
-		return 0;
-	len += entry_len;
+	sock_pe_add_iov(iov, &iov_cnt, &pe_entry->msg_hdr,
+			sizeof(struct sock_msg_hdr));
+	sock_pe_add_iov(iov, &iov_cnt, &pe_entry->pe.tx.tx_op,
+			sizeof(struct sock_atomic_req) -
+			sizeof(struct sock_msg_hdr));
 
-	if (pe_entry->flags & FI_REMOTE_CQ_DATA) {
-		if (sock_pe_send_field(pe_entry, &pe_entry->data,
-				       SOCK_CQ_DATA_SIZE, len))
-			return 0;
-		len += SOCK_CQ_DATA_SIZE;
-	}
+	if (pe_entry->flags & FI_REMOTE_CQ_DATA)
+		sock_pe_add_iov(iov, &iov_cnt, &pe_entry->data,
+				SOCK_CQ_DATA_SIZE);
 
 	/* dest iocs */
-	entry_len = sizeof(union sock_iov) * pe_entry->pe.tx.tx_op.dest_iov_len;
 	for (i = 0; i < pe_entry->pe.tx.tx_op.dest_iov_len; i++) {
-		iov[i].ioc.addr = pe_entry->pe.tx.tx_iov[i].dst.ioc.addr;
-		iov[i].ioc.count = pe_entry->pe.tx.tx_iov[i].dst.ioc.count;
-		iov[i].ioc.key = pe_entry->pe.tx.tx_iov[i].dst.ioc.key;
+		ioc[i].ioc.addr = pe_entry->pe.tx.tx_iov[i].dst.ioc.addr;
+		ioc[i].ioc.count = pe_entry->pe.tx.tx_iov[i].dst.ioc.count;
+		ioc[i].ioc.key = pe_entry->pe.tx.tx_iov[i].dst.ioc.key;
 	}
-
-	if (sock_pe_send_field(pe_entry, &iov[0], entry_len, len))
-		return 0;
-	len += entry_len;
+	sock_pe_add_iov(iov, &iov_cnt, &ioc[0], sizeof(union sock_iov) *
+			pe_entry->pe.tx.tx_op.dest_iov_len);
 
 	datatype_sz = fi_datatype_size(pe_entry->pe.tx.tx_op.atomic.datatype);
 	if (pe_entry->flags & FI_INJECT) {
 		/* cmp data */
-		if (sock_pe_send_field(pe_entry,
-					&pe_entry->pe.tx.inject[0] + pe_entry->pe.tx.tx_op.src_iov_len,
-					pe_entry->pe.tx.tx_op.atomic.cmp_iov_len, len))
-			return 0;
-		len += pe_entry->pe.tx.tx_op.atomic.cmp_iov_len;
+		sock_pe_add_iov(iov, &iov_cnt, &pe_entry->pe.tx.inject[0] +
+				pe_entry->pe.tx.tx_op.src_iov_len,
+				pe_entry->pe.tx.tx_op.atomic.cmp_iov_len);
 		/* data */
-		if (sock_pe_send_field(pe_entry,
-				       &pe_entry->pe.tx.inject[0],
-				       pe_entry->pe.tx.tx_op.src_iov_len, len))
-			return 0;
-		len += pe_entry->pe.tx.tx_op.src_iov_len;
+		sock_pe_add_iov(iov, &iov_cnt, &pe_entry->pe.tx.inject[0],
+				pe_entry->pe.tx.tx_op.src_iov_len);
 	} else {
 		/* cmp data */
-		for (i = 0; i < pe_entry->pe.tx.tx_op.atomic.cmp_iov_len; i++) {
-			if (sock_pe_send_field(pe_entry,
-						(void *) (uintptr_t) pe_entry->pe.tx.tx_iov[i].cmp.ioc.addr,
-						pe_entry->pe.tx.tx_iov[i].cmp.ioc.count *
-						datatype_sz, len))
-			return 0;
-			len += (pe_entry->pe.tx.tx_iov[i].cmp.ioc.count * datatype_sz);
-		}
+		for (i = 0; i < pe_entry->pe.tx.tx_op.atomic.cmp_iov_len; i++)
+			sock_pe_add_iov(iov, &iov_cnt,
+				(void *) (uintptr_t) pe_entry->pe.tx.tx_iov[i].cmp.ioc.addr,
+				pe_entry->pe.tx.tx_iov[i].cmp.ioc.count * datatype_sz);
 		/* data */
-		for (i = 0; i < pe_entry->pe.tx.tx_op.src_iov_len; i++) {
-			if (pe_entry->pe.tx.tx_op.atomic.op != FI_ATOMIC_READ) {
-				if (sock_pe_send_field(pe_entry,
-				    (void *) (uintptr_t) pe_entry->pe.tx.tx_iov[i].src.ioc.addr,
-				    pe_entry->pe.tx.tx_iov[i].src.ioc.count *
-				    datatype_sz, len))
-					return 0;
-				len += (pe_entry->pe.tx.tx_iov[i].src.ioc.count * datatype_sz);
-			}
+		if (pe_entry->pe.tx.tx_op.atomic.op != FI_ATOMIC_READ) {
+			for (i = 0; i < pe_entry->pe.tx.tx_op.src_iov_len; i++)
+				sock_pe_add_iov(iov, &iov_cnt,
+					(void *) (uintptr_t) pe_entry->pe.tx.tx_iov[i].src.ioc.addr,
+					pe_entry->pe.tx.tx_iov[i].src.ioc.count * datatype_sz);
 		}
 	}
 
-	sock_comm_flush(pe_entry);
-	if (!sock_comm_tx_done(pe_entry))
+	if (sock_pe_send_iov(pe_entry, iov, iov_cnt))
 		return 0;
 
 	if (pe_entry->done_len == pe_entry->total_len) {
@@ -1891,52 +2201,44 @@ static int sock_pe_progress_tx_write(struct sock_pe *pe,
 				     struct sock_conn *conn)
 {
 	union sock_iov dest_iov[SOCK_EP_MAX_IOV_LIMIT];
-	ssize_t len, i, dest_iov_len;
+	struct iovec iov[SOCK_PE_MAX_TX_IOV];
+	int iov_cnt = 0;
+	ssize_t i;
 
 	if (pe_entry->pe.tx.send_done)
 		return 0;
 
-	len = sizeof(struct sock_msg_hdr);
-	if (pe_entry->flags & FI_REMOTE_CQ_DATA) {
-		if (sock_pe_send_field(pe_entry, &pe_entry->data,
-				       SOCK_CQ_DATA_SIZE, len))
-			return 0;
-		len += SOCK_CQ_DATA_SIZE;
-	}
+	sock_pe_add_iov(iov, &iov_cnt, &pe_entry->msg_hdr,
+			sizeof(struct sock_msg_hdr));
+	if (pe_entry->flags & FI_REMOTE_CQ_DATA)
+		sock_pe_add_iov(iov, &iov_cnt, &pe_entry->data,
+				SOCK_CQ_DATA_SIZE);
 
 	/* dest iovs */
-	dest_iov_len = sizeof(union sock_iov) * pe_entry->pe.tx.tx_op.dest_iov_len;
 	for (i = 0; i < pe_entry->pe.tx.tx_op.dest_iov_len; i++) {
 		dest_iov[i].iov.addr = pe_entry->pe.tx.tx_iov[i].dst.iov.addr;
 		dest_iov[i].iov.len = pe_entry->pe.tx.tx_iov[i].dst.iov.len;
 		dest_iov[i].iov.key = pe_entry->pe.tx.tx_iov[i].dst.iov.key;
 	}
-	if (sock_pe_send_field(pe_entry, &dest_iov[0], dest_iov_len, len))
-		return 0;
-	len += dest_iov_len;
+	sock_pe_add_iov(iov, &iov_cnt, &dest_iov[0], sizeof(union sock_iov) *
+			pe_entry->pe.tx.tx_op.dest_iov_len);
 
 	/* data */
 	if (pe_entry->flags & FI_INJECT) {
-		if (sock_pe_send_field(pe_entry, &pe_entry->pe.tx.inject[0],
-				       pe_entry->pe.tx.tx_op.src_iov_len, len))
-			return 0;
-		len += pe_entry->pe.tx.tx_op.src_iov_len;
+		sock_pe_add_iov(iov, &iov_cnt, &pe_entry->pe.tx.inject[0],
+				pe_entry->pe.tx.tx_op.src_iov_len);
 		pe_entry->data_len = pe_entry->pe.tx.tx_op.src_iov_len;
 	} else {
 		pe_entry->data_len = 0;
 		for (i = 0; i < pe_entry->pe.tx.tx_op.src_iov_len; i++) {
-			if (sock_pe_send_field(
-				    pe_entry,
-				    (void *) (uintptr_t) pe_entry->pe.tx.tx_iov[i].src.iov.addr,
-				    pe_entry->pe.tx.tx_iov[i].src.iov.len, len))
-				return 0;
-			len += pe_entry->pe.tx.tx_iov[i].src.iov.len;
+			sock_pe_add_iov(iov, &iov_cnt,
+				(void *) (uintptr_t) pe_entry->pe.tx.tx_iov[i].src.iov.addr,
+				pe_entry->pe.tx.tx_iov[i].src.iov.len);
 			pe_entry->data_len += pe_entry->pe.tx.tx_iov[i].src.iov.len;
 		}
 	}
 
-	sock_comm_flush(pe_entry);
-	if (!sock_comm_tx_done(pe_entry))
+	if (sock_pe_send_iov(pe_entry, iov, iov_cnt))
 		return 0;
 
 	if (pe_entry->done_len == pe_entry->total_len) {
@@ -1954,15 +2256,17 @@ static int sock_pe_progress_tx_read(struct sock_pe *pe,
 				    struct sock_conn *conn)
 {
 	union sock_iov src_iov[SOCK_EP_MAX_IOV_LIMIT];
-	ssize_t len, i, src_iov_len;
+	struct iovec iov[SOCK_PE_MAX_TX_IOV];
+	int iov_cnt = 0;
+	ssize_t i;
 
 	if (pe_entry->pe.tx.send_done)
 		return 0;
 
-	len = sizeof(struct sock_msg_hdr);
+	sock_pe_add_iov(iov, &iov_cnt, &pe_entry->msg_hdr,
+			sizeof(struct sock_msg_hdr));
 
 	/* src iovs */
-	src_iov_len = sizeof(union sock_iov) * pe_entry->pe.tx.tx_op.src_iov_len;
 	pe_entry->data_len = 0;
 	for (i = 0; i < pe_entry->pe.tx.tx_op.src_iov_len; i++) {
 		src_iov[i].iov.addr = pe_entry->pe.tx.tx_iov[i].src.iov.addr;
@@ -1970,13 +2274,10 @@ static int sock_pe_progress_tx_read(struct sock_pe *pe,
 		src_iov[i].iov.key = pe_entry->pe.tx.tx_iov[i].src.iov.key;
 		pe_entry->data_len += pe_entry->pe.tx.tx_iov[i].src.iov.len;
 	}
+	sock_pe_add_iov(iov, &iov_cnt, &src_iov[0], sizeof(union sock_iov) *
+			pe_entry->pe.tx.tx_op.src_iov_len);
 
-	if (sock_pe_send_field(pe_entry, &src_iov[0], src_iov_len, len))
-		return 0;
-	len += src_iov_len;
-
-	sock_comm_flush(pe_entry);
-	if (!sock_comm_tx_done(pe_entry))
+	if (sock_pe_send_iov(pe_entry, iov, iov_cnt))
 		return 0;
 
 	if (pe_entry->done_len == pe_entry->total_len) {
@@ -1990,49 +2291,77 @@ static int sock_pe_progress_tx_read(struct sock_pe *pe,
 }
 
 
+/*
+ * A local peer copies rendezvous data straight out of our buffers, so
+ * the request tells it where they are.
+ */
+static void sock_pe_add_rndv_src(struct sock_pe_entry *pe_entry,
+				 struct iovec *iov, int *iov_cnt)
+{
+	size_t i, cnt = pe_entry->pe.tx.tx_op.src_iov_len;
+
+	if (!pe_entry->pe.tx.rndv_src_cnt) {
+		pe_entry->pe.tx.rndv_src_cnt = htonll(cnt);
+		pe_entry->total_len += sizeof(uint64_t) +
+				       cnt * sizeof(union sock_iov);
+		pe_entry->msg_hdr.msg_len = htonll(pe_entry->total_len);
+	}
+
+	sock_pe_add_iov(iov, iov_cnt, &pe_entry->pe.tx.rndv_src_cnt,
+			sizeof(uint64_t));
+	for (i = 0; i < cnt; i++)
+		sock_pe_add_iov(iov, iov_cnt, &pe_entry->pe.tx.tx_iov[i].src,
+				sizeof(union sock_iov));
+}
+
 static int sock_pe_progress_tx_send(struct sock_pe *pe,
 				    struct sock_pe_entry *pe_entry,
 				    struct sock_conn *conn)
 {
-	size_t len, i;
+	struct iovec iov[SOCK_PE_MAX_TX_IOV];
+	int iov_cnt = 0;
+	size_t i;
+
 	if (pe_entry->pe.tx.send_done)
 		return 0;
 
-	len = sizeof(struct sock_msg_hdr);
-	if (pe_entry->pe.tx.tx_op.op == SOCK_OP_TSEND) {
-		if (sock_pe_send_field(pe_entry, &pe_entry->tag,
-				       SOCK_TAG_SIZE, len))
-			return 0;
-		len += SOCK_TAG_SIZE;
-	}
+	sock_pe_add_iov(iov, &iov_cnt, &pe_entry->msg_hdr,
+			sizeof(struct sock_msg_hdr));
+	if (pe_entry->pe.tx.rndv_state == SOCK_RNDV_SEND_DATA) {
+		sock_pe_add_iov(iov, &iov_cnt, &pe_entry->pe.tx.rndv_id,
+				sizeof(uint64_t));
+	} else {
+		if (pe_entry->pe.tx.tx_op.op == SOCK_OP_TSEND)
+			sock_pe_add_iov(iov, &iov_cnt, &pe_entry->tag,
+					SOCK_TAG_SIZE);
 
-	if (pe_entry->flags & FI_REMOTE_CQ_DATA) {
-		if (sock_pe_send_field(pe_entry, &pe_entry->data,
-				       SOCK_CQ_DATA_SIZE, len))
-			return 0;
-		len += SOCK_CQ_DATA_SIZE;
+		if (pe_entry->flags & FI_REMOTE_CQ_DATA)
+			sock_pe_add_iov(iov, &iov_cnt, &pe_entry->data,
+					SOCK_CQ_DATA_SIZE);
 	}
 
 	if (pe_entry->flags & FI_INJECT) {
-		if (sock_pe_send_field(pe_entry, pe_entry->pe.tx.inject,
-				       pe_entry->pe.tx.tx_op.src_iov_len, len))
-			return 0;
-		len += pe_entry->pe.tx.tx_op.src_iov_len;
+		sock_pe_add_iov(iov, &iov_cnt, pe_entry->pe.tx.inject,
+				pe_entry->pe.tx.tx_op.src_iov_len);
 		pe_entry->data_len = pe_entry->pe.tx.tx_op.src_iov_len;
+	} else if (pe_entry->pe.tx.rndv_state == SOCK_RNDV_SEND_REQ) {
+		sock_pe_add_iov(iov, &iov_cnt, &pe_entry->pe.tx.rndv_len,
+				sizeof(uint64_t));
+		pe_entry->data_len = ntohll(pe_entry->pe.tx.rndv_len);
+		if (conn->shm && (pe_entry->pe.tx.rndv_src_cnt ||
+				  !pe_entry->done_len))
+			sock_pe_add_rndv_src(pe_entry, iov, &iov_cnt);
 	} else {
 		pe_entry->data_len = 0;
 		for (i = 0; i < pe_entry->pe.tx.tx_op.src_iov_len; i++) {
-			if (sock_pe_send_field(pe_entry,
-				    (void *) (uintptr_t) pe_entry->pe.tx.tx_iov[i].src.iov.addr,
-				    pe_entry->pe.tx.tx_iov[i].src.iov.len, len))
-				return 0;
-			len += pe_entry->pe.tx.tx_iov[i].src.iov.len;
+			sock_pe_add_iov(iov, &iov_cnt,
+				(void *) (uintptr_t) pe_entry->pe.tx.tx_iov[i].src.iov.addr,
+				pe_entry->pe.tx.tx_iov[i].src.iov.len);
 			pe_entry->data_len += pe_entry->pe.tx.tx_iov[i].src.iov.len;
 		}
 	}
 
-	sock_comm_flush(pe_entry);
-	if (!sock_comm_tx_done(pe_entry))
+	if (sock_pe_send_iov(pe_entry, iov, iov_cnt))
 		return 0;
 
 	pe_entry->tag = 0;
@@ -2042,13 +2371,25 @@ static int sock_pe_progress_tx_send(struct sock_pe *pe,
 
 	pe_entry->msg_hdr.flags = pe_entry->flags;
 	if (pe_entry->done_len == pe_entry->total_len) {
-		pe_entry->pe.tx.send_done = 1;
 		pe_entry->conn->tx_pe_entry = NULL;
+		if (pe_entry->pe.tx.rndv_state == SOCK_RNDV_SEND_REQ) {
+			/* the connection is free for others until the CTS */
+			pe_entry->pe.tx.rndv_state = SOCK_RNDV_WAIT_CTS;
+			SOCK_LOG_DBG("Rendezvous request sent\n");
+			return 0;
+		}
+
+		pe_entry->pe.tx.send_done = 1;
 		SOCK_LOG_DBG("Send complete\n");
 
 		if (pe_entry->flags & FI_INJECT_COMPLETE) {
 			sock_pe_report_send_completion(pe_entry);
 			pe_entry->is_complete = 1;
+		} else if (pe_entry->flags & FI_TRANSMIT_COMPLETE) {
+			/* wait for the peer's count to reach this one */
+			pe_entry->pe.tx.ack_seq = ++conn->tx_ack_seq;
+			dlist_insert_tail(&pe_entry->pe.tx.ack_entry,
+					  &conn->tx_ack_list);
 		}
 	}
 
@@ -2059,20 +2400,19 @@ static int sock_pe_progress_tx_conn_msg(struct sock_pe *pe,
 					struct sock_pe_entry *pe_entry,
 					struct sock_conn *conn)
 {
-	size_t len;
+	struct iovec iov[2];
+	int iov_cnt = 0;
+
 	if (pe_entry->pe.tx.send_done)
 		return 0;
 
-	len = sizeof(struct sock_msg_hdr);
-
-	if (sock_pe_send_field(pe_entry, pe_entry->pe.tx.inject,
-                               pe_entry->pe.tx.tx_op.src_iov_len, len))
-		return 0;
-	len += pe_entry->pe.tx.tx_op.src_iov_len;
+	sock_pe_add_iov(iov, &iov_cnt, &pe_entry->msg_hdr,
+			sizeof(struct sock_msg_hdr));
+	sock_pe_add_iov(iov, &iov_cnt, pe_entry->pe.tx.inject,
+			pe_entry->pe.tx.tx_op.src_iov_len);
 	pe_entry->data_len = pe_entry->pe.tx.tx_op.src_iov_len;
 
-	sock_comm_flush(pe_entry);
-	if (!sock_comm_tx_done(pe_entry))
+	if (sock_pe_send_iov(pe_entry, iov, iov_cnt))
 		return 0;
 
 	if (pe_entry->done_len == pe_entry->total_len) {
@@ -2094,6 +2434,31 @@ static int sock_pe_progress_tx_entry(struct sock_pe *pe,
 	if (!pe_entry->conn || pe_entry->pe.tx.send_done)
 		return 0;
 
+	if (pe_entry->pe.tx.rndv_state == SOCK_RNDV_WAIT_CTS) {
+		/* no CTS is coming from a receiver that went away */
+		if (conn->disconnected ||
+		    conn->state == SOCK_CONN_STATE_FAILED) {
+			sock_pe_report_tx_error(pe_entry, FI_ECONNABORTED);
+			pe_entry->pe.tx.send_done = 1;
+			pe_entry->is_complete = 1;
+		}
+		return 0;
+	}
+
+	if (conn->state != SOCK_CONN_STATE_CONNECTED) {
+		fastlock_acquire(&conn->ep_attr->cmap.lock);
+		ret = sock_conn_progress_connect(conn);
+		fastlock_release(&conn->ep_attr->cmap.lock);
+		if (ret == -FI_EAGAIN)
+			return 0;
+		if (ret) {
+			sock_pe_report_tx_error(pe_entry, -ret);
+			pe_entry->pe.tx.send_done = 1;
+			pe_entry->is_complete = 1;
+			return 0;
+		}
+	}
+
 	if (conn->tx_pe_entry != NULL && conn->tx_pe_entry != pe_entry) {
 		SOCK_LOG_DBG("Cannot progress %p as conn %p is being used by %p\n",
 			      pe_entry, conn, conn->tx_pe_entry);
@@ -2101,6 +2466,8 @@ static int sock_pe_progress_tx_entry(struct sock_pe *pe,
 	}
 
 	if (conn->tx_pe_entry == NULL) {
+		/* the acks we owe the peer ride ahead of our traffic */
+		sock_comm_ack_flush(conn);
 		SOCK_LOG_DBG("Connection %p grabbed by %p\n", conn, pe_entry);
 		conn->tx_pe_entry = pe_entry;
 	}
@@ -2111,16 +2478,10 @@ static int sock_pe_progress_tx_entry(struct sock_pe *pe,
 		return 0;
 	}
 
-	if (!pe_entry->pe.tx.header_sent) {
-		if (sock_pe_send_field(pe_entry, &pe_entry->msg_hdr,
-				       sizeof(struct sock_msg_hdr), 0))
-			return 0;
-		pe_entry->pe.tx.header_sent = 1;
-	}
-
 	switch (pe_entry->msg_hdr.op_type) {
 	case SOCK_OP_SEND:
 	case SOCK_OP_TSEND:
+	case SOCK_OP_RNDV_DATA:
 		ret = sock_pe_progress_tx_send(pe, pe_entry, conn);
 		break;
 	case SOCK_OP_WRITE:
@@ -2151,6 +2512,7 @@ static int sock_pe_progress_rx_pe_entry(struct sock_pe *pe,
 	int ret;
 
 	if (sock_comm_is_disconnected(pe_entry)) {
+		pe_entry->conn->ep_attr->cmap.reap_pending = 1;
 		sock_pe_release_entry(pe, pe_entry);
 		return 0;
 	}
@@ -2193,9 +2555,13 @@ static void sock_pe_new_rx_entry(struct sock_pe *pe, struct sock_rx_ctx *rx_ctx,
 	struct sock_pe_entry *pe_entry;
 
 	pe_entry = sock_pe_acquire_entry(pe);
+	if (!pe_entry)
+		return;
 	memset(&pe_entry->pe.rx, 0, sizeof(pe_entry->pe.rx));
 
 	pe_entry->conn = conn;
+	conn->pe_ref++;
+	conn->last_used = fi_gettime_ms();
 	pe_entry->type = SOCK_PE_RX;
 	pe_entry->ep_attr = ep_attr;
 	pe_entry->is_complete = 0;
@@ -2211,8 +2577,8 @@ static void sock_pe_new_rx_entry(struct sock_pe *pe, struct sock_rx_ctx *rx_ctx,
 	else
 		pe_entry->comp = &rx_ctx->comp;
 
-	SOCK_LOG_DBG("New RX on PE entry %p (%ld)\n",
-		      pe_entry, PE_INDEX(pe, pe_entry));
+	SOCK_LOG_DBG("New RX on PE entry %p (%d)\n",
+		      pe_entry, pe_entry->id);
 
 	SOCK_LOG_DBG("Inserting rx_entry to PE entry %p, conn: %p\n",
 		      pe_entry, pe_entry->conn);
@@ -2223,11 +2589,14 @@ static void sock_pe_new_rx_entry(struct sock_pe *pe, struct sock_rx_ctx *rx_ctx,
 static int sock_pe_new_tx_entry(struct sock_pe *pe, struct sock_tx_ctx *tx_ctx)
 {
 	int i, datatype_sz;
+	uint64_t len;
 	struct sock_msg_hdr *msg_hdr;
 	struct sock_pe_entry *pe_entry;
 	struct sock_ep_attr *ep_attr;
 
 	pe_entry = sock_pe_acquire_entry(pe);
+	if (!pe_entry)
+		return 0;
 	memset(&pe_entry->pe.tx, 0, sizeof(pe_entry->pe.tx));
 	memset(&pe_entry->msg_hdr, 0, sizeof(pe_entry->msg_hdr));
 
@@ -2244,13 +2613,15 @@ static int sock_pe_new_tx_entry(struct sock_pe *pe, struct sock_tx_ctx *tx_ctx)
 	msg_hdr = &pe_entry->msg_hdr;
 	msg_hdr->msg_len = sizeof(*msg_hdr);
 
-	msg_hdr->pe_entry_id = PE_INDEX(pe, pe_entry);
+	msg_hdr->pe_entry_id = pe_entry->id;
 	SOCK_LOG_DBG("New TX on PE entry %p (%d)\n",
 		      pe_entry, msg_hdr->pe_entry_id);
 
 	sock_tx_ctx_read_op_send(tx_ctx, &pe_entry->pe.tx.tx_op,
 			&pe_entry->flags, &pe_entry->context, &pe_entry->addr,
 			&pe_entry->buf, &ep_attr, &pe_entry->conn);
+	pe_entry->conn->pe_ref++;
+	pe_entry->conn->last_used = fi_gettime_ms();
 
 	if (pe_entry->pe.tx.tx_op.op == SOCK_OP_TSEND) {
 		rbread(&tx_ctx->rb, &pe_entry->tag, sizeof(pe_entry->tag));
@@ -2276,10 +2647,18 @@ static int sock_pe_new_tx_entry(struct sock_pe *pe, struct sock_tx_ctx *tx_ctx)
 				 pe_entry->pe.tx.tx_op.src_iov_len);
 			msg_hdr->msg_len += pe_entry->pe.tx.tx_op.src_iov_len;
 		} else {
-			for (i = 0; i < pe_entry->pe.tx.tx_op.src_iov_len; i++) {
+			for (i = 0, len = 0; i < pe_entry->pe.tx.tx_op.src_iov_len; i++) {
 				rbread(&tx_ctx->rb, &pe_entry->pe.tx.tx_iov[i].src,
 					 sizeof(pe_entry->pe.tx.tx_iov[i].src));
-				msg_hdr->msg_len += pe_entry->pe.tx.tx_iov[i].src.iov.len;
+				len += pe_entry->pe.tx.tx_iov[i].src.iov.len;
+			}
+
+			if (len > sock_rndv_threshold) {
+				pe_entry->pe.tx.rndv_state = SOCK_RNDV_SEND_REQ;
+				pe_entry->pe.tx.rndv_len = htonll(len);
+				msg_hdr->msg_len += sizeof(uint64_t);
+			} else {
+				msg_hdr->msg_len += len;
 			}
 		}
 		msg_hdr->dest_iov_len = pe_entry->pe.tx.tx_op.dest_iov_len;
@@ -2385,7 +2764,8 @@ static int sock_pe_new_tx_entry(struct sock_pe *pe, struct sock_tx_ctx *tx_ctx)
 	if (pe_entry->flags & FI_INJECT_COMPLETE)
 		pe_entry->flags &= ~FI_TRANSMIT_COMPLETE;
 
-	msg_hdr->flags = htonll(pe_entry->flags);
+	msg_hdr->flags = htonll(pe_entry->pe.tx.rndv_state ?
+				pe_entry->flags | SOCK_RNDV_REQ : pe_entry->flags);
 	pe_entry->total_len = msg_hdr->msg_len;
 	msg_hdr->msg_len = htonll(msg_hdr->msg_len);
 	msg_hdr->pe_entry_id = htons(msg_hdr->pe_entry_id);
@@ -2395,15 +2775,17 @@ static int sock_pe_new_tx_entry(struct sock_pe *pe, struct sock_tx_ctx *tx_ctx)
 void sock_pe_signal(struct sock_pe *pe)
 {
 	char c = 0;
-	if (pe->domain->progress_mode != FI_PROGRESS_AUTO)
-		return;
 
 	fastlock_acquire(&pe->signal_lock);
-	if (pe->wcnt == pe->rcnt) {
-		if (ofi_write_socket(pe->signal_fds[SOCK_SIGNAL_WR_FD], &c, 1) != 1)
+	/* with manual progress, only threads asleep in sock_pe_wait() care */
+	if (pe->wcnt == pe->rcnt &&
+	    (pe->domain->progress_mode == FI_PROGRESS_AUTO || pe->num_waiters)) {
+		if (ofi_write_socket(pe->signal_fds[SOCK_SIGNAL_WR_FD], &c, 1) != 1) {
 			SOCK_LOG_ERROR("Failed to signal\n");
-		else
+		} else {
 			pe->wcnt++;
+			pe->signal_waiters = pe->num_waiters;
+		}
 	}
 	fastlock_release(&pe->signal_lock);
 }
@@ -2416,6 +2798,14 @@ void sock_pe_poll_add(struct sock_pe *pe, int fd)
         fastlock_release(&pe->signal_lock);
 }
 
+void sock_pe_poll_del(struct sock_pe *pe, int fd)
+{
+	fastlock_acquire(&pe->signal_lock);
+	if (sock_epoll_del(&pe->epoll_set, fd))
+		SOCK_LOG_ERROR("failed to del from epoll set: %d\n", fd);
+	fastlock_release(&pe->signal_lock);
+}
+
 void sock_pe_add_tx_ctx(struct sock_pe *pe, struct sock_tx_ctx *ctx)
 {
 	struct dlist_entry *entry;
@@ -2455,16 +2845,39 @@ out:
 
 void sock_pe_remove_tx_ctx(struct sock_tx_ctx *tx_ctx)
 {
-	pthread_mutex_lock(&tx_ctx->domain->pe->list_lock);
+	struct sock_pe *pe = sock_tx_ctx_pe(tx_ctx);
+
+	pthread_mutex_lock(&pe->list_lock);
 	dlist_remove(&tx_ctx->pe_entry);
-	pthread_mutex_unlock(&tx_ctx->domain->pe->list_lock);
+	pthread_mutex_unlock(&pe->list_lock);
 }
 
 void sock_pe_remove_rx_ctx(struct sock_rx_ctx *rx_ctx)
 {
-	pthread_mutex_lock(&rx_ctx->domain->pe->list_lock);
+	struct sock_pe *pe = sock_rx_ctx_pe(rx_ctx);
+
+	pthread_mutex_lock(&pe->list_lock);
 	dlist_remove(&rx_ctx->pe_entry);
-	pthread_mutex_unlock(&rx_ctx->domain->pe->list_lock);
+	pthread_mutex_unlock(&pe->list_lock);
+}
+
+/*
+ * Start on the next message of connections that have it read ahead
+ * already.  Called with the connection map lock held.
+ */
+static void sock_pe_new_rx_staged(struct sock_pe *pe,
+				  struct sock_ep_attr *ep_attr,
+				  struct sock_rx_ctx *rx_ctx)
+{
+	struct dlist_entry *entry;
+	struct sock_conn *conn;
+
+	dlist_foreach(&pe->rx_stage_list, entry) {
+		conn = container_of(entry, struct sock_conn, rx_stage_entry);
+		if (conn->ep_attr == ep_attr && !conn->rx_pe_entry &&
+		    !conn->disconnected)
+			sock_pe_new_rx_entry(pe, rx_ctx, ep_attr, conn);
+	}
 }
 
 static int sock_pe_progress_rx_ep(struct sock_pe *pe, struct sock_ep_attr *ep_attr,
@@ -2479,8 +2892,14 @@ static int sock_pe_progress_rx_ep(struct sock_pe *pe, struct sock_ep_attr *ep_at
         if (!map->used)
                 return 0;
 
+	if (map->num_uring)
+		sock_uring_progress(pe->uring);
+
+	sock_conn_map_reap(ep_attr);
         num_fds = sock_epoll_wait(&map->epoll_set, 0);
-        if (num_fds < 0 || num_fds == 0) {
+        if (num_fds < 0 ||
+	    (num_fds == 0 && !map->num_shm && !map->num_uring &&
+	     dlist_empty(&pe->rx_stage_list))) {
                 if (num_fds < 0)
                         SOCK_LOG_ERROR("poll failed: %s\n", strerror(errno));
                 return num_fds;
@@ -2491,9 +2910,14 @@ static int sock_pe_progress_rx_ep(struct sock_pe *pe, struct sock_ep_attr *ep_at
 		fd = sock_epoll_get_fd_at_index(&map->epoll_set, i);
 		if(fd == -1) /* failed to lookup fd due to connection failures */
 			continue;
-		conn = idm_lookup(&ep_attr->conn_idm, fd);
+		conn = sock_conn_map_lookup_fd(map, fd);
 		if (!conn)
-			SOCK_LOG_ERROR("idm_lookup failed\n");
+			SOCK_LOG_ERROR("fd lookup failed: %d\n", fd);
+
+		if (conn && sock_shm_rx_active(conn)) {
+			sock_shm_drain(conn);
+			continue;
+		}
 
 		if (!conn || conn->rx_pe_entry)
 			continue;
@@ -2501,13 +2925,231 @@ static int sock_pe_progress_rx_ep(struct sock_pe *pe, struct sock_ep_attr *ep_at
 		sock_pe_new_rx_entry(pe, rx_ctx, ep_attr, conn);
 	}
 
+	/*
+	 * data from local peers arrives in shared memory, and io_uring
+	 * connections have theirs received already
+	 */
+	for (i = 0; (map->num_shm || map->num_uring) && i < map->used; i++) {
+		conn = map->table[i];
+		if (conn->rx_pe_entry || conn->disconnected)
+			continue;
+		if ((conn->shm && sock_shm_rx_ready(conn)) ||
+		    (conn->uring && sock_uring_rx_ready(conn)))
+			sock_pe_new_rx_entry(pe, rx_ctx, ep_attr, conn);
+	}
+
+	sock_pe_new_rx_staged(pe, ep_attr, rx_ctx);
 	fastlock_release(&map->lock);
 	return ret;
 }
 
+/*
+ * Parse the messages that the last reads brought in beyond the ones
+ * just handled, without polling the sockets again.  Returns 1 if there
+ * were any.
+ */
+static int sock_pe_progress_rx_staged(struct sock_pe *pe,
+				      struct sock_rx_ctx *rx_ctx)
+{
+	struct dlist_entry *entry, *last;
+	struct sock_pe_entry *pe_entry;
+	struct sock_ep_attr *ep_attr;
+	int ret;
+
+	last = rx_ctx->pe_entry_list.prev;
+	if (rx_ctx->ctx.fid.fclass == FI_CLASS_SRX_CTX) {
+		dlist_foreach(&rx_ctx->ep_list, entry) {
+			ep_attr = container_of(entry, struct sock_ep_attr,
+					       rx_ctx_entry);
+			fastlock_acquire(&ep_attr->cmap.lock);
+			sock_pe_new_rx_staged(pe, ep_attr, rx_ctx);
+			fastlock_release(&ep_attr->cmap.lock);
+		}
+	} else {
+		ep_attr = rx_ctx->ep_attr;
+		fastlock_acquire(&ep_attr->cmap.lock);
+		sock_pe_new_rx_staged(pe, ep_attr, rx_ctx);
+		fastlock_release(&ep_attr->cmap.lock);
+	}
+	if (last == rx_ctx->pe_entry_list.prev)
+		return 0;
+
+	for (entry = last->next; entry != &rx_ctx->pe_entry_list;) {
+		pe_entry = container_of(entry, struct sock_pe_entry, ctx_entry);
+		entry = entry->next;
+		ret = sock_pe_progress_rx_pe_entry(pe, pe_entry, rx_ctx);
+		if (ret < 0)
+			return ret;
+	}
+	return 1;
+}
+
+/*
+ * Copy the data of a local sender straight into the bound buffer, and
+ * report the receive.  Returns 0 if it has to be requested with a CTS
+ * instead.  The rx context lock is dropped during the copy; the entry
+ * is left alone meanwhile as it is no longer in SOCK_RNDV_SEND_CTS.
+ */
+static int sock_pe_pull_rndv(struct sock_rx_ctx *rx_ctx,
+			     struct sock_pe_entry *pe_entry,
+			     struct sock_rx_entry *rx_rndv)
+{
+	struct iovec iov[SOCK_EP_MAX_IOV_LIMIT];
+	size_t i, len = 0;
+	int ret;
+
+	if (!rx_rndv->rndv_src_cnt || !rx_rndv->conn->shm ||
+	    (rx_rndv->flags & FI_DISCARD))
+		return 0;
+
+	for (i = 0; i < rx_rndv->rx_op.dest_iov_len; i++) {
+		iov[i].iov_base = (void *) (uintptr_t) rx_rndv->iov[i].iov.addr;
+		iov[i].iov_len = rx_rndv->iov[i].iov.len;
+		len += iov[i].iov_len;
+	}
+	if (len < rx_rndv->total_len)
+		return 0;
+
+	rx_rndv->rndv_state = SOCK_RNDV_WAIT_DATA;
+	fastlock_release(&rx_ctx->lock);
+	ret = sock_shm_pull(rx_rndv->conn, iov, i, rx_rndv->rndv_src,
+			    rx_rndv->rndv_src_cnt);
+	if (!ret) {
+		SOCK_LOG_DBG("Copied rendezvous %" PRIu64 " from peer\n",
+			     rx_rndv->rndv_id);
+		pe_entry->flags = rx_rndv->flags;
+		pe_entry->context = rx_rndv->context;
+		pe_entry->data = rx_rndv->data;
+		pe_entry->tag = rx_rndv->tag;
+		pe_entry->addr = rx_rndv->addr;
+		pe_entry->data_len = rx_rndv->total_len;
+		pe_entry->buf = rx_rndv->iov[0].iov.addr;
+		sock_pe_report_recv_completion(pe_entry);
+	}
+	fastlock_acquire(&rx_ctx->lock);
+
+	if (ret)
+		return 0;
+
+	dlist_remove(&rx_rndv->entry);
+	sock_pe_release_rndv(rx_rndv);
+	return 1;
+}
+
+/*
+ * The data of rendezvous messages from a peer that went away is lost
+ * once nothing reads the connection anymore: drop the unmatched
+ * requests, and fail the receives bound to the others.
+ */
+static void sock_pe_progress_rndv_lost(struct sock_rx_ctx *rx_ctx)
+{
+	struct dlist_entry *entry;
+	struct sock_rx_entry *rx_rndv;
+	struct sock_pe_entry pe_entry;
+
+	fastlock_acquire(&rx_ctx->lock);
+	for (entry = rx_ctx->rx_rndv_ref_list.next;
+	     entry != &rx_ctx->rx_rndv_ref_list;) {
+		rx_rndv = container_of(entry, struct sock_rx_entry, conn_entry);
+		entry = entry->next;
+		if (!rx_rndv->conn->disconnected || rx_rndv->conn->rx_pe_entry)
+			continue;
+
+		SOCK_LOG_DBG("Peer of rendezvous %p went away\n", rx_rndv);
+		if (rx_rndv->rndv_state == SOCK_RNDV_UNMATCHED) {
+			sock_rx_dequeue_entry(rx_ctx, rx_rndv);
+			sock_pe_release_rndv(rx_rndv);
+			continue;
+		}
+
+		dlist_remove(&rx_rndv->entry);
+		if (!(rx_rndv->flags & FI_DISCARD)) {
+			memset(&pe_entry, 0, sizeof(pe_entry));
+			pe_entry.type = SOCK_PE_RX;
+			pe_entry.comp = rx_rndv->comp;
+			pe_entry.flags = rx_rndv->flags;
+			pe_entry.context = rx_rndv->context;
+			pe_entry.data = rx_rndv->data;
+			pe_entry.tag = rx_rndv->tag;
+			pe_entry.addr = rx_rndv->addr;
+			if (rx_rndv->rx_op.dest_iov_len)
+				pe_entry.pe.rx.rx_iov[0].iov.addr =
+					rx_rndv->iov[0].iov.addr;
+			sock_pe_report_rx_abort(&pe_entry, FI_ECONNABORTED);
+		}
+		sock_pe_release_rndv(rx_rndv);
+	}
+	fastlock_release(&rx_ctx->lock);
+}
+
+/*
+ * Ask the senders of newly matched rendezvous messages for their data,
+ * or tell local senders that it has been copied.
+ */
+static void sock_pe_progress_rndv_cts(struct sock_pe *pe,
+				      struct sock_rx_ctx *rx_ctx)
+{
+	struct dlist_entry *entry;
+	struct sock_rx_entry *rx_rndv;
+	struct sock_pe_entry *pe_entry;
+	struct sock_msg_response *response;
+
+	fastlock_acquire(&rx_ctx->lock);
+	for (entry = rx_ctx->rx_rndv_list.next;
+	     entry != &rx_ctx->rx_rndv_list;) {
+		rx_rndv = container_of(entry, struct sock_rx_entry, entry);
+		entry = entry->next;
+		if (rx_rndv->rndv_state != SOCK_RNDV_SEND_CTS ||
+		    rx_rndv->conn->disconnected)
+			continue;
+
+		pe_entry = sock_pe_acquire_entry(pe);
+		if (!pe_entry)
+			break;
+
+		memset(&pe_entry->pe.rx, 0, sizeof(pe_entry->pe.rx));
+		pe_entry->type = SOCK_PE_RX;
+		pe_entry->conn = rx_rndv->conn;
+		pe_entry->conn->pe_ref++;
+		pe_entry->ep_attr = rx_rndv->conn->ep_attr;
+		pe_entry->comp = rx_rndv->comp;
+		pe_entry->is_complete = 0;
+		pe_entry->pe.rx.header_read = 1;
+		pe_entry->pe.rx.pending_send = 1;
+		pe_entry->pe.rx.rndv_id = htonll(rx_rndv->rndv_id);
+
+		response = &pe_entry->response;
+		memset(response, 0, sizeof(*response));
+		response->pe_entry_id = htons(rx_rndv->rndv_pe_id);
+		response->msg_hdr.version = SOCK_WIRE_PROTO_VERSION;
+		pe_entry->done_len = 0;
+
+		if (sock_pe_pull_rndv(rx_ctx, pe_entry, rx_rndv)) {
+			response->msg_hdr.op_type = SOCK_OP_SEND_COMPLETE;
+			response->msg_hdr.msg_len = htonll(sizeof(*response));
+			pe_entry->total_len = sizeof(*response);
+		} else {
+			response->msg_hdr.op_type = SOCK_OP_RNDV_CTS;
+			response->msg_hdr.msg_len = htonll(sizeof(*response) +
+							   sizeof(uint64_t));
+			pe_entry->total_len = sizeof(*response) +
+					      sizeof(uint64_t);
+			rx_rndv->rndv_state = SOCK_RNDV_WAIT_DATA;
+			SOCK_LOG_DBG("Sending CTS for rendezvous %" PRIu64
+				     " on %p\n", rx_rndv->rndv_id, pe_entry);
+		}
+		dlist_insert_tail(&pe_entry->ctx_entry, &rx_ctx->pe_entry_list);
+
+		sock_pe_progress_pending_ack(pe, pe_entry);
+		if (pe_entry->is_complete)
+			sock_pe_release_entry(pe, pe_entry);
+	}
+	fastlock_release(&rx_ctx->lock);
+}
+
 int sock_pe_progress_rx_ctx(struct sock_pe *pe, struct sock_rx_ctx *rx_ctx)
 {
-	int ret = 0;
+	int i, ret = 0;
 	struct sock_ep_attr *ep_attr;
 	struct dlist_entry *entry;
 	struct sock_pe_entry *pe_entry;
@@ -2543,9 +3185,29 @@ int sock_pe_progress_rx_ctx(struct sock_pe *pe, struct sock_rx_ctx *rx_ctx)
 		if (ret < 0)
 			goto out;
 	}
+
+	for (i = 0; i < SOCK_RX_STAGE_BURST && !dlist_empty(&pe->rx_stage_list);
+	     i++) {
+		ret = sock_pe_progress_rx_staged(pe, rx_ctx);
+		if (ret < 0)
+			goto out;
+		if (!ret)
+			break;
+	}
+	ret = 0;
+
+	if (!dlist_empty(&rx_ctx->rx_rndv_ref_list))
+		sock_pe_progress_rndv_lost(rx_ctx);
+	if (!dlist_empty(&rx_ctx->rx_rndv_list))
+		sock_pe_progress_rndv_cts(pe, rx_ctx);
 out:
 	if (ret < 0)
 		SOCK_LOG_ERROR("failed to progress RX ctx\n");
+	/* send what this pass queued, in one go */
+	sock_comm_ack_flush_all(pe);
+	sock_comm_agg_flush_all(pe);
+	if (pe->uring)
+		sock_uring_progress(pe->uring);
 	fastlock_release(&pe->lock);
 	return ret;
 }
@@ -2578,7 +3240,7 @@ void sock_pe_progress_rx_ctrl_ctx(struct sock_pe *pe, struct sock_rx_ctx *rx_ctx
 
 int sock_pe_progress_tx_ctx(struct sock_pe *pe, struct sock_tx_ctx *tx_ctx)
 {
-	int ret = 0;
+	int i, ret = 0;
 	struct dlist_entry *entry;
 	struct sock_pe_entry *pe_entry;
 
@@ -2602,10 +3264,11 @@ int sock_pe_progress_tx_ctx(struct sock_pe *pe, struct sock_tx_ctx *tx_ctx)
 		}
 	}
 
+	/* take in a burst at once, so that small messages get packed */
 	fastlock_acquire(&tx_ctx->rlock);
-	if (!rbempty(&tx_ctx->rb) && !dlist_empty(&pe->free_list)) {
+	for (i = 0; i < SOCK_TX_AGG_MAX_CNT && ret >= 0 &&
+	     !rbempty(&tx_ctx->rb) && sock_pe_entry_avail(pe); i++)
 		ret = sock_pe_new_tx_entry(pe, tx_ctx);
-	}
 	fastlock_release(&tx_ctx->rlock);
 	if (ret < 0)
 		goto out;
@@ -2614,23 +3277,28 @@ int sock_pe_progress_tx_ctx(struct sock_pe *pe, struct sock_tx_ctx *tx_ctx)
 out:
 	if (ret < 0)
 		SOCK_LOG_ERROR("failed to progress TX ctx\n");
+	sock_comm_ack_flush_all(pe);
+	sock_comm_agg_flush_all(pe);
+	if (pe->uring)
+		sock_uring_progress(pe->uring);
 	fastlock_release(&pe->lock);
 	return ret;
 }
 
-static void sock_pe_poll(struct sock_pe *pe)
+/*
+ * Returns 1 if the PE has nothing to do until one of the fds in its
+ * epoll set becomes ready.
+ */
+static int sock_pe_idle(struct sock_pe *pe)
 {
-	char tmp;
-	int ret;
 	struct dlist_entry *entry;
 	struct sock_tx_ctx *tx_ctx;
 	struct sock_rx_ctx *rx_ctx;
 
-	if (pe->waittime && ((fi_gettime_ms() - pe->waittime) < sock_pe_waittime))
-		return;
-
-	if (dlist_empty(&pe->tx_list) && dlist_empty(&pe->rx_list))
-		return;
+	if ((dlist_empty(&pe->tx_list) && dlist_empty(&pe->rx_list)) ||
+	    !dlist_empty(&pe->tx_agg_list) || !dlist_empty(&pe->rx_stage_list) ||
+	    !dlist_empty(&pe->rx_ack_list))
+		return 0;
 
 	pthread_mutex_lock(&pe->list_lock);
 	if (!dlist_empty(&pe->tx_list)) {
@@ -2641,7 +3309,7 @@ static void sock_pe_poll(struct sock_pe *pe)
 			if (!rbempty(&tx_ctx->rb) ||
 			    !dlist_empty(&tx_ctx->pe_entry_list)) {
 				pthread_mutex_unlock(&pe->list_lock);
-				return;
+				return 0;
 			}
 		}
 	}
@@ -2654,38 +3322,130 @@ static void sock_pe_poll(struct sock_pe *pe)
 			if (!dlist_empty(&rx_ctx->rx_buffered_list) ||
 			    !dlist_empty(&rx_ctx->pe_entry_list)) {
 				pthread_mutex_unlock(&pe->list_lock);
-				return;
+				return 0;
 			}
 		}
 	}
 	pthread_mutex_unlock(&pe->list_lock);
 
-	ret = sock_epoll_wait(&pe->epoll_set, -1);
-        if (ret < 0)
-                SOCK_LOG_ERROR("poll failed : %s\n", strerror(errno));
+	return !sock_shm_prepare_wait(pe) &&
+	       !(pe->uring && sock_uring_prepare_wait(pe->uring));
+}
+
+static void sock_pe_read_signal(struct sock_pe *pe)
+{
+	char tmp;
 
-	fastlock_acquire(&pe->signal_lock);
 	if (pe->rcnt != pe->wcnt) {
 		if (ofi_read_socket(pe->signal_fds[SOCK_SIGNAL_RD_FD], &tmp, 1) == 1)
 			pe->rcnt++;
 		else
 			SOCK_LOG_ERROR("Invalid signal\n");
 	}
+}
+
+static void sock_pe_poll(struct sock_pe *pe)
+{
+	int ret;
+
+	if (pe->waittime && ((fi_gettime_ms() - pe->waittime) < sock_pe_waittime))
+		return;
+
+	if (!sock_pe_idle(pe))
+		return;
+
+	/* wake up to close connections that went idle meanwhile */
+	ret = sock_epoll_wait(&pe->epoll_set, sock_conn_reap_interval());
+        if (ret < 0)
+                SOCK_LOG_ERROR("poll failed : %s\n", strerror(errno));
+
+	fastlock_acquire(&pe->signal_lock);
+	sock_pe_read_signal(pe);
 	fastlock_release(&pe->signal_lock);
 	pe->waittime = fi_gettime_ms();
 }
 
+/*
+ * Blocking waits under FI_PROGRESS_MANUAL.  A waiter first keeps
+ * progressing the PE for about twice the recent gap between the
+ * completions it was waiting for, up to sock_wait_spin_max
+ * microseconds.  Past that window, or right away if completions come
+ * further apart than that, it sleeps on the PE epoll set until a
+ * connection has data or another thread signals the PE: new transmits,
+ * and completions written to a CQ or counter while a thread sleeps, do.
+ */
+void sock_spin_update(struct sock_spin *spin)
+{
+	uint64_t now, gap;
+
+	now = sock_gettime_us();
+	if (spin->last) {
+		/* a long idle period says nothing about the next burst */
+		gap = MIN(now - spin->last, 4 * (uint64_t) sock_wait_spin_max);
+		spin->gap = spin->gap ? (3 * spin->gap + gap) / 4 : gap;
+	}
+	spin->last = now;
+}
+
+uint64_t sock_spin_deadline(struct sock_spin *spin)
+{
+	uint64_t window;
+
+	if (sock_wait_spin_max < 0)
+		return UINT64_MAX;
+
+	if (!spin->last)
+		window = sock_wait_spin_max;
+	else if (spin->gap > (uint64_t) sock_wait_spin_max)
+		window = 0;
+	else
+		window = MIN(2 * spin->gap, (uint64_t) sock_wait_spin_max);
+	return sock_gettime_us() + window;
+}
+
+/*
+ * Sleep for up to timeout ms, unless ready(arg) holds once this thread
+ * can be signaled, or the PE has work of its own.  A signal is meant
+ * for every thread that was waiting when it was written, so it is only
+ * consumed once the last of those has left; later waiters checked
+ * ready() after it anyway.
+ */
+void sock_pe_wait(struct sock_pe *pe, int (*ready)(void *arg), void *arg,
+		  int timeout)
+{
+	int reap_interval, wcnt;
+
+	fastlock_acquire(&pe->signal_lock);
+	pe->num_waiters++;
+	wcnt = pe->wcnt;
+	fastlock_release(&pe->signal_lock);
+
+	if (!ready(arg) && sock_pe_idle(pe)) {
+		reap_interval = sock_conn_reap_interval();
+		if (reap_interval >= 0 &&
+		    (timeout < 0 || timeout > reap_interval))
+			timeout = reap_interval;
+		if (sock_epoll_wait(&pe->epoll_set, timeout) < 0)
+			SOCK_LOG_ERROR("poll failed : %s\n", strerror(errno));
+	}
+
+	fastlock_acquire(&pe->signal_lock);
+	pe->num_waiters--;
+	if (pe->rcnt != pe->wcnt && wcnt != pe->wcnt)
+		pe->signal_waiters--;
+	if (!pe->signal_waiters)
+		sock_pe_read_signal(pe);
+	fastlock_release(&pe->signal_lock);
+}
+
 #if !defined __APPLE__ && !defined _WIN32
-static void sock_thread_set_affinity(char *s)
+static void sock_parse_cpuset(char *s, cpu_set_t *mycpuset)
 {
 	char *saveptra = NULL, *saveptrb = NULL, *saveptrc = NULL;
 	char *a, *b, *c;
 	int j, first, last, stride;
-	cpu_set_t mycpuset;
-	pthread_t mythread;
 
-	mythread = pthread_self();
-	CPU_ZERO(&mycpuset);
+	CPU_ZERO(mycpuset);
 
 	a = strtok_r(s, ",", &saveptra);
 	while (a) {
@@ -2710,23 +3470,60 @@ static void sock_thread_set_affinity(char *s)
 			last = first;
 
 		for (j = first; j <= last; j += stride)
-			CPU_SET(j, &mycpuset);
+			CPU_SET(j, mycpuset);
 		a =  strtok_r(NULL, ",", &saveptra);
 	}
+}
+
+/*
+ * Bind the calling thread to the CPUs in s.  With several progress
+ * threads, thread 'index' is bound to the index-th CPU of the set
+ * (modulo its size) instead.
+ */
+static void sock_thread_set_affinity(const char *s, int index, int count)
+{
+	int j, n, cpu;
+	char *str;
+	cpu_set_t mycpuset, shardset;
+	pthread_t mythread;
+
+	str = strdup(s);
+	if (!str) {
+		SOCK_LOG_ERROR("failed to parse affinity string\n");
+		return;
+	}
+	sock_parse_cpuset(str, &mycpuset);
+	free(str);
+
+	n = CPU_COUNT(&mycpuset);
+	if (count > 1 && n > 0) {
+		CPU_ZERO(&shardset);
+		for (cpu = 0, j = index % n; cpu < CPU_SETSIZE; cpu++) {
+			if (!CPU_ISSET(cpu, &mycpuset))
+				continue;
+			if (j-- == 0) {
+				CPU_SET(cpu, &shardset);
+				break;
+			}
+		}
+		mycpuset = shardset;
+	}
 
+	mythread = pthread_self();
 	j = pthread_setaffinity_np(mythread, sizeof(cpu_set_t), &mycpuset);
 	if (j != 0)
 		SOCK_LOG_ERROR("pthread_setaffinity_np failed\n");
 }
 #endif
 
-static void sock_pe_set_affinity(void)
+static void sock_pe_set_affinity(struct sock_pe *pe)
 {
 	if (sock_pe_affinity_str == NULL)
 		return;
 
 #if !defined __APPLE__ && !defined _WIN32
-	sock_thread_set_affinity(sock_pe_affinity_str);
+	sock_thread_set_affinity(sock_pe_affinity_str, pe->shard_id,
+				 pe->num_shards);
 #else
 	SOCK_LOG_ERROR("*** FI_SOCKETS_PE_AFFINITY is not supported on OS X\n");
 #endif
@@ -2740,8 +3537,8 @@ static void *sock_pe_progress_thread(void *data)
 	struct sock_rx_ctx *rx_ctx;
 	struct sock_pe *pe = (struct sock_pe *)data;
 
-	SOCK_LOG_DBG("Progress thread started\n");
-	sock_pe_set_affinity();
+	SOCK_LOG_DBG("Progress thread %d started\n", pe->shard_id);
+	sock_pe_set_affinity(pe);
 	while (*((volatile int *)&pe->do_progress)) {
 		if (pe->domain->progress_mode == FI_PROGRESS_AUTO)
 			sock_pe_poll(pe);
@@ -2785,25 +3582,39 @@ static void sock_pe_init_table(struct sock_pe *pe)
 {
 	int i;
 
-	memset(&pe->pe_table, 0,
-	       sizeof(struct sock_pe_entry) * SOCK_PE_MAX_ENTRIES);
-
 	dlist_init(&pe->free_list);
 	dlist_init(&pe->busy_list);
-	dlist_init(&pe->pool_list);
 
-	for (i = 0; i < SOCK_PE_MAX_ENTRIES; i++) {
-		dlist_insert_head(&pe->pe_table[i].entry, &pe->free_list);
-		pe->pe_table[i].cache_sz = SOCK_PE_COMM_BUFF_SZ;
-		if (rbinit(&pe->pe_table[i].comm_buf, SOCK_PE_COMM_BUFF_SZ))
-			SOCK_LOG_ERROR("failed to init comm-cache\n");
+	for (i = 0; i < sock_pe_entries; i++) {
+		if (!sock_pe_alloc_entry(pe)) {
+			SOCK_LOG_ERROR("failed to allocate progress entries\n");
+			break;
+		}
 	}
+	SOCK_LOG_DBG("PE table init: %d entries\n", pe->num_entries);
+}
+
+static void sock_pe_free_table(struct sock_pe *pe)
+{
+	struct sock_pe_entry *pe_entry;
 
-	pe->num_free_entries = SOCK_PE_MAX_ENTRIES;
-	SOCK_LOG_DBG("PE table init: OK\n");
+	while (!dlist_empty(&pe->free_list)) {
+		pe_entry = container_of(pe->free_list.next,
+					struct sock_pe_entry, entry);
+		sock_pe_free_entry(pe, pe_entry);
+	}
+	while (!dlist_empty(&pe->busy_list)) {
+		pe_entry = container_of(pe->busy_list.next,
+					struct sock_pe_entry, entry);
+		sock_pe_free_entry(pe, pe_entry);
+	}
+	idx_reset(&pe->pe_idx);
+	idm_reset(&pe->pe_map);
+	util_buf_pool_destroy(pe->pe_pool);
 }
 
-struct sock_pe *sock_pe_init(struct sock_domain *domain)
+static struct sock_pe *sock_pe_create(struct sock_domain *domain,
+				      int shard_id, int num_shards)
 {
 	struct sock_pe *pe;
 
@@ -2811,19 +3622,29 @@ struct sock_pe *sock_pe_init(struct sock_domain *domain)
 	if (!pe)
 		return NULL;
 
-	sock_pe_init_table(pe);
 	dlist_init(&pe->tx_list);
 	dlist_init(&pe->rx_list);
+	dlist_init(&pe->shm_list);
+	dlist_init(&pe->tx_agg_list);
+	dlist_init(&pe->rx_stage_list);
+	dlist_init(&pe->rx_ack_list);
+	fastlock_init(&pe->shm_lock);
 	fastlock_init(&pe->lock);
 	fastlock_init(&pe->signal_lock);
 	pthread_mutex_init(&pe->list_lock, NULL);
 	pe->domain = domain;
-
-	pe->pe_rx_pool = util_buf_pool_create(sizeof(struct sock_pe_entry), 16, 0, 1024);
-	if (!pe->pe_rx_pool) {
+	pe->shard_id = shard_id;
+	pe->num_shards = num_shards;
+	atomic_initialize(&pe->num_ep, 0);
+
+	pe->pe_pool = util_buf_pool_create(sizeof(struct sock_pe_entry),
+					   SOCK_PE_ENTRY_ALIGN, 0,
+					   SOCK_PE_DEF_ENTRIES);
+	if (!pe->pe_pool) {
 		SOCK_LOG_ERROR("failed to create buffer pool\n");
 		goto err1;
 	}
+	sock_pe_init_table(pe);
 
 	pe->atomic_rx_pool = util_buf_pool_create(SOCK_EP_MAX_ATOMIC_SZ,
 						  16, 0, 32);
@@ -2837,13 +3658,23 @@ struct sock_pe *sock_pe_init(struct sock_domain *domain)
                 goto err3;
         }
 
-	if (domain->progress_mode == FI_PROGRESS_AUTO) {
-		if (socketpair(AF_UNIX, SOCK_STREAM, 0, pe->signal_fds) < 0)
-			goto err4;
+	if (sock_io_uring_enabled) {
+		if (sock_uring_create(&pe->uring)) {
+			SOCK_LOG_INFO("io_uring not available, using epoll\n");
+			pe->uring = NULL;
+		} else {
+			sock_epoll_add(&pe->epoll_set, sock_uring_fd(pe->uring));
+		}
+	}
 
-		fd_set_nonblock(pe->signal_fds[SOCK_SIGNAL_RD_FD]);
-		sock_epoll_add(&pe->epoll_set, pe->signal_fds[SOCK_SIGNAL_RD_FD]);
+	/* wakes the progress thread, or manual progress waiters */
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, pe->signal_fds) < 0)
+		goto err4;
 
+	fd_set_nonblock(pe->signal_fds[SOCK_SIGNAL_RD_FD]);
+	sock_epoll_add(&pe->epoll_set, pe->signal_fds[SOCK_SIGNAL_RD_FD]);
+
+	if (domain->progress_mode == FI_PROGRESS_AUTO) {
 		pe->do_progress = 1;
 		if (pthread_create(&pe->progress_thread, NULL,
 				   sock_pe_progress_thread, (void *)pe)) {
@@ -2858,55 +3689,104 @@ err5:
 	ofi_close_socket(pe->signal_fds[0]);
 	ofi_close_socket(pe->signal_fds[1]);
 err4:
+	if (pe->uring)
+		sock_uring_destroy(pe->uring);
 	sock_epoll_close(&pe->epoll_set);
 err3:
 	util_buf_pool_destroy(pe->atomic_rx_pool);
 err2:
-	util_buf_pool_destroy(pe->pe_rx_pool);
+	sock_pe_free_table(pe);
 err1:
 	fastlock_destroy(&pe->lock);
 	free(pe);
 	return NULL;
 }
 
-static void sock_pe_free_util_pool(struct sock_pe *pe)
+struct sock_pe *sock_pe_init(struct sock_domain *domain)
 {
-	struct dlist_entry *entry;
-	struct sock_pe_entry *pe_entry;
+	struct sock_pe *pe;
+	int i, num_shards;
 
-	while (!dlist_empty(&pe->pool_list)) {
-		entry = pe->pool_list.next;
-		pe_entry = container_of(entry, struct sock_pe_entry, entry);
-		rbfree(&pe_entry->comm_buf);
-		dlist_remove(&pe_entry->entry);
-		util_buf_release(pe->pe_rx_pool, pe_entry);
+	num_shards = (domain->progress_mode == FI_PROGRESS_AUTO &&
+		      sock_pe_threads > 1) ? sock_pe_threads : 1;
+
+	pe = sock_pe_create(domain, 0, num_shards);
+	if (!pe || num_shards == 1)
+		return pe;
+
+	pe->shard = calloc(num_shards, sizeof(*pe->shard));
+	if (!pe->shard) {
+		SOCK_LOG_ERROR("failed to allocate progress threads\n");
+		pe->num_shards = 1;
+		return pe;
 	}
 
-	util_buf_pool_destroy(pe->pe_rx_pool);
-	util_buf_pool_destroy(pe->atomic_rx_pool);
+	pe->shard[0] = pe;
+	for (i = 1; i < num_shards; i++) {
+		pe->shard[i] = sock_pe_create(domain, i, num_shards);
+		if (!pe->shard[i]) {
+			SOCK_LOG_ERROR("failed to create progress thread %d\n", i);
+			break;
+		}
+	}
+	pe->num_shards = i;
+	return pe;
 }
 
-void sock_pe_finalize(struct sock_pe *pe)
+struct sock_pe *sock_pe_get_shard(struct sock_pe *pe, int shared)
 {
+	struct sock_pe *shard = pe;
 	int i;
+
+	/* Shared contexts are progressed by the domain PE */
+	if (!shared) {
+		for (i = 1; i < pe->num_shards; i++) {
+			if (atomic_get(&pe->shard[i]->num_ep) <
+			    atomic_get(&shard->num_ep))
+				shard = pe->shard[i];
+		}
+	}
+	atomic_inc(&shard->num_ep);
+	return shard;
+}
+
+void sock_pe_put_shard(struct sock_pe *pe)
+{
+	atomic_dec(&pe->num_ep);
+}
+
+static void sock_pe_destroy(struct sock_pe *pe)
+{
 	if (pe->domain->progress_mode == FI_PROGRESS_AUTO) {
 		pe->do_progress = 0;
 		sock_pe_signal(pe);
 		pthread_join(pe->progress_thread, NULL);
-		ofi_close_socket(pe->signal_fds[0]);
-		ofi_close_socket(pe->signal_fds[1]);
-	}
-
-	for (i = 0; i < SOCK_PE_MAX_ENTRIES; i++) {
-		rbfree(&pe->pe_table[i].comm_buf);
 	}
+	ofi_close_socket(pe->signal_fds[0]);
+	ofi_close_socket(pe->signal_fds[1]);
 
-	sock_pe_free_util_pool(pe);
+	SOCK_LOG_INFO("PE %d: at most %d progress entries in use\n",
+		      pe->shard_id, pe->max_used_entries);
+	sock_pe_free_table(pe);
+	util_buf_pool_destroy(pe->atomic_rx_pool);
+	if (pe->uring)
+		sock_uring_destroy(pe->uring);
 	fastlock_destroy(&pe->lock);
 	fastlock_destroy(&pe->signal_lock);
+	fastlock_destroy(&pe->shm_lock);
 	pthread_mutex_destroy(&pe->list_lock);
 	sock_epoll_close(&pe->epoll_set);
 	free(pe);
+}
+
+void sock_pe_finalize(struct sock_pe *pe)
+{
+	int i;
+
+	for (i = 1; i < pe->num_shards; i++)
+		sock_pe_destroy(pe->shard[i]);
+	free(pe->shard);
+	sock_pe_destroy(pe);
 	SOCK_LOG_DBG("Progress engine finalize: OK\n");
 }
 
@@ -43,6 +43,8 @@
 
 #include "sock.h"
 #include "sock_util.h"
+#include "fasthash.h"
+#include "fi_mem.h"
 
 #define SOCK_LOG_DBG(...) _SOCK_LOG_DBG(FI_LOG_EP_DATA, __VA_ARGS__)
 #define SOCK_LOG_ERROR(...) _SOCK_LOG_ERROR(FI_LOG_EP_DATA, __VA_ARGS__)
@@ -82,6 +84,7 @@ struct sock_rx_entry *sock_rx_new_entry(struct sock_rx_ctx *rx_ctx)
 	rx_entry->is_tagged = 0;
 	SOCK_LOG_DBG("New rx_entry: %p, ctx: %p\n", rx_entry, rx_ctx);
 	dlist_init(&rx_entry->entry);
+	dlist_init(&rx_entry->match_entry);
 	rx_ctx->num_left--;
 	return rx_entry;
 }
@@ -90,7 +93,16 @@ void sock_rx_release_entry(struct sock_rx_entry *rx_entry)
 {
 	struct sock_rx_ctx *rx_ctx;
 	SOCK_LOG_DBG("Releasing rx_entry: %p\n", rx_entry);
-	if (rx_entry->is_pool_entry) {
+	if (rx_entry->is_buffered) {
+		rx_ctx = rx_entry->rx_ctx;
+		if (!rx_entry->rndv_state)
+			rx_ctx->buffered_len -= rx_entry->total_len;
+		if (rx_entry->buf_class)
+			util_buf_release(rx_ctx->buf_pool[rx_entry->buf_class - 1],
+					 rx_entry);
+		else
+			free(rx_entry);
+	} else if (rx_entry->is_pool_entry) {
 		rx_ctx = rx_entry->rx_ctx;
 		memset(rx_entry, 0, sizeof(*rx_entry));
 		rx_entry->rx_ctx =  rx_ctx;
@@ -101,21 +113,67 @@ void sock_rx_release_entry(struct sock_rx_entry *rx_entry)
 	}
 }
 
+/*
+ * Unexpected messages are charged against total_buffered_recv.  One
+ * message is always accepted into an empty buffer so that a message
+ * larger than the budget cannot stall its connection forever.
+ */
+int sock_rx_buffer_full(struct sock_rx_ctx *rx_ctx, size_t len)
+{
+	return rx_ctx->buffered_len &&
+	       rx_ctx->buffered_len + len > rx_ctx->attr.total_buffered_recv;
+}
+
+static int sock_rx_buf_class(size_t len)
+{
+	int i;
+
+	for (i = 0; i < SOCK_RX_BUF_CLASSES; i++) {
+		if (len <= (1ULL << (SOCK_RX_BUF_MIN_SHIFT +
+				     i * SOCK_RX_BUF_CLASS_SHIFT)))
+			return i;
+	}
+	return -1;
+}
+
+static struct sock_rx_entry *sock_rx_buf_alloc(struct sock_rx_ctx *rx_ctx,
+					       int buf_class)
+{
+	size_t size;
+
+	if (!rx_ctx->buf_pool[buf_class]) {
+		size = 1ULL << (SOCK_RX_BUF_MIN_SHIFT +
+				buf_class * SOCK_RX_BUF_CLASS_SHIFT);
+		rx_ctx->buf_pool[buf_class] = util_buf_pool_create(
+				sizeof(struct sock_rx_entry) + size, 16, 0,
+				SOCK_RX_BUF_CHUNK_SZ / size);
+		if (!rx_ctx->buf_pool[buf_class])
+			return NULL;
+	}
+	return util_buf_alloc(rx_ctx->buf_pool[buf_class]);
+}
+
 struct sock_rx_entry *sock_rx_new_buffered_entry(struct sock_rx_ctx *rx_ctx,
 						 size_t len)
 {
 	struct sock_rx_entry *rx_entry;
+	int buf_class;
 
-	if (rx_ctx->buffered_len + len >= rx_ctx->attr.total_buffered_recv)
-		SOCK_LOG_ERROR("Exceeded buffered recv limit\n");
-
-	rx_entry = calloc(1, sizeof(*rx_entry) + len);
+	buf_class = sock_rx_buf_class(len);
+	if (buf_class < 0) {
+		rx_entry = malloc(sizeof(*rx_entry) + len);
+	} else {
+		rx_entry = sock_rx_buf_alloc(rx_ctx, buf_class);
+	}
 	if (!rx_entry)
 		return NULL;
 
 	SOCK_LOG_DBG("New buffered entry:%p len: %lu, ctx: %p\n",
 		       rx_entry, len, rx_ctx);
 
+	memset(rx_entry, 0, sizeof(*rx_entry));
+	rx_entry->buf_class = buf_class + 1;
+	rx_entry->rx_ctx = rx_ctx;
 	rx_entry->is_busy = 1;
 	rx_entry->is_buffered = 1;
 	rx_entry->rx_op.dest_iov_len = 1;
@@ -124,37 +182,283 @@ struct sock_rx_entry *sock_rx_new_buffered_entry(struct sock_rx_ctx *rx_ctx,
 	rx_entry->total_len = len;
 
 	rx_ctx->buffered_len += len;
+	dlist_init(&rx_entry->entry);
+	dlist_init(&rx_entry->match_entry);
+	return rx_entry;
+}
+
+void sock_rx_buffer_finalize(struct sock_rx_ctx *rx_ctx)
+{
+	struct sock_rx_entry *rx_entry;
+	int i;
+
+	while (!dlist_empty(&rx_ctx->rx_buffered_list)) {
+		rx_entry = container_of(rx_ctx->rx_buffered_list.next,
+					struct sock_rx_entry, entry);
+		sock_rx_dequeue_entry(rx_ctx, rx_entry);
+		sock_rx_release_entry(rx_entry);
+	}
+
+	for (i = 0; i < SOCK_RX_BUF_CLASSES; i++) {
+		if (rx_ctx->buf_pool[i])
+			util_buf_pool_destroy(rx_ctx->buf_pool[i]);
+	}
+}
+
+static inline int sock_rx_match(struct sock_rx_ctx *rx_ctx,
+				struct sock_rx_entry *rx_entry,
+				uint64_t addr, uint64_t tag, uint64_t ignore)
+{
+	return ((rx_entry->tag & ~ignore) == (tag & ~ignore)) &&
+		(rx_entry->addr == FI_ADDR_UNSPEC || addr == FI_ADDR_UNSPEC ||
+		 rx_entry->addr == addr ||
+		 (rx_ctx->av &&
+		  !sock_av_compare_addr(rx_ctx->av, addr, rx_entry->addr)));
+}
+
+/*
+ * The source part of a match key must agree with sock_av_compare_addr,
+ * so it is derived from the AV table contents rather than the fi_addr.
+ * Without an AV every incoming message carries an unusable address and
+ * only posted receives for FI_ADDR_UNSPEC can be keyed.
+ */
+static inline int sock_rx_src_key(struct sock_rx_ctx *rx_ctx, uint64_t addr,
+				  int posted, uint64_t *key)
+{
+	uint64_t index;
+
+	if (!rx_ctx->av) {
+		*key = 0;
+		return !posted || addr == FI_ADDR_UNSPEC;
+	}
+
+	if (addr == FI_ADDR_UNSPEC)
+		return 0;
+
+	index = addr & rx_ctx->av->mask;
+	if (index >= rx_ctx->av->table_hdr->stored)
+		return 0;
+
+	*key = fasthash64(&rx_ctx->av->table[index].addr,
+			  sizeof(struct sockaddr_in), 0);
+	return 1;
+}
+
+static inline uint64_t sock_rx_hash(uint64_t src, uint64_t tag,
+				    uint8_t is_tagged)
+{
+	uint64_t key[2];
+
+	key[0] = is_tagged ? tag : 0;
+	key[1] = is_tagged;
+	return fasthash64(key, sizeof(key), src);
+}
+
+/* Hash of a posted receive; fails if it carries a wildcard */
+static int sock_rx_posted_hash(struct sock_rx_ctx *rx_ctx, uint64_t addr,
+			       uint64_t tag, uint64_t ignore,
+			       uint8_t is_tagged, uint64_t *hash)
+{
+	uint64_t src;
+
+	if (!rx_ctx->rx_entry_hash || (is_tagged && ignore) ||
+	    !sock_rx_src_key(rx_ctx, addr, 1, &src))
+		return 0;
+
+	*hash = sock_rx_hash(src, tag, is_tagged);
+	return 1;
+}
+
+static void sock_rx_rehash_list(struct dlist_entry *list,
+				struct dlist_entry *table, uint64_t mask)
+{
+	struct dlist_entry *entry;
+	struct sock_rx_entry *rx_entry;
+
+	for (entry = list->next; entry != list; entry = entry->next) {
+		rx_entry = container_of(entry, struct sock_rx_entry, entry);
+		if (rx_entry->is_hashed)
+			dlist_insert_tail(&rx_entry->match_entry,
+					  &table[rx_entry->match_hash & mask]);
+	}
+}
+
+/*
+ * Double both tables.  The ordered lists are walked front to back, so
+ * every new bucket stays in post or arrival order.  If the allocation
+ * fails the old tables stay in use, only with longer chains.
+ */
+static void sock_rx_match_grow(struct sock_rx_ctx *rx_ctx)
+{
+	struct dlist_entry *table;
+	size_t i, size;
+
+	size = (rx_ctx->hash_mask + 1) * 2;
+	table = calloc(2 * size, sizeof(*table));
+	if (!table)
+		return;
+
+	for (i = 0; i < 2 * size; i++)
+		dlist_init(&table[i]);
+
+	sock_rx_rehash_list(&rx_ctx->rx_entry_list, table, size - 1);
+	sock_rx_rehash_list(&rx_ctx->rx_buffered_list, table + size, size - 1);
+
+	free(rx_ctx->rx_entry_hash);
+	rx_ctx->rx_entry_hash = table;
+	rx_ctx->rx_buffered_hash = table + size;
+	rx_ctx->hash_mask = size - 1;
+}
+
+static void sock_rx_hash_entry(struct sock_rx_ctx *rx_ctx,
+			       struct dlist_entry *table,
+			       struct sock_rx_entry *rx_entry, uint64_t hash)
+{
+	rx_entry->match_hash = hash;
+	rx_entry->is_hashed = 1;
+	dlist_insert_tail(&rx_entry->match_entry,
+			  &table[hash & rx_ctx->hash_mask]);
+
+	if (++rx_ctx->num_hashed > rx_ctx->hash_mask + 1)
+		sock_rx_match_grow(rx_ctx);
+}
+
+int sock_rx_match_init(struct sock_rx_ctx *rx_ctx)
+{
+	size_t i, size;
+
+	size = roundup_power_of_two(MAX(rx_ctx->attr.size,
+					SOCK_RX_HASH_MIN_SZ));
+	rx_ctx->rx_entry_hash = calloc(2 * size, sizeof(struct dlist_entry));
+	if (!rx_ctx->rx_entry_hash)
+		return -FI_ENOMEM;
+
+	rx_ctx->rx_buffered_hash = rx_ctx->rx_entry_hash + size;
+	for (i = 0; i < 2 * size; i++)
+		dlist_init(&rx_ctx->rx_entry_hash[i]);
+
+	dlist_init(&rx_ctx->rx_wildcard_list);
+	rx_ctx->hash_mask = size - 1;
+	rx_ctx->num_hashed = 0;
+	return 0;
+}
+
+void sock_rx_match_finalize(struct sock_rx_ctx *rx_ctx)
+{
+	free(rx_ctx->rx_entry_hash);
+	rx_ctx->rx_entry_hash = rx_ctx->rx_buffered_hash = NULL;
+}
+
+void sock_rx_enqueue_entry(struct sock_rx_ctx *rx_ctx,
+			   struct sock_rx_entry *rx_entry)
+{
+	uint64_t hash;
+
+	rx_entry->seq = rx_ctx->post_seq++;
+	dlist_insert_tail(&rx_entry->entry, &rx_ctx->rx_entry_list);
+	if (sock_rx_posted_hash(rx_ctx, rx_entry->addr, rx_entry->tag,
+				rx_entry->ignore, rx_entry->is_tagged, &hash))
+		sock_rx_hash_entry(rx_ctx, rx_ctx->rx_entry_hash, rx_entry,
+				   hash);
+	else
+		dlist_insert_tail(&rx_entry->match_entry,
+				  &rx_ctx->rx_wildcard_list);
+}
+
+void sock_rx_enqueue_buffered_entry(struct sock_rx_ctx *rx_ctx,
+				    struct sock_rx_entry *rx_entry)
+{
+	uint64_t src;
+
 	dlist_insert_tail(&rx_entry->entry, &rx_ctx->rx_buffered_list);
-	rx_entry->is_busy = 1;
-	rx_entry->is_tagged = 0;
+	if (rx_ctx->rx_buffered_hash &&
+	    sock_rx_src_key(rx_ctx, rx_entry->addr, 0, &src))
+		sock_rx_hash_entry(rx_ctx, rx_ctx->rx_buffered_hash, rx_entry,
+				   sock_rx_hash(src, rx_entry->tag,
+						rx_entry->is_tagged));
+	else
+		rx_ctx->num_buffered_unkeyed++;
+}
 
-	return rx_entry;
+void sock_rx_dequeue_entry(struct sock_rx_ctx *rx_ctx,
+			   struct sock_rx_entry *rx_entry)
+{
+	if (rx_entry->is_hashed)
+		rx_ctx->num_hashed--;
+	else if (rx_entry->is_buffered)
+		rx_ctx->num_buffered_unkeyed--;
+
+	dlist_remove(&rx_entry->match_entry);
+	dlist_init(&rx_entry->match_entry);
+	dlist_remove(&rx_entry->entry);
+	rx_entry->is_hashed = 0;
 }
 
 struct sock_rx_entry *sock_rx_get_entry(struct sock_rx_ctx *rx_ctx,
 					uint64_t addr, uint64_t tag,
 					uint8_t is_tagged)
 {
-	struct dlist_entry *entry;
-	struct sock_rx_entry *rx_entry;
+	struct dlist_entry *entry, *bucket;
+	struct sock_rx_entry *rx_entry, *match = NULL;
+	uint64_t src;
 
-	for (entry = rx_ctx->rx_entry_list.next;
-	     entry != &rx_ctx->rx_entry_list; entry = entry->next) {
+	if (!rx_ctx->rx_entry_hash || !sock_rx_src_key(rx_ctx, addr, 0, &src)) {
+		for (entry = rx_ctx->rx_entry_list.next;
+		     entry != &rx_ctx->rx_entry_list; entry = entry->next) {
+			rx_entry = container_of(entry, struct sock_rx_entry,
+						entry);
+			if (rx_entry->is_busy ||
+			    (is_tagged != rx_entry->is_tagged))
+				continue;
 
-		rx_entry = container_of(entry, struct sock_rx_entry, entry);
+			if (sock_rx_match(rx_ctx, rx_entry, addr, tag,
+					  rx_entry->ignore)) {
+				match = rx_entry;
+				break;
+			}
+		}
+		goto out;
+	}
+
+	/*
+	 * The earliest posted match is either the first match in the
+	 * bucket or an older receive on the wildcard list.
+	 */
+	bucket = &rx_ctx->rx_entry_hash[sock_rx_hash(src, tag, is_tagged) &
+					rx_ctx->hash_mask];
+	for (entry = bucket->next; entry != bucket; entry = entry->next) {
+		rx_entry = container_of(entry, struct sock_rx_entry,
+					match_entry);
 		if (rx_entry->is_busy || (is_tagged != rx_entry->is_tagged))
 			continue;
 
-		if (((rx_entry->tag & ~rx_entry->ignore) == (tag & ~rx_entry->ignore)) &&
-		    (rx_entry->addr == FI_ADDR_UNSPEC || addr == FI_ADDR_UNSPEC ||
-		     rx_entry->addr == addr ||
-		     (rx_ctx->av &&
-		      !sock_av_compare_addr(rx_ctx->av, addr, rx_entry->addr)))) {
-			rx_entry->is_busy = 1;
-			return rx_entry;
+		if (sock_rx_match(rx_ctx, rx_entry, addr, tag,
+				  rx_entry->ignore)) {
+			match = rx_entry;
+			break;
 		}
 	}
-	return NULL;
+
+	for (entry = rx_ctx->rx_wildcard_list.next;
+	     entry != &rx_ctx->rx_wildcard_list; entry = entry->next) {
+		rx_entry = container_of(entry, struct sock_rx_entry,
+					match_entry);
+		if (match && rx_entry->seq > match->seq)
+			break;
+
+		if (rx_entry->is_busy || (is_tagged != rx_entry->is_tagged))
+			continue;
+
+		if (sock_rx_match(rx_ctx, rx_entry, addr, tag,
+				  rx_entry->ignore)) {
+			match = rx_entry;
+			break;
+		}
+	}
+out:
+	if (match)
+		match->is_busy = 1;
+	return match;
 }
 
 struct sock_rx_entry *sock_rx_get_buffered_entry(struct sock_rx_ctx *rx_ctx,
@@ -162,8 +466,31 @@ struct sock_rx_entry *sock_rx_get_buffered_entry(struct sock_rx_ctx *rx_ctx,
 						uint64_t ignore,
 						uint8_t is_tagged)
 {
-	struct dlist_entry *entry;
+	struct dlist_entry *entry, *bucket;
 	struct sock_rx_entry *rx_entry;
+	uint64_t hash;
+
+	/*
+	 * Unkeyed messages may match anything, so the bucket can only be
+	 * used while none are buffered.
+	 */
+	if (!rx_ctx->num_buffered_unkeyed &&
+	    sock_rx_posted_hash(rx_ctx, addr, tag, ignore, is_tagged, &hash)) {
+		bucket = &rx_ctx->rx_buffered_hash[hash & rx_ctx->hash_mask];
+		for (entry = bucket->next; entry != bucket;
+		     entry = entry->next) {
+			rx_entry = container_of(entry, struct sock_rx_entry,
+						match_entry);
+			if (rx_entry->is_busy ||
+			    (is_tagged != rx_entry->is_tagged) ||
+			    rx_entry->is_claimed)
+				continue;
+
+			if (sock_rx_match(rx_ctx, rx_entry, addr, tag, ignore))
+				return rx_entry;
+		}
+		return NULL;
+	}
 
 	for (entry = rx_ctx->rx_buffered_list.next;
 	     entry != &rx_ctx->rx_buffered_list; entry = entry->next) {
@@ -173,13 +500,8 @@ struct sock_rx_entry *sock_rx_get_buffered_entry(struct sock_rx_ctx *rx_ctx,
 		    rx_entry->is_claimed)
 			continue;
 
-		if (((rx_entry->tag & ~ignore) == (tag & ~ignore)) &&
-		    (rx_entry->addr == FI_ADDR_UNSPEC || addr == FI_ADDR_UNSPEC ||
-		     rx_entry->addr == addr ||
-		     (rx_ctx->av &&
-		      !sock_av_compare_addr(rx_ctx->av, addr, rx_entry->addr)))) {
+		if (sock_rx_match(rx_ctx, rx_entry, addr, tag, ignore))
 			return rx_entry;
-		}
 	}
 	return NULL;
 }
@@ -0,0 +1,574 @@
+/*
+ * Copyright (c) 2014 Intel Corporation, Inc.  All rights reserved.
+ *
+ * This software is available to you under a choice of one of two
+ * licenses.  You may choose to be licensed under the terms of the GNU
+ * General Public License (GPL) Version 2, available from the file
+ * COPYING in the main directory of this source tree, or the
+ * BSD license below:
+ *
+ *     Redistribution and use in source and binary forms, with or
+ *     without modification, are permitted provided that the following
+ *     conditions are met:
+ *
+ *      - Redistributions of source code must retain the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer.
+ *
+ *      - Redistributions in binary form must reproduce the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer in the documentation and/or other materials
+ *        provided with the distribution.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#include "config.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <unistd.h>
+
+#include "sock.h"
+#include "sock_util.h"
+#include "fi_util.h"
+
+#define SOCK_LOG_DBG(...) _SOCK_LOG_DBG(FI_LOG_EP_DATA, __VA_ARGS__)
+#define SOCK_LOG_ERROR(...) _SOCK_LOG_ERROR(FI_LOG_EP_DATA, __VA_ARGS__)
+
+#ifdef HAVE_ATOMICS
+
+#define SOCK_SHM_MAGIC (0x66695f736f636b31ULL)
+#define SOCK_SHM_MAX_RING_SZ (1ULL << 30)
+
+/*
+ * head is only written by the consumer and tail by the producer; both
+ * count bytes since the connection was opened.  A consumer about to
+ * sleep sets waiting, and the producer rings the socket when it finds it
+ * set.  closed is set by the producer when it goes away.
+ */
+struct sock_shm_ring {
+	atomic_uint_fast64_t head;
+	char pad0[UTIL_CACHE_LINE_SIZE - sizeof(atomic_uint_fast64_t)];
+	atomic_uint_fast64_t tail;
+	atomic_int waiting;
+	atomic_int closed;
+	char pad1[UTIL_CACHE_LINE_SIZE - sizeof(atomic_uint_fast64_t) -
+		  2 * sizeof(atomic_int)];
+};
+
+/*
+ * pid of each side, and a value stored at cookie_addr in its memory:
+ * reading it back with process_vm_readv() proves that pid names the
+ * peer from our point of view, e.g. across PID namespaces.
+ */
+struct sock_shm_peer {
+	int32_t pid;
+	uint32_t reserved;
+	uint64_t cookie;
+	uint64_t cookie_addr;
+};
+
+/* ring[0] is written by the side that created the segment */
+struct sock_shm_seg {
+	struct sock_shm_ring ring[2];
+	uint64_t magic;
+	uint64_t ring_sz;
+	struct sock_shm_peer peer[2];
+};
+
+#define SOCK_SHM_DATA_OFFSET \
+	((sizeof(struct sock_shm_seg) + UTIL_CACHE_LINE_SIZE - 1) & \
+	 ~(UTIL_CACHE_LINE_SIZE - 1))
+
+struct sock_shm_conn {
+	struct util_shm shm;
+	struct sock_shm_seg *seg;
+	struct sock_shm_ring *tx, *rx;
+	char *tx_data, *rx_data;
+	uint64_t mask;
+	int side;
+	int rx_active;
+	int eof;
+	int pull;
+	uint64_t cookie;
+	struct sock_pe *pe;
+	struct dlist_entry entry;
+};
+
+static atomic_uint_fast64_t sock_shm_seq;
+
+/* the peer connected to one of our addresses, or from it */
+int sock_shm_is_local(struct sock_conn *conn)
+{
+	struct sockaddr_in local, peer;
+	socklen_t len;
+
+	len = sizeof(local);
+	if (getsockname(conn->sock_fd, (struct sockaddr *) &local, &len) ||
+	    local.sin_family != AF_INET)
+		return 0;
+
+	len = sizeof(peer);
+	if (getpeername(conn->sock_fd, (struct sockaddr *) &peer, &len) ||
+	    peer.sin_family != AF_INET)
+		return 0;
+
+	return local.sin_addr.s_addr == peer.sin_addr.s_addr;
+}
+
+static size_t sock_shm_seg_size(uint64_t ring_sz)
+{
+	return SOCK_SHM_DATA_OFFSET + 2 * ring_sz;
+}
+
+static void sock_shm_setup(struct sock_conn *conn, struct sock_shm_conn *shm,
+			   int side)
+{
+	struct sock_shm_seg *seg = shm->seg;
+
+	/* the mapping is all we need; keep the fd budget for sockets */
+	close(shm->shm.shared_fd);
+	shm->shm.shared_fd = -1;
+
+	shm->side = side;
+	shm->tx = &seg->ring[side];
+	shm->rx = &seg->ring[!side];
+	shm->tx_data = (char *) seg + SOCK_SHM_DATA_OFFSET + side * seg->ring_sz;
+	shm->rx_data = (char *) seg + SOCK_SHM_DATA_OFFSET + !side * seg->ring_sz;
+	shm->mask = seg->ring_sz - 1;
+
+	shm->cookie = ((uint64_t) getpid() << 32) ^ fi_gettime_ms() ^
+		      (uintptr_t) shm;
+	seg->peer[side].pid = getpid();
+	seg->peer[side].cookie = shm->cookie;
+	seg->peer[side].cookie_addr = (uintptr_t) &shm->cookie;
+
+	shm->pe = conn->ep_attr->pe;
+	fastlock_acquire(&shm->pe->shm_lock);
+	dlist_insert_tail(&shm->entry, &shm->pe->shm_list);
+	fastlock_release(&shm->pe->shm_lock);
+
+	conn->shm = shm;
+	conn->ep_attr->cmap.num_shm++;
+}
+
+/* Called with the connection map lock held */
+int sock_shm_create(struct sock_conn *conn, struct sock_conn_shm_req *req)
+{
+	struct sock_shm_conn *shm;
+	struct sock_shm_seg *seg;
+	uint64_t ring_sz;
+	void *ptr;
+	int ret;
+
+	shm = calloc(1, sizeof(*shm));
+	if (!shm)
+		return -FI_ENOMEM;
+
+	ring_sz = roundup_power_of_two(MAX(sock_shm_ring_sz, 4096));
+	ring_sz = MIN(ring_sz, SOCK_SHM_MAX_RING_SZ);
+	snprintf(req->name, sizeof(req->name), "fi_sock_%d_%" PRIu64, getpid(),
+		 (uint64_t) atomic_fetch_add(&sock_shm_seq, 1));
+
+	ret = ofi_shm_map(&shm->shm, req->name, sock_shm_seg_size(ring_sz),
+			  0, &ptr);
+	if (ret) {
+		free(shm);
+		return ret;
+	}
+
+	seg = ptr;
+	memset(seg, 0, SOCK_SHM_DATA_OFFSET);
+	seg->magic = SOCK_SHM_MAGIC;
+	seg->ring_sz = ring_sz;
+	shm->seg = seg;
+	sock_shm_setup(conn, shm, 0);
+
+	req->ring_sz = htonll(ring_sz);
+	SOCK_LOG_DBG("Created %s for %s:%d\n", req->name,
+		     inet_ntoa(conn->addr.sin_addr), ntohs(conn->addr.sin_port));
+	return 0;
+}
+
+/* Called with the connection map lock held */
+int sock_shm_attach(struct sock_conn *conn, struct sock_conn_shm_req *req)
+{
+	struct sock_shm_conn *shm;
+	struct sock_shm_seg *seg;
+	uint64_t ring_sz;
+	void *ptr;
+	int ret;
+
+	ring_sz = ntohll(req->ring_sz);
+	if (ring_sz < 4096 || ring_sz > SOCK_SHM_MAX_RING_SZ ||
+	    (ring_sz & (ring_sz - 1)))
+		return -FI_EINVAL;
+
+	shm = calloc(1, sizeof(*shm));
+	if (!shm)
+		return -FI_ENOMEM;
+
+	req->name[SOCK_SHM_NAME_LEN - 1] = '\0';
+	ret = ofi_shm_map(&shm->shm, req->name, sock_shm_seg_size(ring_sz),
+			  1, &ptr);
+	if (ret) {
+		free(shm);
+		return ret;
+	}
+
+	seg = ptr;
+	if (seg->magic != SOCK_SHM_MAGIC || seg->ring_sz != ring_sz) {
+		SOCK_LOG_ERROR("invalid shared memory segment %s\n", req->name);
+		ofi_shm_unmap(&shm->shm);
+		free(shm);
+		return -FI_EINVAL;
+	}
+
+	/* nobody else may open it, and its name may be reused */
+	shm_unlink(shm->shm.name);
+	free((void *) shm->shm.name);
+	shm->shm.name = NULL;
+
+	shm->seg = seg;
+	shm->rx_active = 1;
+	sock_shm_setup(conn, shm, 1);
+	SOCK_LOG_DBG("Attached to %s\n", req->name);
+	return 0;
+}
+
+/*
+ * The peer attached: its messages now come through the segment, which no
+ * longer needs a name
+ */
+void sock_shm_connected(struct sock_conn *conn)
+{
+	struct sock_shm_conn *shm = conn->shm;
+
+	shm->rx_active = 1;
+	if (shm->shm.name) {
+		shm_unlink(shm->shm.name);
+		free((void *) shm->shm.name);
+		shm->shm.name = NULL;
+	}
+}
+
+/* Called with the connection map lock held, or on endpoint close */
+void sock_shm_detach(struct sock_conn *conn)
+{
+	struct sock_shm_conn *shm = conn->shm;
+
+	if (!shm)
+		return;
+
+	atomic_store(&shm->tx->closed, 1);
+	fastlock_acquire(&shm->pe->shm_lock);
+	dlist_remove(&shm->entry);
+	fastlock_release(&shm->pe->shm_lock);
+
+	ofi_shm_unmap(&shm->shm);
+	free(shm);
+	conn->shm = NULL;
+	conn->ep_attr->cmap.num_shm--;
+}
+
+static void sock_shm_notify(struct sock_conn *conn)
+{
+	struct sock_shm_ring *tx = conn->shm->tx;
+	char c = 0;
+
+	if (atomic_load(&tx->waiting) && atomic_exchange(&tx->waiting, 0)) {
+		if (send(conn->sock_fd, &c, 1, SOCK_SEND_NOSIGNAL) != 1)
+			SOCK_LOG_DBG("wakeup %s\n", strerror(ofi_sockerr()));
+	}
+}
+
+/*
+ * Write as much of the iov as fits.  Like a non-blocking socket, returns
+ * 0 when the ring is full.
+ */
+ssize_t sock_shm_sendv(struct sock_conn *conn, const struct iovec *iov,
+		       size_t iov_cnt)
+{
+	struct sock_shm_conn *shm = conn->shm;
+	uint64_t head, tail, pos, avail;
+	size_t i, len, off, n, done = 0;
+
+	tail = atomic_load_explicit(&shm->tx->tail, memory_order_relaxed);
+	head = atomic_load_explicit(&shm->tx->head, memory_order_acquire);
+	avail = shm->mask + 1 - (tail - head);
+
+	for (i = 0; i < iov_cnt && avail; i++) {
+		len = MIN(iov[i].iov_len, avail);
+		pos = (tail + done) & shm->mask;
+		n = MIN(len, shm->mask + 1 - pos);
+		memcpy(shm->tx_data + pos, iov[i].iov_base, n);
+		off = n;
+		if (off < len)
+			memcpy(shm->tx_data, (char *) iov[i].iov_base + off,
+			       len - off);
+		done += len;
+		avail -= len;
+	}
+
+	if (!done)
+		return 0;
+
+	/* orders the tail update before the check of waiting */
+	atomic_store(&shm->tx->tail, tail + done);
+	sock_shm_notify(conn);
+	SOCK_LOG_DBG("wrote to shm: %lu\n", done);
+	return done;
+}
+
+ssize_t sock_shm_recv(struct sock_conn *conn, void *buf, size_t len, int peek)
+{
+	struct sock_shm_conn *shm = conn->shm;
+	uint64_t head, tail, pos;
+	size_t n;
+	int closed;
+
+	closed = atomic_load_explicit(&shm->rx->closed, memory_order_acquire);
+	head = atomic_load_explicit(&shm->rx->head, memory_order_relaxed);
+	tail = atomic_load_explicit(&shm->rx->tail, memory_order_acquire);
+
+	len = MIN(len, tail - head);
+	if (!len) {
+		if (closed || shm->eof) {
+			conn->disconnected = 1;
+			SOCK_LOG_DBG("Disconnected: %s:%d\n",
+				     inet_ntoa(conn->addr.sin_addr),
+				     ntohs(conn->addr.sin_port));
+		}
+		return 0;
+	}
+
+	pos = head & shm->mask;
+	n = MIN(len, shm->mask + 1 - pos);
+	memcpy(buf, shm->rx_data + pos, n);
+	if (n < len)
+		memcpy((char *) buf + n, shm->rx_data, len - n);
+
+	if (!peek)
+		atomic_store_explicit(&shm->rx->head, head + len,
+				      memory_order_release);
+	return len;
+}
+
+/* Messages from the peer are read from the segment, not the socket */
+int sock_shm_rx_active(struct sock_conn *conn)
+{
+	return conn->shm && conn->shm->rx_active;
+}
+
+int sock_shm_rx_ready(struct sock_conn *conn)
+{
+	struct sock_shm_conn *shm = conn->shm;
+
+	return shm->rx_active && (shm->eof || atomic_load(&shm->rx->closed) ||
+	       atomic_load_explicit(&shm->rx->tail, memory_order_relaxed) !=
+	       atomic_load_explicit(&shm->rx->head, memory_order_relaxed));
+}
+
+/* Consume wakeups from the socket, noting when the peer closed it */
+void sock_shm_drain(struct sock_conn *conn)
+{
+	char buf[64];
+	ssize_t ret;
+
+	do {
+		ret = recv(conn->sock_fd, buf, sizeof(buf), 0);
+	} while (ret == sizeof(buf));
+
+	if (!ret || (ret < 0 && ofi_sockerr() != EAGAIN &&
+		     ofi_sockerr() != EWOULDBLOCK && ofi_sockerr() != EINTR))
+		conn->shm->eof = 1;
+}
+
+/*
+ * Ask the peers of the PE's shared memory connections to ring the
+ * socket on their next write.  Returns non-zero if one of them already
+ * wrote, in which case the PE should not sleep.
+ */
+int sock_shm_prepare_wait(struct sock_pe *pe)
+{
+	struct sock_shm_conn *shm;
+	struct dlist_entry *entry;
+	int ready = 0;
+
+	fastlock_acquire(&pe->shm_lock);
+	dlist_foreach(&pe->shm_list, entry) {
+		shm = container_of(entry, struct sock_shm_conn, entry);
+		if (!shm->rx_active)
+			continue;
+		atomic_store(&shm->rx->waiting, 1);
+		if (atomic_load(&shm->rx->tail) != atomic_load(&shm->rx->head))
+			ready = 1;
+	}
+	fastlock_release(&pe->shm_lock);
+	return ready;
+}
+
+#ifdef HAVE_PROCESS_VM_READV
+static void sock_shm_iov_advance(struct iovec *iov, size_t *idx, size_t cnt,
+				 size_t len)
+{
+	while (*idx < cnt && len >= iov[*idx].iov_len) {
+		len -= iov[*idx].iov_len;
+		(*idx)++;
+	}
+	if (*idx < cnt) {
+		iov[*idx].iov_base = (char *) iov[*idx].iov_base + len;
+		iov[*idx].iov_len -= len;
+	}
+}
+
+static int sock_shm_check_peer(struct sock_shm_conn *shm)
+{
+	struct sock_shm_peer *peer = &shm->seg->peer[!shm->side];
+	struct iovec local, remote;
+	uint64_t cookie;
+
+	local.iov_base = &cookie;
+	local.iov_len = sizeof(cookie);
+	remote.iov_base = (void *) (uintptr_t) peer->cookie_addr;
+	remote.iov_len = sizeof(cookie);
+
+	if (process_vm_readv(peer->pid, &local, 1, &remote, 1, 0) !=
+	    sizeof(cookie)) {
+		SOCK_LOG_DBG("cannot read from pid %d: %s\n", peer->pid,
+			     strerror(errno));
+		return -FI_EACCES;
+	}
+	return cookie == peer->cookie ? 0 : -FI_EACCES;
+}
+
+/*
+ * Copy the local peer's buffers described by remote into local, which
+ * must be large enough.  Fails if the peer's memory cannot be read, in
+ * which case the connection does not try again.
+ */
+int sock_shm_pull(struct sock_conn *conn, const struct iovec *local,
+		  size_t local_cnt, const union sock_iov *remote,
+		  size_t remote_cnt)
+{
+	struct sock_shm_conn *shm = conn->shm;
+	struct iovec liov[SOCK_EP_MAX_IOV_LIMIT], riov[SOCK_EP_MAX_IOV_LIMIT];
+	size_t i, li = 0, ri = 0;
+	ssize_t ret;
+
+	if (!shm->pull)
+		shm->pull = sock_shm_check_peer(shm) ? -1 : 1;
+	if (shm->pull < 0)
+		return -FI_ENOSYS;
+
+	memcpy(liov, local, local_cnt * sizeof(*liov));
+	for (i = 0; i < remote_cnt; i++) {
+		riov[i].iov_base = (void *) (uintptr_t) remote[i].iov.addr;
+		riov[i].iov_len = remote[i].iov.len;
+	}
+
+	while (ri < remote_cnt && li < local_cnt) {
+		ret = process_vm_readv(shm->seg->peer[!shm->side].pid,
+				       &liov[li], local_cnt - li,
+				       &riov[ri], remote_cnt - ri, 0);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0) {
+			SOCK_LOG_ERROR("process_vm_readv: %s\n", strerror(errno));
+			shm->pull = -1;
+			return -FI_EIO;
+		}
+		sock_shm_iov_advance(liov, &li, local_cnt, ret);
+		sock_shm_iov_advance(riov, &ri, remote_cnt, ret);
+	}
+	return ri == remote_cnt ? 0 : -FI_ETRUNC;
+}
+#else
+int sock_shm_pull(struct sock_conn *conn, const struct iovec *local,
+		  size_t local_cnt, const union sock_iov *remote,
+		  size_t remote_cnt)
+{
+	return -FI_ENOSYS;
+}
+#endif /* HAVE_PROCESS_VM_READV */
+
+#else /* HAVE_ATOMICS */
+
+int sock_shm_is_local(struct sock_conn *conn)
+{
+	return 0;
+}
+
+int sock_shm_create(struct sock_conn *conn, struct sock_conn_shm_req *req)
+{
+	return -FI_ENOSYS;
+}
+
+int sock_shm_attach(struct sock_conn *conn, struct sock_conn_shm_req *req)
+{
+	return -FI_ENOSYS;
+}
+
+void sock_shm_connected(struct sock_conn *conn)
+{
+}
+
+void sock_shm_detach(struct sock_conn *conn)
+{
+}
+
+ssize_t sock_shm_sendv(struct sock_conn *conn, const struct iovec *iov,
+		       size_t iov_cnt)
+{
+	return -1;
+}
+
+ssize_t sock_shm_recv(struct sock_conn *conn, void *buf, size_t len, int peek)
+{
+	return 0;
+}
+
+int sock_shm_rx_active(struct sock_conn *conn)
+{
+	return 0;
+}
+
+int sock_shm_rx_ready(struct sock_conn *conn)
+{
+	return 0;
+}
+
+void sock_shm_drain(struct sock_conn *conn)
+{
+}
+
+int sock_shm_prepare_wait(struct sock_pe *pe)
+{
+	return 0;
+}
+
+int sock_shm_pull(struct sock_conn *conn, const struct iovec *local,
+		  size_t local_cnt, const union sock_iov *remote,
+		  size_t remote_cnt)
+{
+	return -FI_ENOSYS;
+}
+
+#endif /* HAVE_ATOMICS */
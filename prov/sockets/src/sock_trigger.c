@@ -58,7 +58,7 @@ ssize_t sock_queue_rma_op(struct fid_ep *ep, const struct fi_msg_rma *msg,
 
 	threshold = &trigger_context->trigger.threshold;
 	cntr = container_of(threshold->cntr, struct sock_cntr, cntr_fid);
-	if (atomic_get(&cntr->value) >= threshold->threshold)
+	if (atomic64_get(&cntr->value) >= threshold->threshold)
 		return 1;
 
 	trigger = calloc(1, sizeof(*trigger));
@@ -79,11 +79,7 @@ ssize_t sock_queue_rma_op(struct fid_ep *ep, const struct fi_msg_rma *msg,
 	trigger->ep = ep;
 	trigger->flags = flags;
 
-	fastlock_acquire(&cntr->trigger_lock);
-	dlist_insert_tail(&trigger->entry, &cntr->trigger_list);
-	fastlock_release(&cntr->trigger_lock);
-	sock_cntr_check_trigger_list(cntr);
-	return 0;
+	return sock_cntr_queue_trigger(cntr, trigger);
 }
 
 ssize_t sock_queue_msg_op(struct fid_ep *ep, const struct fi_msg *msg,
@@ -101,7 +97,7 @@ ssize_t sock_queue_msg_op(struct fid_ep *ep, const struct fi_msg *msg,
 
 	threshold = &trigger_context->trigger.threshold;
 	cntr = container_of(threshold->cntr, struct sock_cntr, cntr_fid);
-	if (atomic_get(&cntr->value) >= threshold->threshold)
+	if (atomic64_get(&cntr->value) >= threshold->threshold)
 		return 1;
 
 	trigger = calloc(1, sizeof(*trigger));
@@ -119,11 +115,7 @@ ssize_t sock_queue_msg_op(struct fid_ep *ep, const struct fi_msg *msg,
 	trigger->ep = ep;
 	trigger->flags = flags;
 
-	fastlock_acquire(&cntr->trigger_lock);
-	dlist_insert_tail(&trigger->entry, &cntr->trigger_list);
-	fastlock_release(&cntr->trigger_lock);
-	sock_cntr_check_trigger_list(cntr);
-	return 0;
+	return sock_cntr_queue_trigger(cntr, trigger);
 }
 
 ssize_t sock_queue_tmsg_op(struct fid_ep *ep, const struct fi_msg_tagged *msg,
@@ -141,7 +133,7 @@ ssize_t sock_queue_tmsg_op(struct fid_ep *ep, const struct fi_msg_tagged *msg,
 
 	threshold = &trigger_context->trigger.threshold;
 	cntr = container_of(threshold->cntr, struct sock_cntr, cntr_fid);
-	if (atomic_get(&cntr->value) >= threshold->threshold)
+	if (atomic64_get(&cntr->value) >= threshold->threshold)
 		return 1;
 
 	trigger = calloc(1, sizeof(*trigger));
@@ -159,11 +151,7 @@ ssize_t sock_queue_tmsg_op(struct fid_ep *ep, const struct fi_msg_tagged *msg,
 	trigger->ep = ep;
 	trigger->flags = flags;
 
-	fastlock_acquire(&cntr->trigger_lock);
-	dlist_insert_tail(&trigger->entry, &cntr->trigger_list);
-	fastlock_release(&cntr->trigger_lock);
-	sock_cntr_check_trigger_list(cntr);
-	return 0;
+	return sock_cntr_queue_trigger(cntr, trigger);
 }
 
 ssize_t sock_queue_atomic_op(struct fid_ep *ep, const struct fi_msg_atomic *msg,
@@ -183,7 +171,7 @@ ssize_t sock_queue_atomic_op(struct fid_ep *ep, const struct fi_msg_atomic *msg,
 
 	threshold = &trigger_context->trigger.threshold;
 	cntr = container_of(threshold->cntr, struct sock_cntr, cntr_fid);
-	if (atomic_get(&cntr->value) >= threshold->threshold)
+	if (atomic64_get(&cntr->value) >= threshold->threshold)
 		return 1;
 
 	trigger = calloc(1, sizeof(*trigger));
@@ -214,9 +202,5 @@ ssize_t sock_queue_atomic_op(struct fid_ep *ep, const struct fi_msg_atomic *msg,
 	trigger->ep = ep;
 	trigger->flags = flags;
 
-	fastlock_acquire(&cntr->trigger_lock);
-	dlist_insert_tail(&trigger->entry, &cntr->trigger_list);
-	fastlock_release(&cntr->trigger_lock);
-	sock_cntr_check_trigger_list(cntr);
-	return 0;
+	return sock_cntr_queue_trigger(cntr, trigger);
 }
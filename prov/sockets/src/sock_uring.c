@@ -0,0 +1,728 @@
+/*
+ * Copyright (c) 2014 Intel Corporation, Inc.  All rights reserved.
+ *
+ * This software is available to you under a choice of one of two
+ * licenses.  You may choose to be licensed under the terms of the GNU
+ * General Public License (GPL) Version 2, available from the file
+ * COPYING in the main directory of this source tree, or the
+ * BSD license below:
+ *
+ *     Redistribution and use in source and binary forms, with or
+ *     without modification, are permitted provided that the following
+ *     conditions are met:
+ *
+ *      - Redistributions of source code must retain the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer.
+ *
+ *      - Redistributions in binary form must reproduce the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer in the documentation and/or other materials
+ *        provided with the distribution.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#include "config.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <unistd.h>
+
+#include "sock.h"
+#include "sock_util.h"
+#include "fi_util.h"
+
+#define SOCK_LOG_DBG(...) _SOCK_LOG_DBG(FI_LOG_EP_DATA, __VA_ARGS__)
+#define SOCK_LOG_ERROR(...) _SOCK_LOG_ERROR(FI_LOG_EP_DATA, __VA_ARGS__)
+
+#if HAVE_IO_URING && defined(HAVE_ATOMICS)
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#define SOCK_URING_ENTRIES (256)
+#define SOCK_URING_BUF_CNT (256)
+#define SOCK_URING_BUF_SZ (8192)
+#define SOCK_URING_BGID (0)
+/* a connection holding this many received buffers stops receiving */
+#define SOCK_URING_CONN_BUFS (SOCK_URING_BUF_CNT / 4)
+#define SOCK_URING_TX_SZ (1 << 16)
+
+/* operation, in the low bits of user_data */
+enum {
+	SOCK_URING_RECV,
+	SOCK_URING_SEND,
+	SOCK_URING_CANCEL,
+	SOCK_URING_OP_MASK = 3,
+};
+
+struct sock_uring_seg {
+	uint16_t bid;
+	uint16_t off;
+	uint16_t len;
+};
+
+/*
+ * Once the connection is detached, the uring_conn owns the socket: it
+ * flushes what is left in tx, then closes the socket and frees itself
+ * when none of its operations are in the kernel anymore.
+ */
+struct sock_uring_conn {
+	int fd;
+	int detached;
+	int eof;
+	int eof_seen;
+	int err;
+	int recv_armed;
+	int cancel_armed;
+	int starved;
+	size_t send_len;
+	struct ringbuf tx;
+	unsigned seg_head;
+	unsigned seg_cnt;
+	struct sock_uring_seg seg[SOCK_URING_BUF_CNT];
+	struct dlist_entry entry;
+	struct dlist_entry starved_entry;
+};
+
+struct sock_uring {
+	int fd;
+	fastlock_t lock;
+
+	void *ring;
+	size_t ring_sz;
+	struct io_uring_sqe *sqes;
+	size_t sqes_sz;
+	atomic_uint *sq_head;
+	atomic_uint *sq_tail;
+	atomic_uint *sq_flags;
+	unsigned *sq_array;
+	unsigned sq_mask;
+	unsigned sq_entries;
+	unsigned sq_local_tail;
+	atomic_uint *cq_head;
+	atomic_uint *cq_tail;
+	struct io_uring_cqe *cqes;
+	unsigned cq_mask;
+
+	struct io_uring_buf_ring *br;
+	size_t br_sz;
+	char *bufs;
+	uint16_t br_tail;
+
+	struct dlist_entry conn_list;
+	/* connections whose receive ran out of buffers */
+	struct dlist_entry starved_list;
+};
+
+static int sock_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+	return (int) syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sock_uring_enter(int fd, unsigned to_submit, unsigned flags)
+{
+	return (int) syscall(__NR_io_uring_enter, fd, to_submit, 0, flags,
+			     NULL, 0);
+}
+
+static int sock_uring_register(int fd, unsigned opcode, void *arg,
+			       unsigned nr_args)
+{
+	return (int) syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static void sock_uring_submit(struct sock_uring *uring)
+{
+	unsigned pending;
+	int ret;
+
+	atomic_store_explicit(uring->sq_tail, uring->sq_local_tail,
+			      memory_order_release);
+	pending = uring->sq_local_tail -
+		atomic_load_explicit(uring->sq_head, memory_order_acquire);
+	if (!pending &&
+	    !(atomic_load_explicit(uring->sq_flags, memory_order_relaxed) &
+	      IORING_SQ_CQ_OVERFLOW))
+		return;
+
+	ret = sock_uring_enter(uring->fd, pending,
+			       pending ? 0 : IORING_ENTER_GETEVENTS);
+	if (ret < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY)
+		SOCK_LOG_ERROR("io_uring_enter: %s\n", strerror(errno));
+}
+
+static struct io_uring_sqe *sock_uring_get_sqe(struct sock_uring *uring)
+{
+	struct io_uring_sqe *sqe;
+	unsigned idx;
+
+	/* the kernel consumes every submitted entry before returning */
+	while (uring->sq_local_tail -
+	       atomic_load_explicit(uring->sq_head, memory_order_acquire) >=
+	       uring->sq_entries)
+		sock_uring_submit(uring);
+
+	idx = uring->sq_local_tail & uring->sq_mask;
+	sqe = &uring->sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	uring->sq_array[idx] = idx;
+	uring->sq_local_tail++;
+	return sqe;
+}
+
+static char *sock_uring_buf(struct sock_uring *uring, uint16_t bid)
+{
+	return uring->bufs + (size_t) bid * SOCK_URING_BUF_SZ;
+}
+
+static void sock_uring_recycle(struct sock_uring *uring, uint16_t bid)
+{
+	struct io_uring_buf *buf;
+
+	buf = &uring->br->bufs[uring->br_tail & (SOCK_URING_BUF_CNT - 1)];
+	buf->addr = (uintptr_t) sock_uring_buf(uring, bid);
+	buf->len = SOCK_URING_BUF_SZ;
+	buf->bid = bid;
+	uring->br_tail++;
+	atomic_store_explicit((_Atomic uint16_t *) &uring->br->tail,
+			      uring->br_tail, memory_order_release);
+}
+
+static void sock_uring_conn_free(struct sock_uring *uring,
+				 struct sock_uring_conn *uconn)
+{
+	for (; uconn->seg_cnt; uconn->seg_cnt--) {
+		sock_uring_recycle(uring, uconn->seg[uconn->seg_head].bid);
+		uconn->seg_head = (uconn->seg_head + 1) % SOCK_URING_BUF_CNT;
+	}
+	if (uconn->starved)
+		dlist_remove(&uconn->starved_entry);
+	dlist_remove(&uconn->entry);
+	ofi_close_socket(uconn->fd);
+	rbfree(&uconn->tx);
+	free(uconn);
+}
+
+/*
+ * Queues whatever the connection needs next.  Returns 1 if it was
+ * freed.
+ */
+static int sock_uring_update(struct sock_uring *uring,
+			     struct sock_uring_conn *uconn)
+{
+	struct io_uring_sqe *sqe;
+	size_t off;
+
+	if (!uconn->send_len && !rbempty(&uconn->tx) && !uconn->err) {
+		off = uconn->tx.rcnt & uconn->tx.size_mask;
+		uconn->send_len = MIN(rbused(&uconn->tx), uconn->tx.size - off);
+		sqe = sock_uring_get_sqe(uring);
+		sqe->opcode = IORING_OP_SEND;
+		sqe->fd = uconn->fd;
+		sqe->addr = (uintptr_t) ((char *) uconn->tx.buf + off);
+		sqe->len = uconn->send_len;
+		sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+		sqe->user_data = (uintptr_t) uconn | SOCK_URING_SEND;
+	}
+
+	if (uconn->recv_armed && !uconn->cancel_armed &&
+	    (uconn->detached || uconn->seg_cnt >= SOCK_URING_CONN_BUFS)) {
+		uconn->cancel_armed = 1;
+		sqe = sock_uring_get_sqe(uring);
+		sqe->opcode = IORING_OP_ASYNC_CANCEL;
+		sqe->fd = -1;
+		sqe->addr = (uintptr_t) uconn | SOCK_URING_RECV;
+		sqe->user_data = (uintptr_t) uconn | SOCK_URING_CANCEL;
+	}
+
+	if (!uconn->recv_armed && !uconn->detached && !uconn->eof &&
+	    !uconn->starved && uconn->seg_cnt <= SOCK_URING_CONN_BUFS / 2) {
+		uconn->recv_armed = 1;
+		sqe = sock_uring_get_sqe(uring);
+		sqe->opcode = IORING_OP_RECV;
+		sqe->fd = uconn->fd;
+		sqe->ioprio = IORING_RECV_MULTISHOT;
+		sqe->flags = IOSQE_BUFFER_SELECT;
+		sqe->buf_group = SOCK_URING_BGID;
+		sqe->user_data = (uintptr_t) uconn | SOCK_URING_RECV;
+	}
+
+	if (uconn->detached && !uconn->recv_armed && !uconn->cancel_armed &&
+	    !uconn->send_len && (rbempty(&uconn->tx) || uconn->err)) {
+		sock_uring_conn_free(uring, uconn);
+		return 1;
+	}
+	return 0;
+}
+
+static void sock_uring_wake_starved(struct sock_uring *uring)
+{
+	struct sock_uring_conn *uconn;
+
+	while (!dlist_empty(&uring->starved_list)) {
+		uconn = container_of(uring->starved_list.next,
+				     struct sock_uring_conn, starved_entry);
+		dlist_remove(&uconn->starved_entry);
+		uconn->starved = 0;
+		sock_uring_update(uring, uconn);
+	}
+}
+
+static void sock_uring_handle_recv(struct sock_uring *uring,
+				   struct sock_uring_conn *uconn,
+				   struct io_uring_cqe *cqe)
+{
+	struct sock_uring_seg *seg;
+
+	if (!(cqe->flags & IORING_CQE_F_MORE))
+		uconn->recv_armed = 0;
+
+	if (cqe->res > 0) {
+		seg = &uconn->seg[(uconn->seg_head + uconn->seg_cnt) %
+				  SOCK_URING_BUF_CNT];
+		seg->bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+		seg->off = 0;
+		seg->len = cqe->res;
+		uconn->seg_cnt++;
+		if (uconn->detached) {
+			uconn->seg_cnt--;
+			sock_uring_recycle(uring, seg->bid);
+		}
+		return;
+	}
+
+	switch (cqe->res) {
+	case -ENOBUFS:
+		if (!uconn->starved) {
+			uconn->starved = 1;
+			dlist_insert_tail(&uconn->starved_entry,
+					  &uring->starved_list);
+		}
+		break;
+	case -ECANCELED:
+		/* by us, or the arming thread exited; rearmed if needed */
+		break;
+	case 0:
+		uconn->eof = 1;
+		break;
+	default:
+		if (cqe->res != -ECONNRESET)
+			SOCK_LOG_ERROR("io_uring recv: %s\n",
+				       strerror(-cqe->res));
+		uconn->eof = 1;
+		uconn->err = -cqe->res;
+		break;
+	}
+}
+
+static void sock_uring_handle_send(struct sock_uring_conn *uconn,
+				   struct io_uring_cqe *cqe)
+{
+	uconn->send_len = 0;
+	if (cqe->res > 0) {
+		uconn->tx.rcnt += cqe->res;
+	} else if (cqe->res != -ECANCELED && cqe->res != -EAGAIN &&
+		   cqe->res != -EINTR) {
+		uconn->err = -cqe->res;
+		rbdiscard(&uconn->tx, rbused(&uconn->tx));
+	}
+}
+
+static void sock_uring_reap(struct sock_uring *uring)
+{
+	struct sock_uring_conn *uconn;
+	struct io_uring_cqe *cqe;
+	unsigned head, tail;
+
+	head = atomic_load_explicit(uring->cq_head, memory_order_relaxed);
+	tail = atomic_load_explicit(uring->cq_tail, memory_order_acquire);
+	for (; head != tail; head++) {
+		cqe = &uring->cqes[head & uring->cq_mask];
+		uconn = (struct sock_uring_conn *)
+			(uintptr_t) (cqe->user_data & ~(uint64_t) SOCK_URING_OP_MASK);
+
+		switch (cqe->user_data & SOCK_URING_OP_MASK) {
+		case SOCK_URING_RECV:
+			sock_uring_handle_recv(uring, uconn, cqe);
+			break;
+		case SOCK_URING_SEND:
+			sock_uring_handle_send(uconn, cqe);
+			break;
+		case SOCK_URING_CANCEL:
+			uconn->cancel_armed = 0;
+			break;
+		}
+		sock_uring_update(uring, uconn);
+	}
+	atomic_store_explicit(uring->cq_head, head, memory_order_release);
+}
+
+void sock_uring_progress(struct sock_uring *uring)
+{
+	fastlock_acquire(&uring->lock);
+	sock_uring_reap(uring);
+	sock_uring_submit(uring);
+	fastlock_release(&uring->lock);
+}
+
+int sock_uring_fd(struct sock_uring *uring)
+{
+	return uring->fd;
+}
+
+/*
+ * Returns 1 if a connection holds data, or an EOF, that was received
+ * while the PE was busy: the ring will not wake it up for those.
+ */
+int sock_uring_prepare_wait(struct sock_uring *uring)
+{
+	struct sock_uring_conn *uconn;
+	struct dlist_entry *entry;
+	int ready = 0;
+
+	fastlock_acquire(&uring->lock);
+	sock_uring_submit(uring);
+	dlist_foreach(&uring->conn_list, entry) {
+		uconn = container_of(entry, struct sock_uring_conn, entry);
+		if (!uconn->detached &&
+		    (uconn->seg_cnt || (uconn->eof && !uconn->eof_seen))) {
+			ready = 1;
+			break;
+		}
+	}
+	fastlock_release(&uring->lock);
+	return ready;
+}
+
+int sock_uring_attach(struct sock_conn *conn)
+{
+	struct sock_uring *uring = conn->ep_attr->pe->uring;
+	struct sock_uring_conn *uconn;
+
+	uconn = calloc(1, sizeof(*uconn));
+	if (!uconn)
+		return -FI_ENOMEM;
+
+	if (rbinit(&uconn->tx, SOCK_URING_TX_SZ)) {
+		free(uconn);
+		return -FI_ENOMEM;
+	}
+	uconn->fd = conn->sock_fd;
+
+	/*
+	 * Arm the receive right away: connections registered by the CM
+	 * reactor would otherwise wait for the PE to wake up by itself.
+	 */
+	fastlock_acquire(&uring->lock);
+	dlist_insert_tail(&uconn->entry, &uring->conn_list);
+	sock_uring_update(uring, uconn);
+	sock_uring_submit(uring);
+	fastlock_release(&uring->lock);
+
+	conn->uring = uconn;
+	return 0;
+}
+
+void sock_uring_detach(struct sock_conn *conn)
+{
+	struct sock_uring *uring = conn->ep_attr->pe->uring;
+	struct sock_uring_conn *uconn = conn->uring;
+
+	if (!uconn)
+		return;
+
+	conn->uring = NULL;
+	conn->sock_fd = -1;
+
+	fastlock_acquire(&uring->lock);
+	uconn->detached = 1;
+	for (; uconn->seg_cnt; uconn->seg_cnt--) {
+		sock_uring_recycle(uring, uconn->seg[uconn->seg_head].bid);
+		uconn->seg_head = (uconn->seg_head + 1) % SOCK_URING_BUF_CNT;
+	}
+	sock_uring_update(uring, uconn);
+	sock_uring_wake_starved(uring);
+	sock_uring_submit(uring);
+	fastlock_release(&uring->lock);
+}
+
+ssize_t sock_uring_sendv(struct sock_conn *conn, const struct iovec *iov,
+			 size_t iov_cnt)
+{
+	struct sock_uring *uring = conn->ep_attr->pe->uring;
+	struct sock_uring_conn *uconn = conn->uring;
+	size_t i, len, total = 0;
+
+	fastlock_acquire(&uring->lock);
+	if (uconn->err) {
+		fastlock_release(&uring->lock);
+		errno = uconn->err;
+		return -1;
+	}
+
+	for (i = 0; i < iov_cnt && !rbfull(&uconn->tx); i++) {
+		len = MIN(iov[i].iov_len, rbavail(&uconn->tx));
+		rbwrite(&uconn->tx, iov[i].iov_base, len);
+		rbcommit(&uconn->tx);
+		total += len;
+		if (len < iov[i].iov_len)
+			break;
+	}
+	if (total)
+		sock_uring_update(uring, uconn);
+	fastlock_release(&uring->lock);
+	return total;
+}
+
+ssize_t sock_uring_recv(struct sock_conn *conn, void *buf, size_t len, int peek)
+{
+	struct sock_uring *uring = conn->ep_attr->pe->uring;
+	struct sock_uring_conn *uconn = conn->uring;
+	struct sock_uring_seg *seg;
+	unsigned i, head, cnt;
+	size_t n, done = 0;
+	int recycled = 0;
+
+	fastlock_acquire(&uring->lock);
+	head = uconn->seg_head;
+	cnt = uconn->seg_cnt;
+	for (i = 0; i < cnt && done < len; i++) {
+		seg = &uconn->seg[(head + i) % SOCK_URING_BUF_CNT];
+		n = MIN(len - done, seg->len);
+		memcpy((char *) buf + done,
+		       sock_uring_buf(uring, seg->bid) + seg->off, n);
+		done += n;
+		if (peek)
+			continue;
+
+		seg->off += n;
+		seg->len -= n;
+		if (seg->len)
+			break;
+
+		sock_uring_recycle(uring, seg->bid);
+		uconn->seg_head = (uconn->seg_head + 1) % SOCK_URING_BUF_CNT;
+		uconn->seg_cnt--;
+		recycled = 1;
+	}
+
+	if (!done && !uconn->seg_cnt && uconn->eof) {
+		conn->disconnected = 1;
+		uconn->eof_seen = 1;
+	}
+
+	if (recycled) {
+		sock_uring_update(uring, uconn);
+		sock_uring_wake_starved(uring);
+	}
+	fastlock_release(&uring->lock);
+	return done;
+}
+
+int sock_uring_rx_ready(struct sock_conn *conn)
+{
+	struct sock_uring_conn *uconn = conn->uring;
+
+	/* unlocked hint; sock_uring_recv() has the final word */
+	return *(volatile unsigned *) &uconn->seg_cnt ||
+		*(volatile int *) &uconn->eof;
+}
+
+int sock_uring_create(struct sock_uring **uring_ptr)
+{
+	struct io_uring_buf_reg reg;
+	struct io_uring_params p;
+	struct sock_uring *uring;
+	size_t sq_sz, cq_sz;
+	char *ring;
+	int ret, i;
+
+	uring = calloc(1, sizeof(*uring));
+	if (!uring)
+		return -FI_ENOMEM;
+
+	memset(&p, 0, sizeof(p));
+	p.flags = IORING_SETUP_CQSIZE;
+	p.cq_entries = SOCK_URING_BUF_CNT * 4;
+	uring->fd = sock_uring_setup(SOCK_URING_ENTRIES, &p);
+	if (uring->fd < 0) {
+		ret = -errno;
+		goto err1;
+	}
+
+	if (!(p.features & IORING_FEAT_SINGLE_MMAP) ||
+	    !(p.features & IORING_FEAT_NODROP) ||
+	    !(p.features & IORING_FEAT_FAST_POLL)) {
+		ret = -FI_ENOSYS;
+		goto err2;
+	}
+
+	sq_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	cq_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	uring->ring_sz = MAX(sq_sz, cq_sz);
+	uring->ring = mmap(NULL, uring->ring_sz, PROT_READ | PROT_WRITE,
+			   MAP_SHARED | MAP_POPULATE, uring->fd,
+			   IORING_OFF_SQ_RING);
+	if (uring->ring == MAP_FAILED) {
+		ret = -errno;
+		goto err2;
+	}
+
+	uring->sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+	uring->sqes = mmap(NULL, uring->sqes_sz, PROT_READ | PROT_WRITE,
+			   MAP_SHARED | MAP_POPULATE, uring->fd,
+			   IORING_OFF_SQES);
+	if (uring->sqes == MAP_FAILED) {
+		ret = -errno;
+		goto err3;
+	}
+
+	ring = uring->ring;
+	uring->sq_head = (atomic_uint *) (ring + p.sq_off.head);
+	uring->sq_tail = (atomic_uint *) (ring + p.sq_off.tail);
+	uring->sq_flags = (atomic_uint *) (ring + p.sq_off.flags);
+	uring->sq_array = (unsigned *) (ring + p.sq_off.array);
+	uring->sq_mask = *(unsigned *) (ring + p.sq_off.ring_mask);
+	uring->sq_entries = p.sq_entries;
+	uring->sq_local_tail = *(unsigned *) uring->sq_tail;
+	uring->cq_head = (atomic_uint *) (ring + p.cq_off.head);
+	uring->cq_tail = (atomic_uint *) (ring + p.cq_off.tail);
+	uring->cqes = (struct io_uring_cqe *) (ring + p.cq_off.cqes);
+	uring->cq_mask = *(unsigned *) (ring + p.cq_off.ring_mask);
+
+	uring->br_sz = SOCK_URING_BUF_CNT * sizeof(struct io_uring_buf);
+	uring->br = mmap(NULL, uring->br_sz, PROT_READ | PROT_WRITE,
+			 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (uring->br == MAP_FAILED) {
+		ret = -errno;
+		goto err4;
+	}
+
+	uring->bufs = calloc(SOCK_URING_BUF_CNT, SOCK_URING_BUF_SZ);
+	if (!uring->bufs) {
+		ret = -FI_ENOMEM;
+		goto err5;
+	}
+
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (uintptr_t) uring->br;
+	reg.ring_entries = SOCK_URING_BUF_CNT;
+	reg.bgid = SOCK_URING_BGID;
+	if (sock_uring_register(uring->fd, IORING_REGISTER_PBUF_RING,
+				&reg, 1)) {
+		ret = -errno;
+		goto err6;
+	}
+	for (i = 0; i < SOCK_URING_BUF_CNT; i++)
+		sock_uring_recycle(uring, i);
+
+	fastlock_init(&uring->lock);
+	dlist_init(&uring->conn_list);
+	dlist_init(&uring->starved_list);
+	*uring_ptr = uring;
+	return 0;
+
+err6:
+	free(uring->bufs);
+err5:
+	munmap(uring->br, uring->br_sz);
+err4:
+	munmap(uring->sqes, uring->sqes_sz);
+err3:
+	munmap(uring->ring, uring->ring_sz);
+err2:
+	close(uring->fd);
+err1:
+	free(uring);
+	return ret;
+}
+
+void sock_uring_destroy(struct sock_uring *uring)
+{
+	struct sock_uring_conn *uconn;
+
+	/* closing the ring cancels whatever is left in the kernel */
+	close(uring->fd);
+	while (!dlist_empty(&uring->conn_list)) {
+		uconn = container_of(uring->conn_list.next,
+				     struct sock_uring_conn, entry);
+		dlist_remove(&uconn->entry);
+		ofi_close_socket(uconn->fd);
+		rbfree(&uconn->tx);
+		free(uconn);
+	}
+	munmap(uring->sqes, uring->sqes_sz);
+	munmap(uring->ring, uring->ring_sz);
+	munmap(uring->br, uring->br_sz);
+	free(uring->bufs);
+	fastlock_destroy(&uring->lock);
+	free(uring);
+}
+
+#else /* HAVE_IO_URING && HAVE_ATOMICS */
+
+int sock_uring_create(struct sock_uring **uring)
+{
+	return -FI_ENOSYS;
+}
+
+void sock_uring_destroy(struct sock_uring *uring)
+{
+}
+
+int sock_uring_fd(struct sock_uring *uring)
+{
+	return -1;
+}
+
+int sock_uring_prepare_wait(struct sock_uring *uring)
+{
+	return 0;
+}
+
+void sock_uring_progress(struct sock_uring *uring)
+{
+}
+
+int sock_uring_attach(struct sock_conn *conn)
+{
+	return -FI_ENOSYS;
+}
+
+void sock_uring_detach(struct sock_conn *conn)
+{
+}
+
+ssize_t sock_uring_sendv(struct sock_conn *conn, const struct iovec *iov,
+			 size_t iov_cnt)
+{
+	return -1;
+}
+
+ssize_t sock_uring_recv(struct sock_conn *conn, void *buf, size_t len, int peek)
+{
+	return 0;
+}
+
+int sock_uring_rx_ready(struct sock_conn *conn)
+{
+	return 0;
+}
+
+#endif /* HAVE_IO_URING && HAVE_ATOMICS */
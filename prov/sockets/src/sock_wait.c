@@ -43,11 +43,6 @@
 #define SOCK_LOG_DBG(...) _SOCK_LOG_DBG(FI_LOG_CORE, __VA_ARGS__)
 #define SOCK_LOG_ERROR(...) _SOCK_LOG_ERROR(FI_LOG_CORE, __VA_ARGS__)
 
-enum {
-	WAIT_READ_FD = 0,
-	WAIT_WRITE_FD,
-};
-
 int sock_wait_get_obj(struct fid_wait *fid, void *arg)
 {
 	struct fi_mutex_cond mut_cond;
@@ -59,7 +54,14 @@ int sock_wait_get_obj(struct fid_wait *fid, void *arg)
 
 	switch (wait->type) {
 	case FI_WAIT_FD:
-		memcpy(arg, &wait->wobj.fd[WAIT_READ_FD], sizeof(int));
+		fastlock_acquire(&wait->lock);
+		if (!wait->fd_exported) {
+			wait->fd_exported = 1;
+			if (wait->signaled)
+				fd_signal_set(&wait->wobj.signal);
+		}
+		fastlock_release(&wait->lock);
+		memcpy(arg, &wait->wobj.signal.fd[FI_READ_FD], sizeof(int));
 		break;
 
 	case FI_WAIT_MUTEX_COND:
@@ -84,15 +86,10 @@ static int sock_wait_init(struct sock_wait *wait, enum fi_wait_obj type)
 
 	switch (type) {
 	case FI_WAIT_FD:
-		if (socketpair(AF_UNIX, SOCK_STREAM, 0, wait->wobj.fd))
-			return -errno;
-
-		ret = fd_set_nonblock(wait->wobj.fd[WAIT_READ_FD]);
-		if (ret) {
-			ofi_close_socket(wait->wobj.fd[WAIT_READ_FD]);
-			ofi_close_socket(wait->wobj.fd[WAIT_WRITE_FD]);
+		ret = fd_signal_init(&wait->wobj.signal);
+		if (ret)
 			return ret;
-		}
+		fastlock_init(&wait->lock);
 		break;
 
 	case FI_WAIT_MUTEX_COND:
@@ -107,9 +104,38 @@ static int sock_wait_init(struct sock_wait *wait, enum fi_wait_obj type)
 	return 0;
 }
 
+/*
+ * Signals are coalesced: one wakeup covers everything signaled since
+ * the last wait returned, and it only costs a system call when a
+ * thread sleeps on the fd or the application has fetched it.
+ */
+static int sock_wait_fd_wait(struct sock_wait *wait, int timeout)
+{
+	int ret = 0;
+
+	fastlock_acquire(&wait->lock);
+	if (!wait->signaled) {
+		wait->num_waiters++;
+		fastlock_release(&wait->lock);
+		ret = fi_poll_fd(wait->wobj.signal.fd[FI_READ_FD], timeout);
+		fastlock_acquire(&wait->lock);
+		wait->num_waiters--;
+	}
+
+	if (wait->signaled) {
+		wait->signaled = 0;
+		fd_signal_reset(&wait->wobj.signal);
+		ret = 0;
+	} else if (ret >= 0) {
+		ret = -FI_ETIMEDOUT;
+	}
+	fastlock_release(&wait->lock);
+	return ret;
+}
+
 static int sock_wait_wait(struct fid_wait *wait_fid, int timeout)
 {
-	int err = 0, ret;
+	int err = 0;
 	struct sock_cq *cq;
 	struct sock_cntr *cntr;
 	struct timeval now;
@@ -117,7 +143,6 @@ static int sock_wait_wait(struct fid_wait *wait_fid, int timeout)
 	double start_ms = 0.0, end_ms = 0.0;
 	struct dlist_entry *p, *head;
 	struct sock_fid_list *list_item;
-	char c;
 
 	wait = container_of(wait_fid, struct sock_wait, wait_fid);
 	if (timeout > 0) {
@@ -136,6 +161,10 @@ static int sock_wait_wait(struct fid_wait *wait_fid, int timeout)
 			sock_cq_progress(cq);
 			if (rbused(&cq->cqerr_rb))
 				return 1;
+			/* a coalesced wakeup may cover more than one entry */
+			if (wait->type == FI_WAIT_FD &&
+			    rbfdused(&cq->cq_rbfd))
+				return 0;
 			break;
 
 		case FI_CLASS_CNTR:
@@ -155,20 +184,7 @@ static int sock_wait_wait(struct fid_wait *wait_fid, int timeout)
 
 	switch (wait->type) {
 	case FI_WAIT_FD:
-		err = fi_poll_fd(wait->wobj.fd[WAIT_READ_FD], timeout);
-		if (err == 0) {
-			err = -FI_ETIMEDOUT;
-		} else {
-			while (err > 0) {
-				ret = ofi_read_socket(wait->wobj.fd[WAIT_READ_FD], &c, 1);
-				if (ret != 1) {
-					SOCK_LOG_ERROR("failed to read wait_fd\n");
-					err = 0;
-					break;
-				} else
-					err--;
-			}
-		}
+		err = sock_wait_fd_wait(wait, timeout);
 		break;
 
 	case FI_WAIT_MUTEX_COND:
@@ -186,16 +202,18 @@ static int sock_wait_wait(struct fid_wait *wait_fid, int timeout)
 void sock_wait_signal(struct fid_wait *wait_fid)
 {
 	struct sock_wait *wait;
-	static char c = 'a';
-	int ret;
 
 	wait = container_of(wait_fid, struct sock_wait, wait_fid);
 
 	switch (wait->type) {
 	case FI_WAIT_FD:
-		ret = ofi_write_socket(wait->wobj.fd[WAIT_WRITE_FD], &c, 1);
-		if (ret != 1)
-			SOCK_LOG_ERROR("failed to signal\n");
+		fastlock_acquire(&wait->lock);
+		if (!wait->signaled) {
+			wait->signaled = 1;
+			if (wait->num_waiters || wait->fd_exported)
+				fd_signal_set(&wait->wobj.signal);
+		}
+		fastlock_release(&wait->lock);
 		break;
 
 	case FI_WAIT_MUTEX_COND:
@@ -245,8 +263,8 @@ int sock_wait_close(fid_t fid)
 	}
 
 	if (wait->type == FI_WAIT_FD) {
-		ofi_close_socket(wait->wobj.fd[WAIT_READ_FD]);
-		ofi_close_socket(wait->wobj.fd[WAIT_WRITE_FD]);
+		fd_signal_free(&wait->wobj.signal);
+		fastlock_destroy(&wait->lock);
 	}
 
 	atomic_dec(&wait->fab->ref);
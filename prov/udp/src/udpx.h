@@ -59,6 +59,8 @@
 #include <fi_list.h>
 #include <fi_signal.h>
 #include <fi_util.h>
+#include <fi_mem.h>
+#include <fi_proto.h>
 
 #ifndef _UDPX_H_
 #define _UDPX_H_
@@ -70,6 +72,11 @@
 
 extern struct fi_provider udpx_prov;
 extern struct fi_info udpx_info;
+extern struct fi_info udpx_rdm_info;
+extern int udpx_rx_batch;
+extern int udpx_tx_batch;
+extern int udpx_rdm_rto;
+extern int udpx_rdm_max_retry;
 
 
 int udpx_check_info(struct fi_info *info);
@@ -83,6 +90,9 @@ int udpx_eq_open(struct fid_fabric *fabric, struct fi_eq_attr *attr,
 
 #define UDPX_FLAG_MULTI_RECV	1
 #define UDPX_IOV_LIMIT		4
+#define UDPX_MAX_BATCH		64
+#define UDPX_DEF_RX_BATCH	16
+#define UDPX_DEF_TX_BATCH	0
 
 struct udpx_ep_entry {
 	void			*context;
@@ -94,6 +104,21 @@ struct udpx_ep_entry {
 
 DECLARE_CIRQUE(struct udpx_ep_entry, udpx_rx_cirq);
 
+/*
+ * Sends queued when transmit batching is enabled.  The destination
+ * points into the AV, and the caller's buffers must remain valid until
+ * the send completes.
+ */
+struct udpx_tx_entry {
+	void			*context;
+	void			*addr;
+	struct iovec		iov[UDPX_IOV_LIMIT];
+	uint8_t			iov_count;
+	uint8_t			resv[sizeof(size_t) - 1];
+};
+
+DECLARE_CIRQUE(struct udpx_tx_entry, udpx_tx_cirq);
+
 struct udpx_ep;
 typedef void (*udpx_rx_comp_func)(struct udpx_ep *ep, void *context,
 		uint64_t flags, size_t len, void *buf, void *addr);
@@ -104,15 +129,156 @@ struct udpx_ep {
 	udpx_rx_comp_func	rx_comp;
 	udpx_tx_comp_func	tx_comp;
 	struct udpx_rx_cirq	*rxq;    /* protected by rx_cq lock */
+	struct udpx_tx_cirq	*txq;    /* protected by tx_cq lock */
 	int			sock;
 };
 
 int udpx_endpoint(struct fid_domain *domain, struct fi_info *info,
 		  struct fid_ep **ep, void *context);
+int udpx_getopt(fid_t fid, int level, int optname,
+		void *optval, size_t *optlen);
+int udpx_setopt(fid_t fid, int level, int optname,
+		const void *optval, size_t optlen);
+
+static inline void udpx_init_msghdr(struct msghdr *hdr, struct iovec *iov,
+				    size_t iov_count, void *addr,
+				    socklen_t addrlen)
+{
+	hdr->msg_name = addr;
+	hdr->msg_namelen = addrlen;
+	hdr->msg_iov = iov;
+	hdr->msg_iovlen = iov_count;
+	hdr->msg_control = NULL;
+	hdr->msg_controllen = 0;
+	hdr->msg_flags = 0;
+}
+
+
+/*
+ * Reliable datagram endpoint.  Every datagram starts with an ofi_ctrl_hdr.
+ * Data packets carry a per-peer sequence number in seg_no and the payload
+ * length in seg_size; the first packet of a message is followed by an
+ * ofi_op_hdr.  Acks return the next expected sequence number in seg_no,
+ * the receive window in seg_size, and a bitmap of received packets
+ * starting at seg_no in rx_key.
+ */
+#define UDPX_MTU		1472
+#define UDPX_RDM_WINDOW		64	/* power of 2, at most 64 */
+#define UDPX_RDM_DATA_SIZE	(UDPX_MTU - sizeof(struct ofi_ctrl_hdr))
+#define UDPX_RDM_INJECT_SIZE	(UDPX_RDM_DATA_SIZE - sizeof(struct ofi_op_hdr))
+#define UDPX_RDM_MAX_MSG_SIZE	(1 << 23)
+#define UDPX_RDM_MAX_BUFFERED	(1 << 16)	/* unexpected message bytes */
+#define UDPX_RDM_DEF_RTO	10	/* milliseconds */
+#define UDPX_RDM_DEF_MAX_RETRY	16
+
+struct udpx_tx_op;
+
+struct udpx_pkt {
+	struct udpx_tx_op	*op;		/* transmit side only */
+	uint64_t		send_time;
+	uint16_t		len;		/* includes ctrl header */
+	uint16_t		retries;
+	uint8_t			resv[4];
+	struct ofi_ctrl_hdr	hdr;
+	uint8_t			data[UDPX_RDM_DATA_SIZE];
+};
+
+struct udpx_tx_op {
+	struct dlist_entry	entry;
+	void			*context;
+	uint64_t		flags;
+	struct ofi_op_hdr	op;
+	uint64_t		msg_id;
+	struct iovec		iov[UDPX_IOV_LIMIT];
+	uint8_t			iov_count;
+	uint8_t			iov_index;
+	uint8_t			resv[2];
+	uint32_t		nseg;
+	size_t			iov_offset;
+	size_t			offset;		/* bytes placed in packets */
+	size_t			pending;	/* packets not yet acked */
+	int			err;
+	uint8_t			inject[UDPX_RDM_INJECT_SIZE];
+};
+
+struct udpx_rx_entry {
+	struct dlist_entry	entry;
+	void			*context;
+	uint64_t		flags;
+	uint64_t		tag;
+	uint64_t		ignore;
+	struct iovec		iov[UDPX_IOV_LIMIT];
+	uint8_t			iov_count;
+};
+
+/* Message that arrived before a matching receive was posted */
+struct udpx_unexp_msg {
+	struct dlist_entry	entry;
+	struct udpx_rx_entry	*rx_entry;	/* matched before fully received */
+	fi_addr_t		addr;
+	struct ofi_op_hdr	op;
+	size_t			offset;
+	uint8_t			buf[];
+};
+
+struct udpx_peer {
+	struct dlist_entry	entry;		/* ep->active_list */
+	struct dlist_entry	ack_entry;	/* ep->ack_list */
+	struct dlist_entry	stall_entry;	/* ep->stall_list */
+	fi_addr_t		addr;
+	uint8_t			active;
+	uint8_t			ack_pending;
+	uint8_t			stalled;
+	uint8_t			failed;
+
+	uint32_t		tx_seq;
+	uint32_t		tx_acked;	/* cumulative ack from the peer */
+	uint32_t		tx_window;	/* advertised from tx_acked */
+	uint64_t		ack_time;
+	uint64_t		msg_id;
+	struct dlist_entry	tx_queue;
+	struct udpx_pkt		*tx_pkt[UDPX_RDM_WINDOW];
+
+	uint32_t		rx_seq;
+	struct udpx_pkt		*rx_pkt[UDPX_RDM_WINDOW];
+	struct udpx_rx_entry	*rx_entry;
+	struct udpx_unexp_msg	*rx_unexp;
+	struct ofi_op_hdr	rx_op;
+	size_t			rx_offset;
+};
+
+struct udpx_rdm_ep {
+	struct util_ep		util_ep;
+	int			sock;
+	fastlock_t		lock;
+
+	struct util_buf_pool	*pkt_pool;
+	struct util_buf_pool	*tx_pool;
+	struct util_buf_pool	*rx_pool;
+
+	struct udpx_peer	**peers;
+	size_t			peer_cnt;
+	struct dlist_entry	active_list;
+	struct dlist_entry	ack_list;
+	struct dlist_entry	stall_list;
+
+	struct dlist_entry	rx_msg_list;
+	struct dlist_entry	rx_tag_list;
+	struct dlist_entry	unexp_msg_list;
+	struct dlist_entry	unexp_tag_list;
+	size_t			unexp_bytes;	/* buffered unexpected data */
+
+	size_t			tx_cnt;		/* sends awaiting completion */
+};
+
+int udpx_rdm_endpoint(struct fid_domain *domain, struct fi_info *info,
+		      struct fid_ep **ep, void *context);
 
 
 int udpx_cq_open(struct fid_domain *domain, struct fi_cq_attr *attr,
 		 struct fid_cq **cq, void *context);
+void udpx_cq_write_err(struct util_cq *cq, void *context, uint64_t flags,
+		       size_t len, size_t olen, uint64_t tag, int err);
 
 
 #endif
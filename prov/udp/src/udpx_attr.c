@@ -88,3 +88,40 @@ struct fi_info udpx_info = {
 	.domain_attr = &udpx_domain_attr,
 	.fabric_attr = &udpx_fabric_attr
 };
+
+struct fi_tx_attr udpx_rdm_tx_attr = {
+	.caps = FI_MSG | FI_TAGGED | FI_SEND,
+	.msg_order = FI_ORDER_SAS,
+	.comp_order = FI_ORDER_NONE,
+	.inject_size = UDPX_RDM_INJECT_SIZE,
+	.size = 1024,
+	.iov_limit = UDPX_IOV_LIMIT
+};
+
+struct fi_rx_attr udpx_rdm_rx_attr = {
+	.caps = FI_MSG | FI_TAGGED | FI_RECV | FI_SOURCE,
+	.msg_order = FI_ORDER_SAS,
+	.comp_order = FI_ORDER_NONE,
+	.total_buffered_recv = UDPX_RDM_MAX_BUFFERED,
+	.size = 1024,
+	.iov_limit = UDPX_IOV_LIMIT
+};
+
+struct fi_ep_attr udpx_rdm_ep_attr = {
+	.type = FI_EP_RDM,
+	.protocol = FI_PROTO_UDP,
+	.protocol_version = 0,
+	.max_msg_size = UDPX_RDM_MAX_MSG_SIZE,
+	.tx_ctx_cnt = 1,
+	.rx_ctx_cnt = 1
+};
+
+struct fi_info udpx_rdm_info = {
+	.caps = FI_MSG | FI_TAGGED | FI_SEND | FI_RECV | FI_SOURCE,
+	.addr_format = FI_SOCKADDR_IN,
+	.tx_attr = &udpx_rdm_tx_attr,
+	.rx_attr = &udpx_rdm_rx_attr,
+	.ep_attr = &udpx_rdm_ep_attr,
+	.domain_attr = &udpx_domain_attr,
+	.fabric_attr = &udpx_fabric_attr
+};
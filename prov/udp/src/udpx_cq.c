@@ -35,6 +35,46 @@
 
 #include "udpx.h"
 
+
+/*
+ * Queue an error completion.  The caller must hold the CQ lock and have
+ * reserved space in the CQ.
+ */
+void udpx_cq_write_err(struct util_cq *cq, void *context, uint64_t flags,
+		       size_t len, size_t olen, uint64_t tag, int err)
+{
+	struct util_cq_err_entry *err_entry;
+	struct fi_cq_tagged_entry *comp;
+
+	err_entry = calloc(1, sizeof(*err_entry));
+	if (!err_entry) {
+		FI_WARN(&udpx_prov, FI_LOG_CQ,
+			"unable to allocate error entry\n");
+		return;
+	}
+
+	err_entry->err_entry.op_context = context;
+	err_entry->err_entry.flags = flags;
+	err_entry->err_entry.len = len;
+	err_entry->err_entry.tag = tag;
+	err_entry->err_entry.olen = olen;
+	err_entry->err_entry.err = err;
+	err_entry->err_entry.prov_errno = err;
+	ofi_cq_insert_error(cq, err_entry);
+
+	comp = cirque_tail(cq->cirq);
+	comp->op_context = context;
+	comp->flags = UTIL_FLAG_ERROR;
+	comp->len = 0;
+	comp->buf = NULL;
+	comp->data = 0;
+	comp->tag = 0;
+	cirque_commit(cq->cirq);
+
+	if (cq->wait)
+		cq->wait->signal(cq->wait);
+}
+
 int udpx_cq_open(struct fid_domain *domain, struct fi_cq_attr *attr,
 		 struct fid_cq **cq_fid, void *context)
 {
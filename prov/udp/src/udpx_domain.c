@@ -86,6 +86,10 @@ int udpx_domain_open(struct fid_fabric *fabric, struct fi_info *info,
 	if (ret)
 		return ret;
 
+	/* RDM endpoints map incoming datagrams back to their AV entry */
+	if (info->ep_attr && info->ep_attr->type == FI_EP_RDM)
+		util_domain->caps |= FI_SOURCE;
+
 	*domain = &util_domain->domain_fid;
 	(*domain)->fid.ops = &udpx_domain_fi_ops;
 	(*domain)->ops = &udpx_domain_ops;
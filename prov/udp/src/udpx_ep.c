@@ -104,6 +104,7 @@ static void udpx_tx_comp(struct udpx_ep *ep, void *context)
 	comp->len = 0;
 	comp->buf = NULL;
 	comp->data = 0;
+	comp->tag = 0;
 	cirque_commit(ep->util_ep.tx_cq->cirq);
 }
 
@@ -124,6 +125,7 @@ static void udpx_rx_comp(struct udpx_ep *ep, void *context, uint64_t flags,
 	comp->len = len;
 	comp->buf = buf;
 	comp->data = 0;
+	comp->tag = 0;
 	cirque_commit(ep->util_ep.rx_cq->cirq);
 }
 
@@ -149,36 +151,167 @@ static void udpx_rx_src_comp_signal(struct udpx_ep *ep, void *context,
 	ep->util_ep.rx_cq->wait->signal(ep->util_ep.rx_cq->wait);
 }
 
-void udpx_ep_progress(struct util_ep *util_ep)
+/*
+ * Receive into as many posted buffers as we have room to complete,
+ * bounded by the configured batch size.
+ */
+static void udpx_ep_progress_rx(struct udpx_ep *ep)
 {
-	struct udpx_ep *ep;
 	struct udpx_ep_entry *entry;
+	struct sockaddr_in6 addr[UDPX_MAX_BATCH];
+#if HAVE_RECVMMSG
+	struct mmsghdr msgs[UDPX_MAX_BATCH];
+#else
 	struct msghdr hdr;
-	struct sockaddr_in6 addr;
+#endif
+	size_t i, cnt;
 	int ret;
 
-	ep = container_of(util_ep, struct udpx_ep, util_ep);
-	hdr.msg_name = &addr;
-	hdr.msg_namelen = sizeof(addr);
-	hdr.msg_control = NULL;
-	hdr.msg_controllen = 0;
-	hdr.msg_flags = 0;
-
-	fastlock_acquire(&ep->util_ep.rx_cq->cq_lock);
-	if (cirque_isempty(ep->rxq))
+	ofi_cq_lock(ep->util_ep.rx_cq);
+	cnt = cirque_freecnt(ep->util_ep.rx_cq->cirq);
+	/* Leave the slots reserved by queued sends on a shared CQ */
+	if (ep->util_ep.rx_cq == ep->util_ep.tx_cq && ep->txq)
+		cnt -= MIN(cnt, cirque_usedcnt(ep->txq));
+	cnt = MIN(cnt, cirque_usedcnt(ep->rxq));
+	cnt = MIN(cnt, (size_t) udpx_rx_batch);
+	if (!cnt)
 		goto out;
 
-	entry = cirque_head(ep->rxq);
-	hdr.msg_iov = entry->iov;
-	hdr.msg_iovlen = entry->iov_count;
+#if HAVE_RECVMMSG
+	for (i = 0; i < cnt; i++) {
+		entry = &ep->rxq->buf[(ep->rxq->rcnt + i) & ep->rxq->size_mask];
+		udpx_init_msghdr(&msgs[i].msg_hdr, entry->iov, entry->iov_count,
+				 &addr[i], sizeof(addr[i]));
+	}
 
-	ret = recvmsg(ep->sock, &hdr, 0);
-	if (ret >= 0) {
-		ep->rx_comp(ep, entry->context, 0, ret, NULL, &addr);
+	ret = recvmmsg(ep->sock, msgs, cnt, 0, NULL);
+	for (i = 0; ret > 0 && i < (size_t) ret; i++) {
+		entry = cirque_head(ep->rxq);
+		ep->rx_comp(ep, entry->context, 0, msgs[i].msg_len, NULL,
+			    &addr[i]);
+		cirque_discard(ep->rxq);
+	}
+#else
+	for (i = 0; i < cnt; i++) {
+		entry = cirque_head(ep->rxq);
+		udpx_init_msghdr(&hdr, entry->iov, entry->iov_count,
+				 &addr[0], sizeof(addr[0]));
+		ret = recvmsg(ep->sock, &hdr, 0);
+		if (ret < 0)
+			break;
+
+		ep->rx_comp(ep, entry->context, 0, ret, NULL, &addr[0]);
 		cirque_discard(ep->rxq);
 	}
+#endif
 out:
-	fastlock_release(&ep->util_ep.rx_cq->cq_lock);
+	ofi_cq_unlock(ep->util_ep.rx_cq);
+}
+
+/*
+ * Push queued sends to the socket.  Called with the tx_cq lock held.
+ * Sends that would block, or that the tx_cq has no room to complete,
+ * remain queued; a send that fails outright is reported through an
+ * error completion.
+ */
+static void udpx_tx_flush(struct udpx_ep *ep)
+{
+	struct udpx_tx_entry *entry;
+#if HAVE_SENDMMSG
+	struct mmsghdr msgs[UDPX_MAX_BATCH];
+	size_t cnt;
+#else
+	struct msghdr hdr;
+#endif
+	size_t i;
+	int ret;
+
+	while (!cirque_isempty(ep->txq) &&
+	       !cirque_isfull(ep->util_ep.tx_cq->cirq)) {
+#if HAVE_SENDMMSG
+		cnt = MIN(cirque_usedcnt(ep->txq),
+			  cirque_freecnt(ep->util_ep.tx_cq->cirq));
+		cnt = MIN(cnt, UDPX_MAX_BATCH);
+		for (i = 0; i < cnt; i++) {
+			entry = &ep->txq->buf[(ep->txq->rcnt + i) &
+					      ep->txq->size_mask];
+			udpx_init_msghdr(&msgs[i].msg_hdr, entry->iov,
+					 entry->iov_count, entry->addr,
+					 ep->util_ep.av->addrlen);
+		}
+
+		ret = sendmmsg(ep->sock, msgs, cnt, 0);
+		if (ret > 0) {
+			for (i = 0; i < (size_t) ret; i++) {
+				entry = cirque_head(ep->txq);
+				ep->tx_comp(ep, entry->context);
+				cirque_discard(ep->txq);
+			}
+			continue;
+		}
+#else
+		entry = cirque_head(ep->txq);
+		udpx_init_msghdr(&hdr, entry->iov, entry->iov_count,
+				 entry->addr, ep->util_ep.av->addrlen);
+		ret = sendmsg(ep->sock, &hdr, 0);
+		if (ret >= 0) {
+			ep->tx_comp(ep, entry->context);
+			cirque_discard(ep->txq);
+			continue;
+		}
+#endif
+		if (errno == EAGAIN || errno == EWOULDBLOCK)
+			break;
+
+		entry = cirque_head(ep->txq);
+		udpx_cq_write_err(ep->util_ep.tx_cq, entry->context, FI_SEND,
+				  0, 0, 0, errno);
+		cirque_discard(ep->txq);
+	}
+}
+
+static ssize_t udpx_tx_queue(struct udpx_ep *ep, const struct iovec *iov,
+			     size_t count, fi_addr_t dest_addr, void *context)
+{
+	struct udpx_tx_entry *entry;
+
+	/* Reserve a CQ slot for every queued send */
+	if (cirque_freecnt(ep->util_ep.tx_cq->cirq) <=
+	    cirque_usedcnt(ep->txq))
+		return -FI_EAGAIN;
+
+	if (cirque_isfull(ep->txq)) {
+		udpx_tx_flush(ep);
+		if (cirque_isfull(ep->txq))
+			return -FI_EAGAIN;
+	}
+
+	entry = cirque_tail(ep->txq);
+	entry->context = context;
+	entry->addr = ip_av_get_addr(ep->util_ep.av, dest_addr);
+	for (entry->iov_count = 0; entry->iov_count < count;
+	     entry->iov_count++)
+		entry->iov[entry->iov_count] = iov[entry->iov_count];
+	cirque_commit(ep->txq);
+
+	if (cirque_usedcnt(ep->txq) >= (size_t) udpx_tx_batch)
+		udpx_tx_flush(ep);
+	return 0;
+}
+
+void udpx_ep_progress(struct util_ep *util_ep)
+{
+	struct udpx_ep *ep;
+
+	ep = container_of(util_ep, struct udpx_ep, util_ep);
+	if (ep->util_ep.rx_cq)
+		udpx_ep_progress_rx(ep);
+
+	if (ep->txq) {
+		ofi_cq_lock(ep->util_ep.tx_cq);
+		udpx_tx_flush(ep);
+		ofi_cq_unlock(ep->util_ep.tx_cq);
+	}
 }
 
 ssize_t udpx_recvmsg(struct fid_ep *ep_fid, const struct fi_msg *msg,
@@ -189,7 +322,7 @@ ssize_t udpx_recvmsg(struct fid_ep *ep_fid, const struct fi_msg *msg,
 	ssize_t ret;
 
 	ep = container_of(ep_fid, struct udpx_ep, util_ep.ep_fid.fid);
-	fastlock_acquire(&ep->util_ep.rx_cq->cq_lock);
+	ofi_cq_lock(ep->util_ep.rx_cq);
 	if (cirque_isfull(ep->rxq)) {
 		ret = -FI_EAGAIN;
 		goto out;
@@ -206,7 +339,7 @@ ssize_t udpx_recvmsg(struct fid_ep *ep_fid, const struct fi_msg *msg,
 	cirque_commit(ep->rxq);
 	ret = 0;
 out:
-	fastlock_release(&ep->util_ep.rx_cq->cq_lock);
+	ofi_cq_unlock(ep->util_ep.rx_cq);
 	return ret;
 }
 
@@ -229,7 +362,7 @@ ssize_t udpx_recv(struct fid_ep *ep_fid, void *buf, size_t len, void *desc,
 	ssize_t ret;
 
 	ep = container_of(ep_fid, struct udpx_ep, util_ep.ep_fid.fid);
-	fastlock_acquire(&ep->util_ep.rx_cq->cq_lock);
+	ofi_cq_lock(ep->util_ep.rx_cq);
 	if (cirque_isfull(ep->rxq)) {
 		ret = -FI_EAGAIN;
 		goto out;
@@ -245,7 +378,7 @@ ssize_t udpx_recv(struct fid_ep *ep_fid, void *buf, size_t len, void *desc,
 	cirque_commit(ep->rxq);
 	ret = 0;
 out:
-	fastlock_release(&ep->util_ep.rx_cq->cq_lock);
+	ofi_cq_unlock(ep->util_ep.rx_cq);
 	return ret;
 }
 
@@ -253,10 +386,18 @@ ssize_t udpx_send(struct fid_ep *ep_fid, const void *buf, size_t len, void *desc
 		fi_addr_t dest_addr, void *context)
 {
 	struct udpx_ep *ep;
+	struct iovec iov;
 	ssize_t ret;
 
 	ep = container_of(ep_fid, struct udpx_ep, util_ep.ep_fid.fid);
-	fastlock_acquire(&ep->util_ep.tx_cq->cq_lock);
+	ofi_cq_lock(ep->util_ep.tx_cq);
+	if (ep->txq) {
+		iov.iov_base = (void *) buf;
+		iov.iov_len = len;
+		ret = udpx_tx_queue(ep, &iov, 1, dest_addr, context);
+		goto out;
+	}
+
 	if (cirque_isfull(ep->util_ep.tx_cq->cirq)) {
 		ret = -FI_EAGAIN;
 		goto out;
@@ -272,7 +413,7 @@ ssize_t udpx_send(struct fid_ep *ep_fid, const void *buf, size_t len, void *desc
 		ret = -errno;
 	}
 out:
-	fastlock_release(&ep->util_ep.tx_cq->cq_lock);
+	ofi_cq_unlock(ep->util_ep.tx_cq);
 	return ret;
 }
 
@@ -292,7 +433,13 @@ ssize_t udpx_sendmsg(struct fid_ep *ep_fid, const struct fi_msg *msg,
 	hdr.msg_controllen = 0;
 	hdr.msg_flags = 0;
 
-	fastlock_acquire(&ep->util_ep.tx_cq->cq_lock);
+	ofi_cq_lock(ep->util_ep.tx_cq);
+	if (ep->txq) {
+		ret = udpx_tx_queue(ep, msg->msg_iov, msg->iov_count,
+				    msg->addr, msg->context);
+		goto out;
+	}
+
 	if (cirque_isfull(ep->util_ep.tx_cq->cirq)) {
 		ret = -FI_EAGAIN;
 		goto out;
@@ -306,7 +453,7 @@ ssize_t udpx_sendmsg(struct fid_ep *ep_fid, const struct fi_msg *msg,
 		ret = -errno;
 	}
 out:
-	fastlock_release(&ep->util_ep.tx_cq->cq_lock);
+	ofi_cq_unlock(ep->util_ep.tx_cq);
 	return ret;
 }
 
@@ -330,6 +477,13 @@ ssize_t udpx_inject(struct fid_ep *ep_fid, const void *buf, size_t len,
 	ssize_t ret;
 
 	ep = container_of(ep_fid, struct udpx_ep, util_ep.ep_fid.fid);
+	if (ep->txq) {
+		/* Keep injected data behind any queued sends */
+		ofi_cq_lock(ep->util_ep.tx_cq);
+		udpx_tx_flush(ep);
+		ofi_cq_unlock(ep->util_ep.tx_cq);
+	}
+
 	ret = sendto(ep->sock, buf, len, 0,
 		     ip_av_get_addr(ep->util_ep.av, dest_addr),
 		     ep->util_ep.av->addrlen);
@@ -371,9 +525,20 @@ static int udpx_ep_close(struct fid *fid)
 		atomic_dec(&ep->util_ep.rx_cq->ref);
 	}
 
-	if (ep->util_ep.tx_cq)
+	if (ep->util_ep.tx_cq) {
+		if (ep->txq) {
+			fid_list_remove(&ep->util_ep.tx_cq->list,
+					&ep->util_ep.tx_cq->list_lock,
+					&ep->util_ep.ep_fid.fid);
+			ofi_cq_lock(ep->util_ep.tx_cq);
+			udpx_tx_flush(ep);
+			ofi_cq_unlock(ep->util_ep.tx_cq);
+		}
 		atomic_dec(&ep->util_ep.tx_cq->ref);
+	}
 
+	if (ep->txq)
+		udpx_tx_cirq_free(ep->txq);
 	udpx_rx_cirq_free(ep->rxq);
 	close(ep->sock);
 	atomic_dec(&ep->util_ep.domain->ref);
@@ -403,6 +568,22 @@ static int udpx_ep_bind_cq(struct udpx_ep *ep, struct util_cq *cq, uint64_t flag
 		ep->util_ep.tx_cq = cq;
 		atomic_inc(&cq->ref);
 		ep->tx_comp = cq->wait ? udpx_tx_comp_signal : udpx_tx_comp;
+
+		/*
+		 * Queued sends are only pushed out by progress, which a
+		 * thread blocked on the CQ wait object would never drive.
+		 */
+		if (cq->wait && ep->txq) {
+			udpx_tx_cirq_free(ep->txq);
+			ep->txq = NULL;
+		}
+
+		if (ep->txq) {
+			ret = fid_list_insert(&cq->list, &cq->list_lock,
+					      &ep->util_ep.ep_fid.fid);
+			if (ret)
+				return ret;
+		}
 	}
 
 	if (flags & FI_RECV) {
@@ -505,6 +686,14 @@ static int udpx_ep_init(struct udpx_ep *ep, struct fi_info *info)
 		return ret;
 	}
 
+	if (udpx_tx_batch > 1) {
+		ep->txq = udpx_tx_cirq_create(info->tx_attr->size);
+		if (!ep->txq) {
+			ret = -FI_ENOMEM;
+			goto err1;
+		}
+	}
+
 	family = info->src_addr ?
 		 ((struct sockaddr *) info->src_addr)->sa_family : AF_INET;
 	ep->sock = socket(family, SOCK_DGRAM, IPPROTO_UDP);
@@ -529,6 +718,8 @@ static int udpx_ep_init(struct udpx_ep *ep, struct fi_info *info)
 err2:
 	close(ep->sock);
 err1:
+	if (ep->txq)
+		udpx_tx_cirq_free(ep->txq);
 	udpx_rx_cirq_free(ep->rxq);
 	return ret;
 }
@@ -546,6 +737,9 @@ int udpx_endpoint(struct fid_domain *domain, struct fi_info *info,
 	if (ret)
 		return ret;
 
+	if (info->ep_attr->type == FI_EP_RDM)
+		return udpx_rdm_endpoint(domain, info, ep_fid, context);
+
 	ep = calloc(1, sizeof(*ep));
 	if (!ep)
 		return -FI_ENOMEM;
@@ -35,17 +35,39 @@
 #include <prov.h>
 #include "udpx.h"
 
+int udpx_rx_batch = UDPX_DEF_RX_BATCH;
+int udpx_tx_batch = UDPX_DEF_TX_BATCH;
+int udpx_rdm_rto = UDPX_RDM_DEF_RTO;
+int udpx_rdm_max_retry = UDPX_RDM_DEF_MAX_RETRY;
 
 int udpx_check_info(struct fi_info *info)
 {
+	if (info && info->ep_attr && info->ep_attr->type == FI_EP_RDM)
+		return fi_check_info(&udpx_prov, &udpx_rdm_info, info,
+				     FI_MATCH_EXACT);
 	return fi_check_info(&udpx_prov, &udpx_info, info, FI_MATCH_EXACT);
 }
 
 static int udpx_getinfo(uint32_t version, const char *node, const char *service,
 			uint64_t flags, struct fi_info *hints, struct fi_info **info)
 {
-	return util_getinfo(&udpx_prov, version, node, service, flags,
-			    &udpx_info, hints, info);
+	struct fi_info *dgram_info = NULL, *rdm_info = NULL;
+	int ret, rdm_ret;
+
+	ret = util_getinfo(&udpx_prov, version, node, service, flags,
+			   &udpx_info, hints, &dgram_info);
+	rdm_ret = util_getinfo(&udpx_prov, version, node, service, flags,
+			       &udpx_rdm_info, hints, &rdm_info);
+	if (ret && rdm_ret)
+		return ret == -FI_ENODATA ? rdm_ret : ret;
+
+	if (dgram_info) {
+		dgram_info->next = rdm_info;
+		*info = dgram_info;
+	} else {
+		*info = rdm_info;
+	}
+	return 0;
 }
 
 static void udpx_fini(void)
@@ -62,7 +84,40 @@ struct fi_provider udpx_prov = {
 	.cleanup = udpx_fini
 };
 
+static int udpx_clamp_batch(int batch)
+{
+	if (batch < 1)
+		return 1;
+	return MIN(batch, UDPX_MAX_BATCH);
+}
+
 UDP_INI
 {
+	fi_param_define(&udpx_prov, "rx_batch", FI_PARAM_INT,
+			"Maximum number of posted receives completed by a "
+			"single progress call (default: 16, max: 64)");
+	fi_param_define(&udpx_prov, "tx_batch", FI_PARAM_INT,
+			"Number of sends to queue before they are posted "
+			"together; 0 or 1 sends immediately (default: 0, "
+			"max: 64)");
+
+	fi_param_define(&udpx_prov, "rdm_rto", FI_PARAM_INT,
+			"Initial retransmit timeout in milliseconds for "
+			"RDM endpoints (default: 10)");
+	fi_param_define(&udpx_prov, "rdm_max_retry", FI_PARAM_INT,
+			"Retransmissions of a packet before an RDM peer is "
+			"reported unreachable (default: 16)");
+
+	fi_param_get_int(&udpx_prov, "rx_batch", &udpx_rx_batch);
+	fi_param_get_int(&udpx_prov, "tx_batch", &udpx_tx_batch);
+	udpx_rx_batch = udpx_clamp_batch(udpx_rx_batch);
+	if (udpx_tx_batch > 1)
+		udpx_tx_batch = udpx_clamp_batch(udpx_tx_batch);
+
+	fi_param_get_int(&udpx_prov, "rdm_rto", &udpx_rdm_rto);
+	fi_param_get_int(&udpx_prov, "rdm_max_retry", &udpx_rdm_max_retry);
+	if (udpx_rdm_rto < 1)
+		udpx_rdm_rto = 1;
+
 	return &udpx_prov;
 }
@@ -0,0 +1,1418 @@
+/*
+ * Copyright (c) 2016 Intel Corporation. All rights reserved.
+ *
+ * This software is available to you under a choice of one of two
+ * licenses.  You may choose to be licensed under the terms of the GNU
+ * General Public License (GPL) Version 2, available from the file
+ * COPYING in the main directory of this source tree, or the
+ * BSD license below:
+ *
+ *     Redistribution and use in source and binary forms, with or
+ *     without modification, are permitted provided that the following
+ *     conditions are met:
+ *
+ *      - Redistributions of source code must retain the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer.
+ *
+ *      - Redistributions in binary form must reproduce the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer in the documentation and/or other materials
+ *        provided with the distribution.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "udpx.h"
+
+
+#define UDPX_RDM_SLOT(seq)	((seq) & (UDPX_RDM_WINDOW - 1))
+#define UDPX_RDM_MAX_BACKOFF	6
+
+static size_t udpx_iov_len(const struct iovec *iov, size_t count)
+{
+	size_t i, len = 0;
+
+	for (i = 0; i < count; i++)
+		len += iov[i].iov_len;
+	return len;
+}
+
+/* Copy into an iov at the given offset, dropping anything past its end */
+static void udpx_copy_to_iov(const struct iovec *iov, size_t count,
+			     size_t offset, const void *buf, size_t len)
+{
+	size_t i, n, done = 0;
+
+	for (i = 0; i < count && done < len; i++) {
+		if (offset >= iov[i].iov_len) {
+			offset -= iov[i].iov_len;
+			continue;
+		}
+
+		n = MIN(iov[i].iov_len - offset, len - done);
+		memcpy((char *) iov[i].iov_base + offset,
+		       (const char *) buf + done, n);
+		done += n;
+		offset = 0;
+	}
+}
+
+static struct udpx_peer *
+udpx_rdm_get_peer(struct udpx_rdm_ep *ep, fi_addr_t addr)
+{
+	struct udpx_peer *peer;
+
+	if (addr >= ep->peer_cnt)
+		return NULL;
+
+	peer = ep->peers[addr];
+	if (!peer) {
+		peer = calloc(1, sizeof(*peer));
+		if (!peer)
+			return NULL;
+
+		peer->addr = addr;
+		peer->tx_window = UDPX_RDM_WINDOW;
+		dlist_init(&peer->tx_queue);
+		ep->peers[addr] = peer;
+	}
+	return peer;
+}
+
+/*
+ * Receive completions must leave room for the sends already accepted
+ * when both directions share a CQ.
+ */
+static int udpx_rdm_rx_cq_full(struct udpx_rdm_ep *ep)
+{
+	struct util_cq *cq = ep->util_ep.rx_cq;
+	size_t resv;
+
+	resv = (cq == ep->util_ep.tx_cq) ? ep->tx_cnt : 0;
+	return cirque_freecnt(cq->cirq) <= resv;
+}
+
+static void udpx_rdm_send_pkt(struct udpx_rdm_ep *ep, struct udpx_peer *peer,
+			      struct udpx_pkt *pkt)
+{
+	/*
+	 * A packet that could not be sent is treated as lost: it is
+	 * retransmitted after the timeout and counts against the retry limit.
+	 */
+	(void) sendto(ep->sock, &pkt->hdr, pkt->len, 0,
+		      ip_av_get_addr(ep->util_ep.av, peer->addr),
+		      ep->util_ep.av->addrlen);
+	pkt->send_time = fi_gettime_ms();
+}
+
+static void udpx_rdm_send_ack(struct udpx_rdm_ep *ep, struct udpx_peer *peer)
+{
+	struct ofi_ctrl_hdr hdr;
+	uint64_t sack = 0;
+	int i, last = -1;
+
+	for (i = 0; i < UDPX_RDM_WINDOW; i++) {
+		if (peer->rx_pkt[UDPX_RDM_SLOT(peer->rx_seq + i)]) {
+			sack |= 1ULL << i;
+			last = i;
+		}
+	}
+
+	memset(&hdr, 0, sizeof hdr);
+	hdr.version = OFI_CTRL_VERSION;
+	hdr.type = ofi_ctrl_ack;
+	/*
+	 * A stalled peer cannot consume anything, so only offer room for
+	 * the packets it already holds; the window reopens once it drains.
+	 */
+	hdr.seg_size = peer->stalled ? last + 1 : UDPX_RDM_WINDOW;
+	hdr.seg_no = peer->rx_seq;
+	hdr.rx_key = sack;
+
+	/* Lost acks are recovered by the sender's retransmissions */
+	(void) sendto(ep->sock, &hdr, sizeof hdr, 0,
+		      ip_av_get_addr(ep->util_ep.av, peer->addr),
+		      ep->util_ep.av->addrlen);
+}
+
+static void udpx_rdm_queue_ack(struct udpx_rdm_ep *ep, struct udpx_peer *peer)
+{
+	if (!peer->ack_pending) {
+		peer->ack_pending = 1;
+		dlist_insert_tail(&peer->ack_entry, &ep->ack_list);
+	}
+}
+
+static void udpx_rdm_activate(struct udpx_rdm_ep *ep, struct udpx_peer *peer)
+{
+	if (!peer->active) {
+		peer->active = 1;
+		dlist_insert_tail(&peer->entry, &ep->active_list);
+	}
+}
+
+static int udpx_rdm_tx_segmented(struct udpx_tx_op *op)
+{
+	return op->nseg && op->offset == op->op.size;
+}
+
+static void udpx_rdm_tx_done(struct udpx_rdm_ep *ep, struct udpx_tx_op *op)
+{
+	struct util_cq *cq = ep->util_ep.tx_cq;
+	struct fi_cq_tagged_entry *comp;
+
+	if (!(op->flags & FI_INJECT)) {
+		ofi_cq_lock(cq);
+		if (op->err) {
+			udpx_cq_write_err(cq, op->context, op->flags, 0, 0, 0,
+					  op->err);
+		} else {
+			comp = cirque_tail(cq->cirq);
+			comp->op_context = op->context;
+			comp->flags = op->flags;
+			comp->len = 0;
+			comp->buf = NULL;
+			comp->data = 0;
+			comp->tag = 0;
+			cirque_commit(cq->cirq);
+		}
+		ofi_cq_unlock(cq);
+		ep->tx_cnt--;
+	}
+	util_buf_release(ep->tx_pool, op);
+}
+
+/*
+ * The peer holds the packet, so its send is done with it.  The packet
+ * itself is kept until the cumulative ack passes it, to probe with.
+ */
+static void udpx_rdm_complete_pkt(struct udpx_rdm_ep *ep,
+				  struct udpx_pkt *pkt, int err)
+{
+	struct udpx_tx_op *op = pkt->op;
+
+	if (!op)
+		return;
+
+	pkt->op = NULL;
+	if (err)
+		op->err = err;
+	if (!--op->pending && udpx_rdm_tx_segmented(op))
+		udpx_rdm_tx_done(ep, op);
+}
+
+static void udpx_rdm_release_pkt(struct udpx_rdm_ep *ep,
+				 struct udpx_peer *peer, uint32_t seq, int err)
+{
+	struct udpx_pkt *pkt;
+
+	pkt = peer->tx_pkt[UDPX_RDM_SLOT(seq)];
+	if (!pkt)
+		return;
+
+	peer->tx_pkt[UDPX_RDM_SLOT(seq)] = NULL;
+	udpx_rdm_complete_pkt(ep, pkt, err);
+	util_buf_release(ep->pkt_pool, pkt);
+}
+
+static void udpx_rdm_fill_pkt(struct udpx_tx_op *op, struct udpx_pkt *pkt,
+			      uint32_t seq)
+{
+	struct iovec *iov;
+	uint8_t *data = pkt->data;
+	size_t space = UDPX_RDM_DATA_SIZE;
+	size_t len = 0, n;
+
+	pkt->hdr.version = OFI_CTRL_VERSION;
+	pkt->hdr.seg_no = seq;
+	pkt->hdr.conn_id = 0;
+	pkt->hdr.msg_id = op->msg_id;
+	pkt->hdr.rx_key = 0;
+
+	if (!op->nseg) {
+		pkt->hdr.type = ofi_ctrl_start_data;
+		memcpy(data, &op->op, sizeof(op->op));
+		data += sizeof(op->op);
+		space -= sizeof(op->op);
+	} else {
+		pkt->hdr.type = ofi_ctrl_data;
+	}
+
+	while (space && op->iov_index < op->iov_count) {
+		iov = &op->iov[op->iov_index];
+		n = MIN(space, iov->iov_len - op->iov_offset);
+		memcpy(data + len, (char *) iov->iov_base + op->iov_offset, n);
+		len += n;
+		space -= n;
+
+		op->iov_offset += n;
+		if (op->iov_offset == iov->iov_len) {
+			op->iov_index++;
+			op->iov_offset = 0;
+		}
+	}
+
+	pkt->hdr.seg_size = (uint16_t) len;
+	pkt->len = (uint16_t) (data + len - (uint8_t *) &pkt->hdr);
+	pkt->op = op;
+	pkt->retries = 0;
+
+	op->offset += len;
+	op->nseg++;
+	op->pending++;
+}
+
+/* Segment queued sends into the window the peer last advertised */
+static void udpx_rdm_push(struct udpx_rdm_ep *ep, struct udpx_peer *peer)
+{
+	struct udpx_tx_op *op;
+	struct udpx_pkt *pkt;
+
+	while (!dlist_empty(&peer->tx_queue) &&
+	       peer->tx_seq - peer->tx_acked < peer->tx_window) {
+		pkt = util_buf_alloc(ep->pkt_pool);
+		if (!pkt)
+			break;
+
+		op = container_of(peer->tx_queue.next, struct udpx_tx_op, entry);
+		udpx_rdm_fill_pkt(op, pkt, peer->tx_seq);
+		if (udpx_rdm_tx_segmented(op))
+			dlist_remove(&op->entry);
+
+		peer->tx_pkt[UDPX_RDM_SLOT(peer->tx_seq)] = pkt;
+		peer->tx_seq++;
+		udpx_rdm_send_pkt(ep, peer, pkt);
+	}
+}
+
+static void udpx_rdm_peer_fail(struct udpx_rdm_ep *ep, struct udpx_peer *peer)
+{
+	struct udpx_tx_op *op;
+	uint32_t seq;
+
+	FI_WARN(&udpx_prov, FI_LOG_EP_DATA,
+		"peer %" PRIu64 " not responding\n", peer->addr);
+	peer->failed = 1;
+
+	for (seq = peer->tx_acked; seq != peer->tx_seq; seq++)
+		udpx_rdm_release_pkt(ep, peer, seq, FI_ETIMEDOUT);
+	peer->tx_acked = peer->tx_seq;
+
+	while (!dlist_empty(&peer->tx_queue)) {
+		op = container_of(peer->tx_queue.next, struct udpx_tx_op, entry);
+		dlist_remove(&op->entry);
+		op->err = FI_ETIMEDOUT;
+		udpx_rdm_tx_done(ep, op);
+	}
+}
+
+static void udpx_rdm_retransmit(struct udpx_rdm_ep *ep, struct udpx_peer *peer,
+				uint64_t now)
+{
+	struct udpx_pkt *pkt;
+	uint64_t timeout;
+	uint32_t seq;
+	int closed;
+
+	closed = peer->tx_seq - peer->tx_acked >= peer->tx_window;
+	for (seq = peer->tx_acked; seq != peer->tx_seq; seq++) {
+		pkt = peer->tx_pkt[UDPX_RDM_SLOT(seq)];
+		if (!pkt)
+			continue;
+
+		/*
+		 * Packets the peer holds are not resent, except the oldest,
+		 * which probes for the ack that moves the window on.
+		 */
+		if (!pkt->op) {
+			if (seq != peer->tx_acked)
+				continue;
+			timeout = (uint64_t) udpx_rdm_rto <<
+				  UDPX_RDM_MAX_BACKOFF;
+		} else {
+			timeout = (uint64_t) udpx_rdm_rto <<
+				  MIN(pkt->retries, UDPX_RDM_MAX_BACKOFF);
+		}
+		if (now < pkt->send_time + timeout)
+			continue;
+
+		/* A peer that keeps acking is alive, even with no room */
+		if ((closed || !pkt->op) && peer->ack_time >= pkt->send_time) {
+			udpx_rdm_send_pkt(ep, peer, pkt);
+			continue;
+		}
+
+		if (++pkt->retries > udpx_rdm_max_retry) {
+			udpx_rdm_peer_fail(ep, peer);
+			return;
+		}
+		udpx_rdm_send_pkt(ep, peer, pkt);
+	}
+}
+
+static void udpx_rdm_handle_ack(struct udpx_rdm_ep *ep, struct udpx_peer *peer,
+				const struct ofi_ctrl_hdr *hdr)
+{
+	struct udpx_pkt *pkt;
+	uint32_t seq, d;
+
+	if (peer->failed || (int32_t) (hdr->seg_no - peer->tx_seq) > 0)
+		return;
+
+	peer->ack_time = fi_gettime_ms();
+	if ((int32_t) (hdr->seg_no - peer->tx_acked) < 0)
+		return;
+
+	for (; peer->tx_acked != hdr->seg_no; peer->tx_acked++)
+		udpx_rdm_release_pkt(ep, peer, peer->tx_acked, 0);
+
+	for (seq = peer->tx_acked; seq != peer->tx_seq; seq++) {
+		d = seq - hdr->seg_no;
+		pkt = peer->tx_pkt[UDPX_RDM_SLOT(seq)];
+		if (pkt && d < UDPX_RDM_WINDOW && (hdr->rx_key & (1ULL << d)))
+			udpx_rdm_complete_pkt(ep, pkt, 0);
+	}
+
+	peer->tx_window = MIN(hdr->seg_size, UDPX_RDM_WINDOW);
+	udpx_rdm_push(ep, peer);
+}
+
+/* Called with the rx CQ lock held and space available in the CQ */
+static void udpx_rdm_rx_comp(struct udpx_rdm_ep *ep,
+			     struct udpx_rx_entry *entry,
+			     const struct ofi_op_hdr *op, fi_addr_t addr)
+{
+	struct util_cq *cq = ep->util_ep.rx_cq;
+	struct fi_cq_tagged_entry *comp;
+	uint64_t tag;
+	size_t len;
+
+	tag = (entry->flags & FI_TAGGED) ? op->tag : 0;
+	len = udpx_iov_len(entry->iov, entry->iov_count);
+	if (op->size > len) {
+		udpx_cq_write_err(cq, entry->context, entry->flags, len,
+				  op->size - len, tag, FI_ETRUNC);
+	} else {
+		if (cq->src)
+			cq->src[cirque_windex(cq->cirq)] = addr;
+
+		comp = cirque_tail(cq->cirq);
+		comp->op_context = entry->context;
+		comp->flags = entry->flags;
+		comp->len = op->size;
+		comp->buf = NULL;
+		comp->data = 0;
+		comp->tag = tag;
+		cirque_commit(cq->cirq);
+	}
+	util_buf_release(ep->rx_pool, entry);
+}
+
+static void udpx_rdm_claim(struct udpx_rdm_ep *ep, struct udpx_unexp_msg *unexp,
+			   struct udpx_rx_entry *entry)
+{
+	udpx_copy_to_iov(entry->iov, entry->iov_count, 0, unexp->buf,
+			 unexp->op.size);
+	udpx_rdm_rx_comp(ep, entry, &unexp->op, unexp->addr);
+	dlist_remove(&unexp->entry);
+	ep->unexp_bytes -= unexp->op.size;
+	free(unexp);
+}
+
+static struct udpx_rx_entry *
+udpx_rdm_match_posted(struct dlist_entry *list, const struct ofi_op_hdr *op)
+{
+	struct udpx_rx_entry *entry;
+	struct dlist_entry *item;
+
+	dlist_foreach(list, item) {
+		entry = container_of(item, struct udpx_rx_entry, entry);
+		if (op->op == ofi_op_msg ||
+		    !((op->tag ^ entry->tag) & ~entry->ignore)) {
+			dlist_remove(item);
+			return entry;
+		}
+	}
+	return NULL;
+}
+
+static int udpx_rdm_start_msg(struct udpx_rdm_ep *ep, struct udpx_peer *peer,
+			      const struct ofi_op_hdr *op)
+{
+	struct udpx_unexp_msg *unexp;
+	struct dlist_entry *posted, *unexp_list;
+
+	if (op->op == ofi_op_tagged) {
+		posted = &ep->rx_tag_list;
+		unexp_list = &ep->unexp_tag_list;
+	} else {
+		posted = &ep->rx_msg_list;
+		unexp_list = &ep->unexp_msg_list;
+	}
+
+	peer->rx_entry = udpx_rdm_match_posted(posted, op);
+	if (peer->rx_entry) {
+		peer->rx_op = *op;
+		peer->rx_offset = 0;
+		return 0;
+	}
+
+	/*
+	 * Leave the packet in the receive window once the buffered data
+	 * would exceed total_buffered_recv.  rx_seq does not advance, so the
+	 * window stays closed until a matching receive is posted or buffered
+	 * messages are claimed.
+	 */
+	if (ep->unexp_bytes + op->size > UDPX_RDM_MAX_BUFFERED)
+		return -FI_EAGAIN;
+
+	unexp = malloc(sizeof(*unexp) + op->size);
+	if (!unexp)
+		return -FI_ENOMEM;
+
+	unexp->rx_entry = NULL;
+	unexp->addr = peer->addr;
+	unexp->op = *op;
+	unexp->offset = 0;
+	dlist_insert_tail(&unexp->entry, unexp_list);
+	ep->unexp_bytes += op->size;
+	peer->rx_unexp = unexp;
+	return 0;
+}
+
+/*
+ * Process the next in-order packet from a peer.  Returns -FI_EAGAIN if
+ * the packet must be retried later.  Called with the rx CQ lock held.
+ */
+static int udpx_rdm_rx_pkt(struct udpx_rdm_ep *ep, struct udpx_peer *peer,
+			   struct udpx_pkt *pkt)
+{
+	struct udpx_unexp_msg *unexp;
+	struct ofi_op_hdr *op;
+	uint8_t *data = pkt->data;
+	size_t len = pkt->len - sizeof(pkt->hdr);
+	size_t n;
+
+	if (pkt->hdr.type == ofi_ctrl_start_data) {
+		op = (struct ofi_op_hdr *) data;
+		if (len < sizeof(*op) || peer->rx_entry || peer->rx_unexp ||
+		    op->version != OFI_OP_VERSION ||
+		    (op->op != ofi_op_msg && op->op != ofi_op_tagged) ||
+		    op->size > UDPX_RDM_MAX_MSG_SIZE) {
+			FI_WARN(&udpx_prov, FI_LOG_EP_DATA,
+				"dropping invalid message start\n");
+			return 0;
+		}
+
+		if (udpx_rdm_start_msg(ep, peer, op))
+			return -FI_EAGAIN;
+
+		data += sizeof(*op);
+		len -= sizeof(*op);
+	}
+
+	if (peer->rx_entry) {
+		udpx_copy_to_iov(peer->rx_entry->iov, peer->rx_entry->iov_count,
+				 peer->rx_offset, data, len);
+		peer->rx_offset += len;
+		if (peer->rx_offset >= peer->rx_op.size) {
+			udpx_rdm_rx_comp(ep, peer->rx_entry, &peer->rx_op,
+					 peer->addr);
+			peer->rx_entry = NULL;
+		}
+	} else if (peer->rx_unexp) {
+		unexp = peer->rx_unexp;
+		n = MIN(len, unexp->op.size - unexp->offset);
+		memcpy(unexp->buf + unexp->offset, data, n);
+		unexp->offset += n;
+		if (unexp->offset == unexp->op.size) {
+			peer->rx_unexp = NULL;
+			if (unexp->rx_entry)
+				udpx_rdm_claim(ep, unexp, unexp->rx_entry);
+		}
+	} else {
+		FI_WARN(&udpx_prov, FI_LOG_EP_DATA,
+			"dropping data outside of a message\n");
+	}
+	return 0;
+}
+
+/* Hand in-order packets to matching, stalling if the CQ has no room */
+static void udpx_rdm_deliver(struct udpx_rdm_ep *ep, struct udpx_peer *peer)
+{
+	struct util_cq *cq = ep->util_ep.rx_cq;
+	struct udpx_pkt *pkt;
+	uint32_t rx_seq = peer->rx_seq;
+	int ret = 0;
+
+	ofi_cq_lock(cq);
+	while ((pkt = peer->rx_pkt[UDPX_RDM_SLOT(peer->rx_seq)])) {
+		if (udpx_rdm_rx_cq_full(ep)) {
+			ret = -FI_EAGAIN;
+			break;
+		}
+
+		ret = udpx_rdm_rx_pkt(ep, peer, pkt);
+		if (ret)
+			break;
+
+		peer->rx_pkt[UDPX_RDM_SLOT(peer->rx_seq)] = NULL;
+		util_buf_release(ep->pkt_pool, pkt);
+		peer->rx_seq++;
+	}
+	ofi_cq_unlock(cq);
+
+	if (ret && !peer->stalled) {
+		peer->stalled = 1;
+		dlist_insert_tail(&peer->stall_entry, &ep->stall_list);
+	} else if (!ret && peer->stalled) {
+		peer->stalled = 0;
+		dlist_remove(&peer->stall_entry);
+		udpx_rdm_queue_ack(ep, peer);
+	} else if (peer->stalled && peer->rx_seq != rx_seq) {
+		udpx_rdm_queue_ack(ep, peer);
+	}
+}
+
+static void udpx_rdm_handle_pkt(struct udpx_rdm_ep *ep, struct udpx_pkt *pkt,
+				size_t len, void *addr)
+{
+	struct udpx_peer *peer;
+	uint32_t seq;
+	int index;
+
+	if (len < sizeof(pkt->hdr) || pkt->hdr.version != OFI_CTRL_VERSION)
+		goto drop;
+
+	index = ip_av_get_index(ep->util_ep.av, addr);
+	if (index < 0) {
+		FI_DBG(&udpx_prov, FI_LOG_EP_DATA,
+		       "dropping packet from unknown address\n");
+		goto drop;
+	}
+
+	peer = udpx_rdm_get_peer(ep, index);
+	if (!peer)
+		goto drop;
+
+	switch (pkt->hdr.type) {
+	case ofi_ctrl_ack:
+		udpx_rdm_handle_ack(ep, peer, &pkt->hdr);
+		break;
+	case ofi_ctrl_start_data:
+	case ofi_ctrl_data:
+		/* Ack everything, including duplicates, whose ack was lost */
+		udpx_rdm_queue_ack(ep, peer);
+
+		seq = pkt->hdr.seg_no;
+		if ((int32_t) (seq - peer->rx_seq) < 0 ||
+		    seq - peer->rx_seq >= UDPX_RDM_WINDOW ||
+		    peer->rx_pkt[UDPX_RDM_SLOT(seq)])
+			break;
+
+		pkt->len = (uint16_t) len;
+		peer->rx_pkt[UDPX_RDM_SLOT(seq)] = pkt;
+		if (seq == peer->rx_seq)
+			udpx_rdm_deliver(ep, peer);
+		return;
+	default:
+		break;
+	}
+drop:
+	util_buf_release(ep->pkt_pool, pkt);
+}
+
+static void udpx_rdm_progress_rx(struct udpx_rdm_ep *ep)
+{
+	struct udpx_pkt *pkt[UDPX_MAX_BATCH];
+	struct sockaddr_in6 addr[UDPX_MAX_BATCH];
+	struct iovec iov[UDPX_MAX_BATCH];
+#if HAVE_RECVMMSG
+	struct mmsghdr msgs[UDPX_MAX_BATCH];
+#else
+	struct msghdr hdr;
+	ssize_t len;
+#endif
+	int i, cnt, ret;
+
+	for (cnt = 0; cnt < udpx_rx_batch; cnt++) {
+		pkt[cnt] = util_buf_alloc(ep->pkt_pool);
+		if (!pkt[cnt])
+			break;
+		iov[cnt].iov_base = &pkt[cnt]->hdr;
+		iov[cnt].iov_len = UDPX_MTU;
+	}
+
+#if HAVE_RECVMMSG
+	for (i = 0; i < cnt; i++) {
+		udpx_init_msghdr(&msgs[i].msg_hdr, &iov[i], 1,
+				 &addr[i], sizeof(addr[i]));
+	}
+
+	ret = cnt ? recvmmsg(ep->sock, msgs, cnt, 0, NULL) : 0;
+	if (ret < 0)
+		ret = 0;
+	for (i = 0; i < ret; i++)
+		udpx_rdm_handle_pkt(ep, pkt[i], msgs[i].msg_len, &addr[i]);
+#else
+	for (ret = 0; ret < cnt; ret++) {
+		udpx_init_msghdr(&hdr, &iov[ret], 1, &addr[0], sizeof(addr[0]));
+		len = recvmsg(ep->sock, &hdr, 0);
+		if (len < 0)
+			break;
+		udpx_rdm_handle_pkt(ep, pkt[ret], len, &addr[0]);
+	}
+#endif
+
+	for (i = ret; i < cnt; i++)
+		util_buf_release(ep->pkt_pool, pkt[i]);
+}
+
+static void udpx_rdm_ep_progress(struct util_ep *util_ep)
+{
+	struct udpx_rdm_ep *ep;
+	struct udpx_peer *peer;
+	struct dlist_entry *item, *next;
+	uint64_t now;
+
+	ep = container_of(util_ep, struct udpx_rdm_ep, util_ep);
+	fastlock_acquire(&ep->lock);
+
+	for (item = ep->stall_list.next; item != &ep->stall_list; item = next) {
+		next = item->next;
+		peer = container_of(item, struct udpx_peer, stall_entry);
+		udpx_rdm_deliver(ep, peer);
+	}
+
+	udpx_rdm_progress_rx(ep);
+
+	while (!dlist_empty(&ep->ack_list)) {
+		peer = container_of(ep->ack_list.next, struct udpx_peer,
+				    ack_entry);
+		dlist_remove(&peer->ack_entry);
+		peer->ack_pending = 0;
+		udpx_rdm_send_ack(ep, peer);
+	}
+
+	now = fi_gettime_ms();
+	for (item = ep->active_list.next; item != &ep->active_list; item = next) {
+		next = item->next;
+		peer = container_of(item, struct udpx_peer, entry);
+		udpx_rdm_retransmit(ep, peer, now);
+		udpx_rdm_push(ep, peer);
+
+		if (peer->tx_acked == peer->tx_seq &&
+		    dlist_empty(&peer->tx_queue)) {
+			dlist_remove(&peer->entry);
+			peer->active = 0;
+		}
+	}
+
+	fastlock_release(&ep->lock);
+}
+
+static ssize_t udpx_rdm_send(struct udpx_rdm_ep *ep, const struct iovec *iov,
+			     size_t count, fi_addr_t dest_addr, void *context,
+			     uint8_t op, uint64_t tag, uint64_t flags)
+{
+	struct udpx_peer *peer;
+	struct udpx_tx_op *tx_op;
+	size_t i, len;
+	ssize_t ret;
+
+	if (count > UDPX_IOV_LIMIT)
+		return -FI_EINVAL;
+
+	len = udpx_iov_len(iov, count);
+	if (len > UDPX_RDM_MAX_MSG_SIZE ||
+	    ((flags & FI_INJECT) && len > UDPX_RDM_INJECT_SIZE))
+		return -FI_EMSGSIZE;
+
+	fastlock_acquire(&ep->lock);
+	peer = udpx_rdm_get_peer(ep, dest_addr);
+	if (!peer) {
+		ret = (dest_addr < ep->peer_cnt) ? -FI_ENOMEM : -FI_EINVAL;
+		goto out;
+	}
+
+	if (peer->failed) {
+		ret = -FI_EHOSTUNREACH;
+		goto out;
+	}
+
+	/* Reserve a CQ slot for every send awaiting completion */
+	if (!(flags & FI_INJECT) &&
+	    cirque_freecnt(ep->util_ep.tx_cq->cirq) <= ep->tx_cnt) {
+		ret = -FI_EAGAIN;
+		goto out;
+	}
+
+	tx_op = util_buf_alloc(ep->tx_pool);
+	if (!tx_op) {
+		ret = -FI_EAGAIN;
+		goto out;
+	}
+
+	tx_op->context = context;
+	tx_op->flags = FI_SEND | (flags & FI_INJECT) |
+		       (op == ofi_op_tagged ? FI_TAGGED : FI_MSG);
+	memset(&tx_op->op, 0, sizeof(tx_op->op));
+	tx_op->op.version = OFI_OP_VERSION;
+	tx_op->op.op = op;
+	tx_op->op.size = len;
+	if (op == ofi_op_tagged)
+		tx_op->op.tag = tag;
+	tx_op->msg_id = peer->msg_id++;
+
+	if (flags & FI_INJECT) {
+		for (i = 0, len = 0; i < count; i++) {
+			memcpy(&tx_op->inject[len], iov[i].iov_base,
+			       iov[i].iov_len);
+			len += iov[i].iov_len;
+		}
+		tx_op->iov[0].iov_base = tx_op->inject;
+		tx_op->iov[0].iov_len = len;
+		tx_op->iov_count = 1;
+	} else {
+		for (i = 0; i < count; i++)
+			tx_op->iov[i] = iov[i];
+		tx_op->iov_count = (uint8_t) count;
+		ep->tx_cnt++;
+	}
+
+	tx_op->iov_index = 0;
+	tx_op->iov_offset = 0;
+	tx_op->nseg = 0;
+	tx_op->offset = 0;
+	tx_op->pending = 0;
+	tx_op->err = 0;
+
+	dlist_insert_tail(&tx_op->entry, &peer->tx_queue);
+	udpx_rdm_activate(ep, peer);
+	udpx_rdm_push(ep, peer);
+	ret = 0;
+out:
+	fastlock_release(&ep->lock);
+	return ret;
+}
+
+static ssize_t udpx_rdm_recv(struct udpx_rdm_ep *ep, const struct iovec *iov,
+			     size_t count, void *context, uint64_t flags,
+			     uint64_t tag, uint64_t ignore)
+{
+	struct util_cq *cq = ep->util_ep.rx_cq;
+	struct udpx_rx_entry *entry;
+	struct udpx_unexp_msg *unexp = NULL;
+	struct dlist_entry *item, *unexp_list;
+	size_t i;
+	ssize_t ret;
+
+	if (count > UDPX_IOV_LIMIT)
+		return -FI_EINVAL;
+
+	fastlock_acquire(&ep->lock);
+	entry = util_buf_alloc(ep->rx_pool);
+	if (!entry) {
+		ret = -FI_EAGAIN;
+		goto out;
+	}
+
+	entry->context = context;
+	entry->flags = FI_RECV | (flags & FI_TAGGED ? FI_TAGGED : FI_MSG);
+	entry->tag = tag;
+	entry->ignore = ignore;
+	for (i = 0; i < count; i++)
+		entry->iov[i] = iov[i];
+	entry->iov_count = (uint8_t) count;
+
+	unexp_list = (flags & FI_TAGGED) ?
+		     &ep->unexp_tag_list : &ep->unexp_msg_list;
+	dlist_foreach(unexp_list, item) {
+		unexp = container_of(item, struct udpx_unexp_msg, entry);
+		if (!unexp->rx_entry && (!(flags & FI_TAGGED) ||
+		    !((unexp->op.tag ^ tag) & ~ignore)))
+			break;
+		unexp = NULL;
+	}
+
+	if (!unexp) {
+		dlist_insert_tail(&entry->entry, (flags & FI_TAGGED) ?
+				  &ep->rx_tag_list : &ep->rx_msg_list);
+		ret = 0;
+		goto out;
+	}
+
+	/* Still arriving; it completes when its last packet is delivered */
+	if (unexp->offset < unexp->op.size) {
+		unexp->rx_entry = entry;
+		ret = 0;
+		goto out;
+	}
+
+	ofi_cq_lock(cq);
+	if (udpx_rdm_rx_cq_full(ep)) {
+		ofi_cq_unlock(cq);
+		util_buf_release(ep->rx_pool, entry);
+		ret = -FI_EAGAIN;
+		goto out;
+	}
+	udpx_rdm_claim(ep, unexp, entry);
+	ofi_cq_unlock(cq);
+	ret = 0;
+out:
+	fastlock_release(&ep->lock);
+	return ret;
+}
+
+static ssize_t udpx_rdm_ep_recv(struct fid_ep *ep_fid, void *buf, size_t len,
+				void *desc, fi_addr_t src_addr, void *context)
+{
+	struct udpx_rdm_ep *ep;
+	struct iovec iov;
+
+	ep = container_of(ep_fid, struct udpx_rdm_ep, util_ep.ep_fid.fid);
+	iov.iov_base = buf;
+	iov.iov_len = len;
+	return udpx_rdm_recv(ep, &iov, 1, context, 0, 0, 0);
+}
+
+static ssize_t udpx_rdm_ep_recvv(struct fid_ep *ep_fid, const struct iovec *iov,
+				 void **desc, size_t count, fi_addr_t src_addr,
+				 void *context)
+{
+	struct udpx_rdm_ep *ep;
+
+	ep = container_of(ep_fid, struct udpx_rdm_ep, util_ep.ep_fid.fid);
+	return udpx_rdm_recv(ep, iov, count, context, 0, 0, 0);
+}
+
+static ssize_t udpx_rdm_ep_recvmsg(struct fid_ep *ep_fid,
+				   const struct fi_msg *msg, uint64_t flags)
+{
+	struct udpx_rdm_ep *ep;
+
+	ep = container_of(ep_fid, struct udpx_rdm_ep, util_ep.ep_fid.fid);
+	return udpx_rdm_recv(ep, msg->msg_iov, msg->iov_count, msg->context,
+			     0, 0, 0);
+}
+
+static ssize_t udpx_rdm_ep_send(struct fid_ep *ep_fid, const void *buf,
+				size_t len, void *desc, fi_addr_t dest_addr,
+				void *context)
+{
+	struct udpx_rdm_ep *ep;
+	struct iovec iov;
+
+	ep = container_of(ep_fid, struct udpx_rdm_ep, util_ep.ep_fid.fid);
+	iov.iov_base = (void *) buf;
+	iov.iov_len = len;
+	return udpx_rdm_send(ep, &iov, 1, dest_addr, context, ofi_op_msg, 0, 0);
+}
+
+static ssize_t udpx_rdm_ep_sendv(struct fid_ep *ep_fid, const struct iovec *iov,
+				 void **desc, size_t count, fi_addr_t dest_addr,
+				 void *context)
+{
+	struct udpx_rdm_ep *ep;
+
+	ep = container_of(ep_fid, struct udpx_rdm_ep, util_ep.ep_fid.fid);
+	return udpx_rdm_send(ep, iov, count, dest_addr, context, ofi_op_msg,
+			     0, 0);
+}
+
+static ssize_t udpx_rdm_ep_sendmsg(struct fid_ep *ep_fid,
+				   const struct fi_msg *msg, uint64_t flags)
+{
+	struct udpx_rdm_ep *ep;
+
+	ep = container_of(ep_fid, struct udpx_rdm_ep, util_ep.ep_fid.fid);
+	return udpx_rdm_send(ep, msg->msg_iov, msg->iov_count, msg->addr,
+			     msg->context, ofi_op_msg, 0, flags);
+}
+
+static ssize_t udpx_rdm_ep_inject(struct fid_ep *ep_fid, const void *buf,
+				  size_t len, fi_addr_t dest_addr)
+{
+	struct udpx_rdm_ep *ep;
+	struct iovec iov;
+
+	ep = container_of(ep_fid, struct udpx_rdm_ep, util_ep.ep_fid.fid);
+	iov.iov_base = (void *) buf;
+	iov.iov_len = len;
+	return udpx_rdm_send(ep, &iov, 1, dest_addr, NULL, ofi_op_msg, 0,
+			     FI_INJECT);
+}
+
+static struct fi_ops_msg udpx_rdm_msg_ops = {
+	.size = sizeof(struct fi_ops_msg),
+	.recv = udpx_rdm_ep_recv,
+	.recvv = udpx_rdm_ep_recvv,
+	.recvmsg = udpx_rdm_ep_recvmsg,
+	.send = udpx_rdm_ep_send,
+	.sendv = udpx_rdm_ep_sendv,
+	.sendmsg = udpx_rdm_ep_sendmsg,
+	.inject = udpx_rdm_ep_inject,
+	.senddata = fi_no_msg_senddata,
+	.injectdata = fi_no_msg_injectdata,
+};
+
+static ssize_t udpx_rdm_ep_trecv(struct fid_ep *ep_fid, void *buf, size_t len,
+				 void *desc, fi_addr_t src_addr, uint64_t tag,
+				 uint64_t ignore, void *context)
+{
+	struct udpx_rdm_ep *ep;
+	struct iovec iov;
+
+	ep = container_of(ep_fid, struct udpx_rdm_ep, util_ep.ep_fid.fid);
+	iov.iov_base = buf;
+	iov.iov_len = len;
+	return udpx_rdm_recv(ep, &iov, 1, context, FI_TAGGED, tag, ignore);
+}
+
+static ssize_t udpx_rdm_ep_trecvv(struct fid_ep *ep_fid,
+				  const struct iovec *iov, void **desc,
+				  size_t count, fi_addr_t src_addr,
+				  uint64_t tag, uint64_t ignore, void *context)
+{
+	struct udpx_rdm_ep *ep;
+
+	ep = container_of(ep_fid, struct udpx_rdm_ep, util_ep.ep_fid.fid);
+	return udpx_rdm_recv(ep, iov, count, context, FI_TAGGED, tag, ignore);
+}
+
+static ssize_t udpx_rdm_ep_trecvmsg(struct fid_ep *ep_fid,
+				    const struct fi_msg_tagged *msg,
+				    uint64_t flags)
+{
+	struct udpx_rdm_ep *ep;
+
+	ep = container_of(ep_fid, struct udpx_rdm_ep, util_ep.ep_fid.fid);
+	return udpx_rdm_recv(ep, msg->msg_iov, msg->iov_count, msg->context,
+			     FI_TAGGED, msg->tag, msg->ignore);
+}
+
+static ssize_t udpx_rdm_ep_tsend(struct fid_ep *ep_fid, const void *buf,
+				 size_t len, void *desc, fi_addr_t dest_addr,
+				 uint64_t tag, void *context)
+{
+	struct udpx_rdm_ep *ep;
+	struct iovec iov;
+
+	ep = container_of(ep_fid, struct udpx_rdm_ep, util_ep.ep_fid.fid);
+	iov.iov_base = (void *) buf;
+	iov.iov_len = len;
+	return udpx_rdm_send(ep, &iov, 1, dest_addr, context, ofi_op_tagged,
+			     tag, 0);
+}
+
+static ssize_t udpx_rdm_ep_tsendv(struct fid_ep *ep_fid,
+				  const struct iovec *iov, void **desc,
+				  size_t count, fi_addr_t dest_addr,
+				  uint64_t tag, void *context)
+{
+	struct udpx_rdm_ep *ep;
+
+	ep = container_of(ep_fid, struct udpx_rdm_ep, util_ep.ep_fid.fid);
+	return udpx_rdm_send(ep, iov, count, dest_addr, context, ofi_op_tagged,
+			     tag, 0);
+}
+
+static ssize_t udpx_rdm_ep_tsendmsg(struct fid_ep *ep_fid,
+				    const struct fi_msg_tagged *msg,
+				    uint64_t flags)
+{
+	struct udpx_rdm_ep *ep;
+
+	ep = container_of(ep_fid, struct udpx_rdm_ep, util_ep.ep_fid.fid);
+	return udpx_rdm_send(ep, msg->msg_iov, msg->iov_count, msg->addr,
+			     msg->context, ofi_op_tagged, msg->tag, flags);
+}
+
+static ssize_t udpx_rdm_ep_tinject(struct fid_ep *ep_fid, const void *buf,
+				   size_t len, fi_addr_t dest_addr,
+				   uint64_t tag)
+{
+	struct udpx_rdm_ep *ep;
+	struct iovec iov;
+
+	ep = container_of(ep_fid, struct udpx_rdm_ep, util_ep.ep_fid.fid);
+	iov.iov_base = (void *) buf;
+	iov.iov_len = len;
+	return udpx_rdm_send(ep, &iov, 1, dest_addr, NULL, ofi_op_tagged, tag,
+			     FI_INJECT);
+}
+
+static struct fi_ops_tagged udpx_rdm_tagged_ops = {
+	.size = sizeof(struct fi_ops_tagged),
+	.recv = udpx_rdm_ep_trecv,
+	.recvv = udpx_rdm_ep_trecvv,
+	.recvmsg = udpx_rdm_ep_trecvmsg,
+	.send = udpx_rdm_ep_tsend,
+	.sendv = udpx_rdm_ep_tsendv,
+	.sendmsg = udpx_rdm_ep_tsendmsg,
+	.inject = udpx_rdm_ep_tinject,
+	.senddata = fi_no_tagged_senddata,
+	.injectdata = fi_no_tagged_injectdata,
+};
+
+static int udpx_rdm_setname(fid_t fid, void *addr, size_t addrlen)
+{
+	struct udpx_rdm_ep *ep;
+	int ret;
+
+	ep = container_of(fid, struct udpx_rdm_ep, util_ep.ep_fid.fid);
+	ret = bind(ep->sock, addr, addrlen);
+	return ret ? -errno : 0;
+}
+
+static int udpx_rdm_getname(fid_t fid, void *addr, size_t *addrlen)
+{
+	struct udpx_rdm_ep *ep;
+	socklen_t len;
+	int ret;
+
+	ep = container_of(fid, struct udpx_rdm_ep, util_ep.ep_fid.fid);
+	len = *addrlen;
+	ret = getsockname(ep->sock, addr, &len);
+	*addrlen = len;
+	return ret ? -errno : 0;
+}
+
+static struct fi_ops_cm udpx_rdm_cm_ops = {
+	.size = sizeof(struct fi_ops_cm),
+	.setname = udpx_rdm_setname,
+	.getname = udpx_rdm_getname,
+	.getpeer = fi_no_getpeer,
+	.connect = fi_no_connect,
+	.listen = fi_no_listen,
+	.accept = fi_no_accept,
+	.reject = fi_no_reject,
+	.shutdown = fi_no_shutdown,
+};
+
+static struct fi_ops_ep udpx_rdm_ep_ops = {
+	.size = sizeof(struct fi_ops_ep),
+	.cancel = fi_no_cancel,
+	.getopt = udpx_getopt,
+	.setopt = udpx_setopt,
+	.tx_ctx = fi_no_tx_ctx,
+	.rx_ctx = fi_no_rx_ctx,
+	.rx_size_left = fi_no_rx_size_left,
+	.tx_size_left = fi_no_tx_size_left,
+};
+
+static void udpx_rdm_free_peer(struct udpx_rdm_ep *ep, struct udpx_peer *peer)
+{
+	struct udpx_tx_op *op;
+	uint32_t seq;
+	int i;
+
+	for (seq = peer->tx_acked; seq != peer->tx_seq; seq++) {
+		if (!peer->tx_pkt[UDPX_RDM_SLOT(seq)])
+			continue;
+
+		op = peer->tx_pkt[UDPX_RDM_SLOT(seq)]->op;
+		util_buf_release(ep->pkt_pool, peer->tx_pkt[UDPX_RDM_SLOT(seq)]);
+		if (op && !--op->pending && udpx_rdm_tx_segmented(op))
+			util_buf_release(ep->tx_pool, op);
+	}
+
+	while (!dlist_empty(&peer->tx_queue)) {
+		op = container_of(peer->tx_queue.next, struct udpx_tx_op, entry);
+		dlist_remove(&op->entry);
+		util_buf_release(ep->tx_pool, op);
+	}
+
+	for (i = 0; i < UDPX_RDM_WINDOW; i++) {
+		if (peer->rx_pkt[i])
+			util_buf_release(ep->pkt_pool, peer->rx_pkt[i]);
+	}
+
+	if (peer->rx_entry)
+		util_buf_release(ep->rx_pool, peer->rx_entry);
+	free(peer);
+}
+
+static void udpx_rdm_free_rx_list(struct udpx_rdm_ep *ep,
+				  struct dlist_entry *list)
+{
+	struct udpx_rx_entry *entry;
+
+	while (!dlist_empty(list)) {
+		entry = container_of(list->next, struct udpx_rx_entry, entry);
+		dlist_remove(&entry->entry);
+		util_buf_release(ep->rx_pool, entry);
+	}
+}
+
+static void udpx_rdm_free_unexp_list(struct udpx_rdm_ep *ep,
+				     struct dlist_entry *list)
+{
+	struct udpx_unexp_msg *unexp;
+
+	while (!dlist_empty(list)) {
+		unexp = container_of(list->next, struct udpx_unexp_msg, entry);
+		dlist_remove(&unexp->entry);
+		if (unexp->rx_entry)
+			util_buf_release(ep->rx_pool, unexp->rx_entry);
+		free(unexp);
+	}
+}
+
+static void udpx_rdm_ep_cleanup(struct udpx_rdm_ep *ep)
+{
+	size_t i;
+
+	for (i = 0; i < ep->peer_cnt; i++) {
+		if (ep->peers[i])
+			udpx_rdm_free_peer(ep, ep->peers[i]);
+	}
+	free(ep->peers);
+
+	udpx_rdm_free_rx_list(ep, &ep->rx_msg_list);
+	udpx_rdm_free_rx_list(ep, &ep->rx_tag_list);
+	udpx_rdm_free_unexp_list(ep, &ep->unexp_msg_list);
+	udpx_rdm_free_unexp_list(ep, &ep->unexp_tag_list);
+
+	util_buf_pool_destroy(ep->rx_pool);
+	util_buf_pool_destroy(ep->tx_pool);
+	util_buf_pool_destroy(ep->pkt_pool);
+}
+
+static int udpx_rdm_ep_close(struct fid *fid)
+{
+	struct udpx_rdm_ep *ep;
+
+	ep = container_of(fid, struct udpx_rdm_ep, util_ep.ep_fid.fid);
+
+	if (ep->util_ep.rx_cq) {
+		fid_list_remove(&ep->util_ep.rx_cq->list,
+				&ep->util_ep.rx_cq->list_lock,
+				&ep->util_ep.ep_fid.fid);
+		atomic_dec(&ep->util_ep.rx_cq->ref);
+	}
+
+	if (ep->util_ep.tx_cq) {
+		fid_list_remove(&ep->util_ep.tx_cq->list,
+				&ep->util_ep.tx_cq->list_lock,
+				&ep->util_ep.ep_fid.fid);
+		atomic_dec(&ep->util_ep.tx_cq->ref);
+	}
+
+	udpx_rdm_ep_cleanup(ep);
+	if (ep->util_ep.av)
+		atomic_dec(&ep->util_ep.av->ref);
+
+	close(ep->sock);
+	fastlock_destroy(&ep->lock);
+	atomic_dec(&ep->util_ep.domain->ref);
+	free(ep);
+	return 0;
+}
+
+static int udpx_rdm_ep_bind_cq(struct udpx_rdm_ep *ep, struct util_cq *cq,
+			       uint64_t flags)
+{
+	if (flags & ~(FI_TRANSMIT | FI_RECV)) {
+		FI_WARN(&udpx_prov, FI_LOG_EP_CTRL,
+			"unsupported flags\n");
+		return -FI_EBADFLAGS;
+	}
+
+	if (((flags & FI_TRANSMIT) && ep->util_ep.tx_cq) ||
+	    ((flags & FI_RECV) && ep->util_ep.rx_cq)) {
+		FI_WARN(&udpx_prov, FI_LOG_EP_CTRL,
+			"duplicate CQ binding\n");
+		return -FI_EINVAL;
+	}
+
+	/* Retransmissions are driven by progress, not by the wait object */
+	if (cq->wait) {
+		FI_WARN(&udpx_prov, FI_LOG_EP_CTRL,
+			"RDM endpoints do not support CQ wait objects\n");
+		return -FI_ENOSYS;
+	}
+
+	if (flags & FI_TRANSMIT) {
+		ep->util_ep.tx_cq = cq;
+		atomic_inc(&cq->ref);
+	}
+
+	if (flags & FI_RECV) {
+		ep->util_ep.rx_cq = cq;
+		atomic_inc(&cq->ref);
+	}
+
+	return fid_list_insert(&cq->list, &cq->list_lock,
+			       &ep->util_ep.ep_fid.fid);
+}
+
+static int udpx_rdm_ep_bind(struct fid *ep_fid, struct fid *bfid,
+			    uint64_t flags)
+{
+	struct udpx_rdm_ep *ep;
+	struct util_av *av;
+	int ret = 0;
+
+	ep = container_of(ep_fid, struct udpx_rdm_ep, util_ep.ep_fid.fid);
+	switch (bfid->fclass) {
+	case FI_CLASS_AV:
+		if (ep->util_ep.av) {
+			FI_WARN(&udpx_prov, FI_LOG_EP_CTRL,
+				"duplicate AV binding\n");
+			return -FI_EINVAL;
+		}
+		av = container_of(bfid, struct util_av, av_fid.fid);
+		if (!(av->flags & FI_SOURCE)) {
+			FI_WARN(&udpx_prov, FI_LOG_EP_CTRL,
+				"AV does not support source lookup\n");
+			return -FI_EINVAL;
+		}
+
+		ep->peers = calloc(av->count, sizeof(*ep->peers));
+		if (!ep->peers)
+			return -FI_ENOMEM;
+		ep->peer_cnt = av->count;
+		atomic_inc(&av->ref);
+		ep->util_ep.av = av;
+		break;
+	case FI_CLASS_CQ:
+		ret = udpx_rdm_ep_bind_cq(ep, container_of(bfid, struct util_cq,
+							   cq_fid.fid), flags);
+		break;
+	case FI_CLASS_EQ:
+		break;
+	default:
+		FI_WARN(&udpx_prov, FI_LOG_EP_CTRL,
+			"invalid fid class\n");
+		ret = -FI_EINVAL;
+		break;
+	}
+	return ret;
+}
+
+static int udpx_rdm_ep_ctrl(struct fid *fid, int command, void *arg)
+{
+	struct udpx_rdm_ep *ep;
+
+	ep = container_of(fid, struct udpx_rdm_ep, util_ep.ep_fid.fid);
+	switch (command) {
+	case FI_ENABLE:
+		if (!ep->util_ep.rx_cq || !ep->util_ep.tx_cq)
+			return -FI_ENOCQ;
+		if (!ep->util_ep.av)
+			return -FI_EOPBADSTATE; /* TODO: Add FI_ENOAV */
+		break;
+	default:
+		return -FI_ENOSYS;
+	}
+	return 0;
+}
+
+static struct fi_ops udpx_rdm_ep_fi_ops = {
+	.size = sizeof(struct fi_ops),
+	.close = udpx_rdm_ep_close,
+	.bind = udpx_rdm_ep_bind,
+	.control = udpx_rdm_ep_ctrl,
+	.ops_open = fi_no_ops_open,
+};
+
+static int udpx_rdm_ep_init(struct udpx_rdm_ep *ep, struct fi_info *info)
+{
+	int family;
+	int ret;
+
+	ep->pkt_pool = util_buf_pool_create(sizeof(struct udpx_pkt), 16, 0, 64);
+	ep->tx_pool = util_buf_pool_create(sizeof(struct udpx_tx_op), 16,
+					   info->tx_attr->size, 16);
+	ep->rx_pool = util_buf_pool_create(sizeof(struct udpx_rx_entry), 16,
+					   info->rx_attr->size, 64);
+	if (!ep->pkt_pool || !ep->tx_pool || !ep->rx_pool) {
+		ret = -FI_ENOMEM;
+		goto err1;
+	}
+
+	family = info->src_addr ?
+		 ((struct sockaddr *) info->src_addr)->sa_family : AF_INET;
+	ep->sock = socket(family, SOCK_DGRAM, IPPROTO_UDP);
+	if (ep->sock < 0) {
+		ret = -errno;
+		goto err1;
+	}
+
+	if (info->src_addr) {
+		ret = bind(ep->sock, info->src_addr, info->src_addrlen);
+		if (ret) {
+			ret = -errno;
+			goto err2;
+		}
+	}
+
+	ret = fi_fd_nonblock(ep->sock);
+	if (ret)
+		goto err2;
+
+	fastlock_init(&ep->lock);
+	dlist_init(&ep->active_list);
+	dlist_init(&ep->ack_list);
+	dlist_init(&ep->stall_list);
+	dlist_init(&ep->rx_msg_list);
+	dlist_init(&ep->rx_tag_list);
+	dlist_init(&ep->unexp_msg_list);
+	dlist_init(&ep->unexp_tag_list);
+	return 0;
+err2:
+	close(ep->sock);
+err1:
+	if (ep->rx_pool)
+		util_buf_pool_destroy(ep->rx_pool);
+	if (ep->tx_pool)
+		util_buf_pool_destroy(ep->tx_pool);
+	if (ep->pkt_pool)
+		util_buf_pool_destroy(ep->pkt_pool);
+	return ret;
+}
+
+int udpx_rdm_endpoint(struct fid_domain *domain, struct fi_info *info,
+		      struct fid_ep **ep_fid, void *context)
+{
+	struct udpx_rdm_ep *ep;
+	int ret;
+
+	ep = calloc(1, sizeof(*ep));
+	if (!ep)
+		return -FI_ENOMEM;
+
+	ret = udpx_rdm_ep_init(ep, info);
+	if (ret) {
+		free(ep);
+		return ret;
+	}
+
+	ep->util_ep.ep_fid.fid.fclass = FI_CLASS_EP;
+	ep->util_ep.ep_fid.fid.context = context;
+	ep->util_ep.ep_fid.fid.ops = &udpx_rdm_ep_fi_ops;
+	ep->util_ep.ep_fid.ops = &udpx_rdm_ep_ops;
+	ep->util_ep.ep_fid.cm = &udpx_rdm_cm_ops;
+	ep->util_ep.ep_fid.msg = &udpx_rdm_msg_ops;
+	ep->util_ep.ep_fid.tagged = &udpx_rdm_tagged_ops;
+	ep->util_ep.progress = udpx_rdm_ep_progress;
+
+	ep->util_ep.domain = container_of(domain, struct util_domain, domain_fid);
+	atomic_inc(&ep->util_ep.domain->ref);
+
+	*ep_fid = &ep->util_ep.ep_fid;
+	return 0;
+}
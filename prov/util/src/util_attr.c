@@ -581,6 +581,17 @@ int fi_check_info(const struct fi_provider *prov,
 	return 0;
 }
 
+static void fi_alter_domain_attr(struct fi_domain_attr *attr,
+				 const struct fi_domain_attr *hints)
+{
+	if (!hints)
+		return;
+
+	/* fi_check_domain_attr has verified we can support the request */
+	if (hints->threading != FI_THREAD_UNSPEC)
+		attr->threading = hints->threading;
+}
+
 static void fi_alter_ep_attr(struct fi_ep_attr *attr,
 			     const struct fi_ep_attr *hints)
 {
@@ -651,6 +662,7 @@ void ofi_alter_info(struct fi_info *info,
 		info->caps = (hints->caps & FI_PRIMARY_CAPS) |
 			     (info->caps & FI_SECONDARY_CAPS);
 
+		fi_alter_domain_attr(info->domain_attr, hints->domain_attr);
 		fi_alter_ep_attr(info->ep_attr, hints->ep_attr);
 		fi_alter_rx_attr(info->rx_attr, hints->rx_attr, info->caps);
 		fi_alter_tx_attr(info->tx_attr, hints->tx_attr, info->caps);
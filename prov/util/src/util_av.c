@@ -40,11 +40,13 @@
 #include <netinet/in.h>
 
 #include <fi_util.h>
+#include <fasthash.h>
 
 
 enum {
 	UTIL_NO_ENTRY = -1,
 	UTIL_DEFAULT_AV_SIZE = 1024,
+	UTIL_AV_HASH_MIN_SIZE = 64,
 };
 
 
@@ -189,37 +191,104 @@ static int fi_verify_av_insert(struct util_av *av, uint64_t flags)
 	return 0;
 }
 
+static struct util_av_hash_table *util_av_hash_alloc(size_t size)
+{
+	struct util_av_hash_table *table;
+	size_t i;
+
+	table = malloc(sizeof(*table) + size * sizeof(table->entry[0]));
+	if (!table)
+		return NULL;
+
+	table->retired = NULL;
+	table->size_mask = size - 1;
+	for (i = 0; i < size; i++)
+		table->entry[i].index = UTIL_NO_ENTRY;
+	return table;
+}
+
+static void util_av_hash_place(struct util_av_hash_table *table,
+			       uint32_t hash, int index)
+{
+	size_t i;
+
+	for (i = hash & table->size_mask;
+	     table->entry[i].index != UTIL_NO_ENTRY;
+	     i = (i + 1) & table->size_mask)
+		;
+
+	table->entry[i].index = index;
+	table->entry[i].hash = hash;
+}
+
+/*
+ * Writers hold the AV lock and bracket every change to the hash table, or
+ * to address data reachable through it, with these calls.  The count is
+ * odd while an update is in progress.
+ */
+static void util_av_write_begin(struct util_av *av)
+{
+#ifdef HAVE_ATOMICS
+	atomic_store_explicit(&av->hash.seq,
+		atomic_load_explicit(&av->hash.seq, memory_order_relaxed) + 1,
+		memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+#endif
+}
+
+static void util_av_write_end(struct util_av *av)
+{
+#ifdef HAVE_ATOMICS
+	atomic_store_explicit(&av->hash.seq,
+		atomic_load_explicit(&av->hash.seq, memory_order_relaxed) + 1,
+		memory_order_release);
+#endif
+}
+
 /*
  * Must hold AV lock
  */
-static int util_av_hash_insert(struct util_av_hash *hash, int slot, int index)
+static int util_av_hash_grow(struct util_av_hash *hash)
 {
-	int entry, i;
+	struct util_av_hash_table *old = hash->table, *table;
+	size_t i;
 
-	if (slot < 0 || slot >= hash->slots)
-		return -FI_EINVAL;
+	table = util_av_hash_alloc((old->size_mask + 1) * 2);
+	if (!table)
+		return -FI_ENOMEM;
 
-	if (hash->table[slot].index == UTIL_NO_ENTRY) {
-		hash->table[slot].index = index;
-		return 0;
+	for (i = 0; i <= old->size_mask; i++) {
+		if (old->entry[i].index != UTIL_NO_ENTRY)
+			util_av_hash_place(table, old->entry[i].hash,
+					   old->entry[i].index);
 	}
 
-	if (hash->free_list == UTIL_NO_ENTRY)
-		return -FI_ENOSPC;
+	table->retired = old;
+	hash->table = table;
+	return 0;
+}
 
-	entry = hash->free_list;
-	hash->free_list = hash->table[hash->free_list].next;
+/*
+ * Must hold AV lock.  The table is kept at most half full.
+ */
+static int util_av_hash_insert(struct util_av_hash *hash, uint32_t key,
+			       int index)
+{
+	int ret;
 
-	for (i = slot; hash->table[i].next != UTIL_NO_ENTRY; )
-		i = hash->table[i].next;
+	if ((hash->used + 1) * 2 > hash->table->size_mask + 1) {
+		ret = util_av_hash_grow(hash);
+		if (ret)
+			return ret;
+	}
 
-	hash->table[i].next = entry;
-	hash->table[entry].index = index;
-	hash->table[entry].next = UTIL_NO_ENTRY;
+	util_av_hash_place(hash->table, key, index);
+	hash->used++;
 	return 0;
 }
 
-int ofi_av_insert_addr(struct util_av *av, const void *addr, int slot, int *index)
+int ofi_av_insert_addr(struct util_av *av, const void *addr, uint32_t hash,
+		       int *index)
 {
 	int ret = 0;
 
@@ -230,52 +299,58 @@ int ofi_av_insert_addr(struct util_av *av, const void *addr, int slot, int *inde
 		goto out;
 	}
 
+	util_av_write_begin(av);
 	if (av->flags & FI_SOURCE) {
-		ret = util_av_hash_insert(&av->hash, slot, av->free_list);
+		ret = util_av_hash_insert(&av->hash, hash, av->free_list);
 		if (ret) {
 			FI_WARN(av->prov, FI_LOG_AV,
 				"failed to insert addr into hash table\n");
-			goto out;
+			goto end;
 		}
 	}
 
 	*index = av->free_list;
 	av->free_list = *(int *) util_av_get_data(av, av->free_list);
 	util_av_set_data(av, *index, addr, av->addrlen);
+end:
+	util_av_write_end(av);
 out:
 	fastlock_release(&av->lock);
 	return ret;
 }
 
 /*
- * Must hold AV lock
+ * Must hold AV lock.  Entries following the removed one in its probe
+ * sequence are shifted back, so no tombstones are left behind.
  */
-static void util_av_hash_remove(struct util_av_hash *hash, int slot, int index)
+static void util_av_hash_remove(struct util_av_hash *hash, uint32_t key,
+				int index)
 {
-	int i;
-
-	if (slot < 0 || slot >= hash->slots)
-		return;
+	struct util_av_hash_table *table = hash->table;
+	size_t i, j, home;
 
-	if (slot == index) {
-		if (hash->table[slot].next == UTIL_NO_ENTRY) {
-			hash->table[slot].index = UTIL_NO_ENTRY;
+	for (i = key & table->size_mask; table->entry[i].index != index;
+	     i = (i + 1) & table->size_mask) {
+		if (table->entry[i].index == UTIL_NO_ENTRY)
 			return;
-		} else {
-			index = hash->table[slot].next;
-			hash->table[slot] = hash->table[index];
-		}
-	} else {
-		for (i = slot; hash->table[i].next != index; )
-			i = hash->table[i].next;
+	}
 
-		hash->table[i].next = hash->table[index].next;
+	for (j = (i + 1) & table->size_mask;
+	     table->entry[j].index != UTIL_NO_ENTRY;
+	     j = (j + 1) & table->size_mask) {
+		home = table->entry[j].hash & table->size_mask;
+		if (((j - home) & table->size_mask) >=
+		    ((j - i) & table->size_mask)) {
+			table->entry[i] = table->entry[j];
+			i = j;
+		}
 	}
-	hash->table[index].next = hash->free_list;
-	hash->free_list = index;
+
+	table->entry[i].index = UTIL_NO_ENTRY;
+	hash->used--;
 }
 
-static int fi_av_remove_addr(struct util_av *av, int slot, int index)
+static int fi_av_remove_addr(struct util_av *av, uint32_t hash, int index)
 {
 	int *entry, *next, i;
 
@@ -285,8 +360,9 @@ static int fi_av_remove_addr(struct util_av *av, int slot, int index)
 	}
 
 	fastlock_acquire(&av->lock);
+	util_av_write_begin(av);
 	if (av->flags & FI_SOURCE)
-		util_av_hash_remove(&av->hash, slot, index);
+		util_av_hash_remove(&av->hash, hash, index);
 
 	entry = util_av_get_data(av, index);
 	if (av->free_list == UTIL_NO_ENTRY || index < av->free_list) {
@@ -302,36 +378,61 @@ static int fi_av_remove_addr(struct util_av *av, int slot, int index)
 		*next = index;
 	}
 
+	util_av_write_end(av);
 	fastlock_release(&av->lock);
 	return 0;
 }
 
-int ofi_av_lookup_index(struct util_av *av, const void *addr, int slot)
+static int util_av_hash_lookup(struct util_av *av, const void *addr,
+			       uint32_t hash)
 {
-	int i, ret = -FI_ENODATA;
+	struct util_av_hash_table *table = av->hash.table;
+	size_t i;
+
+	for (i = hash & table->size_mask;
+	     table->entry[i].index != UTIL_NO_ENTRY;
+	     i = (i + 1) & table->size_mask) {
+		if (table->entry[i].hash == hash &&
+		    !memcmp(ofi_av_get_addr(av, table->entry[i].index), addr,
+			    av->addrlen))
+			return table->entry[i].index;
+	}
+	return -FI_ENODATA;
+}
+
+/*
+ * Lookups run without the AV lock when atomics are available.  A lookup
+ * that overlaps an update sees the sequence count change and retries.
+ */
+int ofi_av_lookup_index(struct util_av *av, const void *addr, uint32_t hash)
+{
+	int ret;
+#ifdef HAVE_ATOMICS
+	unsigned seq;
+#endif
 
-	if (slot < 0 || slot >= av->hash.slots) {
-		FI_WARN(av->prov, FI_LOG_AV, "invalid slot (%d)\n", slot);
+	if (!av->hash.table) {
+		FI_WARN(av->prov, FI_LOG_AV, "FI_SOURCE not enabled\n");
 		return -FI_EINVAL;
 	}
 
+#ifdef HAVE_ATOMICS
+
+	do {
+		seq = atomic_load_explicit(&av->hash.seq, memory_order_acquire);
+		if (seq & 1)
+			continue;
+		ret = util_av_hash_lookup(av, addr, hash);
+		atomic_thread_fence(memory_order_acquire);
+	} while (seq & 1 ||
+		 seq != atomic_load_explicit(&av->hash.seq,
+					     memory_order_relaxed));
+#else
 	fastlock_acquire(&av->lock);
-	if (av->hash.table[slot].index == UTIL_NO_ENTRY) {
-		FI_DBG(av->prov, FI_LOG_AV, "no entry at slot (%d)\n", slot);
-		goto out;
-	}
-
-	for (i = slot; i != UTIL_NO_ENTRY; i = av->hash.table[i].next) {
-		if (!memcmp(ofi_av_get_addr(av, av->hash.table[i].index), addr,
-			    av->addrlen)) {
-			ret = av->hash.table[i].index;
-			FI_DBG(av->prov, FI_LOG_AV, "entry at index (%d)\n", ret);
-			break;
-		}
-	}
-out:
-	FI_DBG(av->prov, FI_LOG_AV, "%d\n", ret);
+	ret = util_av_hash_lookup(av, addr, hash);
 	fastlock_release(&av->lock);
+#endif
+	FI_DBG(av->prov, FI_LOG_AV, "%d\n", ret);
 	return ret;
 }
 
@@ -357,6 +458,17 @@ int ofi_av_bind(struct fid *av_fid, struct fid *eq_fid, uint64_t flags)
 	return 0;
 }
 
+static void util_av_hash_free(struct util_av_hash *hash)
+{
+	struct util_av_hash_table *table;
+
+	while (hash->table) {
+		table = hash->table;
+		hash->table = table->retired;
+		free(table);
+	}
+}
+
 int ofi_av_close(struct util_av *av)
 {
 	if (atomic_get(&av->ref)) {
@@ -369,28 +481,12 @@ int ofi_av_close(struct util_av *av)
 
 	atomic_dec(&av->domain->ref);
 	fastlock_destroy(&av->lock);
+	util_av_hash_free(&av->hash);
 	/* TODO: unmap data? */
 	free(av->data);
 	return 0;
 }
 
-static void util_av_hash_init(struct util_av_hash *hash)
-{
-	int i;
-
-	for (i = 0; i < hash->slots; i++) {
-		hash->table[i].index = UTIL_NO_ENTRY;
-		hash->table[i].next = UTIL_NO_ENTRY;
-	}
-
-	hash->free_list = hash->slots;
-	for (i = hash->slots; i < hash->total_count; i++) {
-		hash->table[i].index = UTIL_NO_ENTRY;
-		hash->table[i].next = i + 1;
-	}
-	hash->table[hash->total_count - 1].next = UTIL_NO_ENTRY;
-}
-
 static int util_av_init(struct util_av *av, const struct fi_av_attr *attr,
 			const struct util_av_attr *util_attr)
 {
@@ -408,17 +504,23 @@ static int util_av_init(struct util_av *av, const struct fi_av_attr *attr,
 	/* TODO: Handle FI_READ */
 	/* TODO: Handle mmap - shared AV */
 
-	if (util_attr->flags & FI_SOURCE) {
-		av->hash.slots = av->count;
-		av->hash.total_count = av->count + util_attr->overhead;
-		FI_INFO(av->prov, FI_LOG_AV,
-		       "FI_SOURCE requested, hash size %zu\n", av->hash.total_count);
+	av->hash.table = NULL;
+	av->hash.used = 0;
+#ifdef HAVE_ATOMICS
+	atomic_init(&av->hash.seq, 0);
+#endif
+	if (av->flags & FI_SOURCE) {
+		av->hash.table = util_av_hash_alloc(UTIL_AV_HASH_MIN_SIZE);
+		if (!av->hash.table)
+			return -FI_ENOMEM;
+		FI_INFO(av->prov, FI_LOG_AV, "FI_SOURCE requested\n");
 	}
 
-	av->data = malloc((av->count * util_attr->addrlen) +
-			  (av->hash.total_count * sizeof(*av->hash.table)));
-	if (!av->data)
+	av->data = malloc(av->count * util_attr->addrlen);
+	if (!av->data) {
+		util_av_hash_free(&av->hash);
 		return -FI_ENOMEM;
+	}
 
 	for (i = 0; i < av->count - 1; i++) {
 		entry = util_av_get_data(av, i);
@@ -427,11 +529,6 @@ static int util_av_init(struct util_av *av, const struct fi_av_attr *attr,
 	entry = util_av_get_data(av, av->count - 1);
 	*entry = UTIL_NO_ENTRY;
 
-	if (util_attr->flags & FI_SOURCE) {
-		av->hash.table = util_av_get_data(av, av->count);
-		util_av_hash_init(&av->hash);
-	}
-
 	return ret;
 }
 
@@ -505,39 +602,32 @@ int ofi_av_init(struct util_domain *domain, const struct fi_av_attr *attr,
  *
  *************************************************************************/
 
-static int ip_av_slot(struct util_av *av, const struct sockaddr *sa)
+/*
+ * Hash the family, port, and full address.  The sockaddr is not hashed
+ * as a whole, since padding and IPv6 flow info are not part of the
+ * address identity.
+ */
+static uint32_t ip_av_hash(const struct sockaddr *sa)
 {
-	uint16_t host;
-	uint16_t port;
-
-	if (!sa)
-		return UTIL_NO_ENTRY;
+	const struct sockaddr_in *sin = (const struct sockaddr_in *) sa;
+	const struct sockaddr_in6 *sin6 = (const struct sockaddr_in6 *) sa;
 
-	switch (((struct sockaddr *) sa)->sa_family) {
+	switch (sa->sa_family) {
 	case AF_INET:
-		host = (uint16_t) ntohl(((struct sockaddr_in *) sa)->
-					sin_addr.s_addr);
-		port = ntohs(((struct sockaddr_in *) sa)->sin_port);
-		break;
+		return fasthash32(&sin->sin_addr, sizeof(sin->sin_addr),
+				  ((uint32_t) AF_INET << 16) | sin->sin_port);
 	case AF_INET6:
-		host = (uint16_t) ((struct sockaddr_in6 *) sa)->
-					sin6_addr.s6_addr[15];
-		port = ntohs(((struct sockaddr_in6 *) sa)->sin6_port);
-		break;
+		return fasthash32(&sin6->sin6_addr, sizeof(sin6->sin6_addr),
+				  ((uint32_t) AF_INET6 << 16) | sin6->sin6_port);
 	default:
 		assert(0);
-		return UTIL_NO_ENTRY;
+		return 0;
 	}
-
-	/* TODO: Find a good hash function */
-	FI_DBG(av->prov, FI_LOG_AV, "slot %d\n",
-		((host << 16) | port) % av->hash.slots);
-	return ((host << 16) | port) % av->hash.slots;
 }
 
 int ip_av_get_index(struct util_av *av, const void *addr)
 {
-	return ofi_av_lookup_index(av, addr, ip_av_slot(av, addr));
+	return ofi_av_lookup_index(av, addr, ip_av_hash(addr));
 }
 
 static void ip_av_write_event(struct util_av *av, uint64_t data,
@@ -591,7 +681,7 @@ static int ip_av_insert_addr(struct util_av *av, const void *addr,
 	int ret, index = -1;
 
 	if (ip_av_valid_addr(av, addr)) {
-		ret = ofi_av_insert_addr(av, addr, ip_av_slot(av, addr), &index);
+		ret = ofi_av_insert_addr(av, addr, ip_av_hash(addr), &index);
 	} else {
 		ret = -FI_EADDRNOTAVAIL;
 		FI_WARN(av->prov, FI_LOG_AV, "invalid address\n");
@@ -837,7 +927,8 @@ static int ip_av_remove(struct fid_av *av_fid, fi_addr_t *fi_addr, size_t count,
 			uint64_t flags)
 {
 	struct util_av *av;
-	int i, slot, index, ret;
+	uint32_t hash;
+	int i, index, ret;
 
 	av = container_of(av_fid, struct util_av, av_fid);
 	if (flags) {
@@ -853,8 +944,8 @@ static int ip_av_remove(struct fid_av *av_fid, fi_addr_t *fi_addr, size_t count,
 	 */
 	for (i = count - 1; i >= 0; i--) {
 		index = (int) fi_addr[i];
-		slot = ip_av_slot(av, ip_av_get_addr(av, index));
-		ret = fi_av_remove_addr(av, slot, index);
+		hash = ip_av_hash(ip_av_get_addr(av, index));
+		ret = fi_av_remove_addr(av, hash, index);
 		if (ret) {
 			FI_WARN(av->prov, FI_LOG_AV,
 				"removal of fi_addr %d failed\n", index);
@@ -944,7 +1035,6 @@ int ip_av_create(struct fid_domain *domain_fid, struct fi_av_attr *attr,
 	else
 		util_attr.addrlen = sizeof(struct sockaddr_in6);
 
-	util_attr.overhead = attr->count >> 2;
 	util_attr.flags = domain->caps & FI_SOURCE ? FI_SOURCE : 0;
 
 	if (attr->type == FI_AV_UNSPEC)
@@ -110,92 +110,124 @@ static void util_cq_read_data(void **dst, void *src)
 
 static void util_cq_read_tagged(void **dst, void *src)
 {
-	util_cq_read_data(dst, src);
-	((struct fi_cq_tagged_entry *) *dst)->tag = 0;
+	*(struct fi_cq_tagged_entry *) *dst = *(struct fi_cq_tagged_entry *) src;
 	*(char**)dst += sizeof(struct fi_cq_tagged_entry);
 }
 
-static ssize_t util_cq_read(struct fid_cq *cq_fid, void *buf, size_t count)
+/*
+ * Consumer side of the CQ.  Lock-free CQs read up to the producer's last
+ * published wcnt and advance their own rcnt; locked CQs share the cirque
+ * counters with the producer under cq_lock.
+ */
+static inline void util_cq_consumer_lock(struct util_cq *cq)
+{
+	if (!cq->spsc)
+		fastlock_acquire(&cq->cq_lock);
+}
+
+static inline void util_cq_consumer_unlock(struct util_cq *cq)
+{
+	if (!cq->spsc)
+		fastlock_release(&cq->cq_lock);
+}
+
+static inline size_t util_cq_avail(struct util_cq *cq, size_t *rcnt,
+				   size_t *mask)
+{
+#ifdef HAVE_ATOMICS
+	if (cq->spsc) {
+		*rcnt = atomic_load_explicit(&cq->spsc->rcnt,
+					     memory_order_relaxed);
+		*mask = cq->spsc->size_mask;
+		return atomic_load_explicit(&cq->spsc->wcnt,
+					    memory_order_acquire) - *rcnt;
+	}
+#endif
+	*rcnt = cq->cirq->rcnt;
+	*mask = cq->cirq->size_mask;
+	return cirque_usedcnt(cq->cirq);
+}
+
+static inline void util_cq_consume(struct util_cq *cq, size_t rcnt)
+{
+#ifdef HAVE_ATOMICS
+	if (cq->spsc) {
+		atomic_store_explicit(&cq->spsc->rcnt, rcnt,
+				      memory_order_release);
+		return;
+	}
+#endif
+	cq->cirq->rcnt = rcnt;
+}
+
+static ssize_t util_cq_read_entries(struct util_cq *cq, void *buf,
+				    size_t count, fi_addr_t *src_addr)
 {
-	struct util_cq *cq;
 	struct fi_cq_tagged_entry *entry;
+	size_t avail, rcnt, mask, index;
 	ssize_t i;
 
-	cq = container_of(cq_fid, struct util_cq, cq_fid);
-	fastlock_acquire(&cq->cq_lock);
-	if (cirque_isempty(cq->cirq)) {
-		fastlock_release(&cq->cq_lock);
+	util_cq_consumer_lock(cq);
+	avail = util_cq_avail(cq, &rcnt, &mask);
+	if (!avail) {
+		util_cq_consumer_unlock(cq);
 		cq->progress(cq);
-		fastlock_acquire(&cq->cq_lock);
-		if (cirque_isempty(cq->cirq)) {
+		util_cq_consumer_lock(cq);
+		avail = util_cq_avail(cq, &rcnt, &mask);
+		if (!avail) {
 			i = -FI_EAGAIN;
 			goto out;
 		}
 	}
 
-	if (count > cirque_usedcnt(cq->cirq))
-		count = cirque_usedcnt(cq->cirq);
+	if (count > avail)
+		count = avail;
 
 	for (i = 0; i < count; i++) {
-		entry = cirque_head(cq->cirq);
+		index = (rcnt + i) & mask;
+		entry = &cq->cirq->buf[index];
 		if (entry->flags & UTIL_FLAG_ERROR) {
 			if (!i)
 				i = -FI_EAVAIL;
 			break;
 		}
+		if (src_addr)
+			src_addr[i] = cq->src[index];
 		cq->read_entry(&buf, entry);
-		cirque_discard(cq->cirq);
 	}
+
+	if (i > 0)
+		util_cq_consume(cq, rcnt + i);
 out:
-	fastlock_release(&cq->cq_lock);
+	util_cq_consumer_unlock(cq);
 	return i;
 }
 
+static ssize_t util_cq_read(struct fid_cq *cq_fid, void *buf, size_t count)
+{
+	struct util_cq *cq;
+
+	cq = container_of(cq_fid, struct util_cq, cq_fid);
+	return util_cq_read_entries(cq, buf, count, NULL);
+}
+
 static ssize_t util_cq_readfrom(struct fid_cq *cq_fid, void *buf,
 				size_t count, fi_addr_t *src_addr)
 {
 	struct util_cq *cq;
-	struct fi_cq_tagged_entry *entry;
 	ssize_t i;
 
 	cq = container_of(cq_fid, struct util_cq, cq_fid);
 	if (!cq->src) {
-		i = util_cq_read(cq_fid, buf, count);
+		i = util_cq_read_entries(cq, buf, count, NULL);
 		if (i > 0) {
 			for (count = 0; count < i; count++)
-				src_addr[i] = FI_ADDR_NOTAVAIL;
+				src_addr[count] = FI_ADDR_NOTAVAIL;
 		}
 		return i;
 	}
 
-	fastlock_acquire(&cq->cq_lock);
-	if (cirque_isempty(cq->cirq)) {
-		fastlock_release(&cq->cq_lock);
-		cq->progress(cq);
-		fastlock_acquire(&cq->cq_lock);
-		if (cirque_isempty(cq->cirq)) {
-			i = -FI_EAGAIN;
-			goto out;
-		}
-	}
-
-	if (count > cirque_usedcnt(cq->cirq))
-		count = cirque_usedcnt(cq->cirq);
-
-	for (i = 0; i < count; i++) {
-		entry = cirque_head(cq->cirq);
-		if (entry->flags & UTIL_FLAG_ERROR) {
-			if (!i)
-				i = -FI_EAVAIL;
-			break;
-		}
-		src_addr[i] = cq->src[cirque_rindex(cq->cirq)];
-		cq->read_entry(&buf, entry);
-		cirque_discard(cq->cirq);
-	}
-out:
-	fastlock_release(&cq->cq_lock);
-	return i;
+	return util_cq_read_entries(cq, buf, count, src_addr);
 }
 
 static ssize_t util_cq_readerr(struct fid_cq *cq_fid, struct fi_cq_err_entry *buf,
@@ -204,17 +236,18 @@ static ssize_t util_cq_readerr(struct fid_cq *cq_fid, struct fi_cq_err_entry *bu
 	struct util_cq *cq;
 	struct util_cq_err_entry *err;
 	struct slist_entry *entry;
+	size_t rcnt, mask;
 	ssize_t ret;
 
 	cq = container_of(cq_fid, struct util_cq, cq_fid);
 	fastlock_acquire(&cq->cq_lock);
-	if (!cirque_isempty(cq->cirq) &&
-	    (cirque_head(cq->cirq)->flags & UTIL_FLAG_ERROR)) {
-		cirque_discard(cq->cirq);
+	if (util_cq_avail(cq, &rcnt, &mask) &&
+	    (cq->cirq->buf[rcnt & mask].flags & UTIL_FLAG_ERROR)) {
 		entry = slist_remove_head(&cq->err_list);
 		err = container_of(entry, struct util_cq_err_entry, list_entry);
 		*buf = err->err_entry;
 		free(err);
+		util_cq_consume(cq, rcnt + 1);
 		ret = 0;
 	} else {
 		ret = -FI_EAGAIN;
@@ -223,6 +256,21 @@ static ssize_t util_cq_readerr(struct fid_cq *cq_fid, struct fi_cq_err_entry *bu
 	return ret;
 }
 
+/*
+ * Queue an error entry.  Callers hold the CQ via ofi_cq_lock and then
+ * commit a cirque entry flagged with UTIL_FLAG_ERROR.  The error list is
+ * always protected by cq_lock, which ofi_cq_lock only takes for locked
+ * CQs.
+ */
+void ofi_cq_insert_error(struct util_cq *cq, struct util_cq_err_entry *err)
+{
+	if (cq->spsc)
+		fastlock_acquire(&cq->cq_lock);
+	slist_insert_tail(&err->list_entry, &cq->err_list);
+	if (cq->spsc)
+		fastlock_release(&cq->cq_lock);
+}
+
 static ssize_t util_cq_sread(struct fid_cq *cq_fid, void *buf, size_t count,
 			     const void *cond, int timeout)
 {
@@ -299,6 +347,7 @@ int ofi_cq_cleanup(struct util_cq *cq)
 
 	atomic_dec(&cq->domain->ref);
 	util_comp_cirq_free(cq->cirq);
+	free(cq->spsc);
 	free(cq->src);
 	return 0;
 }
@@ -336,6 +385,7 @@ static int fi_cq_init(struct fid_domain *domain, struct fi_cq_attr *attr,
 	dlist_init(&cq->list);
 	fastlock_init(&cq->list_lock);
 	fastlock_init(&cq->cq_lock);
+	cq->spsc = NULL;
 	slist_init(&cq->err_list);
 	cq->read_entry = read_entry;
 
@@ -372,6 +422,31 @@ static int fi_cq_init(struct fid_domain *domain, struct fi_cq_attr *attr,
 	return 0;
 }
 
+/*
+ * FI_THREAD_DOMAIN serializes all access to the domain's objects, so a
+ * CQ sees at most one producer and one consumer at a time.
+ * FI_THREAD_COMPLETION is not enough: progress driven from another CQ
+ * may write into this one while it is being read.
+ */
+static int util_cq_init_spsc(struct util_cq *cq)
+{
+#ifdef HAVE_ATOMICS
+	struct util_cq_spsc *spsc;
+
+	if (cq->domain->threading != FI_THREAD_DOMAIN)
+		return 0;
+
+	if (posix_memalign((void **) &spsc, UTIL_CACHE_LINE_SIZE, sizeof(*spsc)))
+		return -FI_ENOMEM;
+
+	atomic_init(&spsc->wcnt, 0);
+	atomic_init(&spsc->rcnt, 0);
+	spsc->size_mask = cq->cirq->size_mask;
+	cq->spsc = spsc;
+#endif
+	return 0;
+}
+
 void ofi_cq_progress(struct util_cq *cq)
 {
 	struct util_ep *ep;
@@ -450,10 +525,15 @@ int ofi_cq_init(const struct fi_provider *prov, struct fid_domain *domain,
 			goto err2;
 		}
 	}
+
+	ret = util_cq_init_spsc(cq);
+	if (ret)
+		goto err2;
 	return 0;
 
 err2:
 	util_comp_cirq_free(cq->cirq);
+	cq->cirq = NULL;
 err1:
 	ofi_cq_cleanup(cq);
 	return ret;
@@ -67,6 +67,7 @@ static int util_domain_init(struct util_domain *domain,
 	domain->mode = info->mode;
 	domain->addr_format = info->addr_format;
 	domain->av_type = info->domain_attr->av_type;
+	domain->threading = info->domain_attr->threading;
 	domain->name = strdup(info->domain_attr->name);
 	return domain->name ? 0 : -FI_ENOMEM;
 }
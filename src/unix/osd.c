@@ -139,6 +139,7 @@ int ofi_shm_map(struct util_shm *shm, const char *name, size_t size,
 		goto failed;
 	}
 
+	shm->size = size;
 	*mapped = shm->ptr;
 
 	return ret;
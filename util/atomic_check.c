@@ -0,0 +1,665 @@
+/*
+ * Copyright (c) 2016 Intel Corporation.  All rights reserved.
+ *
+ * This software is available to you under the BSD license below:
+ *
+ *     Redistribution and use in source and binary forms, with or
+ *     without modification, are permitted provided that the following
+ *     conditions are met:
+ *
+ *      - Redistributions of source code must retain the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer.
+ *
+ *      - Redistributions in binary form must reproduce the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer in the documentation and/or other materials
+ *        provided with the distribution.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <complex.h>
+#include <float.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <rdma/fabric.h>
+#include <rdma/fi_atomic.h>
+
+#include "sock.h"
+
+/*
+ * Checks the sockets provider's atomic kernels against the original
+ * per-element implementation, which is kept here as the reference.
+ * Every (op, datatype) pair is run over lengths that leave odd tails
+ * after the vector loop, with inputs that include NaN, signed zeros,
+ * infinities and equal compare operands.  Results must match bitwise,
+ * and the kernel table must have an entry exactly where the reference
+ * supports the op.
+ *
+ * With -b, the checks are skipped and the kernels are timed against the
+ * reference instead, in ns per element over BENCH_CNT elements.
+ */
+
+#define MAX_CNT		257
+#define ROUNDS		8
+#define BENCH_CNT	(64 * 1024)
+#define BENCH_ROUNDS	100
+
+static const size_t cnts[] = {
+	0, 1, 2, 3, 4, 5, 7, 8, 9, 15, 16, 17, 31, 32, 33,
+	63, 64, 65, 127, 128, 129, MAX_CNT
+};
+
+#define REF_ATOMIC_UPDATE_INT(_cmp, _src, _dst, _tmp) do {		\
+	switch (op) {							\
+	case FI_MIN:							\
+		*_cmp = *_dst;						\
+		if (*_src < *_dst)					\
+			*_dst = *_src;					\
+		break;							\
+	case FI_MAX:							\
+		*_cmp = *_dst;						\
+		if (*_src > *_dst)					\
+			*_dst = *_src;					\
+		break;							\
+	case FI_SUM:							\
+		*_cmp = *_dst;						\
+		*_dst = *_dst + *_src;					\
+		break;							\
+	case FI_PROD:							\
+		*_cmp = *_dst;						\
+		*_dst = *_dst * *_src;					\
+		break;							\
+	case FI_LOR:							\
+		*_cmp = *_dst;						\
+		*_dst = *_dst || *_src;					\
+		break;							\
+	case FI_LAND:							\
+		*_cmp = *_dst;						\
+		*_dst = *_dst && *_src;					\
+		break;							\
+	case FI_BOR:							\
+		*_cmp = *_dst;						\
+		*_dst = *_dst | *_src;					\
+		break;							\
+	case FI_BAND:							\
+		*_cmp = *_dst;						\
+		*_dst = *_dst & *_src;					\
+		break;							\
+	case FI_LXOR:							\
+		*_cmp = *_dst;						\
+		*_dst = ((*_dst && !*_src) || (!*_dst && *_src));	\
+		break;							\
+	case FI_BXOR:							\
+		*_cmp = *_dst;						\
+		*_dst = *_dst ^ *_src;					\
+		break;							\
+	case FI_ATOMIC_READ:						\
+		*_cmp = *_dst;						\
+		break;							\
+	case FI_ATOMIC_WRITE:						\
+		*_cmp = *_dst;						\
+		*_dst = *_src;						\
+		break;							\
+	case FI_CSWAP:							\
+		if (*_cmp == *_dst)					\
+			*_dst = *_src;					\
+		else							\
+			*_cmp = *_dst;					\
+		break;							\
+	case FI_CSWAP_NE:						\
+		_tmp = *_dst;						\
+		if (*_cmp != *_dst)					\
+			*_dst = *_src;					\
+		*_cmp = _tmp;						\
+		break;							\
+	case FI_CSWAP_LE:						\
+		_tmp = *_dst;						\
+		if (*_cmp <= *_dst)					\
+			*_dst = *_src;					\
+		*_cmp = _tmp;						\
+		break;							\
+	case FI_CSWAP_LT:						\
+		_tmp = *_dst;						\
+		if (*_cmp < *_dst)					\
+			*_dst = *_src;					\
+		*_cmp = _tmp;						\
+		break;							\
+	case FI_CSWAP_GE:						\
+		_tmp = *_dst;						\
+		if (*_cmp >= *_dst)					\
+			*_dst = *_src;					\
+		*_cmp = _tmp;						\
+		break;							\
+	case FI_CSWAP_GT:						\
+		_tmp = *_dst;						\
+		if (*_cmp > *_dst)					\
+			*_dst = *_src;					\
+		*_cmp = _tmp;						\
+		break;							\
+	case FI_MSWAP:							\
+		_tmp = *_dst;						\
+		*_dst = (*_src & *_cmp) | (*_dst & ~(*_cmp));		\
+		*_cmp = _tmp;						\
+		break;							\
+	default:							\
+		ret = -1;						\
+		break;							\
+	}								\
+} while (0)
+
+#define REF_ATOMIC_UPDATE_FLOAT(_cmp, _src, _dst, _tmp) do {		\
+	switch (op) {							\
+	case FI_MIN:							\
+		*_cmp = *_dst;						\
+		if (*_src < *_dst)					\
+			*_dst = *_src;					\
+		break;							\
+	case FI_MAX:							\
+		*_cmp = *_dst;						\
+		if (*_src > *_dst)					\
+			*_dst = *_src;					\
+		break;							\
+	case FI_SUM:							\
+		*_cmp = *_dst;						\
+		*_dst = *_dst + *_src;					\
+		break;							\
+	case FI_PROD:							\
+		*_cmp = *_dst;						\
+		*_dst = *_dst * *_src;					\
+		break;							\
+	case FI_LOR:							\
+		*_cmp = *_dst;						\
+		*_dst = *_dst || *_src;					\
+		break;							\
+	case FI_LAND:							\
+		*_cmp = *_dst;						\
+		*_dst = *_dst && *_src;					\
+		break;							\
+	case FI_ATOMIC_READ:						\
+		*_cmp = *_dst;						\
+		break;							\
+	case FI_ATOMIC_WRITE:						\
+		*_cmp = *_dst;						\
+		*_dst = *_src;						\
+		break;							\
+	case FI_CSWAP:							\
+		if (*_cmp == *_dst)					\
+			*_dst = *_src;					\
+		else							\
+			*_cmp = *_dst;					\
+		break;							\
+	case FI_CSWAP_NE:						\
+		_tmp = *_dst;						\
+		if (*_cmp != *_dst)					\
+			*_dst = *_src;					\
+		*_cmp = _tmp;						\
+		break;							\
+	case FI_CSWAP_LE:						\
+		_tmp = *_dst;						\
+		if (*_cmp <= *_dst)					\
+			*_dst = *_src;					\
+		*_cmp = _tmp;						\
+		break;							\
+	case FI_CSWAP_LT:						\
+		_tmp = *_dst;						\
+		if (*_cmp < *_dst)					\
+			*_dst = *_src;					\
+		*_cmp = _tmp;						\
+		break;							\
+	case FI_CSWAP_GE:						\
+		_tmp = *_dst;						\
+		if (*_cmp >= *_dst)					\
+			*_dst = *_src;					\
+		*_cmp = _tmp;						\
+		break;							\
+	case FI_CSWAP_GT:						\
+		_tmp = *_dst;						\
+		if (*_cmp > *_dst)					\
+			*_dst = *_src;					\
+		*_cmp = _tmp;						\
+		break;							\
+	default:							\
+		ret = -1;						\
+		break;							\
+	}								\
+} while (0)
+
+#define REF_ATOMIC_UPDATE_COMPLEX(_cmp, _src, _dst, _tmp) do {		\
+	switch (op) {							\
+	case FI_SUM:							\
+		*_cmp = *_dst;						\
+		*_dst = *_dst + *_src;					\
+		break;							\
+	case FI_PROD:							\
+		*_cmp = *_dst;						\
+		*_dst = *_dst * *_src;					\
+		break;							\
+	case FI_LOR:							\
+		*_cmp = *_dst;						\
+		*_dst = *_dst || *_src;					\
+		break;							\
+	case FI_LAND:							\
+		*_cmp = *_dst;						\
+		*_dst = *_dst && *_src;					\
+		break;							\
+	case FI_ATOMIC_READ:						\
+		*_cmp = *_dst;						\
+		break;							\
+	case FI_ATOMIC_WRITE:						\
+		*_cmp = *_dst;						\
+		*_dst = *_src;						\
+		break;							\
+	case FI_CSWAP:							\
+		if (*_cmp == *_dst)					\
+			*_dst = *_src;					\
+		else							\
+			*_cmp = *_dst;					\
+		break;							\
+	case FI_CSWAP_NE:						\
+		_tmp = *_dst;						\
+		if (*_cmp != *_dst)					\
+			*_dst = *_src;					\
+		*_cmp = _tmp;						\
+		break;							\
+	default:							\
+		ret = -1;						\
+		break;							\
+	}								\
+} while (0)
+
+#define REF_ATOMIC_CASE(_dt, _type, _kind)				\
+	case _dt:							\
+	{								\
+		_type *_cmp = cmp, *_dst = dst, *_src = src, _tmp;	\
+		for (i = 0; i < cnt && !ret; i++, _cmp++, _dst++, _src++) \
+			REF_ATOMIC_UPDATE_##_kind(_cmp, _src, _dst, _tmp); \
+		break;							\
+	}
+
+/* One element at a time, as the target side did before the kernels */
+static int ref_update(void *cmp, void *dst, void *src, size_t cnt,
+		      enum fi_datatype datatype, enum fi_op op)
+{
+	size_t i;
+	int ret = 0;
+
+	switch (datatype) {
+	REF_ATOMIC_CASE(FI_INT8, int8_t, INT)
+	REF_ATOMIC_CASE(FI_UINT8, uint8_t, INT)
+	REF_ATOMIC_CASE(FI_INT16, int16_t, INT)
+	REF_ATOMIC_CASE(FI_UINT16, uint16_t, INT)
+	REF_ATOMIC_CASE(FI_INT32, int32_t, INT)
+	REF_ATOMIC_CASE(FI_UINT32, uint32_t, INT)
+	REF_ATOMIC_CASE(FI_INT64, int64_t, INT)
+	REF_ATOMIC_CASE(FI_UINT64, uint64_t, INT)
+	REF_ATOMIC_CASE(FI_FLOAT, float, FLOAT)
+	REF_ATOMIC_CASE(FI_DOUBLE, double, FLOAT)
+	REF_ATOMIC_CASE(FI_LONG_DOUBLE, long double, FLOAT)
+	REF_ATOMIC_CASE(FI_FLOAT_COMPLEX, float complex, COMPLEX)
+	REF_ATOMIC_CASE(FI_DOUBLE_COMPLEX, double complex, COMPLEX)
+	REF_ATOMIC_CASE(FI_LONG_DOUBLE_COMPLEX, long double complex, COMPLEX)
+	default:
+		ret = -1;
+		break;
+	}
+	return ret;
+}
+
+static uint64_t rng_state = 0x9e3779b97f4a7c15ULL;
+
+static uint64_t rng(void)
+{
+	rng_state ^= rng_state << 13;
+	rng_state ^= rng_state >> 7;
+	rng_state ^= rng_state << 17;
+	return rng_state;
+}
+
+/* Mostly awkward values, so that every comparison path is taken */
+static double rand_real(void)
+{
+	static const double special[] = {
+		0.0, -0.0, 1.0, -1.0, 0.5, -2.5, 3.0, 1e30, -1e30,
+		1e-30, DBL_MIN / 4, INFINITY, -INFINITY, NAN, -NAN
+	};
+	uint64_t r = rng();
+
+	if (r & 1)
+		return special[(r >> 1) % (sizeof(special) / sizeof(*special))];
+	return ((double) (int64_t) (r >> 8) / (1ULL << 40)) - 2048.0;
+}
+
+static uint64_t rand_int(void)
+{
+	uint64_t r = rng();
+
+	switch (r & 3) {
+	case 0:
+		return 0;
+	case 1:
+		return (r >> 2) % 5 - 2;
+	default:
+		return rng();
+	}
+}
+
+#define GEN_CASE(_dt, _type, _expr)					\
+	case _dt:							\
+	{								\
+		_type *_buf = buf;					\
+		for (i = 0; i < cnt; i++)				\
+			_buf[i] = (_type) (_expr);			\
+		break;							\
+	}
+
+static void gen(void *buf, size_t cnt, enum fi_datatype datatype)
+{
+	size_t i;
+
+	switch (datatype) {
+	GEN_CASE(FI_INT8, int8_t, rand_int())
+	GEN_CASE(FI_UINT8, uint8_t, rand_int())
+	GEN_CASE(FI_INT16, int16_t, rand_int())
+	GEN_CASE(FI_UINT16, uint16_t, rand_int())
+	GEN_CASE(FI_INT32, int32_t, rand_int())
+	GEN_CASE(FI_UINT32, uint32_t, rand_int())
+	GEN_CASE(FI_INT64, int64_t, rand_int())
+	GEN_CASE(FI_UINT64, uint64_t, rand_int())
+	GEN_CASE(FI_FLOAT, float, rand_real())
+	GEN_CASE(FI_DOUBLE, double, rand_real())
+	GEN_CASE(FI_LONG_DOUBLE, long double, rand_real())
+	GEN_CASE(FI_FLOAT_COMPLEX, float complex,
+		 CMPLXF(rand_real(), rand_real()))
+	GEN_CASE(FI_DOUBLE_COMPLEX, double complex,
+		 CMPLX(rand_real(), rand_real()))
+	GEN_CASE(FI_LONG_DOUBLE_COMPLEX, long double complex,
+		 CMPLXL(rand_real(), rand_real()))
+	default:
+		break;
+	}
+}
+
+static size_t type_size(enum fi_datatype datatype)
+{
+	switch (datatype) {
+	case FI_INT8:
+	case FI_UINT8:
+		return 1;
+	case FI_INT16:
+	case FI_UINT16:
+		return 2;
+	case FI_INT32:
+	case FI_UINT32:
+	case FI_FLOAT:
+		return 4;
+	case FI_INT64:
+	case FI_UINT64:
+	case FI_DOUBLE:
+		return 8;
+	case FI_LONG_DOUBLE:
+		return sizeof(long double);
+	case FI_FLOAT_COMPLEX:
+		return sizeof(float complex);
+	case FI_DOUBLE_COMPLEX:
+		return sizeof(double complex);
+	case FI_LONG_DOUBLE_COMPLEX:
+		return sizeof(long double complex);
+	default:
+		return 0;
+	}
+}
+
+/* Size of one real component of a floating point datatype, else 0 */
+static size_t real_size(enum fi_datatype datatype)
+{
+	switch (datatype) {
+	case FI_FLOAT:
+	case FI_FLOAT_COMPLEX:
+		return sizeof(float);
+	case FI_DOUBLE:
+	case FI_DOUBLE_COMPLEX:
+		return sizeof(double);
+	case FI_LONG_DOUBLE:
+	case FI_LONG_DOUBLE_COMPLEX:
+		return sizeof(long double);
+	default:
+		return 0;
+	}
+}
+
+static int is_nan(const void *val, size_t size)
+{
+	float f;
+	double d;
+	long double ld;
+
+	if (size == sizeof(float)) {
+		memcpy(&f, val, size);
+		return isnan(f);
+	} else if (size == sizeof(double)) {
+		memcpy(&d, val, size);
+		return isnan(d);
+	}
+	memcpy(&ld, val, size);
+	return isnan(ld);
+}
+
+/*
+ * Compare the value bits only: x87 long doubles are stored with padding
+ * whose contents are unspecified.  When both operands of an arithmetic
+ * op are NaN, IEEE 754 does not say which one propagates, and the
+ * reference itself gives a different answer depending on how it is
+ * compiled, so any NaN is accepted for those results.
+ */
+static int same(const void *a, const void *b, size_t cnt,
+		enum fi_datatype datatype, int any_nan)
+{
+	const uint8_t *_a = a, *_b = b;
+	size_t i, size, len;
+
+	size = real_size(datatype);
+	if (!size)
+		return !memcmp(a, b, cnt * type_size(datatype));
+
+	len = (size == sizeof(long double) && LDBL_MANT_DIG == 64) ? 10 : size;
+	cnt *= type_size(datatype) / size;
+	for (i = 0; i < cnt; i++, _a += size, _b += size) {
+		if (!memcmp(_a, _b, len))
+			continue;
+		if (!any_nan || !is_nan(_a, size) || !is_nan(_b, size))
+			return 0;
+	}
+	return 1;
+}
+
+/* fi_tostr() returns a static buffer, so print one name at a time */
+static void report(enum fi_op op, enum fi_datatype datatype, size_t cnt,
+		   const char *msg)
+{
+	printf("%s ", fi_tostr(&op, FI_TYPE_ATOMIC_OP));
+	printf("%s count %zu: %s\n",
+	       fi_tostr(&datatype, FI_TYPE_ATOMIC_TYPE), cnt, msg);
+}
+
+static int check(enum fi_op op, enum fi_datatype datatype, size_t cnt)
+{
+	static long double complex buf[6][MAX_CNT];
+	void *cmp = buf[0], *dst = buf[1], *src = buf[2];
+	void *ref_cmp = buf[3], *ref_dst = buf[4], *ref_src = buf[5];
+	size_t size = type_size(datatype);
+	sock_atomic_kernel_t kernel = sock_atomic_kernels[op][datatype];
+	size_t i;
+	int ret;
+
+	memset(buf, 0, sizeof(buf));
+	gen(dst, cnt, datatype);
+	gen(src, cnt, datatype);
+	gen(cmp, cnt, datatype);
+
+	/* Make the compare operand equal to dst for some elements */
+	for (i = 0; i < cnt; i++) {
+		if (rng() & 1)
+			memcpy((char *) cmp + i * size,
+			       (char *) dst + i * size, size);
+	}
+
+	memcpy(ref_cmp, cmp, cnt * size);
+	memcpy(ref_dst, dst, cnt * size);
+	memcpy(ref_src, src, cnt * size);
+
+	ret = ref_update(ref_cmp, ref_dst, ref_src, cnt, datatype, op);
+	if (!kernel) {
+		if (cnt && !ret) {
+			report(op, datatype, cnt, "supported, but no kernel");
+			return -1;
+		}
+		return 0;
+	}
+
+	kernel(cmp, dst, src, cnt);
+	if (cnt && ret) {
+		report(op, datatype, cnt, "kernel for an unsupported op");
+		return -1;
+	}
+
+	if (!same(dst, ref_dst, cnt, datatype,
+		  op == FI_SUM || op == FI_PROD) ||
+	    !same(cmp, ref_cmp, cnt, datatype, 0) ||
+	    !same(src, ref_src, cnt, datatype, 0)) {
+		report(op, datatype, cnt, "result differs");
+		return -1;
+	}
+	return 0;
+}
+
+static double now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/*
+ * Best of BENCH_ROUNDS, each starting from the same operands, so that
+ * repeated updates do not drift into overflow or denormals.
+ */
+static double bench_one(void *bufs[4], enum fi_op op,
+			enum fi_datatype datatype,
+			sock_atomic_kernel_t kernel)
+{
+	size_t len = BENCH_CNT * type_size(datatype);
+	double start, t, best = 0;
+	int round;
+
+	for (round = 0; round < BENCH_ROUNDS; round++) {
+		memcpy(bufs[1], bufs[3], len);
+		start = now_ns();
+		if (kernel)
+			kernel(bufs[0], bufs[1], bufs[2], BENCH_CNT);
+		else
+			ref_update(bufs[0], bufs[1], bufs[2], BENCH_CNT,
+				   datatype, op);
+		t = now_ns() - start;
+		if (!round || t < best)
+			best = t;
+	}
+	return best / BENCH_CNT;
+}
+
+static int bench(void)
+{
+	static const enum fi_op ops[] = { FI_SUM, FI_MIN, FI_MAX };
+	static const enum fi_datatype types[] = {
+		FI_INT32, FI_INT64, FI_FLOAT, FI_DOUBLE
+	};
+	sock_atomic_kernel_t kernel;
+	void *bufs[4];
+	double kern_ns, ref_ns;
+	size_t i, j;
+	int ret = 0;
+
+	/* cmp, dst, src, and the saved dst */
+	for (i = 0; i < 4; i++) {
+		bufs[i] = malloc(BENCH_CNT * sizeof(double));
+		if (!bufs[i]) {
+			while (i--)
+				free(bufs[i]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	for (i = 0; i < sizeof(ops) / sizeof(*ops); i++) {
+		for (j = 0; j < sizeof(types) / sizeof(*types); j++) {
+			kernel = sock_atomic_kernels[ops[i]][types[j]];
+			if (!kernel) {
+				report(ops[i], types[j], BENCH_CNT, "no kernel");
+				ret = EXIT_FAILURE;
+				continue;
+			}
+
+			gen(bufs[2], BENCH_CNT, types[j]);
+			gen(bufs[3], BENCH_CNT, types[j]);
+
+			kern_ns = bench_one(bufs, ops[i], types[j], kernel);
+			ref_ns = bench_one(bufs, ops[i], types[j], NULL);
+			printf("%s ", fi_tostr(&ops[i], FI_TYPE_ATOMIC_OP));
+			printf("%s: kernel %.3f ns, reference %.3f ns "
+			       "per element, %.1fx\n",
+			       fi_tostr(&types[j], FI_TYPE_ATOMIC_TYPE),
+			       kern_ns, ref_ns, ref_ns / kern_ns);
+		}
+	}
+
+	for (i = 0; i < 4; i++)
+		free(bufs[i]);
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+	enum fi_datatype datatype;
+	enum fi_op op;
+	size_t i;
+	int round, failed = 0, run = 0;
+
+	if (argc > 1) {
+		if (strcmp(argv[1], "-b")) {
+			fprintf(stderr, "usage: %s [-b]\n", argv[0]);
+			return EXIT_FAILURE;
+		}
+		return bench();
+	}
+
+	for (round = 0; round < ROUNDS; round++) {
+		for (op = 0; op < FI_ATOMIC_OP_LAST; op++) {
+			for (datatype = 0; datatype < FI_DATATYPE_LAST;
+			     datatype++) {
+				for (i = 0; i < sizeof(cnts) / sizeof(*cnts);
+				     i++) {
+					failed += !!check(op, datatype, cnts[i]);
+					run++;
+				}
+			}
+		}
+	}
+
+	printf("%d of %d atomic kernel checks failed\n", failed, run);
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,880 @@
+/*
+ * Copyright (c) 2016 Intel Corporation.  All rights reserved.
+ *
+ * This software is available to you under the BSD license below:
+ *
+ *     Redistribution and use in source and binary forms, with or
+ *     without modification, are permitted provided that the following
+ *     conditions are met:
+ *
+ *      - Redistributions of source code must retain the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer.
+ *
+ *      - Redistributions in binary form must reproduce the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer in the documentation and/or other materials
+ *        provided with the distribution.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/resource.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include <rdma/fabric.h>
+#include <rdma/fi_cm.h>
+#include <rdma/fi_domain.h>
+#include <rdma/fi_endpoint.h>
+#include <rdma/fi_errno.h>
+#include <rdma/fi_rma.h>
+#include <rdma/fi_tagged.h>
+
+/*
+ * Message rate between two RDM endpoints on the loopback interface.  The
+ * process forks: the child streams messages and the parent receives
+ * them through a window of pre-posted receives.  Endpoint names and the
+ * start and stop signals go over pipes, and the rate is measured on the
+ * receive side, along with the CPU time the receiving process spent per
+ * message, progress threads included.  Provider parameters, such as
+ * FI_SOCKETS_IO_URING, are taken from the environment as usual.
+ *
+ * With --end, the run is repeated for every power of two from --size up
+ * to that size, each sending at most SWEEP_BYTES.
+ *
+ * With --rma, the sender writes into a buffer the receiver registered,
+ * from --threads threads with an endpoint each, and the rate is measured
+ * on the send side.  The receiver only drives progress.
+ *
+ * With --depth, the receiver first posts tagged receives from the sender
+ * that never match, so every arriving message is matched against a
+ * queue that deep.
+ */
+
+#define IDLE_TIMEOUT	5	/* seconds without a completion */
+#define NAME_MAX_LEN	128
+#define SWEEP_BYTES	(1ULL << 30)
+
+static struct fi_info *hints, *info;
+static struct fid_fabric *fabric;
+static struct fid_domain *domain;
+static struct fid_av *av;
+static struct fid_cq *cq;
+static struct fid_ep *ep;
+static struct fid_mr *mr;
+static fi_addr_t peer;
+static uint64_t rma_addr, rma_key;
+
+static size_t size = 16, end_size;
+static uint64_t count = 200000;
+static size_t window = 256;
+static size_t av_pad;
+static size_t depth;
+static int tagged, inject, source, rma;
+static int threads = 1;
+static char *buf;
+
+static const struct option longopts[] = {
+	{"provider", required_argument, NULL, 'f'},
+	{"size", required_argument, NULL, 's'},
+	{"end", required_argument, NULL, 'e'},
+	{"count", required_argument, NULL, 'n'},
+	{"window", required_argument, NULL, 'w'},
+	{"av_size", required_argument, NULL, 'a'},
+	{"depth", required_argument, NULL, 'D'},
+	{"threads", required_argument, NULL, 't'},
+	{"tagged", no_argument, NULL, 'T'},
+	{"rma", no_argument, NULL, 'R'},
+	{"inject", no_argument, NULL, 'i'},
+	{"source", no_argument, NULL, 'S'},
+	{"manual", no_argument, NULL, 'm'},
+	{"thread_domain", no_argument, NULL, 'd'},
+	{"help", no_argument, NULL, 'h'},
+	{0,0,0,0}
+};
+
+static const char *help_strings[][2] = {
+	{"PROV", "\t\tprovider, default sockets"},
+	{"BYTES", "\t\tmessage size, default 16"},
+	{"BYTES", "\t\tsweep sizes from -s up to BYTES"},
+	{"N", "\t\tmessages to send, default 200000"},
+	{"N", "\t\tposted receives and outstanding sends, default 256"},
+	{"N", "\t\tinsert N other addresses into the receiver's AV first"},
+	{"N", "\t\tpost N unmatched tagged receives first, implies -T"},
+	{"N", "\t\tsender threads with -R, each with its own endpoint"},
+	{"", "\t\tuse tagged messages"},
+	{"", "\t\tuse RMA writes instead of messages"},
+	{"", "\t\tsend with fi_inject, without send completions"},
+	{"", "\t\trequest FI_SOURCE and read completions with fi_cq_readfrom"},
+	{"", "\t\tuse FI_PROGRESS_MANUAL"},
+	{"", "\tuse FI_THREAD_DOMAIN"},
+	{"", "\t\tprint this help"},
+	{"", ""}
+};
+
+static void usage(void)
+{
+	int i = 0;
+	const struct option *ptr = longopts;
+
+	for (; ptr->name != NULL; ++i, ptr = &longopts[i])
+		if (ptr->has_arg == required_argument)
+			printf("  -%c, --%s=%s%s\n", ptr->val, ptr->name,
+				help_strings[i][0], help_strings[i][1]);
+		else
+			printf("  -%c, --%s\t%s\n", ptr->val, ptr->name,
+				help_strings[i][1]);
+}
+
+static void print_err(const char *call, ssize_t ret)
+{
+	fprintf(stderr, "%s: %zd (%s)\n", call, ret, fi_strerror((int) -ret));
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* User and system time of the whole process, in seconds */
+static double cpu_time(void)
+{
+	struct rusage ru;
+
+	getrusage(RUSAGE_SELF, &ru);
+	return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 +
+	       ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+}
+
+static int open_ep(struct fid_ep **ep_out, struct fid_cq **cq_out)
+{
+	struct fi_cq_attr cq_attr;
+	int ret;
+
+	memset(&cq_attr, 0, sizeof cq_attr);
+	cq_attr.format = FI_CQ_FORMAT_CONTEXT;
+	cq_attr.size = window * 2;
+	ret = fi_cq_open(domain, &cq_attr, cq_out, NULL);
+	if (ret) {
+		print_err("fi_cq_open", ret);
+		return ret;
+	}
+
+	ret = fi_endpoint(domain, info, ep_out, NULL);
+	if (ret) {
+		print_err("fi_endpoint", ret);
+		return ret;
+	}
+
+	ret = fi_ep_bind(*ep_out, &av->fid, 0);
+	if (ret) {
+		print_err("fi_ep_bind", ret);
+		return ret;
+	}
+
+	ret = fi_ep_bind(*ep_out, &(*cq_out)->fid, FI_TRANSMIT | FI_RECV);
+	if (ret) {
+		print_err("fi_ep_bind", ret);
+		return ret;
+	}
+
+	ret = fi_enable(*ep_out);
+	if (ret)
+		print_err("fi_enable", ret);
+	return ret;
+}
+
+static int init(void)
+{
+	struct fi_av_attr av_attr;
+	int ret;
+
+	ret = fi_getinfo(FI_VERSION(FI_MAJOR_VERSION, FI_MINOR_VERSION),
+			 "127.0.0.1", NULL, 0, hints, &info);
+	if (ret) {
+		print_err("fi_getinfo", ret);
+		return ret;
+	}
+
+	if (window > info->rx_attr->size || window > info->tx_attr->size) {
+		fprintf(stderr, "window exceeds the queue sizes (%zu, %zu)\n",
+			info->tx_attr->size, info->rx_attr->size);
+		return -FI_EINVAL;
+	}
+
+	if (threads > 1 && info->domain_attr->threading != FI_THREAD_SAFE) {
+		fprintf(stderr, "--threads needs FI_THREAD_SAFE\n");
+		return -FI_EINVAL;
+	}
+
+	if (inject && size > info->tx_attr->inject_size) {
+		fprintf(stderr, "size exceeds the inject size (%zu)\n",
+			info->tx_attr->inject_size);
+		return -FI_EINVAL;
+	}
+
+	ret = fi_fabric(info->fabric_attr, &fabric, NULL);
+	if (ret) {
+		print_err("fi_fabric", ret);
+		return ret;
+	}
+
+	ret = fi_domain(fabric, info, &domain, NULL);
+	if (ret) {
+		print_err("fi_domain", ret);
+		return ret;
+	}
+
+	memset(&av_attr, 0, sizeof av_attr);
+	av_attr.type = FI_AV_MAP;
+	av_attr.count = av_pad + 1;
+	ret = fi_av_open(domain, &av_attr, &av, NULL);
+	if (ret) {
+		print_err("fi_av_open", ret);
+		return ret;
+	}
+
+	ret = open_ep(&ep, &cq);
+	if (ret)
+		return ret;
+
+	buf = calloc(window, size ? size : 1);
+	if (!buf)
+		return -FI_ENOMEM;
+
+	if (rma) {
+		ret = fi_mr_reg(domain, buf, window * size, FI_REMOTE_WRITE,
+				0, 0, 0, &mr, NULL);
+		if (ret) {
+			print_err("fi_mr_reg", ret);
+			return ret;
+		}
+		rma_key = fi_mr_key(mr);
+		rma_addr = info->domain_attr->mr_mode == FI_MR_SCALABLE ?
+			   0 : (uintptr_t) buf;
+	}
+	return 0;
+}
+
+static void fini(void)
+{
+	if (mr)
+		fi_close(&mr->fid);
+	if (ep)
+		fi_close(&ep->fid);
+	if (cq)
+		fi_close(&cq->fid);
+	if (av)
+		fi_close(&av->fid);
+	if (domain)
+		fi_close(&domain->fid);
+	if (fabric)
+		fi_close(&fabric->fid);
+	if (info)
+		fi_freeinfo(info);
+	free(buf);
+
+	mr = NULL;
+	ep = NULL;
+	cq = NULL;
+	av = NULL;
+	domain = NULL;
+	fabric = NULL;
+	info = NULL;
+	buf = NULL;
+}
+
+/* Fill the AV with addresses nobody sends from, so lookups see a full table */
+static int pad_av(void)
+{
+	struct sockaddr_in sin;
+	fi_addr_t addr;
+	size_t i;
+	int ret;
+
+	if (info->addr_format != FI_SOCKADDR_IN) {
+		fprintf(stderr, "--av_size needs FI_SOCKADDR_IN addresses\n");
+		return -FI_EINVAL;
+	}
+
+	memset(&sin, 0, sizeof sin);
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(9);
+	for (i = 0; i < av_pad; i++) {
+		sin.sin_addr.s_addr = htonl(0x0a000001 + i);
+		ret = fi_av_insert(av, &sin, 1, &addr, 0, NULL);
+		if (ret != 1) {
+			print_err("fi_av_insert", ret);
+			return ret ? ret : -FI_EINVAL;
+		}
+	}
+	return 0;
+}
+
+static int exchange_names(int wfd, int rfd)
+{
+	char name[NAME_MAX_LEN], peer_name[NAME_MAX_LEN];
+	size_t len = sizeof name;
+	int ret;
+
+	ret = fi_getname(&ep->fid, name, &len);
+	if (ret) {
+		print_err("fi_getname", ret);
+		return ret;
+	}
+
+	if (write(wfd, name, sizeof name) != sizeof name ||
+	    read(rfd, peer_name, sizeof peer_name) != sizeof peer_name) {
+		fprintf(stderr, "address exchange failed\n");
+		return -FI_EIO;
+	}
+
+	ret = fi_av_insert(av, peer_name, 1, &peer, 0, NULL);
+	if (ret != 1) {
+		print_err("fi_av_insert", ret);
+		return ret ? ret : -FI_EINVAL;
+	}
+	return 0;
+}
+
+/*
+ * Returns the number of completions read, or a negative error.  Receive
+ * completions are checked against the sender's address with --source.
+ */
+static ssize_t read_cq(struct fid_cq *rcq, int recv)
+{
+	struct fi_cq_entry comp[64];
+	struct fi_cq_err_entry err_entry;
+	fi_addr_t src[64];
+	ssize_t i, ret;
+
+	if (source && recv) {
+		ret = fi_cq_readfrom(rcq, comp, 64, src);
+		for (i = 0; i < ret; i++) {
+			if (src[i] != peer) {
+				fprintf(stderr, "source address %#llx, "
+					"expected %#llx\n",
+					(unsigned long long) src[i],
+					(unsigned long long) peer);
+				return -FI_EOTHER;
+			}
+		}
+	} else {
+		ret = fi_cq_read(rcq, comp, 64);
+	}
+
+	if (ret == -FI_EAGAIN)
+		return 0;
+
+	if (ret == -FI_EAVAIL) {
+		memset(&err_entry, 0, sizeof err_entry);
+		fi_cq_readerr(rcq, &err_entry, 0);
+		print_err("completion", -err_entry.err);
+		return -err_entry.err;
+	}
+
+	if (ret < 0)
+		print_err("fi_cq_read", ret);
+	return ret;
+}
+
+static ssize_t post_recv(uint64_t i)
+{
+	char *rbuf = buf + (i % window) * size;
+
+	if (tagged)
+		return fi_trecv(ep, rbuf, size, NULL, FI_ADDR_UNSPEC,
+				i % window, 0, NULL);
+	return fi_recv(ep, rbuf, size, NULL, FI_ADDR_UNSPEC, NULL);
+}
+
+/* Tags at or above the window are never sent */
+static int post_depth(void)
+{
+	size_t i;
+	ssize_t ret;
+
+	for (i = 0; i < depth; i++) {
+		ret = fi_trecv(ep, buf, size, NULL, peer, window + i, 0, NULL);
+		if (ret) {
+			print_err("fi_trecv", ret);
+			return (int) ret;
+		}
+	}
+	return 0;
+}
+
+static ssize_t post_send(uint64_t i)
+{
+	if (inject) {
+		if (tagged)
+			return fi_tinject(ep, buf, size, peer, i % window);
+		return fi_inject(ep, buf, size, peer);
+	}
+
+	if (tagged)
+		return fi_tsend(ep, buf, size, NULL, peer, i % window, NULL);
+	return fi_send(ep, buf, size, NULL, peer, NULL);
+}
+
+static int receiver(int wfd)
+{
+	uint64_t posted, completed = 0;
+	double start, end, last, cpu;
+	ssize_t ret;
+
+	ret = post_depth();
+	if (ret)
+		return (int) ret;
+
+	for (posted = 0; posted < window && posted < count; posted++) {
+		ret = post_recv(posted);
+		if (ret) {
+			print_err("fi_recv", ret);
+			return (int) ret;
+		}
+	}
+
+	if (write(wfd, "s", 1) != 1)
+		return -FI_EIO;
+
+	cpu = cpu_time();
+	start = last = now();
+	while (completed < count) {
+		ret = read_cq(cq, 1);
+		if (ret < 0)
+			return (int) ret;
+
+		if (!ret) {
+			if (now() - last > IDLE_TIMEOUT) {
+				fprintf(stderr, "stalled after %llu of %llu "
+					"messages\n",
+					(unsigned long long) completed,
+					(unsigned long long) count);
+				return -FI_ETIMEDOUT;
+			}
+			continue;
+		}
+
+		completed += ret;
+		last = now();
+		for (; posted < completed + window && posted < count;
+		     posted++) {
+			ret = post_recv(posted);
+			if (ret) {
+				print_err("fi_recv", ret);
+				return (int) ret;
+			}
+		}
+	}
+	end = now();
+	cpu = cpu_time() - cpu;
+
+	if (write(wfd, "d", 1) != 1)
+		return -FI_EIO;
+
+	printf("%s %s%s%s, %zu bytes, depth %zu: %llu msgs in %.3f s, "
+	       "%.3f M msgs/s, %.1f MB/s, %.2f us cpu/msg\n",
+	       info->fabric_attr->prov_name,
+	       fi_tostr(&info->ep_attr->type, FI_TYPE_EP_TYPE),
+	       tagged ? " tagged" : "", inject ? " inject" : "", size, depth,
+	       (unsigned long long) count, end - start,
+	       count / (end - start) / 1e6,
+	       count * size / (end - start) / 1e6, cpu / count * 1e6);
+	return 0;
+}
+
+static int sender(int rfd)
+{
+	uint64_t sent = 0, outstanding = 0;
+	char c;
+	ssize_t ret;
+
+	if (read(rfd, &c, 1) != 1)
+		return -FI_EIO;
+
+	while (sent < count) {
+		if (outstanding < window) {
+			ret = post_send(sent);
+			if (!ret) {
+				sent++;
+				outstanding += !inject;
+				continue;
+			}
+			if (ret != -FI_EAGAIN) {
+				print_err("fi_send", ret);
+				return (int) ret;
+			}
+		}
+
+		ret = read_cq(cq, 0);
+		if (ret < 0)
+			return (int) ret;
+		outstanding -= ret;
+	}
+
+	while (outstanding) {
+		ret = read_cq(cq, 0);
+		if (ret < 0)
+			return (int) ret;
+		outstanding -= ret;
+	}
+
+	/* Keep progressing until the receiver has everything */
+	fcntl(rfd, F_SETFL, O_NONBLOCK);
+	while ((ret = read(rfd, &c, 1)) < 0 && errno == EAGAIN) {
+		ret = read_cq(cq, 0);
+		if (ret < 0)
+			return (int) ret;
+	}
+	return 0;
+}
+
+struct rma_writer {
+	pthread_t thread;
+	struct fid_ep *ep;
+	struct fid_cq *cq;
+	uint64_t count;
+	int ret;
+};
+
+static ssize_t post_write(struct fid_ep *wep, uint64_t i, int comp)
+{
+	uint64_t addr = rma_addr + (i % window) * size;
+
+	if (inject && !comp)
+		return fi_inject_write(wep, buf, size, peer, addr, rma_key);
+	return fi_write(wep, buf, size, NULL, peer, addr, rma_key, NULL);
+}
+
+/*
+ * Injected writes report no completion, so every window'th write and the
+ * last write of each thread take one, which bounds the writes in flight to
+ * two windows.
+ */
+static void *rma_write(void *arg)
+{
+	struct rma_writer *w = arg;
+	uint64_t sent = 0, outstanding = 0;
+	ssize_t ret = 0;
+	size_t limit = inject ? 2 : window;
+	int comp;
+
+	while (sent < w->count || outstanding) {
+		comp = !inject || sent % window == window - 1 ||
+		       sent == w->count - 1;
+		if (sent < w->count && outstanding < limit) {
+			ret = post_write(w->ep, sent, comp);
+			if (!ret) {
+				sent++;
+				outstanding += comp;
+				continue;
+			}
+			if (ret != -FI_EAGAIN) {
+				print_err("fi_write", ret);
+				break;
+			}
+		}
+
+		ret = read_cq(w->cq, 0);
+		if (ret < 0)
+			break;
+		outstanding -= ret;
+		ret = 0;
+	}
+
+	w->ret = (int) ret;
+	return NULL;
+}
+
+static int rma_sender(int rfd, int wfd)
+{
+	struct rma_writer *writers;
+	double start, end;
+	char c;
+	int i, ret = 0;
+
+	writers = calloc(threads, sizeof *writers);
+	if (!writers)
+		return -FI_ENOMEM;
+
+	for (i = 0; i < threads; i++) {
+		writers[i].count = count / threads + (i < count % threads);
+		if (!i) {
+			writers[i].ep = ep;
+			writers[i].cq = cq;
+		} else {
+			ret = open_ep(&writers[i].ep, &writers[i].cq);
+			if (ret)
+				goto out;
+		}
+	}
+
+	if (read(rfd, &c, 1) != 1) {
+		ret = -FI_EIO;
+		goto out;
+	}
+
+	start = now();
+	for (i = 0; i < threads; i++) {
+		ret = -pthread_create(&writers[i].thread, NULL, rma_write,
+				      &writers[i]);
+		if (ret) {
+			print_err("pthread_create", ret);
+			break;
+		}
+	}
+	while (i--) {
+		pthread_join(writers[i].thread, NULL);
+		ret = ret ? ret : writers[i].ret;
+	}
+	end = now();
+
+	if (write(wfd, "d", 1) != 1)
+		ret = ret ? ret : -FI_EIO;
+
+	if (!ret)
+		printf("%s %s rma write%s, %zu bytes, %d threads: "
+		       "%llu writes in %.3f s, %.3f M writes/s, %.1f MB/s\n",
+		       info->fabric_attr->prov_name,
+		       fi_tostr(&info->ep_attr->type, FI_TYPE_EP_TYPE),
+		       inject ? " inject" : "", size, threads,
+		       (unsigned long long) count, end - start,
+		       count / (end - start) / 1e6,
+		       count * size / (end - start) / 1e6);
+out:
+	for (i = 1; i < threads; i++) {
+		if (writers[i].ep)
+			fi_close(&writers[i].ep->fid);
+		if (writers[i].cq)
+			fi_close(&writers[i].cq->fid);
+	}
+	free(writers);
+	return ret;
+}
+
+/* The target of RMA writes only drives progress until the sender is done */
+static int rma_target(int wfd, int rfd)
+{
+	ssize_t ret;
+	char c;
+
+	if (write(wfd, "s", 1) != 1)
+		return -FI_EIO;
+
+	fcntl(rfd, F_SETFL, O_NONBLOCK);
+	while ((ret = read(rfd, &c, 1)) < 0 && errno == EAGAIN) {
+		ret = read_cq(cq, 1);
+		if (ret < 0)
+			return (int) ret;
+	}
+	return 0;
+}
+
+static int exchange_key(int wfd, int rfd, int target)
+{
+	uint64_t key[2];
+
+	if (target) {
+		key[0] = rma_addr;
+		key[1] = rma_key;
+		if (write(wfd, key, sizeof key) != sizeof key)
+			return -FI_EIO;
+	} else {
+		if (read(rfd, key, sizeof key) != sizeof key)
+			return -FI_EIO;
+		rma_addr = key[0];
+		rma_key = key[1];
+	}
+	return 0;
+}
+
+/* One measurement with the current parameters, in a fresh pair of processes */
+static int run(void)
+{
+	int to_child[2], to_parent[2];
+	int ret, status;
+	pid_t pid;
+
+	if (pipe(to_child) || pipe(to_parent)) {
+		perror("pipe");
+		return -FI_EIO;
+	}
+
+	pid = fork();
+	if (pid < 0) {
+		perror("fork");
+		return -FI_EIO;
+	}
+
+	if (!pid) {
+		close(to_child[1]);
+		close(to_parent[0]);
+		ret = init();
+		if (!ret)
+			ret = exchange_names(to_parent[1], to_child[0]);
+		if (!ret && rma)
+			ret = exchange_key(to_parent[1], to_child[0], 0);
+		if (!ret)
+			ret = rma ? rma_sender(to_child[0], to_parent[1]) :
+			      sender(to_child[0]);
+		fini();
+		fi_freeinfo(hints);
+		exit(ret ? EXIT_FAILURE : EXIT_SUCCESS);
+	}
+
+	close(to_child[0]);
+	close(to_parent[1]);
+	ret = init();
+	if (!ret && av_pad)
+		ret = pad_av();
+	if (!ret)
+		ret = exchange_names(to_child[1], to_parent[0]);
+	if (!ret && rma)
+		ret = exchange_key(to_child[1], to_parent[0], 1);
+	if (!ret)
+		ret = rma ? rma_target(to_child[1], to_parent[0]) :
+		      receiver(to_child[1]);
+
+	/* The sender sees EOF and gives up if we failed */
+	close(to_child[1]);
+	close(to_parent[0]);
+	if (waitpid(pid, &status, 0) != pid || !WIFEXITED(status) ||
+	    WEXITSTATUS(status) != EXIT_SUCCESS)
+		ret = ret ? ret : -FI_EOTHER;
+
+	fini();
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+	uint64_t msgs;
+	int op, ret;
+
+	hints = fi_allocinfo();
+	if (!hints)
+		return EXIT_FAILURE;
+
+	hints->mode = ~0;
+	hints->caps = FI_MSG;
+	hints->ep_attr->type = FI_EP_RDM;
+	hints->addr_format = FI_SOCKADDR_IN;
+	hints->fabric_attr->prov_name = strdup("sockets");
+
+	while ((op = getopt_long(argc, argv, "f:s:e:n:w:a:D:t:TRiSmdh",
+				 longopts, NULL)) != -1) {
+		switch (op) {
+		case 'f':
+			free(hints->fabric_attr->prov_name);
+			hints->fabric_attr->prov_name = strdup(optarg);
+			break;
+		case 's':
+			size = strtoul(optarg, NULL, 0);
+			break;
+		case 'e':
+			end_size = strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			count = strtoull(optarg, NULL, 0);
+			break;
+		case 'w':
+			window = strtoul(optarg, NULL, 0);
+			break;
+		case 'a':
+			av_pad = strtoul(optarg, NULL, 0);
+			break;
+		case 'D':
+			depth = strtoul(optarg, NULL, 0);
+			tagged = 1;
+			hints->caps |= FI_TAGGED | FI_DIRECTED_RECV;
+			break;
+		case 't':
+			threads = atoi(optarg);
+			break;
+		case 'T':
+			tagged = 1;
+			hints->caps |= FI_TAGGED;
+			break;
+		case 'R':
+			rma = 1;
+			hints->caps |= FI_RMA;
+			break;
+		case 'i':
+			inject = 1;
+			break;
+		case 'S':
+			source = 1;
+			hints->caps |= FI_SOURCE;
+			break;
+		case 'm':
+			hints->domain_attr->control_progress = FI_PROGRESS_MANUAL;
+			hints->domain_attr->data_progress = FI_PROGRESS_MANUAL;
+			break;
+		case 'd':
+			hints->domain_attr->threading = FI_THREAD_DOMAIN;
+			break;
+		case 'h':
+		default:
+			printf("Usage: %s\n", argv[0]);
+			usage();
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (!window) {
+		fprintf(stderr, "window must be at least 1\n");
+		return EXIT_FAILURE;
+	}
+
+	if (threads < 1 || (threads > 1 && !rma)) {
+		fprintf(stderr, "--threads must be at least 1, and needs --rma "
+			"for more\n");
+		return EXIT_FAILURE;
+	}
+
+	setvbuf(stdout, NULL, _IONBF, 0);
+	if (end_size < size) {
+		ret = run();
+	} else {
+		msgs = count;
+		for (ret = 0; !ret && size <= end_size;
+		     size = size ? size * 2 : 1) {
+			count = SWEEP_BYTES / (size ? size : 1);
+			if (count > msgs)
+				count = msgs;
+			if (!count)
+				count = 1;
+			ret = run();
+		}
+	}
+
+	fi_freeinfo(hints);
+	return ret ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,460 @@
+/*
+ * Copyright (c) 2016 Intel Corporation.  All rights reserved.
+ *
+ * This software is available to you under the BSD license below:
+ *
+ *     Redistribution and use in source and binary forms, with or
+ *     without modification, are permitted provided that the following
+ *     conditions are met:
+ *
+ *      - Redistributions of source code must retain the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer.
+ *
+ *      - Redistributions in binary form must reproduce the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer in the documentation and/or other materials
+ *        provided with the distribution.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <getopt.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include <rdma/fabric.h>
+#include <rdma/fi_domain.h>
+#include <rdma/fi_cm.h>
+#include <rdma/fi_errno.h>
+
+#include "fi.h"
+#include "fi_util.h"
+
+/*
+ * Micro-benchmarks of the util code shared by providers.  The program
+ * links the util sources directly and runs them under a stub provider,
+ * so nothing but the code being measured is on the path.
+ *
+ * cq: one thread writes completions the way a provider's progress does,
+ * bracketed by ofi_cq_lock/ofi_cq_unlock, while the main thread drains
+ * them with fi_cq_read.  The run is repeated with FI_THREAD_SAFE, which
+ * uses the locked cirque, and FI_THREAD_DOMAIN, which uses the lock-free
+ * one.  Either side yields while the CQ is full or empty, so the pair
+ * also makes progress on a single CPU.
+ *
+ * av: fills an FI_SOURCE AV with IPv4 peers and times ip_av_get_index(),
+ * the reverse lookup done per received packet, over the peers in random
+ * order.  Two address layouts are used: consecutive hosts, and hosts
+ * that share their low 16 bits and differ only above them.
+ */
+
+#define BENCH_NAME	"utilbench"
+
+static struct fi_provider bench_prov = {
+	.name = BENCH_NAME,
+	.version = FI_VERSION(1, 0),
+	.fi_version = FI_VERSION(FI_MAJOR_VERSION, FI_MINOR_VERSION),
+};
+
+static struct util_fabric fabric;
+static struct util_domain domain;
+
+static uint64_t count = 10000000;
+static size_t cq_size = 1024;
+static size_t batch = 16;
+static size_t read_cnt = 64;
+static size_t peers;
+
+static const struct option longopts[] = {
+	{"count", required_argument, NULL, 'n'},
+	{"cq_size", required_argument, NULL, 's'},
+	{"batch", required_argument, NULL, 'b'},
+	{"read", required_argument, NULL, 'r'},
+	{"peers", required_argument, NULL, 'a'},
+	{"help", no_argument, NULL, 'h'},
+	{0,0,0,0}
+};
+
+static const char *help_strings[][2] = {
+	{"N", "\t\toperations per run, default 10000000"},
+	{"N", "\t\tCQ size, default 1024"},
+	{"N", "\t\tcompletions written per lock, default 16"},
+	{"N", "\t\tcompletions per fi_cq_read, default 64"},
+	{"N", "\t\tAV entries, default 10000 and 100000"},
+	{"", "\t\tprint this help"},
+	{"", ""}
+};
+
+static void usage(const char *name)
+{
+	int i = 0;
+	const struct option *ptr = longopts;
+
+	printf("Usage: %s [OPTIONS] cq|av\n", name);
+	for (; ptr->name != NULL; ++i, ptr = &longopts[i])
+		if (ptr->has_arg == required_argument)
+			printf("  -%c, --%s=%s%s\n", ptr->val, ptr->name,
+				help_strings[i][0], help_strings[i][1]);
+		else
+			printf("  -%c, --%s\t%s\n", ptr->val, ptr->name,
+				help_strings[i][1]);
+}
+
+static void print_err(const char *call, ssize_t ret)
+{
+	fprintf(stderr, "%s: %zd (%s)\n", call, ret, fi_strerror((int) -ret));
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int open_domain(enum fi_threading threading, uint64_t caps)
+{
+	struct fi_fabric_attr fabric_attr;
+	struct fi_info *info;
+	int ret;
+
+	memset(&fabric_attr, 0, sizeof fabric_attr);
+	fabric_attr.name = BENCH_NAME;
+	fabric_attr.prov_name = BENCH_NAME;
+	fabric_attr.prov_version = bench_prov.version;
+
+	memset(&fabric, 0, sizeof fabric);
+	ret = ofi_fabric_init(&bench_prov, &fabric_attr, &fabric_attr,
+			      &fabric, NULL, FI_MATCH_EXACT);
+	if (ret) {
+		print_err("ofi_fabric_init", ret);
+		return ret;
+	}
+
+	info = fi_allocinfo();
+	if (!info) {
+		ofi_fabric_close(&fabric);
+		return -FI_ENOMEM;
+	}
+
+	info->domain_attr->name = strdup(BENCH_NAME);
+	info->domain_attr->threading = threading;
+	info->caps = caps;
+	info->addr_format = FI_SOCKADDR_IN;
+
+	memset(&domain, 0, sizeof domain);
+	ret = ofi_domain_init(&fabric.fabric_fid, info, &domain, NULL);
+	fi_freeinfo(info);
+	if (ret) {
+		print_err("ofi_domain_init", ret);
+		ofi_fabric_close(&fabric);
+	}
+	return ret;
+}
+
+static void close_domain(void)
+{
+	free((void *) domain.name);
+	ofi_domain_close(&domain);
+	ofi_fabric_close(&fabric);
+}
+
+static void *cq_producer(void *arg)
+{
+	struct util_cq *cq = arg;
+	struct fi_cq_tagged_entry *comp;
+	uint64_t i = 0;
+	size_t n;
+
+	while (i < count) {
+		ofi_cq_lock(cq);
+		for (n = 0; n < batch && i < count && !cirque_isfull(cq->cirq);
+		     n++, i++) {
+			comp = cirque_tail(cq->cirq);
+			memset(comp, 0, sizeof *comp);
+			comp->op_context = (void *) (uintptr_t) i;
+			comp->flags = FI_MSG | FI_RECV;
+			cirque_commit(cq->cirq);
+		}
+		ofi_cq_unlock(cq);
+
+		if (!n)
+			sched_yield();
+	}
+	return NULL;
+}
+
+/* Completions must come out complete and in the order they went in */
+static int cq_consumer(struct util_cq *cq)
+{
+	struct fi_cq_entry *comp;
+	uint64_t i = 0;
+	ssize_t ret, j;
+
+	comp = calloc(read_cnt, sizeof *comp);
+	if (!comp)
+		return -FI_ENOMEM;
+
+	while (i < count) {
+		ret = fi_cq_read(&cq->cq_fid, comp, read_cnt);
+		if (ret == -FI_EAGAIN) {
+			sched_yield();
+			continue;
+		}
+		if (ret < 0) {
+			print_err("fi_cq_read", ret);
+			goto out;
+		}
+
+		for (j = 0; j < ret; j++, i++) {
+			if (comp[j].op_context != (void *) (uintptr_t) i) {
+				fprintf(stderr, "completion %llu out of order\n",
+					(unsigned long long) i);
+				ret = -FI_EOTHER;
+				goto out;
+			}
+		}
+	}
+	ret = 0;
+out:
+	free(comp);
+	return (int) ret;
+}
+
+static int bench_cq_run(enum fi_threading threading)
+{
+	struct fi_cq_attr attr;
+	struct util_cq cq;
+	pthread_t thread;
+	double start, end;
+	int ret;
+
+	ret = open_domain(threading, 0);
+	if (ret)
+		return ret;
+
+	memset(&attr, 0, sizeof attr);
+	attr.format = FI_CQ_FORMAT_CONTEXT;
+	attr.size = cq_size;
+	attr.wait_obj = FI_WAIT_NONE;
+
+	memset(&cq, 0, sizeof cq);
+	ret = ofi_cq_init(&bench_prov, &domain.domain_fid, &attr, &cq,
+			  &ofi_cq_progress, NULL);
+	if (ret) {
+		print_err("ofi_cq_init", ret);
+		goto out;
+	}
+
+	start = now();
+	ret = pthread_create(&thread, NULL, cq_producer, &cq);
+	if (ret) {
+		print_err("pthread_create", -ret);
+		goto cleanup;
+	}
+
+	ret = cq_consumer(&cq);
+	pthread_join(thread, NULL);
+	end = now();
+
+	if (!ret)
+		printf("cq %s (%s): %llu completions in %.3f s, "
+		       "%.2f M/s, %.1f ns each\n",
+		       fi_tostr(&threading, FI_TYPE_THREADING),
+		       cq.spsc ? "lock-free" : "locked",
+		       (unsigned long long) count, end - start,
+		       count / (end - start) / 1e6,
+		       (end - start) * 1e9 / count);
+cleanup:
+	ofi_cq_cleanup(&cq);
+out:
+	close_domain();
+	return ret;
+}
+
+static int bench_cq(void)
+{
+	int ret;
+
+	ret = bench_cq_run(FI_THREAD_SAFE);
+	if (!ret)
+		ret = bench_cq_run(FI_THREAD_DOMAIN);
+	return ret;
+}
+
+static void av_addr(struct sockaddr_in *sin, size_t i, int shared)
+{
+	memset(sin, 0, sizeof *sin);
+	sin->sin_family = AF_INET;
+	if (shared) {
+		sin->sin_addr.s_addr = htonl(((uint32_t) i << 16) | 0x0101);
+		sin->sin_port = htons(4000 + (i >> 16));
+	} else {
+		sin->sin_addr.s_addr = htonl(0x0a000001 + (uint32_t) i);
+		sin->sin_port = htons(4000);
+	}
+}
+
+static int bench_av_run(size_t n, int shared)
+{
+	struct fi_av_attr attr;
+	struct fid_av *av_fid;
+	struct util_av *av;
+	struct sockaddr_in *addr;
+	size_t *order, i, j, tmp;
+	fi_addr_t fi_addr;
+	uint64_t k;
+	double start, end;
+	int ret;
+
+	addr = calloc(n, sizeof *addr);
+	order = calloc(n, sizeof *order);
+	if (!addr || !order) {
+		ret = -FI_ENOMEM;
+		goto free;
+	}
+
+	ret = open_domain(FI_THREAD_SAFE, FI_SOURCE);
+	if (ret)
+		goto free;
+
+	memset(&attr, 0, sizeof attr);
+	attr.type = FI_AV_TABLE;
+	attr.count = n;
+	ret = ip_av_create(&domain.domain_fid, &attr, &av_fid, NULL);
+	if (ret) {
+		print_err("ip_av_create", ret);
+		goto out;
+	}
+	av = container_of(av_fid, struct util_av, av_fid);
+
+	for (i = 0; i < n; i++) {
+		av_addr(&addr[i], i, shared);
+		ret = fi_av_insert(av_fid, &addr[i], 1, &fi_addr, 0, NULL);
+		if (ret != 1) {
+			print_err("fi_av_insert", ret);
+			ret = ret ? ret : -FI_EINVAL;
+			goto close;
+		}
+		order[i] = i;
+	}
+
+	srand(1);
+	for (i = n - 1; i > 0; i--) {
+		j = rand() % (i + 1);
+		tmp = order[i];
+		order[i] = order[j];
+		order[j] = tmp;
+	}
+
+	ret = 0;
+	start = now();
+	for (k = 0; k < count; k++) {
+		i = order[k % n];
+		if (ip_av_get_index(av, &addr[i]) != (int) i) {
+			fprintf(stderr, "lookup of peer %zu failed\n", i);
+			ret = -FI_EOTHER;
+			goto close;
+		}
+	}
+	end = now();
+
+	printf("av %zu peers, %s: %llu lookups in %.3f s, "
+	       "%.1f ns each\n", n,
+	       shared ? "hosts sharing low bits" : "consecutive hosts",
+	       (unsigned long long) count, end - start,
+	       (end - start) * 1e9 / count);
+close:
+	fi_close(&av_fid->fid);
+out:
+	close_domain();
+free:
+	free(addr);
+	free(order);
+	return ret;
+}
+
+static int bench_av(void)
+{
+	static const size_t sizes[] = { 10000, 100000 };
+	size_t i, n;
+	int ret = 0;
+
+	for (i = 0; !ret && i < sizeof(sizes) / sizeof(*sizes); i++) {
+		n = peers ? peers : sizes[i];
+		ret = bench_av_run(n, 0);
+		if (!ret)
+			ret = bench_av_run(n, 1);
+		if (peers)
+			break;
+	}
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+	int op, ret;
+
+	while ((op = getopt_long(argc, argv, "n:s:b:r:a:h",
+				 longopts, NULL)) != -1) {
+		switch (op) {
+		case 'n':
+			count = strtoull(optarg, NULL, 0);
+			break;
+		case 's':
+			cq_size = strtoul(optarg, NULL, 0);
+			break;
+		case 'b':
+			batch = strtoul(optarg, NULL, 0);
+			break;
+		case 'r':
+			read_cnt = strtoul(optarg, NULL, 0);
+			break;
+		case 'a':
+			peers = strtoul(optarg, NULL, 0);
+			break;
+		case 'h':
+		default:
+			usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (optind != argc - 1 || !batch || !read_cnt) {
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	/* This copy of the util code is not set up by fi_ini() */
+	fi_util_init();
+	setvbuf(stdout, NULL, _IONBF, 0);
+	if (!strcmp(argv[optind], "cq")) {
+		ret = bench_cq();
+	} else if (!strcmp(argv[optind], "av")) {
+		ret = bench_av();
+	} else {
+		usage(argv[0]);
+		ret = -FI_EINVAL;
+	}
+
+	fi_util_fini();
+	return ret ? EXIT_FAILURE : EXIT_SUCCESS;
+}